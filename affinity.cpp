@@ -0,0 +1,265 @@
+#include "affinity.h"
+#include "core_budget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C"
+{
+    #include <libavutil/log.h>
+}
+
+#ifdef LINUX
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+    #define MPOL_PREFERRED 1
+#endif
+
+#define MAX_NUMA_NODES 64
+
+static bool g_affinity = false;
+static int g_numa_node = -1;
+static cpu_set_t g_stage_sets[kAffinityStageCount];
+
+/** Parse a list like "0-7,16-23", as the kernel writes them in sysfs. */
+static bool parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    while (*list && *list != '\n')
+    {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+
+        if (end == list)
+            return false;
+
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+
+            if (end == list)
+                return false;
+        }
+
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+
+        list = end;
+
+        if (*list == ',')
+            list++;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+static bool read_node_cpus(int node, cpu_set_t *set)
+{
+    char path[128];
+    char list[4096];
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    bool ok = fgets(list, sizeof(list), f) && parse_cpu_list(list, set);
+
+    fclose(f);
+
+    return ok;
+}
+
+/** The node the CPU belongs to, -1 without NUMA information. */
+static int find_cpu_node(int cpu)
+{
+    cpu_set_t set;
+
+    for (int node = 0; node < MAX_NUMA_NODES; node++)
+    {
+        if (read_node_cpus(node, &set) && CPU_ISSET(cpu, &set))
+            return node;
+    }
+
+    return -1;
+}
+
+/** "16-19" style description of a set for the log. */
+static void format_cpu_set(const cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+
+        int last = cpu;
+
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+
+        len += snprintf(buf + len, size - len, len ? ",%d" : "%d", cpu);
+
+        if (last > cpu && len < size)
+            len += snprintf(buf + len, size - len, "-%d", last);
+
+        cpu = last;
+    }
+}
+
+void init_affinity(const char *cpu_list, int numa_node)
+{
+    cpu_set_t set;
+
+    if (cpu_list && *cpu_list)
+    {
+        if (!parse_cpu_list(cpu_list, &set))
+        {
+            av_log(NULL, AV_LOG_WARNING, "Invalid CPU list '%s', threads are not pinned\n", cpu_list);
+            return;
+        }
+
+        // Memory goes to the node of the first CPU in the list
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                g_numa_node = find_cpu_node(cpu);
+                break;
+            }
+        }
+    }
+    else
+    {
+        if (numa_node < 0)
+            numa_node = find_cpu_node(sched_getcpu());
+
+        if (numa_node < 0 || !read_node_cpus(numa_node, &set))
+        {
+            av_log(NULL, AV_LOG_WARNING, "No NUMA node information, threads are not pinned\n");
+            return;
+        }
+
+        g_numa_node = numa_node;
+    }
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    if (ret)
+    {
+        av_log(NULL, AV_LOG_WARNING, "Could not pin to the CPU set: %s\n", strerror(ret));
+        return;
+    }
+
+    // Frame buffers are first touched by the threads that fill them, all on
+    // this node now, prefer it for pages touched anywhere else too
+    if (g_numa_node >= 0)
+    {
+        unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long)) + 1] = { 0 };
+
+        mask[g_numa_node / (8 * sizeof(unsigned long))] |= 1UL << (g_numa_node % (8 * sizeof(unsigned long)));
+
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, (unsigned long) MAX_NUMA_NODES + 1) < 0)
+            av_log(NULL, AV_LOG_WARNING, "Could not prefer memory on node %d\n", g_numa_node);
+    }
+
+    for (int s = 0; s < kAffinityStageCount; s++)
+        g_stage_sets[s] = set;
+
+    g_affinity = true;
+
+    char cpus[256];
+    format_cpu_set(&set, cpus, sizeof(cpus));
+
+    av_log(NULL, AV_LOG_INFO, "Affinity: node %d, CPUs %s\n", g_numa_node, cpus);
+}
+
+void split_affinity()
+{
+    if (!g_affinity)
+        return;
+
+    const CorePlan *plan = get_core_plan();
+    const cpu_set_t &job = g_stage_sets[kAffinityJob];
+    int count = CPU_COUNT(&job);
+    int total = plan->decode + plan->filter + plan->encode;
+
+    // Too few to split, every stage shares the job's set
+    if (count < 3 || total < 3)
+        return;
+
+    int sizes[kAffinityStageCount];
+    sizes[kAffinityDecode] = FFMAX(1, (int) ((double) count * plan->decode / total + 0.5));
+    sizes[kAffinityFilter] = FFMAX(1, (int) ((double) count * plan->filter / total + 0.5));
+    sizes[kAffinityEncode] = FFMAX(1, count - sizes[kAffinityDecode] - sizes[kAffinityFilter]);
+
+    // Contiguous runs of the job's CPUs, in pipeline order
+    int stage = kAffinityDecode;
+    int taken = 0;
+
+    for (int s = kAffinityDecode; s < kAffinityStageCount; s++)
+        CPU_ZERO(&g_stage_sets[s]);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && stage < kAffinityStageCount; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &job))
+            continue;
+
+        CPU_SET(cpu, &g_stage_sets[stage]);
+
+        if (++taken == sizes[stage])
+        {
+            stage++;
+            taken = 0;
+        }
+    }
+
+    char sets[kAffinityStageCount][256];
+
+    for (int s = 0; s < kAffinityStageCount; s++)
+        format_cpu_set(&g_stage_sets[s], sets[s], sizeof(sets[s]));
+
+    av_log(NULL, AV_LOG_INFO, "Affinity: decode %s, filter %s, encode %s\n",
+           sets[kAffinityDecode], sets[kAffinityFilter], sets[kAffinityEncode]);
+}
+
+void pin_thread(EAffinityStage stage)
+{
+    if (!g_affinity)
+        return;
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &g_stage_sets[stage]);
+
+    if (ret)
+        av_log(NULL, AV_LOG_WARNING, "Could not pin thread: %s\n", strerror(ret));
+}
+
+#else
+
+void init_affinity(const char *cpu_list, int numa_node)
+{
+    av_log(NULL, AV_LOG_WARNING, "Thread pinning is only supported on Linux\n");
+}
+
+void split_affinity()
+{
+}
+
+void pin_thread(EAffinityStage stage)
+{
+}
+
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+// Sets of CPUs threads are pinned to, the job's set is split between the stages
+enum EAffinityStage
+{
+    kAffinityJob = 0,
+    kAffinityDecode,
+    kAffinityFilter,
+    kAffinityEncode,
+    kAffinityStageCount
+};
+
+/**
+ * Pin the calling thread to a CPU set and prefer its NUMA node for memory,
+ * before any other thread is started so they all inherit both. The set is
+ * cpu_list ("0-7,16-23") if given, else the CPUs of numa_node, or of the
+ * node the process is running on for -1. Call before init_core_budget(), the
+ * CPU count then only sees the set.
+ * Linux only, elsewhere nothing is pinned.
+ */
+void init_affinity(const char *cpu_list, int numa_node);
+
+/**
+ * Split the job's set between decode, filter and encode in the proportions
+ * of the core plan, and log the sets. Call once the plan is made.
+ */
+void split_affinity();
+
+/**
+ * Pin the calling thread to a stage's CPUs. Codec and filter threads are
+ * started by the thread that opens them and inherit its set, so the opening
+ * thread is pinned to their stage while it does that.
+ */
+void pin_thread(EAffinityStage stage);
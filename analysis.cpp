@@ -0,0 +1,497 @@
+#include "analysis.h"
+#include "loudness.h"
+
+extern "C"
+{
+    #include <libavutil/pixdesc.h>
+}
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define HAVE_SSE2_INTRINSICS 1
+#endif
+
+// Size of the shared downscaled luma plane
+#define ANALYSIS_PLANE_WIDTH 64
+#define ANALYSIS_PLANE_HEIGHT 36
+#define ANALYSIS_PLANE_SIZE (ANALYSIS_PLANE_WIDTH * ANALYSIS_PLANE_HEIGHT)
+
+// A plane cell is black at or below this 8 bit luma, a frame is black when
+// at least BLACK_RATIO of its cells are
+#define BLACK_LUMA_THRESHOLD 32
+#define BLACK_RATIO 0.98
+#define BLACK_MIN_DURATION 0.1
+
+#define SCENE_CUT_THRESHOLD 0.1
+
+// Audio is measured in windows of 1/AUDIO_WINDOWS_PER_SECOND seconds
+#define AUDIO_WINDOWS_PER_SECOND 20
+#define SILENCE_THRESHOLD_DB -60.0
+#define SILENCE_MIN_DURATION 0.5
+
+typedef struct TimeRange {
+    double start;
+    double end;
+} TimeRange;
+
+typedef struct SceneCut {
+    double time;
+    double score;
+} SceneCut;
+
+// Video state, owned by the decode thread
+static bool g_video_init = false;
+static unsigned int g_video_stream_index = 0;
+static bool g_video_record = false;
+static AVRational g_video_time_base;
+static uint8_t g_plane[2][ANALYSIS_PLANE_SIZE];
+static int g_plane_index = 0;
+static bool g_have_plane = false;
+static double g_last_video_time = 0;
+static double g_black_start = -1;
+static std::vector<TimeRange> g_black_ranges;
+static std::vector<SceneCut> g_scene_cuts;
+static std::vector<float> g_frame_luma;
+static double g_luma_min = 255;
+static double g_luma_max = 0;
+static double g_luma_sum = 0;
+
+// Audio state, owned by the encode thread
+static bool g_audio_init = false;
+static unsigned int g_audio_stream_index = 0;
+static AVSampleFormat g_sample_fmt;
+static int g_channels = 0;
+static int g_sample_rate = 0;
+static int g_window_size = 0;
+static int g_window_fill = 0;
+static std::vector<double> g_window_sum;
+static int64_t g_audio_samples = 0;
+static double g_silence_start = -1;
+static std::vector<TimeRange> g_silent_ranges;
+static double g_audio_sum_squares = 0;
+static double g_audio_peak = 0;
+
+/** Sum of n unsigned bytes. */
+static unsigned sum_u8(const uint8_t *p, int n)
+{
+    unsigned sum = 0;
+    int i = 0;
+
+#if HAVE_SSE2_INTRINSICS
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (p + i)), zero));
+
+    sum = (unsigned) (_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#endif
+
+    for (; i < n; i++)
+        sum += p[i];
+
+    return sum;
+}
+
+/** Sum of absolute differences of two planes, n a multiple of 16. */
+static unsigned sad_plane(const uint8_t *a, const uint8_t *b, int n)
+{
+    unsigned sad = 0;
+    int i = 0;
+
+#if HAVE_SSE2_INTRINSICS
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (a + i)),
+                                              _mm_loadu_si128((const __m128i *) (b + i))));
+
+    sad = (unsigned) (_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#endif
+
+    for (; i < n; i++)
+        sad += abs(a[i] - b[i]);
+
+    return sad;
+}
+
+/** Sum of squares and peak of n float samples. */
+static double sum_squares_flt(const float *p, int n, double *peak)
+{
+    double sum = 0;
+    float max = 0;
+    int i = 0;
+
+#if HAVE_SSE2_INTRINSICS
+    const __m128 sign = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 acc = _mm_setzero_ps();
+    __m128 vmax = _mm_setzero_ps();
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(p + i);
+        acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+        vmax = _mm_max_ps(vmax, _mm_and_ps(v, sign));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum = (double) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    _mm_storeu_ps(lanes, vmax);
+    max = FFMAX(FFMAX(lanes[0], lanes[1]), FFMAX(lanes[2], lanes[3]));
+#endif
+
+    for (; i < n; i++)
+    {
+        sum += p[i] * p[i];
+        max = FFMAX(max, fabsf(p[i]));
+    }
+
+    *peak = FFMAX(*peak, (double) max);
+
+    return sum;
+}
+
+/** Box downscale the luma of a frame into the plane. Returns false for unusable formats. */
+static bool downscale_luma(const AVFrame *frame, uint8_t *plane)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat) frame->format);
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->comp[0].depth < 8 || desc->comp[0].step != (desc->comp[0].depth > 8 ? 2 : 1) ||
+        frame->width < ANALYSIS_PLANE_WIDTH || frame->height < ANALYSIS_PLANE_HEIGHT)
+        return false;
+
+    int block_w = frame->width / ANALYSIS_PLANE_WIDTH;
+    int block_h = frame->height / ANALYSIS_PLANE_HEIGHT;
+    int block_size = block_w * block_h;
+    int shift = desc->comp[0].depth - 8;
+
+    for (int by = 0; by < ANALYSIS_PLANE_HEIGHT; by++)
+    {
+        for (int bx = 0; bx < ANALYSIS_PLANE_WIDTH; bx++)
+        {
+            const uint8_t *src = frame->data[0] + by * block_h * frame->linesize[0];
+            unsigned sum = 0;
+
+            if (desc->comp[0].step == 1)
+            {
+                src += bx * block_w;
+
+                for (int y = 0; y < block_h; y++, src += frame->linesize[0])
+                    sum += sum_u8(src, block_w);
+            }
+            else
+            {
+                src += bx * block_w * 2;
+
+                for (int y = 0; y < block_h; y++, src += frame->linesize[0])
+                    for (int x = 0; x < block_w; x++)
+                        sum += ((const uint16_t *) src)[x] >> shift;
+            }
+
+            plane[by * ANALYSIS_PLANE_WIDTH + bx] = (uint8_t) (sum / block_size);
+        }
+    }
+
+    return true;
+}
+
+int init_video_analysis(AVStream *stream, bool record)
+{
+    g_video_stream_index = stream->index;
+    g_video_time_base = stream->time_base;
+    g_video_record = record;
+    g_video_init = true;
+
+    return 0;
+}
+
+double analyze_video_frame(unsigned int stream_index, AVFrame *frame)
+{
+    if (!g_video_init || stream_index != g_video_stream_index)
+        return -1;
+
+    uint8_t *plane = g_plane[g_plane_index];
+    const uint8_t *prev = g_plane[g_plane_index ^ 1];
+
+    if (!downscale_luma(frame, plane))
+        return -1;
+
+    double score = -1;
+
+    if (g_have_plane)
+        score = sad_plane(plane, prev, ANALYSIS_PLANE_SIZE) / (255.0 * ANALYSIS_PLANE_SIZE);
+
+    g_have_plane = true;
+    g_plane_index ^= 1;
+
+    if (!g_video_record || frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return score;
+
+    double time = frame->best_effort_timestamp * av_q2d(g_video_time_base);
+    double luma = sum_u8(plane, ANALYSIS_PLANE_SIZE) / (double) ANALYSIS_PLANE_SIZE;
+
+    g_last_video_time = time;
+
+    g_frame_luma.push_back((float) luma);
+    g_luma_sum += luma;
+    g_luma_min = FFMIN(g_luma_min, luma);
+    g_luma_max = FFMAX(g_luma_max, luma);
+
+    // Black frame detection
+    int black_cells = 0;
+    for (int i = 0; i < ANALYSIS_PLANE_SIZE; i++)
+        black_cells += plane[i] <= BLACK_LUMA_THRESHOLD;
+
+    if (black_cells >= BLACK_RATIO * ANALYSIS_PLANE_SIZE)
+    {
+        if (g_black_start < 0)
+            g_black_start = time;
+    }
+    else if (g_black_start >= 0)
+    {
+        if (time - g_black_start >= BLACK_MIN_DURATION)
+            g_black_ranges.push_back({ g_black_start, time });
+
+        g_black_start = -1;
+    }
+
+    // Scene cuts
+    if (score > SCENE_CUT_THRESHOLD)
+        g_scene_cuts.push_back({ time, score });
+
+    return score;
+}
+
+int init_audio_analysis(unsigned int stream_index, AVCodecContext *enc_ctx)
+{
+    g_audio_stream_index = stream_index;
+    g_sample_fmt = enc_ctx->sample_fmt;
+    g_channels = enc_ctx->channels;
+    g_sample_rate = enc_ctx->sample_rate;
+    g_window_size = FFMAX(1, g_sample_rate / AUDIO_WINDOWS_PER_SECOND);
+    g_window_sum.assign(g_channels, 0.0);
+
+    switch (g_sample_fmt)
+    {
+        case AV_SAMPLE_FMT_FLT:
+        case AV_SAMPLE_FMT_FLTP:
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S16P:
+            break;
+
+        default:
+            av_log(NULL, AV_LOG_WARNING, "Audio analysis does not support sample format %s\n", av_get_sample_fmt_name(g_sample_fmt));
+            return AVERROR(ENOSYS);
+    }
+
+    g_audio_init = true;
+
+    return 0;
+}
+
+/** Sum of squares of count samples of channel ch, starting at sample offset. */
+static double channel_sum_squares(uint8_t **samples, int ch, int offset, int count, double *peak)
+{
+    double sum = 0;
+
+    switch (g_sample_fmt)
+    {
+        case AV_SAMPLE_FMT_FLTP:
+            return sum_squares_flt((const float *) samples[ch] + offset, count, peak);
+
+        case AV_SAMPLE_FMT_FLT:
+            for (int i = 0; i < count; i++)
+            {
+                float v = ((const float *) samples[0])[(offset + i) * g_channels + ch];
+                sum += v * v;
+                *peak = FFMAX(*peak, (double) fabsf(v));
+            }
+            break;
+
+        case AV_SAMPLE_FMT_S16P:
+        case AV_SAMPLE_FMT_S16:
+        {
+            const int16_t *p = (const int16_t *) samples[g_sample_fmt == AV_SAMPLE_FMT_S16P ? ch : 0];
+            int stride = g_sample_fmt == AV_SAMPLE_FMT_S16P ? 1 : g_channels;
+            int base = g_sample_fmt == AV_SAMPLE_FMT_S16P ? offset : offset * g_channels + ch;
+
+            for (int i = 0; i < count; i++)
+            {
+                double v = p[base + i * stride] / 32768.0;
+                sum += v * v;
+                *peak = FFMAX(*peak, fabs(v));
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return sum;
+}
+
+static double db(double mean_square)
+{
+    return mean_square > 0 ? 10.0 * log10(mean_square) : -INFINITY;
+}
+
+void analyze_audio_samples(unsigned int stream_index, uint8_t **samples, int nb_samples)
+{
+    if (!g_audio_init || stream_index != g_audio_stream_index)
+        return;
+
+    int offset = 0;
+
+    while (offset < nb_samples)
+    {
+        int count = FFMIN(nb_samples - offset, g_window_size - g_window_fill);
+
+        for (int ch = 0; ch < g_channels; ch++)
+        {
+            double sum = channel_sum_squares(samples, ch, offset, count, &g_audio_peak);
+
+            g_window_sum[ch] += sum;
+            g_audio_sum_squares += sum;
+        }
+
+        offset += count;
+        g_window_fill += count;
+        g_audio_samples += count;
+
+        if (g_window_fill < g_window_size)
+            break;
+
+        // A window is silent when its loudest channel is below the threshold
+        double loudest = 0;
+        for (int ch = 0; ch < g_channels; ch++)
+        {
+            loudest = FFMAX(loudest, g_window_sum[ch] / g_window_size);
+            g_window_sum[ch] = 0;
+        }
+
+        double window_start = (double) (g_audio_samples - g_window_size) / g_sample_rate;
+
+        if (db(loudest) < SILENCE_THRESHOLD_DB)
+        {
+            if (g_silence_start < 0)
+                g_silence_start = window_start;
+        }
+        else if (g_silence_start >= 0)
+        {
+            if (window_start - g_silence_start >= SILENCE_MIN_DURATION)
+                g_silent_ranges.push_back({ g_silence_start, window_start });
+
+            g_silence_start = -1;
+        }
+
+        g_window_fill = 0;
+    }
+}
+
+static void write_ranges(FILE *f, const char *name, const std::vector<TimeRange> &ranges)
+{
+    fprintf(f, "    \"%s\": [", name);
+
+    for (size_t i = 0; i < ranges.size(); i++)
+        fprintf(f, "%s{ \"start\": %.3f, \"end\": %.3f }", i ? ", " : "", ranges[i].start, ranges[i].end);
+
+    fprintf(f, "]");
+}
+
+int write_analysis_sidecar(const char *filename)
+{
+    LoudnessResults loudness;
+    bool have_loudness = get_loudness_results(&loudness);
+
+    if (!g_video_record && !g_audio_init && !have_loudness)
+        return 0;
+
+    FILE *f = fopen(filename, "w");
+    if (!f)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not open analysis sidecar '%s'\n", filename);
+        return AVERROR(EIO);
+    }
+
+    fprintf(f, "{\n");
+
+    if (g_video_record)
+    {
+        // Close a black section that runs to the end
+        if (g_black_start >= 0 && g_last_video_time - g_black_start >= BLACK_MIN_DURATION)
+            g_black_ranges.push_back({ g_black_start, g_last_video_time });
+        g_black_start = -1;
+
+        size_t frames = g_frame_luma.size();
+
+        fprintf(f, "  \"video\": {\n");
+        fprintf(f, "    \"frames\": %u,\n", (unsigned) frames);
+        fprintf(f, "    \"luma\": { \"average\": %.2f, \"min\": %.2f, \"max\": %.2f },\n",
+                frames ? g_luma_sum / frames : 0.0, frames ? g_luma_min : 0.0, g_luma_max);
+        write_ranges(f, "black", g_black_ranges);
+        fprintf(f, ",\n    \"scenes\": [");
+
+        for (size_t i = 0; i < g_scene_cuts.size(); i++)
+            fprintf(f, "%s{ \"time\": %.3f, \"score\": %.4f }", i ? ", " : "", g_scene_cuts[i].time, g_scene_cuts[i].score);
+
+        fprintf(f, "],\n    \"frame_luma\": [");
+
+        for (size_t i = 0; i < frames; i++)
+            fprintf(f, "%s%.1f", i ? "," : "", g_frame_luma[i]);
+
+        fprintf(f, "]\n  }%s\n", g_audio_init || have_loudness ? "," : "");
+    }
+
+    if (g_audio_init)
+    {
+        double end = (double) g_audio_samples / g_sample_rate;
+
+        if (g_silence_start >= 0 && end - g_silence_start >= SILENCE_MIN_DURATION)
+            g_silent_ranges.push_back({ g_silence_start, end });
+        g_silence_start = -1;
+
+        double samples = (double) g_audio_samples * g_channels;
+        double rms = samples > 0 ? db(g_audio_sum_squares / samples) : -INFINITY;
+        double peak = g_audio_peak > 0 ? 20.0 * log10(g_audio_peak) : -INFINITY;
+
+        fprintf(f, "  \"audio\": {\n");
+        fprintf(f, "    \"duration\": %.3f,\n", end);
+        fprintf(f, "    \"rms_db\": %.2f,\n", isfinite(rms) ? rms : -144.0);
+        fprintf(f, "    \"peak_db\": %.2f,\n", isfinite(peak) ? peak : -144.0);
+        write_ranges(f, "silence", g_silent_ranges);
+        fprintf(f, "\n  }%s\n", have_loudness ? "," : "");
+    }
+
+    if (have_loudness)
+    {
+        fprintf(f, "  \"loudness\": {\n");
+        fprintf(f, "    \"integrated\": %.2f,\n", isfinite(loudness.integrated) ? loudness.integrated : -70.0);
+        fprintf(f, "    \"range\": %.2f,\n", loudness.range);
+        fprintf(f, "    \"true_peak\": %.2f,\n", isfinite(loudness.true_peak) ? loudness.true_peak : -144.0);
+        fprintf(f, "    \"threshold\": %.2f", loudness.threshold);
+
+        if (loudness.normalized)
+        {
+            fprintf(f, ",\n    \"target\": %.2f,\n", loudness.target);
+            fprintf(f, "    \"output_integrated\": %.2f,\n", isfinite(loudness.output_integrated) ? loudness.output_integrated : -70.0);
+            fprintf(f, "    \"output_true_peak\": %.2f,\n", isfinite(loudness.output_true_peak) ? loudness.output_true_peak : -144.0);
+            fprintf(f, "    \"final_gain\": %.2f", loudness.final_gain);
+        }
+
+        fprintf(f, "\n  }\n");
+    }
+
+    fprintf(f, "}\n");
+    fclose(f);
+
+    return 0;
+}
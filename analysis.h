@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+    #include <libavutil/frame.h>
+}
+
+/**
+ * Set up the shared luma analysis plane for one video stream.
+ * If record is set black frames, scene cuts and luma statistics are
+ * collected for the analysis sidecar, otherwise only scene scores are
+ * computed (for the thumbnailer).
+ */
+int init_video_analysis(AVStream *stream, bool record);
+
+/**
+ * Downscale the luma of a decoded frame into the analysis plane and update
+ * the statistics. Returns the scene change score against the previous frame,
+ * 0.0 to 1.0, or -1 if there is none or the frame is of another stream.
+ */
+double analyze_video_frame(unsigned int stream_index, AVFrame *frame);
+
+/**
+ * Collect silence and level statistics for one audio stream, in the format
+ * of its encoder.
+ */
+int init_audio_analysis(unsigned int stream_index, AVCodecContext *enc_ctx);
+
+/**
+ * Analyze converted audio samples on their way into the audio FIFO.
+ * Samples of other streams are ignored.
+ */
+void analyze_audio_samples(unsigned int stream_index, uint8_t **samples, int nb_samples);
+
+/**
+ * Close any open black or silent section and write the sidecar, including
+ * the loudness measurement if there is one.
+ */
+int write_analysis_sidecar(const char *filename);
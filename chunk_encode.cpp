@@ -0,0 +1,654 @@
+#include <stdint.h>
+
+#include "chunk_encode.h"
+#include "affinity.h"
+#include "core_budget.h"
+#include "filters.h"
+#include "scaler.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C"
+{
+    #include <libavfilter/buffersink.h>
+    #include <libavfilter/buffersrc.h>
+    #include <libavutil/time.h>
+}
+
+// A 1080p libx264 encoder stops scaling at about this many threads, the rest
+// of the cores go to more chunks at once
+#define CHUNK_WORKER_CORES 4
+
+#define MIN_CHUNK_SECONDS 2.0
+
+// Frames decoded past the end of a chunk, so the frame rate conversion and
+// deinterlacing filters can finish the chunk's last output frames
+#define CHUNK_TAIL_FRAMES 8
+
+typedef struct ChunkResult {
+    std::vector<AVPacket *> packets;    // Encoded, waiting for the earlier chunks to be written
+    int64_t frames;
+    bool done;
+} ChunkResult;
+
+typedef struct ChunkEncoder {
+    const char *input_file;
+    AVStream *st;
+    AVCodecContext *enc_ctx;            // Settings for every chunk's encoder
+    const std::vector<VideoChunk> *chunks;
+    std::vector<ChunkResult> results;
+    CorePlan plan;                      // Threads of each worker
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                // Signalled when a chunk is done
+    int next_chunk;
+    int error;                          // The first failed chunk stops the others
+} ChunkEncoder;
+
+/** What one chunk is encoded with, opened by the worker that takes the chunk. */
+typedef struct ChunkContext {
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *dec_ctx;
+    FilteringContext filter;
+    Scaler *scaler;
+    AVCodecContext *enc_ctx;
+    int64_t first_pts;                  // Frames kept, in the encoder time base
+    int64_t end_pts;
+} ChunkContext;
+
+/** The keyframe nearest to target. */
+static int64_t find_cut(const std::vector<int64_t> &keyframes, int64_t target)
+{
+    std::vector<int64_t>::const_iterator it = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+
+    if (it == keyframes.end())
+        return keyframes.back();
+
+    if (it != keyframes.begin() && target - *(it - 1) < *it - target)
+        return *(it - 1);
+
+    return *it;
+}
+
+int plan_video_chunks(const char *input_file, int stream_index, int nb_chunks,
+                      int start_time, int end_time, std::vector<VideoChunk> &chunks)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    std::vector<int64_t> keyframes;
+    AVPacket packet;
+    int ret;
+
+    if ((ret = avformat_open_input(&fmt_ctx, input_file, NULL, NULL)) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open input file for the chunk plan\n");
+        return ret;
+    }
+
+    if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+    {
+        avformat_close_input(&fmt_ctx);
+        return ret;
+    }
+
+    AVStream *st = fmt_ctx->streams[stream_index];
+    AVRational time_base = st->time_base;
+
+    // Only the keyframes of the video are read, where the demuxer can skip the rest
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++)
+        fmt_ctx->streams[i]->discard = (int) i == stream_index ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+
+    while ((ret = av_read_frame(fmt_ctx, &packet)) >= 0 || ret == AVERROR(EAGAIN))
+    {
+        if (ret == AVERROR(EAGAIN))
+        {
+            av_usleep(10000);
+            continue;
+        }
+
+        int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+
+        if (packet.stream_index == stream_index &&
+            (packet.flags & AV_PKT_FLAG_KEY) &&
+            pts != AV_NOPTS_VALUE)
+            keyframes.push_back(pts);
+
+        av_packet_unref(&packet);
+    }
+
+    int64_t stream_start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    int64_t stream_end = st->duration != AV_NOPTS_VALUE ? stream_start + st->duration :
+                         stream_start + av_rescale_q(fmt_ctx->duration, AV_TIME_BASE_Q, time_base);
+
+    avformat_close_input(&fmt_ctx);
+
+    if (ret != AVERROR_EOF)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Error reading the keyframes for the chunk plan\n");
+        return ret;
+    }
+
+    std::sort(keyframes.begin(), keyframes.end());
+    keyframes.erase(std::unique(keyframes.begin(), keyframes.end()), keyframes.end());
+
+    int64_t range_start = start_time != -1 ? av_rescale(start_time, time_base.den, time_base.num) : stream_start;
+    int64_t range_end = end_time != -1 ? av_rescale(end_time, time_base.den, time_base.num) : stream_end;
+    int64_t min_length = (int64_t) (MIN_CHUNK_SECONDS / av_q2d(time_base));
+
+    VideoChunk chunk;
+    chunk.start = start_time != -1 ? range_start : AV_NOPTS_VALUE;
+
+    chunks.clear();
+
+    int64_t prev = range_start;
+
+    for (int i = 1; i < nb_chunks && !keyframes.empty(); i++)
+    {
+        int64_t cut = find_cut(keyframes, range_start + (range_end - range_start) * i / nb_chunks);
+
+        // Too close to the previous cut or the end, the next target may do better
+        if (cut - prev < min_length || range_end - cut < min_length)
+            continue;
+
+        chunk.end = cut;
+        chunks.push_back(chunk);
+
+        chunk.start = cut;
+        prev = cut;
+    }
+
+    chunk.end = end_time != -1 ? range_end : AV_NOPTS_VALUE;
+    chunks.push_back(chunk);
+
+    av_log(NULL, AV_LOG_INFO, "Video split into %d chunk%s at %d keyframes\n",
+           (int) chunks.size(), chunks.size() > 1 ? "s" : "", (int) keyframes.size());
+
+    return 0;
+}
+
+static void free_chunk_context(ChunkContext *c)
+{
+    avcodec_free_context(&c->enc_ctx);
+    free_scaler(&c->scaler);
+    avfilter_graph_free(&c->filter.filter_graph);
+    avcodec_free_context(&c->dec_ctx);
+    avformat_close_input(&c->fmt_ctx);
+}
+
+/** Open the demuxer at the chunk's first keyframe, the decoder, the filters and the encoder. */
+static int open_chunk(ChunkEncoder *e, ChunkContext *c, const VideoChunk &chunk)
+{
+    AVStream *st = e->st;
+    AVCodecContext *tmpl = e->enc_ctx;
+    int ret;
+
+    if ((ret = avformat_open_input(&c->fmt_ctx, e->input_file, NULL, NULL)) < 0)
+        return ret;
+
+    if ((ret = avformat_find_stream_info(c->fmt_ctx, NULL)) < 0)
+        return ret;
+
+    for (unsigned int i = 0; i < c->fmt_ctx->nb_streams; i++)
+        c->fmt_ctx->streams[i]->discard = (int) i == st->index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    if (chunk.start != AV_NOPTS_VALUE &&
+        (ret = av_seek_frame(c->fmt_ctx, st->index, chunk.start, AVSEEK_FLAG_BACKWARD)) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot seek to the chunk at %" PRId64 "\n", chunk.start);
+        return ret;
+    }
+
+    AVCodec *dec = avcodec_find_decoder(st->codecpar->codec_id);
+
+    if (!dec)
+        return AVERROR_DECODER_NOT_FOUND;
+
+    if (!(c->dec_ctx = avcodec_alloc_context3(dec)))
+        return AVERROR(ENOMEM);
+
+    if ((ret = avcodec_parameters_to_context(c->dec_ctx, st->codecpar)) < 0)
+        return ret;
+
+    c->dec_ctx->framerate = av_guess_frame_rate(c->fmt_ctx, c->fmt_ctx->streams[st->index], NULL);
+    c->dec_ctx->pkt_timebase = st->time_base;
+
+    set_codec_threads(c->dec_ctx, dec, e->plan.decode);
+
+    if ((ret = avcodec_open2(c->dec_ctx, dec, NULL)) < 0)
+        return ret;
+
+    if ((ret = init_chunk_filter(&c->filter, st, tmpl, e->plan.filter)) < 0)
+        return ret;
+
+    if (tmpl->width != st->codecpar->width ||
+        tmpl->height != st->codecpar->height ||
+        tmpl->pix_fmt != st->codecpar->format)
+    {
+        if ((ret = init_scaler(&c->scaler, tmpl->width, tmpl->height, tmpl->pix_fmt, e->plan.filter)) < 0)
+            return ret;
+    }
+
+    // The stream's settings, so every chunk comes out with the same parameter sets
+    if (!(c->enc_ctx = avcodec_alloc_context3(tmpl->codec)))
+        return AVERROR(ENOMEM);
+
+    c->enc_ctx->bit_rate = tmpl->bit_rate;
+    c->enc_ctx->width = tmpl->width;
+    c->enc_ctx->height = tmpl->height;
+    c->enc_ctx->sample_aspect_ratio = tmpl->sample_aspect_ratio;
+    c->enc_ctx->pix_fmt = tmpl->pix_fmt;
+    c->enc_ctx->time_base = tmpl->time_base;
+    c->enc_ctx->framerate = tmpl->framerate;
+    c->enc_ctx->gop_size = tmpl->gop_size;
+    c->enc_ctx->max_b_frames = tmpl->max_b_frames;
+    c->enc_ctx->flags = tmpl->flags | AV_CODEC_FLAG_CLOSED_GOP;
+
+    set_codec_threads(c->enc_ctx, tmpl->codec, e->plan.encode);
+
+    if ((ret = avcodec_open2(c->enc_ctx, tmpl->codec, NULL)) < 0)
+        return ret;
+
+    if (c->enc_ctx->extradata_size != tmpl->extradata_size ||
+        (tmpl->extradata_size && memcmp(c->enc_ctx->extradata, tmpl->extradata, tmpl->extradata_size)))
+    {
+        av_log(NULL, AV_LOG_ERROR, "Chunk encoder headers differ from the stream's, cannot concatenate\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    c->first_pts = chunk.start != AV_NOPTS_VALUE ? get_video_chain_pts(st, tmpl, chunk.start) : INT64_MIN;
+    c->end_pts = chunk.end != AV_NOPTS_VALUE ? get_video_chain_pts(st, tmpl, chunk.end) : INT64_MAX;
+
+    return 0;
+}
+
+/** Encode a frame, NULL to flush, and keep the packets for the writer. */
+static int encode_chunk_frame(ChunkContext *c, AVFrame *frame, ChunkResult *result)
+{
+    int ret = avcodec_send_frame(c->enc_ctx, frame);
+
+    while (ret >= 0)
+    {
+        AVPacket *packet = av_packet_alloc();
+
+        if (!packet)
+            return AVERROR(ENOMEM);
+
+        ret = avcodec_receive_packet(c->enc_ctx, packet);
+
+        if (ret < 0)
+        {
+            av_packet_free(&packet);
+            break;
+        }
+
+        result->packets.push_back(packet);
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/** Scale and encode the frames the graph has ready, dropping those outside the chunk. */
+static int encode_chunk_filtered(ChunkContext *c, ChunkResult *result)
+{
+    AVRational time_base = av_buffersink_get_time_base(c->filter.buffersink_ctx);
+    int ret;
+
+    while (1)
+    {
+        AVFrame *frame = av_frame_alloc();
+
+        if (!frame)
+            return AVERROR(ENOMEM);
+
+        ret = av_buffersink_get_frame_flags(c->filter.buffersink_ctx, frame, 0);
+
+        if (ret < 0)
+        {
+            av_frame_free(&frame);
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+        }
+
+        // Rounded like the cuts, so a frame either side of one is in exactly one chunk
+        if (frame->pts != AV_NOPTS_VALUE)
+        {
+            frame->pts = av_rescale_q_rnd(frame->pts, time_base, c->enc_ctx->time_base,
+                                          (AVRounding) (AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+
+            if (frame->pts < c->first_pts || frame->pts >= c->end_pts)
+            {
+                av_frame_free(&frame);
+                continue;
+            }
+        }
+
+        if (c->scaler)
+        {
+            AVFrame *scaled_frame = NULL;
+
+            ret = scale_frame(c->scaler, frame, &scaled_frame);
+            av_frame_free(&frame);
+
+            if (ret < 0)
+                return ret;
+
+            frame = scaled_frame;
+        }
+
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+        ret = encode_chunk_frame(c, frame, result);
+        av_frame_free(&frame);
+
+        if (ret < 0)
+            return ret;
+
+        result->frames++;
+    }
+}
+
+static bool chunk_encoder_failed(ChunkEncoder *e)
+{
+    pthread_mutex_lock(&e->mutex);
+    bool failed = e->error < 0;
+    pthread_mutex_unlock(&e->mutex);
+
+    return failed;
+}
+
+/** Decode, filter and encode one chunk into its result. */
+static int encode_chunk(ChunkEncoder *e, int index)
+{
+    const VideoChunk &chunk = (*e->chunks)[index];
+    ChunkResult *result = &e->results[index];
+    ChunkContext c;
+    AVPacket packet;
+    int tail = 0;
+
+    memset(&c, 0, sizeof(c));
+
+    AVFrame *frame = av_frame_alloc();
+    int ret = frame ? open_chunk(e, &c, chunk) : AVERROR(ENOMEM);
+    bool reading = true;
+
+    while (ret >= 0 && reading && !chunk_encoder_failed(e))
+    {
+        ret = av_read_frame(c.fmt_ctx, &packet);
+
+        if (ret == AVERROR(EAGAIN))
+        {
+            av_usleep(10000);
+            ret = 0;
+            continue;
+        }
+
+        if (ret == AVERROR_EOF)
+        {
+            ret = avcodec_send_packet(c.dec_ctx, NULL);
+        }
+        else if (ret >= 0)
+        {
+            if (packet.stream_index != e->st->index)
+            {
+                av_packet_unref(&packet);
+                continue;
+            }
+
+            ret = avcodec_send_packet(c.dec_ctx, &packet);
+            av_packet_unref(&packet);
+        }
+
+        while (ret >= 0)
+        {
+            ret = avcodec_receive_frame(c.dec_ctx, frame);
+
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            {
+                if (ret == AVERROR_EOF)
+                    reading = false;
+
+                ret = 0;
+                break;
+            }
+
+            if (ret < 0)
+                break;
+
+            int64_t pts = frame->pts = frame->best_effort_timestamp;
+
+            // Frames before the start time, and the leading frames of an open GOP
+            // that belong to the previous chunk
+            if (pts != AV_NOPTS_VALUE && chunk.start != AV_NOPTS_VALUE && pts < chunk.start)
+            {
+                av_frame_unref(frame);
+                continue;
+            }
+
+            if (pts != AV_NOPTS_VALUE && chunk.end != AV_NOPTS_VALUE && pts >= chunk.end &&
+                tail++ >= CHUNK_TAIL_FRAMES)
+            {
+                av_frame_unref(frame);
+                reading = false;
+                break;
+            }
+
+            ret = av_buffersrc_add_frame_flags(c.filter.buffersrc_ctx, frame, 0);
+
+            if (ret >= 0)
+                ret = encode_chunk_filtered(&c, result);
+        }
+    }
+
+    // Flush the filters and the encoder
+    if (ret >= 0 && (ret = av_buffersrc_add_frame_flags(c.filter.buffersrc_ctx, NULL, 0)) >= 0)
+        ret = encode_chunk_filtered(&c, result);
+
+    if (ret >= 0)
+        ret = encode_chunk_frame(&c, NULL, result);
+
+    av_frame_free(&frame);
+    free_chunk_context(&c);
+
+    return ret;
+}
+
+static void *chunk_worker_thread_proc(void *arg)
+{
+    ChunkEncoder *e = (ChunkEncoder *) arg;
+
+    // Every chunk decodes, filters and encodes on this thread and the codec
+    // threads it starts, anywhere on the job's CPUs
+    pin_thread(kAffinityJob);
+
+    pthread_mutex_lock(&e->mutex);
+
+    while (e->error >= 0 && e->next_chunk < (int) e->chunks->size())
+    {
+        int index = e->next_chunk++;
+
+        pthread_mutex_unlock(&e->mutex);
+
+        int64_t start = av_gettime_relative();
+        int ret = encode_chunk(e, index);
+        double seconds = (av_gettime_relative() - start) / 1000000.0;
+
+        pthread_mutex_lock(&e->mutex);
+
+        ChunkResult &result = e->results[index];
+
+        result.done = true;
+
+        if (ret < 0 && e->error >= 0)
+            e->error = ret;
+
+        if (ret < 0)
+            av_log(NULL, AV_LOG_ERROR, "Chunk %d failed\n", index);
+        else
+            av_log(NULL, AV_LOG_INFO, "Chunk %d: %" PRId64 " frames in %.1f s, %.1f fps\n",
+                   index, result.frames, seconds, seconds > 0 ? result.frames / seconds : 0.0);
+
+        pthread_cond_broadcast(&e->cond);
+    }
+
+    pthread_mutex_unlock(&e->mutex);
+
+    return NULL;
+}
+
+static void init_chunk_encoder(ChunkEncoder *e, const char *input_file, AVStream *st, AVCodecContext *enc_ctx,
+                               const std::vector<VideoChunk> &chunks, int workers)
+{
+    const CorePlan *plan = get_core_plan();
+    int cores = FFMAX(1, get_core_budget() / workers);
+
+    e->input_file = input_file;
+    e->st = st;
+    e->enc_ctx = enc_ctx;
+    e->chunks = &chunks;
+    e->results.resize(chunks.size());
+    e->next_chunk = 0;
+    e->error = 0;
+
+    // Each worker gets its share of the job's cores, split like the job's
+    e->plan.cores = cores;
+    e->plan.decode = plan->cores > 0 ? FFMAX(1, cores * plan->decode / plan->cores) : 1;
+    e->plan.filter = plan->cores > 0 ? FFMAX(1, cores * plan->filter / plan->cores) : 1;
+    e->plan.encode = plan->cores > 0 ? FFMAX(1, cores * plan->encode / plan->cores) : 1;
+
+    for (size_t i = 0; i < e->results.size(); i++)
+    {
+        e->results[i].frames = 0;
+        e->results[i].done = false;
+    }
+
+    pthread_mutex_init(&e->mutex, NULL);
+    pthread_cond_init(&e->cond, NULL);
+}
+
+static void free_chunk_encoder(ChunkEncoder *e)
+{
+    for (size_t i = 0; i < e->results.size(); i++)
+    {
+        for (size_t p = 0; p < e->results[i].packets.size(); p++)
+            av_packet_free(&e->results[i].packets[p]);
+
+        e->results[i].packets.clear();
+    }
+
+    pthread_mutex_destroy(&e->mutex);
+    pthread_cond_destroy(&e->cond);
+}
+
+int encode_video_chunks(const char *input_file, AVStream *st, AVCodecContext *enc_ctx,
+                        AVFormatContext *ofmt_ctx, const std::vector<VideoChunk> &chunks)
+{
+    ChunkEncoder e;
+    std::vector<pthread_t> threads;
+    int ret = 0;
+
+    int workers = av_clip(get_core_budget() / CHUNK_WORKER_CORES, 1, (int) chunks.size());
+
+    init_chunk_encoder(&e, input_file, st, enc_ctx, chunks, workers);
+
+    av_log(NULL, AV_LOG_INFO, "Encoding %d chunks on %d workers: %d decode, %d filter, %d encode threads each\n",
+           (int) chunks.size(), workers, e.plan.decode, e.plan.filter, e.plan.encode);
+
+    for (int w = 0; w < workers; w++)
+    {
+        pthread_t thread;
+
+        if ((ret = pthread_create(&thread, NULL, chunk_worker_thread_proc, &e)))
+        {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s\n", strerror(ret));
+            ret = AVERROR(ret);
+            break;
+        }
+
+        threads.push_back(thread);
+    }
+
+    // Write the chunks in order as they finish, later ones wait in memory
+    for (size_t i = 0; i < chunks.size() && ret >= 0 && !threads.empty(); i++)
+    {
+        ChunkResult &result = e.results[i];
+
+        pthread_mutex_lock(&e.mutex);
+
+        while (!result.done && e.error >= 0)
+            pthread_cond_wait(&e.cond, &e.mutex);
+
+        ret = e.error;
+
+        pthread_mutex_unlock(&e.mutex);
+
+        for (size_t p = 0; p < result.packets.size(); p++)
+        {
+            AVPacket *packet = result.packets[p];
+
+            // Through the muxer, the chunks carry their timestamps from the source on
+            if (ret >= 0)
+            {
+                packet->stream_index = 0;
+                av_packet_rescale_ts(packet, enc_ctx->time_base, ofmt_ctx->streams[0]->time_base);
+
+                if ((ret = av_interleaved_write_frame(ofmt_ctx, packet)) < 0)
+                    av_log(NULL, AV_LOG_ERROR, "Could not write a packet of chunk %d\n", (int) i);
+            }
+
+            av_packet_free(&packet);
+        }
+
+        result.packets.clear();
+    }
+
+    // Stop the workers on an error
+    pthread_mutex_lock(&e.mutex);
+
+    if (ret < 0 && e.error >= 0)
+        e.error = ret;
+
+    pthread_mutex_unlock(&e.mutex);
+
+    for (size_t t = 0; t < threads.size(); t++)
+        pthread_join(threads[t], NULL);
+
+    free_chunk_encoder(&e);
+
+    return ret;
+}
+
+int encode_video_chunk_file(const char *input_file, AVStream *st, AVCodecContext *enc_ctx,
+                            const VideoChunk &chunk, const char *output_file)
+{
+    ChunkEncoder e;
+    std::vector<VideoChunk> chunks(1, chunk);
+    AVIOContext *pb = NULL;
+
+    init_chunk_encoder(&e, input_file, st, enc_ctx, chunks, 1);
+
+    int64_t start = av_gettime_relative();
+    int ret = encode_chunk(&e, 0);
+    double seconds = (av_gettime_relative() - start) / 1000000.0;
+
+    if (ret >= 0 && (ret = avio_open(&pb, output_file, AVIO_FLAG_WRITE)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not open chunk output '%s'\n", output_file);
+
+    if (ret >= 0)
+    {
+        const ChunkResult &result = e.results[0];
+
+        for (size_t p = 0; p < result.packets.size(); p++)
+            avio_write(pb, result.packets[p]->data, result.packets[p]->size);
+
+        avio_closep(&pb);
+
+        av_log(NULL, AV_LOG_INFO, "Chunk: %" PRId64 " frames in %.1f s, %.1f fps\n",
+               result.frames, seconds, seconds > 0 ? result.frames / seconds : 0.0);
+    }
+
+    free_chunk_encoder(&e);
+
+    return ret;
+}
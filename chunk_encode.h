@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+/** A run of whole GOPs of the video stream, timestamps in the stream's time base. */
+typedef struct VideoChunk {
+    int64_t start;              // First frame kept, a keyframe after the first chunk. AV_NOPTS_VALUE from the start
+    int64_t end;                // First frame not kept, AV_NOPTS_VALUE to the end of the stream
+} VideoChunk;
+
+/**
+ * Split video stream stream_index of input_file into at most nb_chunks runs
+ * of about the same duration, cut at keyframes, between start_time and
+ * end_time in seconds, -1 for either end of the stream. The keyframes are
+ * found by a demux pass that decodes nothing. Chunks shorter than a couple
+ * of seconds are merged into their neighbours.
+ */
+int plan_video_chunks(const char *input_file, int stream_index, int nb_chunks,
+                      int start_time, int end_time, std::vector<VideoChunk> &chunks);
+
+/**
+ * Encode the chunks of video stream st in parallel and mux the packets into
+ * ofmt_ctx in order, with their timestamps. Each chunk gets its own demuxer, decoder, filter graph
+ * and an encoder opened with the settings of enc_ctx and closed GOPs, so
+ * every chunk starts with an IDR frame and the streams concatenate into one.
+ * The workers and their threads come out of the core budget.
+ */
+int encode_video_chunks(const char *input_file, AVStream *st, AVCodecContext *enc_ctx,
+                        AVFormatContext *ofmt_ctx, const std::vector<VideoChunk> &chunks);
+
+/**
+ * Encode one chunk on the calling thread, with the whole core plan, and
+ * write its packets to output_file as they are written to the stream.
+ */
+int encode_video_chunk_file(const char *input_file, AVStream *st, AVCodecContext *enc_ctx,
+                            const VideoChunk &chunk, const char *output_file);
@@ -0,0 +1,742 @@
+#include <stdint.h>
+
+#include "chunk_jobs.h"
+#include "core_budget.h"
+#include "ffmpeg_transcoder.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef WINDOWS
+    #include <direct.h>
+    #include <process.h>
+    #include <sys/utime.h>
+    #define getpid _getpid
+    #define make_dir(path) _mkdir(path)
+    #define remove_dir(path) _rmdir(path)
+#else
+    #include <unistd.h>
+    #include <utime.h>
+    #define make_dir(path) mkdir(path, 0755)
+    #define remove_dir(path) rmdir(path)
+#endif
+
+extern "C"
+{
+    #include <libavutil/avstring.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/time.h>
+}
+
+extern Options g_options;
+
+// Runs of a chunk before the whole encode is given up
+#define MAX_CHUNK_ATTEMPTS 3
+
+// A worker touches its claim this often, the coordinator runs the chunk
+// again elsewhere once a claim has not been touched for the timeout
+#define CLAIM_HEARTBEAT_SECONDS 10
+#define CLAIM_TIMEOUT_SECONDS 120
+
+#define COORDINATOR_POLL_SECONDS 1
+
+#define STITCH_BUFFER_SIZE (1 << 20)
+
+// key=value lines of a job file
+typedef std::map<std::string, std::string> JobFields;
+
+// Where an attempt at a chunk is. Each attempt has files of its own,
+// chunk_NNNN.A.*, that only move forward in this order, the job by the
+// coordinator's rename into place and the rest by the worker's renames.
+// Nobody but the worker that claimed an attempt touches its files after,
+// so a worker thought gone that is still running finishes into its own
+// names and the coordinator takes whichever attempt is done first.
+enum EChunkState
+{
+    kChunkQueued = 0,           // chunk_NNNN.A.job
+    kChunkClaimed,              // chunk_NNNN.A.claim, renamed from the job by the worker that has it
+    kChunkDone,                 // chunk_NNNN.A.done, renamed from the claim after the chunk_NNNN.A.h264 stream
+    kChunkFailed,               // chunk_NNNN.A.failed, renamed from the claim
+    kChunkMissing               // Not issued, or removed
+};
+
+typedef struct LocalWorkers {
+    std::string executable;
+    std::string args;
+    std::vector<pthread_t> threads;
+    pthread_mutex_t mutex;
+    int running;
+} LocalWorkers;
+
+typedef struct ClaimHeartbeat {
+    std::string claim;
+    ContinueMutex running;
+    pthread_t thread;
+} ClaimHeartbeat;
+
+static std::string get_chunk_path(const std::string &job_dir, int index, int attempt, const char *ext)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "chunk_%04d.%d.%s", index, attempt, ext);
+
+    return job_dir + "/" + name;
+}
+
+static bool file_exists(const std::string &path)
+{
+    struct stat info;
+
+    return stat(path.c_str(), &info) == 0;
+}
+
+static std::string to_hex(const uint8_t *data, int size)
+{
+    std::string hex;
+    char byte[3];
+
+    for (int i = 0; i < size; i++)
+    {
+        snprintf(byte, sizeof(byte), "%02x", data[i]);
+        hex += byte;
+    }
+
+    return hex;
+}
+
+static std::string get_field(const JobFields &fields, const char *key)
+{
+    JobFields::const_iterator it = fields.find(key);
+
+    return it != fields.end() ? it->second : "";
+}
+
+static std::string format_pts(int64_t pts)
+{
+    char value[32];
+
+    if (pts == AV_NOPTS_VALUE)
+        return "none";
+
+    snprintf(value, sizeof(value), "%" PRId64, pts);
+
+    return value;
+}
+
+static int64_t parse_pts(const std::string &value)
+{
+    return value == "none" || value.empty() ? AV_NOPTS_VALUE : strtoll(value.c_str(), NULL, 10);
+}
+
+static std::string format_rational(AVRational q)
+{
+    char value[32];
+
+    snprintf(value, sizeof(value), "%d/%d", q.num, q.den);
+
+    return value;
+}
+
+static AVRational parse_rational(const std::string &value)
+{
+    AVRational q = { 0, 1 };
+
+    sscanf(value.c_str(), "%d/%d", &q.num, &q.den);
+
+    return q;
+}
+
+/** Write a job file aside and rename it into place, so it is never claimed half written. */
+static int write_job_file(const std::string &path, const JobFields &fields)
+{
+    std::string part = path + ".part";
+    FILE *f = fopen(part.c_str(), "w");
+
+    if (!f)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not write job file '%s'\n", part.c_str());
+        return AVERROR(errno);
+    }
+
+    for (JobFields::const_iterator it = fields.begin(); it != fields.end(); ++it)
+        fprintf(f, "%s=%s\n", it->first.c_str(), it->second.c_str());
+
+    fclose(f);
+
+    remove(path.c_str());
+
+    if (rename(part.c_str(), path.c_str()))
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not rename job file '%s'\n", part.c_str());
+        return AVERROR(errno);
+    }
+
+    return 0;
+}
+
+static int read_job_file(const std::string &path, JobFields &fields)
+{
+    char line[kMaxSysStringLength];
+    FILE *f = fopen(path.c_str(), "r");
+
+    if (!f)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not read job file '%s'\n", path.c_str());
+        return AVERROR(errno);
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char *value = strchr(line, '=');
+
+        if (!value)
+            continue;
+
+        *value++ = '\0';
+        fields[line] = value;
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+/** The settings a worker needs to open an encoder just like enc_ctx. */
+static void get_encoder_fields(AVCodecContext *enc_ctx, JobFields &fields)
+{
+    char value[32];
+
+    fields["encoder"] = enc_ctx->codec->name;
+
+    snprintf(value, sizeof(value), "%d", enc_ctx->width);
+    fields["width"] = value;
+
+    snprintf(value, sizeof(value), "%d", enc_ctx->height);
+    fields["height"] = value;
+
+    fields["pix_fmt"] = av_get_pix_fmt_name(enc_ctx->pix_fmt);
+    fields["sample_aspect_ratio"] = format_rational(enc_ctx->sample_aspect_ratio);
+    fields["time_base"] = format_rational(enc_ctx->time_base);
+    fields["framerate"] = format_rational(enc_ctx->framerate);
+
+    snprintf(value, sizeof(value), "%d", enc_ctx->gop_size);
+    fields["gop_size"] = value;
+
+    snprintf(value, sizeof(value), "%d", enc_ctx->max_b_frames);
+    fields["max_b_frames"] = value;
+
+    snprintf(value, sizeof(value), "%" PRId64, (int64_t) enc_ctx->bit_rate);
+    fields["bit_rate"] = value;
+
+    snprintf(value, sizeof(value), "%d", enc_ctx->flags);
+    fields["flags"] = value;
+
+    // Workers check theirs against it, a different encoder build would not concatenate
+    fields["extradata"] = to_hex(enc_ctx->extradata, enc_ctx->extradata_size);
+}
+
+static int open_job_encoder(const JobFields &job, AVCodecContext **enc_ctx)
+{
+    AVCodec *encoder = avcodec_find_encoder_by_name(get_field(job, "encoder").c_str());
+    int ret;
+
+    if (!encoder)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Encoder %s not found\n", get_field(job, "encoder").c_str());
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    AVCodecContext *ctx = *enc_ctx = avcodec_alloc_context3(encoder);
+
+    if (!ctx)
+        return AVERROR(ENOMEM);
+
+    ctx->width = atoi(get_field(job, "width").c_str());
+    ctx->height = atoi(get_field(job, "height").c_str());
+    ctx->pix_fmt = av_get_pix_fmt(get_field(job, "pix_fmt").c_str());
+    ctx->sample_aspect_ratio = parse_rational(get_field(job, "sample_aspect_ratio"));
+    ctx->time_base = parse_rational(get_field(job, "time_base"));
+    ctx->framerate = parse_rational(get_field(job, "framerate"));
+    ctx->gop_size = atoi(get_field(job, "gop_size").c_str());
+    ctx->max_b_frames = atoi(get_field(job, "max_b_frames").c_str());
+    ctx->bit_rate = strtoll(get_field(job, "bit_rate").c_str(), NULL, 10);
+    ctx->flags = atoi(get_field(job, "flags").c_str());
+
+    set_codec_threads(ctx, encoder, get_core_plan()->encode);
+
+    if ((ret = avcodec_open2(ctx, encoder, NULL)) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open the chunk encoder\n");
+        return ret;
+    }
+
+    if (to_hex(ctx->extradata, ctx->extradata_size) != get_field(job, "extradata"))
+    {
+        av_log(NULL, AV_LOG_ERROR, "Encoder headers on this host differ from the coordinator's, cannot concatenate\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    return 0;
+}
+
+/** Checked in the order the files move, so a move in between only shows a later state. */
+static EChunkState get_chunk_state(const std::string &job_dir, int index, int attempt)
+{
+    if (file_exists(get_chunk_path(job_dir, index, attempt, "job")))
+        return kChunkQueued;
+
+    if (file_exists(get_chunk_path(job_dir, index, attempt, "claim")))
+        return kChunkClaimed;
+
+    if (file_exists(get_chunk_path(job_dir, index, attempt, "done")))
+        return kChunkDone;
+
+    if (file_exists(get_chunk_path(job_dir, index, attempt, "failed")))
+        return kChunkFailed;
+
+    return kChunkMissing;
+}
+
+static void *claim_heartbeat_thread_proc(void *arg)
+{
+    ClaimHeartbeat *heartbeat = (ClaimHeartbeat *) arg;
+    int seconds = 0;
+
+    while (heartbeat->running.get())
+    {
+        av_usleep(1000000);
+
+        if (++seconds % CLAIM_HEARTBEAT_SECONDS == 0)
+            utime(heartbeat->claim.c_str(), NULL);
+    }
+
+    return NULL;
+}
+
+/** Decode, filter and encode the claimed attempt into chunk_NNNN.A.h264. */
+static int encode_job(const std::string &job_dir, int index, int attempt)
+{
+    std::string claim = get_chunk_path(job_dir, index, attempt, "claim");
+    std::string output = get_chunk_path(job_dir, index, attempt, "h264");
+    std::string part = output + ".part";
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *enc_ctx = NULL;
+    JobFields job;
+    int ret;
+
+    if ((ret = read_job_file(claim, job)) < 0)
+        return ret;
+
+    std::string input = get_field(job, "input");
+    int stream_index = atoi(get_field(job, "stream").c_str());
+
+    if ((ret = avformat_open_input(&fmt_ctx, input.c_str(), NULL, NULL)) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open input file '%s'\n", input.c_str());
+        return ret;
+    }
+
+    if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) >= 0 &&
+        (stream_index < 0 || stream_index >= (int) fmt_ctx->nb_streams))
+        ret = AVERROR_STREAM_NOT_FOUND;
+
+    if (ret >= 0)
+    {
+        AVStream *st = fmt_ctx->streams[stream_index];
+
+        plan_core_budget(st->codecpar);
+
+        // The filter chain takes it from the options, as in the coordinator
+        std::string avisynth = get_field(job, "avisynth");
+
+        g_options.avisynth = !avisynth.empty();
+        av_strlcpy(g_options.avisynth_script, avisynth.c_str(), sizeof(g_options.avisynth_script));
+
+        VideoChunk chunk;
+        chunk.start = parse_pts(get_field(job, "start"));
+        chunk.end = parse_pts(get_field(job, "end"));
+
+        if ((ret = open_job_encoder(job, &enc_ctx)) >= 0)
+            ret = encode_video_chunk_file(input.c_str(), st, enc_ctx, chunk, part.c_str());
+    }
+
+    avcodec_free_context(&enc_ctx);
+    avformat_close_input(&fmt_ctx);
+
+    if (ret < 0)
+    {
+        remove(part.c_str());
+        return ret;
+    }
+
+    // The name is this attempt's, nobody else writes or reads it until it is done
+    if (rename(part.c_str(), output.c_str()))
+        return AVERROR(errno);
+
+    return 0;
+}
+
+int run_chunk_worker(const char *job_dir)
+{
+    JobFields manifest;
+    int encoded = 0;
+    int failed = 0;
+    int ret;
+
+    if ((ret = read_job_file(std::string(job_dir) + "/manifest", manifest)) < 0)
+        return ret;
+
+    int nb_chunks = atoi(get_field(manifest, "chunks").c_str());
+
+    av_log(NULL, AV_LOG_INFO, "Chunk worker %d on %s, %d chunks\n", (int) getpid(), job_dir, nb_chunks);
+
+    while (1)
+    {
+        int index = -1;
+        int attempt = 0;
+
+        // Earliest chunk first, whoever renames the job file has the attempt
+        for (int i = 0; i < nb_chunks && index < 0; i++)
+        {
+            for (int a = 1; a <= MAX_CHUNK_ATTEMPTS && index < 0; a++)
+            {
+                if (!rename(get_chunk_path(job_dir, i, a, "job").c_str(), get_chunk_path(job_dir, i, a, "claim").c_str()))
+                {
+                    index = i;
+                    attempt = a;
+                }
+            }
+        }
+
+        if (index < 0)
+            break;
+
+        av_log(NULL, AV_LOG_INFO, "Claimed chunk %d, attempt %d\n", index, attempt);
+
+        ClaimHeartbeat heartbeat;
+        heartbeat.claim = get_chunk_path(job_dir, index, attempt, "claim");
+
+        bool beating = !pthread_create(&heartbeat.thread, NULL, claim_heartbeat_thread_proc, &heartbeat);
+
+        ret = encode_job(job_dir, index, attempt);
+
+        heartbeat.running.set(false);
+
+        if (beating)
+            pthread_join(heartbeat.thread, NULL);
+
+        // The claim is this worker's alone, the coordinator never moves it.
+        // Touched last so the done file has the time the attempt finished
+        std::string done = get_chunk_path(job_dir, index, attempt, "done");
+
+        if (ret >= 0)
+        {
+            utime(heartbeat.claim.c_str(), NULL);
+
+            if (rename(heartbeat.claim.c_str(), done.c_str()))
+                ret = AVERROR(errno);
+        }
+
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Chunk %d attempt %d failed\n", index, attempt);
+            rename(heartbeat.claim.c_str(), get_chunk_path(job_dir, index, attempt, "failed").c_str());
+            failed++;
+        }
+        else
+            encoded++;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Chunk worker %d: %d chunks encoded, %d failed\n", (int) getpid(), encoded, failed);
+
+    return failed ? AVERROR_EXTERNAL : 0;
+}
+
+static void *local_worker_thread_proc(void *arg)
+{
+    LocalWorkers *workers = (LocalWorkers *) arg;
+
+    int code = RunProcess(workers->executable.c_str(), workers->args.c_str());
+
+    if (code != 0)
+        av_log(NULL, AV_LOG_WARNING, "Chunk worker process exited with %d\n", code);
+
+    pthread_mutex_lock(&workers->mutex);
+    workers->running--;
+    pthread_mutex_unlock(&workers->mutex);
+
+    return NULL;
+}
+
+/** Start local worker processes up to count, each on its share of the job's cores. */
+static void start_local_workers(LocalWorkers *workers, int count)
+{
+    pthread_mutex_lock(&workers->mutex);
+
+    while (workers->running < count)
+    {
+        pthread_t thread;
+        int ret;
+
+        if ((ret = pthread_create(&thread, NULL, local_worker_thread_proc, workers)))
+        {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s\n", strerror(ret));
+            break;
+        }
+
+        workers->threads.push_back(thread);
+        workers->running++;
+    }
+
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+/** Append the streams of the accepted attempts to the video output in order. */
+static int stitch_chunks(const std::string &job_dir, const std::vector<int> &accepted, AVFormatContext *ofmt_ctx)
+{
+    uint8_t *buffer = (uint8_t *) av_malloc(STITCH_BUFFER_SIZE);
+    int ret = 0;
+
+    if (!buffer)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < (int) accepted.size() && ret >= 0; i++)
+    {
+        std::string path = get_chunk_path(job_dir, i, accepted[i], "h264");
+        FILE *f = fopen(path.c_str(), "rb");
+        size_t size;
+
+        if (!f)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not open chunk stream '%s'\n", path.c_str());
+            ret = AVERROR(errno);
+            break;
+        }
+
+        while ((size = fread(buffer, 1, STITCH_BUFFER_SIZE, f)) > 0)
+            avio_write(ofmt_ctx->pb, buffer, (int) size);
+
+        if (ferror(f))
+            ret = AVERROR(EIO);
+
+        fclose(f);
+    }
+
+    av_free(buffer);
+
+    return ret;
+}
+
+static void remove_job_dir(const std::string &job_dir, int nb_chunks)
+{
+    static const char *extensions[] = { "job", "job.part", "claim", "done", "failed", "h264", "h264.part" };
+
+    for (int i = 0; i < nb_chunks; i++)
+    {
+        for (int a = 1; a <= MAX_CHUNK_ATTEMPTS; a++)
+        {
+            for (size_t e = 0; e < sizeof(extensions) / sizeof(extensions[0]); e++)
+                remove(get_chunk_path(job_dir, i, a, extensions[e]).c_str());
+        }
+    }
+
+    remove((job_dir + "/manifest").c_str());
+    remove_dir(job_dir.c_str());
+}
+
+int run_chunk_coordinator(const char *executable, const char *work_dir, int processes,
+                          const char *input_file, AVStream *st, AVCodecContext *enc_ctx,
+                          AVFormatContext *ofmt_ctx, const std::vector<VideoChunk> &chunks)
+{
+    int nb_chunks = (int) chunks.size();
+    std::vector<JobFields> jobs(nb_chunks);
+    std::vector<int> attempts(nb_chunks, 1);         // Issued so far
+    std::vector<int> accepted(nb_chunks, 0);         // The attempt stitched, 0 until one is done
+    LocalWorkers workers;
+    char name[64];
+    char value[64];
+    int ret = 0;
+
+    snprintf(name, sizeof(name), "chunks_%d", (int) getpid());
+    std::string job_dir = std::string(work_dir) + "/" + name;
+
+    make_dir(work_dir);
+
+    if (make_dir(job_dir.c_str()) && errno != EEXIST)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not create job directory '%s'\n", job_dir.c_str());
+        return AVERROR(errno);
+    }
+
+    // What every chunk shares, then its range
+    JobFields base;
+
+    get_encoder_fields(enc_ctx, base);
+
+    base["input"] = input_file;
+    snprintf(value, sizeof(value), "%d", st->index);
+    base["stream"] = value;
+    base["avisynth"] = g_options.avisynth ? g_options.avisynth_script : "";
+
+    for (int i = 0; i < nb_chunks && ret >= 0; i++)
+    {
+        jobs[i] = base;
+        jobs[i]["start"] = format_pts(chunks[i].start);
+        jobs[i]["end"] = format_pts(chunks[i].end);
+
+        ret = write_job_file(get_chunk_path(job_dir, i, 1, "job"), jobs[i]);
+    }
+
+    // Workers read the manifest first, it goes in last
+    JobFields manifest;
+
+    snprintf(value, sizeof(value), "%d", nb_chunks);
+    manifest["chunks"] = value;
+
+    if (ret >= 0)
+        ret = write_job_file(job_dir + "/manifest", manifest);
+
+    if (ret < 0)
+        return ret;
+
+    av_log(NULL, AV_LOG_INFO, "%d chunk jobs in %s, %d local worker%s; more can be started anywhere that sees it with: %s -chunk_worker %s\n",
+           nb_chunks, job_dir.c_str(), processes, processes != 1 ? "s" : "", executable, job_dir.c_str());
+
+    // Local workers split this job's cores between them
+    snprintf(value, sizeof(value), "%d", get_core_budget());
+
+    workers.executable = executable;
+    workers.args = std::string("-chunk_worker \"") + job_dir + "\" -cores " + value + " -jobs ";
+    snprintf(value, sizeof(value), "%d", FFMAX(1, processes));
+    workers.args += value;
+    workers.running = 0;
+
+    pthread_mutex_init(&workers.mutex, NULL);
+
+    start_local_workers(&workers, processes);
+
+    while (1)
+    {
+        int done = 0;
+        int queued = 0;
+
+        for (int i = 0; i < nb_chunks && ret >= 0; i++)
+        {
+            time_t finished = 0;
+            int live = 0;
+
+            if (accepted[i])
+            {
+                done++;
+                continue;
+            }
+
+            for (int a = 1; a <= attempts[i]; a++)
+            {
+                std::string claim = get_chunk_path(job_dir, i, a, "claim");
+                struct stat info;
+
+                switch (get_chunk_state(job_dir, i, a))
+                {
+                    case kChunkQueued:
+                        queued++;
+                        live++;
+                        break;
+
+                    case kChunkDone:
+                        // Of attempts done since the last poll, the one that finished first
+                        if (stat(get_chunk_path(job_dir, i, a, "done").c_str(), &info) == 0 &&
+                            (!accepted[i] || info.st_mtime < finished))
+                        {
+                            accepted[i] = a;
+                            finished = info.st_mtime;
+                        }
+                        break;
+
+                    case kChunkClaimed:
+                        // A stale claim is left alone, its worker may only be slow and
+                        // finishes into its own names; the chunk is issued again meanwhile
+                        if (stat(claim.c_str(), &info) != 0 ||
+                            time(NULL) - info.st_mtime <= CLAIM_TIMEOUT_SECONDS)
+                            live++;
+                        break;
+
+                    case kChunkFailed:
+                    case kChunkMissing:
+                        break;
+                }
+            }
+
+            if (accepted[i])
+            {
+                // The first attempt done is the one stitched, nobody needs to take the others
+                for (int a = 1; a <= attempts[i]; a++)
+                    remove(get_chunk_path(job_dir, i, a, "job").c_str());
+
+                done++;
+                continue;
+            }
+
+            if (live > 0)
+                continue;
+
+            if (attempts[i] >= MAX_CHUNK_ATTEMPTS)
+            {
+                av_log(NULL, AV_LOG_ERROR, "Chunk %d failed %d times, giving up\n", i, MAX_CHUNK_ATTEMPTS);
+                ret = AVERROR_EXTERNAL;
+                break;
+            }
+
+            attempts[i]++;
+
+            av_log(NULL, AV_LOG_WARNING, "Running chunk %d again, attempt %d\n", i, attempts[i]);
+
+            ret = write_job_file(get_chunk_path(job_dir, i, attempts[i], "job"), jobs[i]);
+            queued++;
+        }
+
+        if (ret < 0 || done == nb_chunks)
+            break;
+
+        // Workers exit when there is nothing left to claim, bring them back for re-runs
+        if (queued > 0)
+            start_local_workers(&workers, processes);
+
+        av_usleep(COORDINATOR_POLL_SECONDS * 1000000);
+    }
+
+    // Leave nothing for the workers to claim, they stop after their current chunk
+    if (ret < 0)
+    {
+        for (int i = 0; i < nb_chunks; i++)
+        {
+            for (int a = 1; a <= attempts[i]; a++)
+                remove(get_chunk_path(job_dir, i, a, "job").c_str());
+        }
+    }
+
+    for (size_t t = 0; t < workers.threads.size(); t++)
+        pthread_join(workers.threads[t], NULL);
+
+    pthread_mutex_destroy(&workers.mutex);
+
+    if (ret >= 0)
+        ret = stitch_chunks(job_dir, accepted, ofmt_ctx);
+
+    // Kept on failure, to see what went wrong
+    if (ret >= 0)
+        remove_job_dir(job_dir, nb_chunks);
+
+    return ret;
+}
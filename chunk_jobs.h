@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+
+#include "chunk_encode.h"
+
+/**
+ * Encode the chunks in worker processes that share a job directory under
+ * work_dir. Each chunk gets a job file with its range and the encoder
+ * settings. processes workers are started here with RunProcess(); 0 leaves
+ * all the chunks to workers started by hand, on this or other hosts that
+ * see the same work_dir and input file. Failed chunks and chunks whose
+ * worker stopped updating its claim are run again as a new attempt, up to a
+ * few times each. Every attempt writes under names of its own and a stale
+ * claim is never taken back, so a slow worker cannot clash with the re-run;
+ * the first attempt of a chunk to be done is the one used. Once every chunk
+ * is done the chunk streams are written to ofmt_ctx in order and the job
+ * directory is removed.
+ */
+int run_chunk_coordinator(const char *executable, const char *work_dir, int processes,
+                          const char *input_file, AVStream *st, AVCodecContext *enc_ctx,
+                          AVFormatContext *ofmt_ctx, const std::vector<VideoChunk> &chunks);
+
+/**
+ * Worker process: claim jobs from job_dir one at a time, by renaming the job
+ * file, encode each and mark it done, until none are left to claim. A worker
+ * only ever moves the claim it made.
+ */
+int run_chunk_worker(const char *job_dir);
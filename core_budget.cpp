@@ -0,0 +1,116 @@
+#include "core_budget.h"
+
+#include <stdint.h>
+
+extern "C"
+{
+    #include <libavutil/cpu.h>
+    #include <libavutil/log.h>
+}
+
+// libavcodec does not scale past this many threads for most codecs
+#define MAX_CODEC_THREADS 16
+
+// Share of a job's cores the video decoder gets, by codec
+#define DECODE_SHARE_HEAVY 0.3      // HEVC, VP9, AV1
+#define DECODE_SHARE_H264 0.25
+#define DECODE_SHARE_LIGHT 0.15     // MPEG-2, MPEG-4 part 2, intra-only codecs
+
+// Share the filters and the scaler get, the encoder gets the rest
+#define FILTER_SHARE 0.2
+
+static int g_core_budget = 0;
+static CorePlan g_core_plan = { 0, 1, 1, 1 };
+
+void init_core_budget(int cores, int jobs)
+{
+    int cpus = av_cpu_count();
+
+    if (cores <= 0 || cores > cpus)
+        cores = cpus;
+
+    if (jobs < 1)
+        jobs = 1;
+
+    g_core_budget = FFMAX(1, cores / jobs);
+
+    av_log(NULL, AV_LOG_INFO, "Core budget: %d of %d CPUs for each of %d job%s\n",
+           g_core_budget, cpus, jobs, jobs > 1 ? "s" : "");
+}
+
+int get_core_budget()
+{
+    if (g_core_budget <= 0)
+        g_core_budget = av_cpu_count();
+
+    return g_core_budget;
+}
+
+static double get_decode_share(AVCodecID codec_id)
+{
+    switch (codec_id)
+    {
+        case AV_CODEC_ID_HEVC:
+        case AV_CODEC_ID_VP9:
+        case AV_CODEC_ID_AV1:
+            return DECODE_SHARE_HEAVY;
+
+        case AV_CODEC_ID_H264:
+            return DECODE_SHARE_H264;
+
+        default:
+            return DECODE_SHARE_LIGHT;
+    }
+}
+
+void plan_core_budget(const AVCodecParameters *video)
+{
+    CorePlan &plan = g_core_plan;
+
+    plan.cores = get_core_budget();
+    plan.decode = 1;
+    plan.filter = 1;
+    plan.encode = 1;
+
+    // Below three cores every stage gets one and they share
+    if (video && plan.cores >= 3)
+    {
+        plan.decode = av_clip((int) (plan.cores * get_decode_share(video->codec_id) + 0.5), 1, MAX_CODEC_THREADS);
+        plan.filter = FFMAX(1, (int) (plan.cores * FILTER_SHARE + 0.5));
+        plan.encode = FFMAX(1, plan.cores - plan.decode - plan.filter);
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Core plan: %d cores, decode %d, filter %d, encode %d\n",
+           plan.cores, plan.decode, plan.filter, plan.encode);
+}
+
+const CorePlan *get_core_plan()
+{
+    return &g_core_plan;
+}
+
+void set_codec_threads(AVCodecContext *ctx, const AVCodec *codec, int threads)
+{
+    bool frame = (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) != 0;
+    bool slice = (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) != 0;
+    bool own = (codec->capabilities & AV_CODEC_CAP_AUTO_THREADS) != 0;   // Like libx264
+
+    // Frame threads would only wait on the frames the decoder skips
+    if (av_codec_is_decoder(codec) && ctx->skip_frame >= AVDISCARD_NONKEY && slice)
+        frame = false;
+
+    if (threads <= 1 || !(frame || slice || own))
+    {
+        ctx->thread_count = 1;
+        return;
+    }
+
+    // Codecs with their own threading scale further, and take the thread type
+    // as the choice between frame and sliced threads
+    ctx->thread_count = own ? threads : FFMIN(threads, MAX_CODEC_THREADS);
+    ctx->thread_type = (frame || !slice) ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+
+    av_log(NULL, AV_LOG_INFO, "%s %s: %d %s threads\n",
+           av_codec_is_decoder(codec) ? "Decoder" : "Encoder", codec->name,
+           ctx->thread_count, ctx->thread_type == FF_THREAD_FRAME ? "frame" : "slice");
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+/** How the cores of one job are shared out between the stages. */
+typedef struct CorePlan {
+    int cores;                  // This job's share of the machine
+    int decode;                 // Video decoder threads
+    int filter;                 // Filter graph, pipeline and scaler threads
+    int encode;                 // Video encoder threads
+} CorePlan;
+
+/**
+ * Set the number of cores transcoding may keep busy, 0 for all the CPUs,
+ * and how many jobs run on them at once. Each job gets an equal share, and
+ * thread counts for the libraries and our own worker threads come out of
+ * that share instead of each sizing itself to the machine.
+ */
+void init_core_budget(int cores, int jobs);
+
+/** Cores this job may keep busy. */
+int get_core_budget();
+
+/**
+ * Split this job's cores between decoding, filtering and encoding the video
+ * stream, NULL if there is none, weighted by how expensive its codec is to
+ * decode. Audio decodes and encodes on one thread each. Logs the plan.
+ */
+void plan_core_budget(const AVCodecParameters *video);
+
+const CorePlan *get_core_plan();
+
+/**
+ * Set thread_count and thread_type on a codec context before it is opened.
+ * Frame threading where the codec supports it, slice threading where it only
+ * supports that or where a decoder skips all but keyframes.
+ */
+void set_codec_threads(AVCodecContext *ctx, const AVCodec *codec, int threads);
@@ -0,0 +1,374 @@
+#include "fast_scale.h"
+
+extern "C"
+{
+    #include <libavutil/cpu.h>
+    #include <libavutil/mem.h>
+}
+
+#include <string.h>
+
+// The AVX2 kernels are built with a per-function target on GCC/Clang, so the
+// rest of the program does not require AVX2, and selected at runtime
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define HAVE_AVX2_INTRINSICS 1
+    #define TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && defined(_M_X64)
+    #include <immintrin.h>
+    #define HAVE_AVX2_INTRINSICS 1
+    #define TARGET_AVX2
+#endif
+
+static bool is_yuv420p(AVPixelFormat fmt)
+{
+    return fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUVJ420P;
+}
+
+static bool is_yuv422p(AVPixelFormat fmt)
+{
+    return fmt == AV_PIX_FMT_YUV422P || fmt == AV_PIX_FMT_YUVJ422P;
+}
+
+/** Full and JPEG range variants do not mix, the fast paths do not convert range. */
+static bool same_range(AVPixelFormat a, AVPixelFormat b)
+{
+    bool a_full = a == AV_PIX_FMT_YUVJ420P || a == AV_PIX_FMT_YUVJ422P;
+    bool b_full = b == AV_PIX_FMT_YUVJ420P || b == AV_PIX_FMT_YUVJ422P;
+
+    return a_full == b_full;
+}
+
+EFastScaleKind find_fast_scale(int src_width, int src_height, AVPixelFormat src_fmt,
+                               int dst_width, int dst_height, AVPixelFormat dst_fmt)
+{
+    if (!is_yuv420p(dst_fmt) || !same_range(src_fmt, dst_fmt))
+        return kNoFastScale;
+
+    if (is_yuv420p(src_fmt))
+    {
+        // Chroma must split into whole 2x2 or 3x3 blocks too
+        if (dst_width * 2 == src_width && dst_height * 2 == src_height &&
+            src_width % 4 == 0 && src_height % 4 == 0)
+            return kFastScaleHalf;
+
+        if (dst_width * 3 == src_width * 2 && dst_height * 3 == src_height * 2 &&
+            src_width % 6 == 0 && src_height % 6 == 0)
+            return kFastScaleTwoThirds;
+    }
+    else if (is_yuv422p(src_fmt))
+    {
+        if (dst_width == src_width && dst_height == src_height &&
+            src_width % 2 == 0 && src_height % 2 == 0)
+            return kFastScale422To420;
+    }
+
+    return kNoFastScale;
+}
+
+void get_fast_scale_unit(EFastScaleKind kind, int *src_rows, int *dst_rows)
+{
+    switch (kind)
+    {
+        case kFastScaleHalf:
+            *src_rows = 4;
+            *dst_rows = 2;
+            break;
+
+        case kFastScaleTwoThirds:
+            *src_rows = 6;
+            *dst_rows = 4;
+            break;
+
+        default:
+            *src_rows = 2;
+            *dst_rows = 2;
+            break;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// C kernels, also the reference for the SIMD ones
+
+/** 2x2 box: every destination pixel is the rounded mean of 4 source pixels. */
+static void half_rows_c(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int rows)
+{
+    for (int y = 0; y < rows; y++, src += 2 * src_stride, dst += dst_stride)
+    {
+        const uint8_t *s0 = src;
+        const uint8_t *s1 = src + src_stride;
+
+        for (int x = 0; x < width; x++)
+            dst[x] = (uint8_t) ((s0[2 * x] + s0[2 * x + 1] + s1[2 * x] + s1[2 * x + 1] + 2) >> 2);
+    }
+}
+
+/**
+ * Bilinear 3:2, destination samples sit at source positions 0.25 and 1.75
+ * of every group of 3, so the weights are 3/4 and 1/4.
+ */
+static void two_thirds_vertical_c(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2,
+                                  uint8_t *t0, uint8_t *t1, int width)
+{
+    for (int x = 0; x < width; x++)
+    {
+        t0[x] = (uint8_t) ((3 * r0[x] + r1[x] + 2) >> 2);
+        t1[x] = (uint8_t) ((r1[x] + 3 * r2[x] + 2) >> 2);
+    }
+}
+
+static void two_thirds_horizontal_c(const uint8_t *src, uint8_t *dst, int dst_width, int x)
+{
+    for (; x < dst_width; x += 2)
+    {
+        const uint8_t *s = src + x / 2 * 3;
+
+        dst[x] = (uint8_t) ((3 * s[0] + s[1] + 2) >> 2);
+        dst[x + 1] = (uint8_t) ((s[1] + 3 * s[2] + 2) >> 2);
+    }
+}
+
+static void average_rows_c(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, int width)
+{
+    for (int x = 0; x < width; x++)
+        dst[x] = (uint8_t) ((r0[x] + r1[x] + 1) >> 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels
+
+#if HAVE_AVX2_INTRINSICS
+
+TARGET_AVX2
+static void half_rows_avx2(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int rows)
+{
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi16(2);
+
+    for (int y = 0; y < rows; y++, src += 2 * src_stride, dst += dst_stride)
+    {
+        const uint8_t *s0 = src;
+        const uint8_t *s1 = src + src_stride;
+        int x = 0;
+
+        for (; x + 32 <= width; x += 32)
+        {
+            // Horizontal pair sums of both rows as 16 bit, 32 outputs
+            __m256i lo = _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i *) (s0 + 2 * x)), ones),
+                                          _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i *) (s1 + 2 * x)), ones));
+            __m256i hi = _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i *) (s0 + 2 * x + 32)), ones),
+                                          _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i *) (s1 + 2 * x + 32)), ones));
+
+            lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+
+            // packus works per 128 bit lane, put the quadwords back in order
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+            _mm256_storeu_si256((__m256i *) (dst + x), packed);
+        }
+
+        for (; x < width; x++)
+            dst[x] = (uint8_t) ((s0[2 * x] + s0[2 * x + 1] + s1[2 * x] + s1[2 * x + 1] + 2) >> 2);
+    }
+}
+
+TARGET_AVX2
+static void two_thirds_vertical_avx2(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2,
+                                     uint8_t *t0, uint8_t *t1, int width)
+{
+    const __m256i w31 = _mm256_set1_epi16(0x0103);   // bytes 3, 1
+    const __m256i w13 = _mm256_set1_epi16(0x0301);   // bytes 1, 3
+    const __m256i two = _mm256_set1_epi16(2);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (r0 + x));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (r1 + x));
+        __m256i c = _mm256_loadu_si256((const __m256i *) (r2 + x));
+
+        // Interleave the rows so maddubs does the weighted sum, unpack and
+        // pack are both per lane so the order comes out right
+        __m256i lo = _mm256_maddubs_epi16(_mm256_unpacklo_epi8(a, b), w31);
+        __m256i hi = _mm256_maddubs_epi16(_mm256_unpackhi_epi8(a, b), w31);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+        _mm256_storeu_si256((__m256i *) (t0 + x), _mm256_packus_epi16(lo, hi));
+
+        lo = _mm256_maddubs_epi16(_mm256_unpacklo_epi8(b, c), w13);
+        hi = _mm256_maddubs_epi16(_mm256_unpackhi_epi8(b, c), w13);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+        _mm256_storeu_si256((__m256i *) (t1 + x), _mm256_packus_epi16(lo, hi));
+    }
+
+    two_thirds_vertical_c(r0 + x, r1 + x, r2 + x, t0 + x, t1 + x, width - x);
+}
+
+/** src must be readable 4 bytes past the last group. */
+TARGET_AVX2
+static void two_thirds_horizontal_avx2(const uint8_t *src, uint8_t *dst, int dst_width)
+{
+    // Per lane, 12 source bytes give 8 outputs as (3/4 tap, 1/4 tap) pairs
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 1, 3, 4, 5, 4, 6, 7, 8, 7, 9, 10, 11, 10,
+                                             0, 1, 2, 1, 3, 4, 5, 4, 6, 7, 8, 7, 9, 10, 11, 10);
+    const __m256i weights = _mm256_set1_epi16(0x0103);
+    const __m256i two = _mm256_set1_epi16(2);
+    int x = 0;
+
+    for (; x + 16 <= dst_width; x += 16)
+    {
+        const uint8_t *s = src + x / 2 * 3;
+
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) s)),
+                                            _mm_loadu_si128((const __m128i *) (s + 12)), 1);
+
+        v = _mm256_maddubs_epi16(_mm256_shuffle_epi8(v, shuffle), weights);
+        v = _mm256_srli_epi16(_mm256_add_epi16(v, two), 2);
+        v = _mm256_packus_epi16(v, v);
+
+        // 8 results in the low quadword of each lane
+        v = _mm256_permute4x64_epi64(v, 0x08);
+        _mm_storeu_si128((__m128i *) (dst + x), _mm256_castsi256_si128(v));
+    }
+
+    two_thirds_horizontal_c(src, dst, dst_width, x);
+}
+
+TARGET_AVX2
+static void average_rows_avx2(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, int width)
+{
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32)
+        _mm256_storeu_si256((__m256i *) (dst + x),
+                            _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *) (r0 + x)),
+                                            _mm256_loadu_si256((const __m256i *) (r1 + x))));
+
+    average_rows_c(r0 + x, r1 + x, dst + x, width - x);
+}
+
+#endif
+
+bool have_fast_scale_simd()
+{
+#if HAVE_AVX2_INTRINSICS
+    static const bool avx2 = (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) != 0;
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static void half_plane(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+                       int width, int rows, bool simd)
+{
+#if HAVE_AVX2_INTRINSICS
+    if (simd)
+    {
+        half_rows_avx2(src, src_stride, dst, dst_stride, width, rows);
+        return;
+    }
+#endif
+
+    half_rows_c(src, src_stride, dst, dst_stride, width, rows);
+}
+
+static void two_thirds_plane(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+                             int src_width, int dst_width, int rows, bool simd)
+{
+    // Two vertically filtered rows, padded for the horizontal kernel's over-read
+    uint8_t *tmp = (uint8_t *) av_malloc(2 * (src_width + 32));
+    if (!tmp)
+        return;
+
+    uint8_t *t0 = tmp;
+    uint8_t *t1 = tmp + src_width + 32;
+
+    memset(tmp, 0, 2 * (src_width + 32));
+
+    for (int y = 0; y < rows; y += 2, src += 3 * src_stride, dst += 2 * dst_stride)
+    {
+#if HAVE_AVX2_INTRINSICS
+        if (simd)
+        {
+            two_thirds_vertical_avx2(src, src + src_stride, src + 2 * src_stride, t0, t1, src_width);
+            two_thirds_horizontal_avx2(t0, dst, dst_width);
+            two_thirds_horizontal_avx2(t1, dst + dst_stride, dst_width);
+            continue;
+        }
+#endif
+
+        two_thirds_vertical_c(src, src + src_stride, src + 2 * src_stride, t0, t1, src_width);
+        two_thirds_horizontal_c(t0, dst, dst_width, 0);
+        two_thirds_horizontal_c(t1, dst + dst_stride, dst_width, 0);
+    }
+
+    av_free(tmp);
+}
+
+static void average_plane(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+                          int width, int rows, bool simd)
+{
+    for (int y = 0; y < rows; y++, src += 2 * src_stride, dst += dst_stride)
+    {
+#if HAVE_AVX2_INTRINSICS
+        if (simd)
+        {
+            average_rows_avx2(src, src + src_stride, dst, width);
+            continue;
+        }
+#endif
+
+        average_rows_c(src, src + src_stride, dst, width);
+    }
+}
+
+void fast_scale(EFastScaleKind kind, const AVFrame *src, AVFrame *dst, int dst_y, int dst_h, bool simd)
+{
+    simd = simd && have_fast_scale_simd();
+
+    for (int p = 0; p < 3; p++)
+    {
+        // Luma, then the two 4:2:0 chroma planes at half the rows
+        int shift = p ? 1 : 0;
+        int y = dst_y >> shift;
+        int rows = dst_h >> shift;
+        int dst_width = p ? (dst->width + 1) >> 1 : dst->width;
+        int src_width = p ? (src->width + 1) >> 1 : src->width;
+
+        uint8_t *d = dst->data[p] + y * dst->linesize[p];
+
+        switch (kind)
+        {
+            case kFastScaleHalf:
+                half_plane(src->data[p] + 2 * y * src->linesize[p], src->linesize[p],
+                           d, dst->linesize[p], dst_width, rows, simd);
+                break;
+
+            case kFastScaleTwoThirds:
+                two_thirds_plane(src->data[p] + y / 2 * 3 * src->linesize[p], src->linesize[p],
+                                 d, dst->linesize[p], src_width, dst_width, rows, simd);
+                break;
+
+            case kFastScale422To420:
+                // Luma is copied, 4:2:2 chroma has every row
+                if (p == 0)
+                {
+                    for (int r = 0; r < rows; r++)
+                        memcpy(d + r * dst->linesize[0], src->data[0] + (y + r) * src->linesize[0], dst_width);
+                }
+                else
+                {
+                    average_plane(src->data[p] + 2 * y * src->linesize[p], src->linesize[p],
+                                  d, dst->linesize[p], dst_width, rows, simd);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+    #include <libavutil/pixfmt.h>
+}
+
+// Conversions with hand-written kernels, everything else goes through libswscale
+enum EFastScaleKind
+{
+    kNoFastScale = 0,
+    kFastScaleHalf,             // yuv420p 2:1 in both directions, 2x2 box
+    kFastScaleTwoThirds,        // yuv420p 3:2 in both directions, bilinear
+    kFastScale422To420          // yuv422p to yuv420p at the same size, chroma row average
+};
+
+EFastScaleKind find_fast_scale(int src_width, int src_height, AVPixelFormat src_fmt,
+                               int dst_width, int dst_height, AVPixelFormat dst_fmt);
+
+/**
+ * Luma rows of source and destination that make up one independent unit of
+ * the conversion. Bands of whole units can be converted in parallel.
+ */
+void get_fast_scale_unit(EFastScaleKind kind, int *src_rows, int *dst_rows);
+
+/**
+ * Convert destination luma rows [dst_y, dst_y + dst_h) of dst from src, the
+ * chroma rows that go with them included. dst_y and dst_h must be multiples
+ * of the unit. simd false forces the C kernels.
+ */
+void fast_scale(EFastScaleKind kind, const AVFrame *src, AVFrame *dst, int dst_y, int dst_h, bool simd = true);
+
+/** True if the AVX2 kernels are compiled in and the CPU supports them. */
+bool have_fast_scale_simd();
@@ -103,9 +103,9 @@ extern "C"
 #include <locale> // time functions
 
 #ifdef WINDOWS
-#define WORK_DIR _T("work\\")  // work dir relative to program working directory
+#define WORK_DIR "work\\"  // work dir relative to program working directory
 #else
-#define WORK_DIR _T("/work/")  // work dir a volume of its own on Linux
+#define WORK_DIR "/work/"  // work dir a volume of its own on Linux
 #endif
 
 // For use on WINDOWS when trying to chase down memory leaks
@@ -117,7 +117,63 @@ extern "C"
 // Write frame to disk helper
 #include "write_frame.h"
 
+// Thumbnail and sprite sheet side output
+#include "thumbnails.h"
+
+// Inline PSNR/SSIM measurement
+#include "quality.h"
+
+// ABR ladder renditions from the one decode
+#include "ladder.h"
+
+// Single interleaved output for -m
+#include "muxer.h"
+
+// Packets written off the encode thread
+#include "output_writer.h"
+
+// Large block output files, preallocated
+#include "output_io.h"
+
+// Memory mapped local input
+#include "mmap_input.h"
+
+// Input fetched ahead of the demuxer, for remote storage
+#include "read_ahead.h"
+
+// Filtered frames published to shared memory for another process
+#include "frame_sink.h"
+
+// HLS/DASH segments cut from the encoded packets
+#include "segmenter.h"
+
+// Black frame, silence, scene and luma analysis
+#include "analysis.h"
+
+// Audio min/max peak files for waveform display
+#include "waveform.h"
+
+// EBU R128 measurement and normalization
+#include "loudness.h"
+
+// Cores of the job, split between decoding, filtering and encoding
+#include "core_budget.h"
+
+// CPU and NUMA node pinning of the stages
+#include "affinity.h"
+
+// Parallel encoding of the video in GOP chunks
+#include "chunk_encode.h"
+
+// Chunk jobs for worker processes, here and on other hosts
+#include "chunk_jobs.h"
+
 extern bool DoDecodeTest(const char *filename);
+extern bool DoScalerBenchmark();
+extern bool DoFrameSinkConsumer(const char *name);
+extern bool DoFrameSinkTest();
+extern bool DoReadAheadTest();
+extern bool DoChunkJobsTest(const char *executable, const char *input_file);
 
 // Types
 ////////
@@ -141,6 +197,8 @@ Options             g_options;
 
 // Describes the input file
 AVFormatContext     *g_ifmt_ctx = NULL;
+static AVIOContext  *g_input_pb = NULL;    // -mmap or -read_ahead input, the format context does not own it
+static void         (*g_close_input_pb)(AVIOContext **pb) = NULL;
 FilteringContext    *g_filter_ctx = NULL;
 StreamContext       *g_stream_ctx = NULL;
 
@@ -158,6 +216,9 @@ static char g_error[AV_ERROR_MAX_STRING_SIZE] = {0};
 // One entry per output file
 static std::vector<AVFormatContext *> g_output_formats;
 
+// The writer thread of each output file, in the same order
+static std::vector<OutputWriter *> g_output_writers;
+
 static SwrContext *g_resampler_context = NULL;
 
 static ContinueMutex g_continue_audio_mutex;
@@ -170,6 +231,16 @@ static double g_total_frames = 0;
 static double g_total_duration = 0;
 static uint32_t g_percentage = (uint32_t) -1;
 
+// Keyframe only mode
+static FILE *g_keyframe_manifest = NULL;
+static int g_keyframe_num = 0;
+
+// Video stream encoded by the chunk workers, -1 for none
+static int g_chunked_stream = -1;
+
+// First error of the filter, convert, encode and write thread, read once it is joined
+static int g_encode_error = 0;
+
 // Forward declarations
 ///////////////////////
 
@@ -178,11 +249,34 @@ static void *filter_convert_encode_write_thread_proc(void *arg);
 static int convert_encode_write_frame(AVFrame *frame, unsigned int stream_index, int *got_frame);
 static void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame);
 
+///////////////////////////////////////////////////////////////////////////////
+// Keyframe only mode: record the keyframe in the manifest and optionally
+// write it to disk as an image. Called from the decode thread.
+///////////////////////////////////////////////////////////////////////////////
+static void write_keyframe(AVFrame *frame, unsigned int stream_index)
+{
+    int64_t pts = frame->best_effort_timestamp;
+    double seconds = -1.0;
+
+    if (pts != AV_NOPTS_VALUE)
+        seconds = pts * av_q2d(g_ifmt_ctx->streams[stream_index]->time_base);
+
+    if (g_options.keyframe_images)
+        WriteFrame(g_stream_ctx[stream_index].dec_ctx, frame, g_keyframe_num);
+
+    if (g_keyframe_manifest)
+        fprintf(g_keyframe_manifest, "%d,%lld,%.6f\n", g_keyframe_num, (long long) pts, seconds);
+
+    g_keyframe_num++;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // DECODE THREAD PROC - reads from decode_input_queue
 ///////////////////////////////////////////////////////////////////////////////
 static void *decode_thread_proc(void *arg)
 {
+    pin_thread(kAffinityDecode);
+
     // Create the filter_encode_write_input_queue, will contain decoded frames
     int ret = av_thread_message_queue_alloc(&g_filter_convert_encode_write_input_queue, THREAD_QUEUE_SIZE, sizeof(FrameAndStream));
 
@@ -292,6 +386,21 @@ static void *decode_thread_proc(void *arg)
                             WriteFrame(g_stream_ctx[stream_index].dec_ctx, frame_and_stream.frame, i);
                     }
 
+                    // Only keyframes come out of the decoder in keyframe only mode
+                    if(type == AVMEDIA_TYPE_VIDEO &&
+                       g_options.keyframes_only)
+                        write_keyframe(frame_and_stream.frame, stream_index);
+
+                    if(type == AVMEDIA_TYPE_VIDEO)
+                    {
+                        // Downscale into the shared analysis plane, gives the scene change score
+                        double scene_score = analyze_video_frame(stream_index, frame_and_stream.frame);
+
+                        // Hand a reference to the thumbnail thread if a thumbnail is due
+                        if(send_thumbnail_frame(stream_index, frame_and_stream.frame, scene_score) < 0)
+                            av_log(NULL, AV_LOG_WARNING, "Could not send frame to the thumbnailer\n");
+                    }
+
                     frame_and_stream.stream_index = stream_index;
 
                     // Put frame on filter_encode_write_input_queue
@@ -321,6 +430,11 @@ static void *decode_thread_proc(void *arg)
                 }
             }
         }
+        else if (g_options.mux)
+        {
+            // Only the transcoded streams go into the single output
+            av_packet_unref(&packet);
+        }
         else
         {
             /* remux this frame without reencoding */
@@ -367,6 +481,8 @@ static void *filter_convert_encode_write_thread_proc(void *arg)
     FrameAndStream frame_and_stream;
     int ret = 0;
 
+    pin_thread(kAffinityEncode);
+
     while(g_continue_audio_mutex.get() ||
           g_continue_video_mutex.get())
     {
@@ -396,6 +512,10 @@ static void *filter_convert_encode_write_thread_proc(void *arg)
             break;
     }
 
+    // The end of the queue is not an error, anything else fails the transcode
+    if (ret < 0 && ret != AVERROR_EOF)
+        g_encode_error = ret;
+
     g_continue_audio_mutex.set(false);
     g_continue_video_mutex.set(false);
 
@@ -410,7 +530,46 @@ static int open_input_file(const std::string &inFileName)
     unsigned int i;
     g_ifmt_ctx = NULL;
 
-    if ((ret = avformat_open_input(&g_ifmt_ctx, inFileName.c_str(), NULL, NULL)) < 0)
+    // Anything that is not a regular file is opened as usual
+    if (g_options.mmap_input)
+    {
+        if ((ret = open_mmap_input(&g_input_pb, inFileName.c_str())) < 0)
+            av_log(NULL, AV_LOG_WARNING, "Cannot map %s, reading it instead\n", inFileName.c_str());
+        else
+            g_close_input_pb = close_mmap_input;
+    }
+
+    if (!g_input_pb && g_options.read_ahead > 0)
+    {
+        if ((ret = open_read_ahead_input(&g_input_pb, inFileName.c_str())) < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Cannot open input file: %s\n", av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+            return ret;
+        }
+
+        g_close_input_pb = close_read_ahead_input;
+    }
+
+    if (g_input_pb)
+    {
+        g_ifmt_ctx = avformat_alloc_context();
+        if (!g_ifmt_ctx)
+            return AVERROR(ENOMEM);
+
+        g_ifmt_ctx->pb = g_input_pb;
+        g_ifmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    // A pipe cannot be rewound, naming the demuxer saves probing it
+    AVInputFormat *input_format = NULL;
+
+    if (!g_options.input_format.empty() && !(input_format = av_find_input_format(g_options.input_format.c_str())))
+    {
+        av_log(NULL, AV_LOG_ERROR, "Unknown input format %s\n", g_options.input_format.c_str());
+        return AVERROR_DEMUXER_NOT_FOUND;
+    }
+
+    if ((ret = avformat_open_input(&g_ifmt_ctx, inFileName.c_str(), input_format, NULL)) < 0)
     {
         av_log(NULL, AV_LOG_ERROR, "Cannot open input file: %s\n", av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
         return ret;
@@ -426,6 +585,14 @@ static int open_input_file(const std::string &inFileName)
     if (!g_stream_ctx)
         return AVERROR(ENOMEM);
 
+    // Share the cores out by the video codec before any codec is opened
+    int video_index = av_find_best_stream(g_ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    plan_core_budget(video_index >= 0 ? g_ifmt_ctx->streams[video_index]->codecpar : NULL);
+    split_affinity();
+
+    // Decoder threads start on this thread's CPUs
+    pin_thread(kAffinityDecode);
+
     for (i = 0; i < g_ifmt_ctx->nb_streams; i++)
     {
         AVStream *stream = g_ifmt_ctx->streams[i];
@@ -459,24 +626,37 @@ static int open_input_file(const std::string &inFileName)
             {
                 codec_ctx->framerate = av_guess_frame_rate(g_ifmt_ctx, stream, NULL);
 
+                // Not known for a stream coming through a pipe
+                double duration = g_ifmt_ctx->duration == AV_NOPTS_VALUE ? 0 : (double) g_ifmt_ctx->duration / AV_TIME_BASE;
+
                 if(g_options.start_time == -1 &&
                    g_options.end_time == -1)
-                    g_total_duration = (double) g_ifmt_ctx->duration / AV_TIME_BASE;
+                    g_total_duration = duration;
                 else
                 {
                     double start_time = g_options.start_time == -1 ? 0 : g_options.start_time;
-                    double end_time = g_options.end_time == -1 ? ((double) g_ifmt_ctx->duration / AV_TIME_BASE) : g_options.end_time;
+                    double end_time = g_options.end_time == -1 ? duration : g_options.end_time;
                     g_total_duration = end_time - start_time;
                 }
 
                 double fps = (double) stream->avg_frame_rate.num / stream->avg_frame_rate.den;
                 g_total_frames = g_total_duration / (1.0 / fps);
+
+                // Keyframe only mode, let the demuxer drop non-key packets where it can
+                // and have the decoder skip anything that is not a keyframe
+                if (g_options.keyframes_only)
+                {
+                    stream->discard = AVDISCARD_NONKEY;
+                    codec_ctx->skip_frame = AVDISCARD_NONKEY;
+                }
             }
 
 			// Just for debugging, two fields which state frame rate
             //double frame_rate = stream->r_frame_rate.num / (double)stream->r_frame_rate.den;
             //frame_rate = stream->avg_frame_rate.num / (double)stream->avg_frame_rate.den;
 
+            set_codec_threads(codec_ctx, dec, codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? get_core_plan()->decode : 1);
+
             /* Open decoder */
             ret = avcodec_open2(codec_ctx, dec, NULL);
             if (ret < 0) {
@@ -488,10 +668,32 @@ static int open_input_file(const std::string &inFileName)
         g_stream_ctx[i].dec_ctx = codec_ctx;
     }
 
+    pin_thread(kAffinityJob);
+
     av_dump_format(g_ifmt_ctx, 0, inFileName.c_str(), 0);
     return 0;
 }
 
+/** Elementary audio goes through the muxer of its file, one packet at a time. */
+static int write_elementary_packet(void *opaque, AVPacket *pkt)
+{
+    return av_write_frame((AVFormatContext *) opaque, pkt);
+}
+
+/** Elementary video goes into its file as is. */
+static int write_raw_packet(void *opaque, AVPacket *pkt)
+{
+    AVIOContext *pb = ((AVFormatContext *) opaque)->pb;
+
+    avio_write(pb, pkt->data, pkt->size);
+    return pb->error;
+}
+
+static void flush_elementary_output(void *opaque)
+{
+    avio_flush(((AVFormatContext *) opaque)->pb);
+}
+
 static int open_output_files()
 {
     AVStream *out_stream = NULL;
@@ -501,6 +703,18 @@ static int open_output_files()
     unsigned int i;
 	AVFormatContext *ofmt_ctx = NULL;
 
+    if (g_options.mux &&
+        (ret = add_muxer_output(g_options.output_file.c_str(),
+                                g_options.output_format.empty() ? NULL : g_options.output_format.c_str(),
+                                g_options.fragmented)) < 0)
+        return ret;
+
+    for (i = 0; i < g_options.tee_outputs.size(); i++)
+    {
+        if ((ret = add_muxer_output(g_options.tee_outputs[i].c_str(), NULL, g_options.fragmented)) < 0)
+            return ret;
+    }
+
     for (i = 0; i < g_ifmt_ctx->nb_streams; i++)
     {
         if(NULL == g_stream_ctx[i].dec_ctx)
@@ -553,7 +767,7 @@ static int open_output_files()
                 enc_ctx->sample_aspect_ratio.den = 1;
 
                 // Check to see if decoded pixel format is supported by encoder
-                enc_ctx->pix_fmt = AV_PIX_FMT_NONE;
+                enc_ctx->pix_fmt = encoder->pix_fmts ? AV_PIX_FMT_NONE : dec_ctx->pix_fmt;
                 for (int index = 0; encoder->pix_fmts && encoder->pix_fmts[index] != -1; index++)
                 {
                     if (encoder->pix_fmts[index] == dec_ctx->pix_fmt)
@@ -563,11 +777,21 @@ static int open_output_files()
                     }
                 }
 
-                // TODO: If pixel format is not supported by encoder, need to add a colorspace conversion ???
+                // If not, pick the supported format that loses the least, the
+                // scaler after the filter graph converts to it
                 if (enc_ctx->pix_fmt == AV_PIX_FMT_NONE)
                 {
-                    av_log(NULL, AV_LOG_FATAL, "Decoded colorspace not supported by encoder\n");
-                    return AVERROR_INVALIDDATA;
+                    int loss = 0;
+                    enc_ctx->pix_fmt = avcodec_find_best_pix_fmt_of_list(encoder->pix_fmts, dec_ctx->pix_fmt, 0, &loss);
+
+                    if (enc_ctx->pix_fmt == AV_PIX_FMT_NONE)
+                    {
+                        av_log(NULL, AV_LOG_FATAL, "Decoded colorspace not supported by encoder\n");
+                        return AVERROR_INVALIDDATA;
+                    }
+
+                    av_log(NULL, AV_LOG_INFO, "Converting %s to %s for the encoder\n",
+                           av_get_pix_fmt_name(dec_ctx->pix_fmt), av_get_pix_fmt_name(enc_ctx->pix_fmt));
                 }
 
                 // For now, just pass-thru framerate
@@ -578,6 +802,13 @@ static int open_output_files()
                 enc_ctx->gop_size = 10;
                 enc_ctx->max_b_frames = 1;
 
+                // Keyframe only mode produces an I-frame only track
+                if (g_options.keyframes_only)
+                {
+                    enc_ctx->gop_size = 1;
+                    enc_ctx->max_b_frames = 0;
+                }
+
                 outFileName = g_options.video_elementary_file;
             }
             else
@@ -597,18 +828,24 @@ static int open_output_files()
                 outFileName = g_options.audio_elementary_file;
             }
 
-			avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, outFileName.c_str());
-			if (!ofmt_ctx)
-			{
-				av_log(NULL, AV_LOG_ERROR, "Could not create output context\n");
-				return AVERROR_UNKNOWN;
-			}
+            if (!g_options.mux)
+            {
+                avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, outFileName.c_str());
+                if (!ofmt_ctx)
+                {
+                    av_log(NULL, AV_LOG_ERROR, "Could not create output context\n");
+                    return AVERROR_UNKNOWN;
+                }
 
-			/*
-             * Some container formats (like MP4) require global headers to be present
-             * Mark the encoder so that it behaves accordingly.
-             */
-            if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+                /*
+                 * Some container formats (like MP4) require global headers to be present
+                 * Mark the encoder so that it behaves accordingly.
+                 */
+                if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+                    enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+            }
+
+            if (muxer_needs_global_header() || segmenter_needs_global_header())
                 enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
             // Use this to open with a dictionary
@@ -616,6 +853,11 @@ static int open_output_files()
             //av_dict_set(&dict, "hwaccel", "none", 0);
             //ret = avcodec_open2(enc_ctx, encoder, &dict);
 
+            if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && have_ladder())
+                configure_ladder_encoder(enc_ctx, 0, get_core_plan()->encode);
+            else
+                set_codec_threads(enc_ctx, encoder, dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? get_core_plan()->encode : 1);
+
             /* Third parameter can be used to pass settings to encoder */
             ret = avcodec_open2(enc_ctx, encoder, NULL);
             if (ret < 0)
@@ -624,6 +866,24 @@ static int open_output_files()
                 return ret;
             }
 
+            // The other rungs are opened with this encoder's settings
+            if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && have_ladder())
+            {
+                ret = init_ladder(enc_ctx, outFileName);
+                if (ret < 0)
+                    return ret;
+            }
+
+            // The -m and -tee outputs take every stream, they are started once all are added
+            if (have_muxer() && (ret = add_mux_stream(i, enc_ctx)) < 0)
+                return ret;
+
+            if (g_options.mux)
+            {
+                g_stream_ctx[i].enc_ctx = enc_ctx;
+                continue;
+            }
+
 	        out_stream = avformat_new_stream(ofmt_ctx, NULL);
 			if (!out_stream)
 			{
@@ -647,12 +907,9 @@ static int open_output_files()
             av_dump_format(ofmt_ctx, 0, outFileName.c_str(), 1);
 			if (!(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
 			{
-				ret = avio_open(&ofmt_ctx->pb, outFileName.c_str(), AVIO_FLAG_WRITE);
+				ret = open_output_io(&ofmt_ctx->pb, outFileName.c_str(), enc_ctx->bit_rate);
 				if (ret < 0)
-				{
-					av_log(NULL, AV_LOG_ERROR, "Could not open output file '%s'", outFileName);
 					return ret;
-				}
 			}
 
             ret = avformat_write_header(ofmt_ctx, NULL);
@@ -663,6 +920,15 @@ static int open_output_files()
             }
 
             g_output_formats.push_back(ofmt_ctx);
+
+            OutputWriter *writer = NULL;
+            ret = init_output_writer(&writer, outFileName.c_str(),
+                                     dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? write_raw_packet : write_elementary_packet,
+                                     flush_elementary_output, ofmt_ctx);
+            g_output_writers.push_back(writer);
+
+            if (ret < 0)
+                return ret;
         }
         else if (dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN)
         {
@@ -683,6 +949,9 @@ static int open_output_files()
         }
     }
 
+    if (have_muxer())
+        return start_muxer();
+
     return 0;
 }
 
@@ -709,6 +978,10 @@ static int convert_audio_frame_to_fifo(AVFrame *frame, unsigned int stream_index
         if(ret < 0)
             return ret;
 
+        analyze_audio_samples(stream_index, converted_input_samples, frame->nb_samples);
+        add_waveform_samples(stream_index, converted_input_samples, frame->nb_samples);
+        measure_loudness(stream_index, converted_input_samples, frame->nb_samples);
+
         /** Add the converted input samples to the FIFO buffer for later processing. */
         ret = add_samples_to_audio_fifo(g_stream_ctx[stream_index].audio_fifo,
                                         converted_input_samples,
@@ -752,6 +1025,9 @@ static int read_audio_frame_from_fifo(AVFrame **frame, unsigned int stream_index
             return AVERROR_EXIT;
         }
 
+        // Loudness normalization, looks ahead into the samples left in the FIFO
+        apply_loudness_gain(stream_index, *frame, g_stream_ctx[stream_index].audio_fifo);
+
         //av_log(NULL, AV_LOG_INFO, "av_audio_fifo_size: %d\n", av_audio_fifo_size(g_stream_ctx[stream_index].audio_fifo));
     }
 
@@ -767,7 +1043,9 @@ static int encode_write_frame(AVFrame *frame, unsigned int stream_index, int *go
         av_log(NULL, AV_LOG_INFO, "Encoding audio frame: %d\n", g_audio_frame_num++);
     else
     {
-        uint32_t percentage = (uint32_t)(100 * ((double) g_video_frame_num++ / g_total_frames));
+        // No total for a stream coming through a pipe
+        uint32_t percentage = g_total_frames > 0 ? (uint32_t)(100 * ((double) g_video_frame_num / g_total_frames)) : 0;
+        g_video_frame_num++;
 
         if(g_percentage != percentage)
         {
@@ -776,6 +1054,39 @@ static int encode_write_frame(AVFrame *frame, unsigned int stream_index, int *go
         }
     }
 
+    // Rung 0 is this encoder, the ladder forces the keyframes and encodes the smaller rungs
+    // A rung that fails leaves its output short, so it fails the transcode too
+    if(AVMEDIA_TYPE_VIDEO == g_stream_ctx[stream_index].enc_ctx->codec_type && have_ladder())
+    {
+        int ret = encode_ladder_frame(frame);
+        if(ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not encode the ladder renditions\n");
+            return ret;
+        }
+    }
+
+    // The interleaver and segmenter go by timestamp, the frames out of the audio FIFO have none
+    if(frame &&
+       (have_muxer() || have_segmenter()) &&
+       AVMEDIA_TYPE_AUDIO == g_stream_ctx[stream_index].enc_ctx->codec_type)
+    {
+        frame->pts = g_stream_ctx[stream_index].next_audio_pts;
+        g_stream_ctx[stream_index].next_audio_pts += frame->nb_samples;
+    }
+
+    // Publish the frame as it goes to the encoder, waits for a consumer that has fallen behind
+    if(frame &&
+       AVMEDIA_TYPE_VIDEO == g_stream_ctx[stream_index].enc_ctx->codec_type &&
+       send_frame_sink_frame(stream_index, frame) < 0)
+        av_log(NULL, AV_LOG_WARNING, "Could not publish frame to the frame sink\n");
+
+    // Keep the pre-encode frame around to score the reconstruction against
+    if(frame &&
+       AVMEDIA_TYPE_VIDEO == g_stream_ctx[stream_index].enc_ctx->codec_type &&
+       quality_add_source_frame(stream_index, frame) < 0)
+        av_log(NULL, AV_LOG_WARNING, "Could not keep source frame for quality measurement\n");
+
     // Send a frame to the encoder
     int ret = avcodec_send_frame(g_stream_ctx[stream_index].enc_ctx, frame);
 
@@ -820,14 +1131,29 @@ static int encode_write_frame(AVFrame *frame, unsigned int stream_index, int *go
 
         av_log(NULL, AV_LOG_DEBUG, "Writing encoded packet to elementary stream file\n");
 
-        /* write encoded packet to its elementary stream */
-        if (g_stream_ctx[stream_index].enc_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
+        // A copy goes into the current segment, a failed segment does not stop the transcode
+        if (have_segmenter())
+            segment_packet(&enc_pkt, stream_index, g_stream_ctx[stream_index].enc_ctx->time_base);
+
+        // The -tee outputs share the packet by reference, one failing does not stop the transcode
+        if (!g_options.mux && have_muxer())
+            mux_packet(&enc_pkt, stream_index, g_stream_ctx[stream_index].enc_ctx->time_base);
+
+        /* write encoded packet to the single output or to its elementary stream */
+        if (g_options.mux)
+        {
+            quality_add_packet(stream_index, &enc_pkt);
+
+            ret = mux_packet(&enc_pkt, stream_index, g_stream_ctx[stream_index].enc_ctx->time_base);
+        }
+        else if (g_stream_ctx[stream_index].enc_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
         {
+            // The frames went in counted in the encoder's time base
             av_packet_rescale_ts(&enc_pkt,
-                g_ifmt_ctx->streams[stream_index]->time_base,
+                g_stream_ctx[stream_index].enc_ctx->time_base,
                 g_output_formats[stream_index]->streams[0]->time_base);
 
-            ret = av_write_frame(g_output_formats[stream_index], &enc_pkt);
+            ret = send_output_packet(g_output_writers[stream_index], &enc_pkt);
             //avio_write(g_output_formats[stream_index]->pb, enc_pkt.data, enc_pkt.size);
             //ret = av_interleaved_write_frame(g_output_formats[stream_index], &enc_pkt);
             if (ret < 0)
@@ -836,8 +1162,10 @@ static int encode_write_frame(AVFrame *frame, unsigned int stream_index, int *go
             }
         }
         else
-        {            
-            avio_write(g_output_formats[stream_index]->pb, enc_pkt.data, enc_pkt.size);
+        {
+            quality_add_packet(stream_index, &enc_pkt);
+
+            ret = send_output_packet(g_output_writers[stream_index], &enc_pkt);
             //ret = av_write_frame(g_output_formats[stream_index], &enc_pkt);
             if (ret < 0)
             {
@@ -869,9 +1197,10 @@ static int convert_encode_write_frame(AVFrame *frame, unsigned int stream_index,
 
         // Encode an encoder context audio frame size at a time.
         // Only the final write should not be an integral encoder context
-        // audio frame size.
+        // audio frame size. The loudness limiter needs its lookahead behind
+        // the frame until the flush.
         while(av_audio_fifo_size(g_stream_ctx[stream_index].audio_fifo) >=
-              g_stream_ctx[stream_index].enc_ctx->frame_size)
+              g_stream_ctx[stream_index].enc_ctx->frame_size + loudness_lookahead(stream_index))
         {
             AVFrame *audio_frame = NULL;
 
@@ -899,21 +1228,33 @@ static int convert_encode_write_frame(AVFrame *frame, unsigned int stream_index,
     return ret;
 }
 
-static int filter_convert_encode_write_frame(AVFrame *frame, unsigned int stream_index)
+/** Next frame out of the stream's filter graph or pipeline, only the pipeline can wait for one. */
+static int get_filtered_frame(unsigned int stream_index, AVFrame *filt_frame, bool wait)
 {
-    int ret;
-    AVFrame *filt_frame = NULL;
+    FilteringContext *fctx = &g_filter_ctx[stream_index];
 
-    //av_log(NULL, AV_LOG_INFO, "Pushing decoded frame to filters\n");
+    if (fctx->pipeline)
+        return receive_filter_pipeline_frame(fctx->pipeline, filt_frame, wait);
 
-    /* push the decoded frame into the filtergraph */
-    ret = av_buffersrc_add_frame_flags(g_filter_ctx[stream_index].buffersrc_ctx, frame, 0);
+    return av_buffersink_get_frame_flags(fctx->buffersink_ctx, filt_frame, 0);
+}
 
-    if (ret < 0)
-    {
-        av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
-        return ret;
-    }
+/** Time base of the frames out of the stream's filter graph or pipeline. */
+static AVRational get_filtered_time_base(unsigned int stream_index)
+{
+    FilteringContext *fctx = &g_filter_ctx[stream_index];
+
+    if (fctx->pipeline)
+        return get_filter_pipeline_time_base(fctx->pipeline);
+
+    return av_buffersink_get_time_base(fctx->buffersink_ctx);
+}
+
+/** Scale, encode and write the frames the filters have ready, when flushing all of them. */
+static int encode_filtered_frames(unsigned int stream_index, bool flushing)
+{
+    int ret = 0;
+    AVFrame *filt_frame = NULL;
 
     /* pull filtered frames from the filtergraph */
     while (g_continue_audio_mutex.get() ||
@@ -929,7 +1270,7 @@ static int filter_convert_encode_write_frame(AVFrame *frame, unsigned int stream
 
         //av_log(NULL, AV_LOG_INFO, "Pulling filtered frame from filters\n");
 
-        ret = av_buffersink_get_frame_flags(g_filter_ctx[stream_index].buffersink_ctx, filt_frame, 0);
+        ret = get_filtered_frame(stream_index, filt_frame, flushing);
 
         if (ret < 0)
         {
@@ -957,6 +1298,35 @@ static int filter_convert_encode_write_frame(AVFrame *frame, unsigned int stream
             break;
         }
 
+        // Convert to the encoder's size and pixel format
+        if (g_stream_ctx[stream_index].scaler)
+        {
+            AVFrame *scaled_frame = NULL;
+
+            ret = scale_frame(g_stream_ctx[stream_index].scaler, filt_frame, &scaled_frame);
+            av_frame_free(&filt_frame);
+
+            if (ret < 0)
+                break;
+
+            filt_frame = scaled_frame;
+        }
+
+        // The encoder, and the muxer after it, count in the encoder's time base
+        if (AVMEDIA_TYPE_VIDEO == g_stream_ctx[stream_index].enc_ctx->codec_type)
+            filt_frame->pts = av_rescale_q_rnd(filt_frame->pts, get_filtered_time_base(stream_index),
+                                               g_stream_ctx[stream_index].enc_ctx->time_base,
+                                               (AVRounding) (AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+
+        // The audio out of the FIFO is counted in samples from where the first filtered frame
+        // starts, so it lines up with the video after -s or on an input not starting at 0
+        else if (!g_stream_ctx[stream_index].audio_pts_started && filt_frame->pts != AV_NOPTS_VALUE)
+        {
+            g_stream_ctx[stream_index].next_audio_pts = av_rescale_q(filt_frame->pts, get_filtered_time_base(stream_index),
+                                                                     g_stream_ctx[stream_index].enc_ctx->time_base);
+            g_stream_ctx[stream_index].audio_pts_started = true;
+        }
+
         ret = convert_encode_write_frame(filt_frame, stream_index, NULL);
 
         if (ret < 0)
@@ -966,12 +1336,71 @@ static int filter_convert_encode_write_frame(AVFrame *frame, unsigned int stream
     return ret;
 }
 
+static int filter_convert_encode_write_frame(AVFrame *frame, unsigned int stream_index)
+{
+    int ret;
+    FilterPipeline *pipeline = g_filter_ctx[stream_index].pipeline;
+
+    //av_log(NULL, AV_LOG_INFO, "Pushing decoded frame to filters\n");
+
+    /* push the decoded frame into the filtergraph */
+    if (pipeline)
+    {
+        // The pipeline is full up to the output, make room
+        while ((ret = send_filter_pipeline_frame(pipeline, frame)) == AVERROR(EAGAIN))
+        {
+            if ((ret = encode_filtered_frames(stream_index, false)) < 0)
+                return ret;
+        }
+
+        // Ended early, like after a trim, the frame is not needed
+        if (ret == AVERROR_EOF)
+            ret = 0;
+    }
+    else
+    {
+        ret = av_buffersrc_add_frame_flags(g_filter_ctx[stream_index].buffersrc_ctx, frame, 0);
+    }
+
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+        return ret;
+    }
+
+    return encode_filtered_frames(stream_index, !frame);
+}
+
 static int flush_encoder(unsigned int stream_index)
 {
     int ret;
     int got_frame = 0;
+    AVCodecContext *enc_ctx = g_stream_ctx[stream_index].enc_ctx;
 
-    if (!(g_stream_ctx[stream_index].enc_ctx->codec->capabilities & AV_CODEC_CAP_DELAY))
+    // The samples the loudness limiter held back for its lookahead are still
+    // in the FIFO, an encoder without delay is not flushed below but needs them
+    if (!(enc_ctx->codec->capabilities & AV_CODEC_CAP_DELAY) &&
+        AVMEDIA_TYPE_AUDIO == enc_ctx->codec_type &&
+        g_stream_ctx[stream_index].audio_fifo)
+    {
+        while (av_audio_fifo_size(g_stream_ctx[stream_index].audio_fifo) > 0)
+        {
+            AVFrame *enc_frame = NULL;
+
+            ret = read_audio_frame_from_fifo(&enc_frame, stream_index);
+            if (ret <= 0)
+                return ret;
+
+            ret = encode_write_frame(enc_frame, stream_index, &got_frame);
+
+            av_frame_free(&enc_frame);
+
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    if (!(enc_ctx->codec->capabilities & AV_CODEC_CAP_DELAY))
         return 0;
 
     av_log(NULL, AV_LOG_INFO, "Flushing stream #%u encoder\n", stream_index);
@@ -980,7 +1409,7 @@ static int flush_encoder(unsigned int stream_index)
     {
         AVFrame *enc_frame = NULL;
 
-        if(AVMEDIA_TYPE_AUDIO == g_stream_ctx[stream_index].enc_ctx->codec_type)
+        if(AVMEDIA_TYPE_AUDIO == enc_ctx->codec_type)
         {
             ret = read_audio_frame_from_fifo(&enc_frame, stream_index);
 
@@ -1014,11 +1443,52 @@ static int flush_encoder(unsigned int stream_index)
 static void parse_params(int argc, char **argv)
 {
     g_options.mux = false;
+    g_options.fragmented = false;
     g_options.start_time = -1;
     g_options.end_time = -1;
     g_options.avisynth = false;
+    g_options.pitch_shift = false;
     g_options.frame_rate.num = 0;
     g_options.frame_rate.den = 0;
+    g_options.keyframes_only = false;
+    g_options.keyframe_images = false;
+    g_options.keyframe_manifest_file = "keyframes.csv";
+    g_options.thumbnail_interval = 0;
+    g_options.thumbnail_scene_threshold = 0;
+    g_options.thumbnail_width = 160;
+    g_options.thumbnail_height = -1;
+    g_options.sprite_columns = 10;
+    g_options.sprite_rows = 10;
+    g_options.quality_metrics = false;
+    g_options.analysis = false;
+    g_options.analysis_file = "analysis.json";
+    g_options.waveform = false;
+    g_options.loudness = false;
+    g_options.loudness_target = 0;
+    g_options.cores = 0;
+    g_options.jobs = 1;
+    g_options.affinity = false;
+    g_options.numa_node = -1;
+    g_options.filter_threads = 0;
+    g_options.filter_stages = 0;
+    g_options.ladder = "";
+    g_options.chunks = 0;
+    g_options.chunk_processes = -1;
+    g_options.work_dir = WORK_DIR;
+    g_options.write_buffer = 32 * 1024 * 1024;
+    g_options.output_buffer = 4 * 1024 * 1024;
+    g_options.direct_io = false;
+    g_options.mmap_input = false;
+    g_options.read_ahead = 0;
+    g_options.read_ahead_fetches = 4;
+    g_options.output_format = "";
+    g_options.input_format = "";
+    g_options.segment_duration = 0;
+    g_options.segment_format = "ts";
+    g_options.segment_cmaf = false;
+    g_options.segment_dir = "segments";
+    g_options.frame_sink = "";
+    g_options.frame_sink_slots = 8;
 
      char cCurrentPath[FILENAME_MAX];
 
@@ -1027,13 +1497,16 @@ static void parse_params(int argc, char **argv)
 
     cCurrentPath[sizeof(cCurrentPath) - 1] = '\0'; /* not really required */
 
-    printf ("The current working directory is %s", cCurrentPath);
+    // stdout may be carrying the output
+    av_log(NULL, AV_LOG_INFO, "The current working directory is %s\n", cCurrentPath);
 
 #ifdef WINDOWS
     g_options.video_elementary_file = cCurrentPath;
     g_options.video_elementary_file += "\\video_out.mp4";
     g_options.audio_elementary_file = cCurrentPath;
     g_options.audio_elementary_file += "\\audio_out.mp4";
+    g_options.output_file = cCurrentPath;
+    g_options.output_file += "\\out.mp4";
 #endif
 
     for(int i=1; i<argc; i++)
@@ -1045,9 +1518,49 @@ static void parse_params(int argc, char **argv)
             g_options.input_file = inputFile;
         }
 
+        if(0 == strcmp(argv[i], "-"))
+            g_options.input_file = "pipe:0";
+
         if(0 == strcmp(argv[i], "-m"))
             g_options.mux = true;
 
+        if(0 == strcmp(argv[i], "-frag"))
+        {
+            g_options.mux = true;
+            g_options.fragmented = true;
+        }
+
+        if(0 == strcmp(argv[i], "-o"))
+        {
+            i++;
+            g_options.output_file = argv[i];
+
+            // Only a container can go to stdout
+            if(0 == strcmp(argv[i], "-"))
+            {
+                g_options.output_file = "pipe:1";
+                g_options.mux = true;
+            }
+        }
+
+        if(0 == strcmp(argv[i], "-output_format"))
+        {
+            i++;
+            g_options.output_format = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-input_format"))
+        {
+            i++;
+            g_options.input_format = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-tee"))
+        {
+            i++;
+            g_options.tee_outputs.push_back(argv[i]);
+        }
+
         if(0 == strcmp(argv[i], "-s"))
         {
             i++;
@@ -1060,6 +1573,9 @@ static void parse_params(int argc, char **argv)
             g_options.end_time = atoi(argv[i]);
         }
 
+        if(0 == strcmp(argv[i], "-pitch_shift"))
+            g_options.pitch_shift = true;
+
         if(0 == strcmp(argv[i], "-avisynth"))
         {
             ++i;
@@ -1067,6 +1583,190 @@ static void parse_params(int argc, char **argv)
             strcpy(g_options.avisynth_script, argv[i]);
         }
 
+        if(0 == strcmp(argv[i], "-keyframes"))
+            g_options.keyframes_only = true;
+
+        if(0 == strcmp(argv[i], "-keyframe_images"))
+        {
+            g_options.keyframes_only = true;
+            g_options.keyframe_images = true;
+        }
+
+        if(0 == strcmp(argv[i], "-thumbs"))
+        {
+            i++;
+            g_options.thumbnail_interval = atof(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-thumb_scene"))
+        {
+            i++;
+            g_options.thumbnail_scene_threshold = atof(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-thumb_size"))
+        {
+            i++;
+            if (sscanf(argv[i], "%dx%d", &g_options.thumbnail_width, &g_options.thumbnail_height) < 2)
+                g_options.thumbnail_height = -1;
+        }
+
+        if(0 == strcmp(argv[i], "-sprite"))
+        {
+            i++;
+            sscanf(argv[i], "%dx%d", &g_options.sprite_columns, &g_options.sprite_rows);
+        }
+
+        if(0 == strcmp(argv[i], "-quality"))
+            g_options.quality_metrics = true;
+
+        if(0 == strcmp(argv[i], "-analysis"))
+            g_options.analysis = true;
+
+        if(0 == strcmp(argv[i], "-waveform"))
+            g_options.waveform = true;
+
+        if(0 == strcmp(argv[i], "-loudness"))
+            g_options.loudness = true;
+
+        if(0 == strcmp(argv[i], "-loudnorm"))
+        {
+            i++;
+            g_options.loudness = true;
+            g_options.loudness_target = atof(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-cores"))
+        {
+            i++;
+            g_options.cores = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-jobs"))
+        {
+            i++;
+            g_options.jobs = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-affinity"))
+            g_options.affinity = true;
+
+        if(0 == strcmp(argv[i], "-numa_node"))
+        {
+            i++;
+            g_options.affinity = true;
+            g_options.numa_node = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-cpus"))
+        {
+            i++;
+            g_options.affinity = true;
+            g_options.cpu_list = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-filter_threads"))
+        {
+            i++;
+            g_options.filter_threads = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-filter_stages"))
+        {
+            i++;
+            g_options.filter_stages = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-filter_profile"))
+        {
+            i++;
+            g_options.filter_profile = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-ladder"))
+        {
+            i++;
+            g_options.ladder = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-write_buffer"))
+        {
+            i++;
+            g_options.write_buffer = atoll(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-output_buffer"))
+        {
+            i++;
+            g_options.output_buffer = atoll(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-direct_io"))
+            g_options.direct_io = true;
+
+        if(0 == strcmp(argv[i], "-mmap"))
+            g_options.mmap_input = true;
+
+        if(0 == strcmp(argv[i], "-read_ahead"))
+        {
+            i++;
+            g_options.read_ahead = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-read_ahead_fetches"))
+        {
+            i++;
+            g_options.read_ahead_fetches = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-segment"))
+        {
+            i++;
+            g_options.segment_duration = atof(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-segment_format"))
+        {
+            i++;
+            g_options.segment_format = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-segment_dir"))
+        {
+            i++;
+            g_options.segment_dir = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-chunks"))
+        {
+            i++;
+            g_options.chunks = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-chunk_processes"))
+        {
+            i++;
+            g_options.chunk_processes = atoi(argv[i]);
+        }
+
+        if(0 == strcmp(argv[i], "-work_dir"))
+        {
+            i++;
+            g_options.work_dir = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-frame_sink"))
+        {
+            i++;
+            g_options.frame_sink = argv[i];
+        }
+
+        if(0 == strcmp(argv[i], "-frame_sink_slots"))
+        {
+            i++;
+            g_options.frame_sink_slots = atoi(argv[i]);
+        }
+
         if(0 == strcmp(argv[i], "-fr"))
         {
             char fr[16];
@@ -1101,22 +1801,95 @@ static void parse_params(int argc, char **argv)
 
 int main(int argc, char **argv)
 {
-    if(1)
+    if (argc > 1 && 0 == strcmp(argv[1], "-benchmark_scaler"))
+        return DoScalerBenchmark() ? 0 : 1;
+
+    // Decoder smoke test: -decode_test file
+    if (argc > 2 && 0 == strcmp(argv[1], "-decode_test"))
+        return DoDecodeTest(argv[2]) ? 0 : 1;
+
+    // Frame sink round trip through a forked consumer: -test_frame_sink
+    if (argc > 1 && 0 == strcmp(argv[1], "-test_frame_sink"))
+        return DoFrameSinkTest() ? 0 : 1;
+
+    // Frame sink consumer for a transcode run with -frame_sink /name: -frame_sink_consumer /name
+    if (argc > 2 && 0 == strcmp(argv[1], "-frame_sink_consumer"))
+        return DoFrameSinkConsumer(argv[2]) ? 0 : 1;
+
+    // Read ahead ring against a local HTTP server and a file: -test_read_ahead
+    if (argc > 1 && 0 == strcmp(argv[1], "-test_read_ahead"))
+        return DoReadAheadTest() ? 0 : 1;
+
+    // Chunk coordinator and workers of this executable, with a worker that goes quiet: -test_chunk_jobs file
+    if (argc > 2 && 0 == strcmp(argv[1], "-test_chunk_jobs"))
+        return DoChunkJobsTest(argv[0], argv[2]) ? 0 : 1;
+
+    // Chunk worker process: -chunk_worker job_dir [-cores n] [-jobs n] [-affinity]
+    if (argc > 2 && 0 == strcmp(argv[1], "-chunk_worker"))
     {
-        DoDecodeTest("F:\\streams\\mpeg1\\1.mpg");
-        return 0;
+        parse_params(argc, argv);
+
+        if (g_options.affinity)
+            init_affinity(g_options.cpu_list.c_str(), g_options.numa_node);
+
+        init_core_budget(g_options.cores, g_options.jobs);
+
+        av_register_all();
+        avfilter_register_all();
+
+        return run_chunk_worker(argv[2]) < 0 ? 1 : 0;
     }
 
     int ret;
+    bool video_analysis_initialized = false;
+    bool audio_analysis_initialized = false;
+    bool loudness_initialized = false;
 
     if (argc < 2)
     {
-        av_log(NULL, AV_LOG_ERROR, "Usage: %s [-m] [-avisynth script] [-fps num/den] [-s time_in_sec] [-e time_in_sec] <input file>\n", argv[0]);
+        av_log(NULL, AV_LOG_ERROR, "Usage: %s [-m] [-frag] [-o file|-] [-output_format fmt] [-input_format fmt] [-tee file]... [-write_buffer bytes] [-output_buffer bytes] [-direct_io] [-mmap] [-read_ahead MB] [-read_ahead_fetches n] [-avisynth script] [-fps num/den] [-pitch_shift] [-s time_in_sec] [-e time_in_sec] [-keyframes] [-keyframe_images] [-thumbs interval_sec] [-thumb_scene threshold] [-thumb_size WxH] [-sprite CxR] [-quality] [-analysis] [-waveform] [-loudness] [-loudnorm LUFS] [-cores n] [-jobs n] [-affinity] [-numa_node n] [-cpus list] [-filter_threads n] [-filter_stages n] [-filter_profile file] [-ladder WxH[:kbps],...] [-segment secs] [-segment_format ts|cmaf] [-segment_dir dir] [-chunks n] [-chunk_processes n] [-work_dir dir] [-frame_sink /name] [-frame_sink_slots n] <input file|->\n", argv[0]);
         return 1;
     }
 
     parse_params(argc, argv);
 
+    // Nothing in the name says what to write to stdout
+    if (g_options.output_file == "pipe:1" && g_options.output_format.empty())
+        g_options.output_format = "mpegts";
+
+    if (!g_options.ladder.empty() && set_ladder(g_options.ladder.c_str()) < 0)
+        return 1;
+
+    // EBU R128 targets are negative, -loudnorm 23 would only measure
+    if (g_options.loudness_target > 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "-loudnorm takes a negative LUFS target, like -23\n");
+        return 1;
+    }
+
+    if (g_options.segment_format == "cmaf")
+        g_options.segment_cmaf = true;
+    else if (g_options.segment_format != "ts")
+    {
+        av_log(NULL, AV_LOG_ERROR, "Unknown segment format %s, use ts or cmaf\n", g_options.segment_format.c_str());
+        return 1;
+    }
+
+    // These look at every video frame on its way through the single pipeline
+    if (g_options.chunks > 1 &&
+        (g_options.mux || !g_options.tee_outputs.empty() || g_options.segment_duration > 0 || g_options.keyframes_only || g_options.quality_metrics || g_options.analysis || have_ladder() || !g_options.frame_sink.empty() ||
+         g_options.thumbnail_interval > 0 || g_options.thumbnail_scene_threshold > 0))
+    {
+        av_log(NULL, AV_LOG_WARNING, "-chunks does not work with -m, -tee, -segment, -keyframes, -quality, -analysis, -ladder, -frame_sink or thumbnails, encoding in one piece\n");
+        g_options.chunks = 0;
+    }
+
+    // Pin first, the core budget only counts the CPUs pinned to
+    if (g_options.affinity)
+        init_affinity(g_options.cpu_list.c_str(), g_options.numa_node);
+
+    init_core_budget(g_options.cores, g_options.jobs);
+
     av_register_all();
 
     avfilter_register_all();
@@ -1124,14 +1897,148 @@ int main(int argc, char **argv)
     if ((ret = open_input_file(g_options.input_file)) < 0)
         goto end;
 
-    if ((ret = open_output_files()) < 0)
+    // The chunks are demuxed again from where each one starts
+    if (g_options.chunks > 1 && g_ifmt_ctx->pb && !(g_ifmt_ctx->pb->seekable & AVIO_SEEKABLE_NORMAL))
+    {
+        av_log(NULL, AV_LOG_WARNING, "-chunks needs a seekable input, encoding in one piece\n");
+        g_options.chunks = 0;
+    }
+
+    set_output_duration(g_total_duration);
+
+    // Encoder and filter threads start on the CPUs of the thread that opens them
+    pin_thread(kAffinityEncode);
+    ret = open_output_files();
+    pin_thread(kAffinityJob);
+
+    if (ret < 0)
+        goto end;
+
+    if (g_options.segment_duration > 0 && (ret = init_segmenter()) < 0)
         goto end;
 
+    // The chunk workers encode the video from their own demuxers, the
+    // pipeline only carries the rest
+    if (g_options.chunks > 1)
+    {
+        for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
+        {
+            if (AVMEDIA_TYPE_VIDEO == g_ifmt_ctx->streams[i]->codecpar->codec_type &&
+                g_stream_ctx[i].enc_ctx)
+            {
+                g_chunked_stream = i;
+                g_ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+                break;
+            }
+        }
+    }
+
 #if USE_FILTER_GRAPH
-    if ((ret = init_filters()) < 0)
+    pin_thread(kAffinityFilter);
+    ret = init_filters();
+    pin_thread(kAffinityJob);
+
+    if (ret < 0)
         goto end;
 #endif
 
+    if (g_options.keyframes_only)
+    {
+        g_keyframe_manifest = fopen(g_options.keyframe_manifest_file.c_str(), "w");
+
+        if (!g_keyframe_manifest)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not open keyframe manifest '%s'\n", g_options.keyframe_manifest_file.c_str());
+            ret = AVERROR(errno);
+            goto end;
+        }
+
+        fprintf(g_keyframe_manifest, "index,pts,time\n");
+    }
+
+    // Score the first video encoder against its reconstruction
+    if (g_options.quality_metrics)
+    {
+        for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
+        {
+            if (g_stream_ctx[i].enc_ctx &&
+                AVMEDIA_TYPE_VIDEO == g_stream_ctx[i].enc_ctx->codec_type)
+            {
+                if ((ret = init_quality(i, g_stream_ctx[i].enc_ctx)) < 0)
+                    goto end;
+
+                break;
+            }
+        }
+    }
+
+    // Publish the first video stream's filtered frames
+    if (!g_options.frame_sink.empty())
+    {
+        for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
+        {
+            if (g_stream_ctx[i].enc_ctx &&
+                AVMEDIA_TYPE_VIDEO == g_stream_ctx[i].enc_ctx->codec_type)
+            {
+                if ((ret = init_frame_sink(g_options.frame_sink.c_str(), g_options.frame_sink_slots, i, g_stream_ctx[i].enc_ctx)) < 0)
+                    goto end;
+
+                break;
+            }
+        }
+    }
+
+    // Analysis of the first video and the first audio stream, the thumbnailer
+    // needs the video analysis plane for its scene change detection
+    for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
+    {
+        if (!g_stream_ctx[i].dec_ctx || !g_stream_ctx[i].enc_ctx)
+            continue;
+
+        if (AVMEDIA_TYPE_VIDEO == g_stream_ctx[i].dec_ctx->codec_type)
+        {
+            if ((g_options.analysis || g_options.thumbnail_scene_threshold > 0) && !video_analysis_initialized)
+            {
+                init_video_analysis(g_ifmt_ctx->streams[i], g_options.analysis);
+                video_analysis_initialized = true;
+            }
+        }
+        else if (AVMEDIA_TYPE_AUDIO == g_stream_ctx[i].dec_ctx->codec_type)
+        {
+            if (g_options.analysis && !audio_analysis_initialized)
+            {
+                init_audio_analysis(i, g_stream_ctx[i].enc_ctx);
+                audio_analysis_initialized = true;
+            }
+
+            if (g_options.waveform)
+                init_waveform(i, g_stream_ctx[i].enc_ctx);
+
+            // The resampler and loudness state are shared, first audio stream only
+            if (g_options.loudness && !loudness_initialized)
+            {
+                init_loudness(i, g_stream_ctx[i].enc_ctx, g_options.loudness_target < 0, g_options.loudness_target);
+                loudness_initialized = true;
+            }
+        }
+    }
+
+    // Start the thumbnail thread for the first video stream
+    if (g_options.thumbnail_interval > 0 || g_options.thumbnail_scene_threshold > 0)
+    {
+        for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
+        {
+            if (AVMEDIA_TYPE_VIDEO == g_ifmt_ctx->streams[i]->codecpar->codec_type &&
+                g_stream_ctx[i].dec_ctx)
+            {
+                if ((ret = init_thumbnailer(g_ifmt_ctx->streams[i])) < 0)
+                    goto end;
+
+                break;
+            }
+        }
+    }
+
     // Create a resampler for any input audio stream
     for(unsigned int i=0; i<g_ifmt_ctx->nb_streams; i++)
     {
@@ -1146,6 +2053,25 @@ int main(int argc, char **argv)
         }
     }
 
+    if (g_chunked_stream >= 0)
+    {
+        std::vector<VideoChunk> chunks;
+
+        ret = plan_video_chunks(g_options.input_file.c_str(), g_chunked_stream, g_options.chunks,
+                                g_options.start_time, g_options.end_time, chunks);
+
+        if (ret >= 0 && g_options.chunk_processes >= 0)
+            ret = run_chunk_coordinator(argv[0], g_options.work_dir.c_str(), g_options.chunk_processes,
+                                        g_options.input_file.c_str(), g_ifmt_ctx->streams[g_chunked_stream],
+                                        g_stream_ctx[g_chunked_stream].enc_ctx, g_output_formats[g_chunked_stream], chunks);
+        else if (ret >= 0)
+            ret = encode_video_chunks(g_options.input_file.c_str(), g_ifmt_ctx->streams[g_chunked_stream],
+                                      g_stream_ctx[g_chunked_stream].enc_ctx, g_output_formats[g_chunked_stream], chunks);
+
+        if (ret < 0)
+            goto end;
+    }
+
     // Create the decode thread input queue, will contain demuxed packets
     ret = av_thread_message_queue_alloc(&g_decode_input_queue, THREAD_QUEUE_SIZE, sizeof(AVPacket));
     if (ret < 0)
@@ -1187,6 +2113,22 @@ int main(int argc, char **argv)
             break;
         }
 
+        // The chunk workers have encoded the video already
+        if (packet.stream_index == g_chunked_stream)
+        {
+            av_packet_unref(&packet);
+            continue;
+        }
+
+        // Keyframe only mode, drop anything the demuxer did not already discard
+        if (g_options.keyframes_only &&
+            AVMEDIA_TYPE_VIDEO == g_ifmt_ctx->streams[packet.stream_index]->codecpar->codec_type &&
+            !(packet.flags & AV_PKT_FLAG_KEY))
+        {
+            av_packet_unref(&packet);
+            continue;
+        }
+
         /*  
         // USED FOR TESTING
         if(AVMEDIA_TYPE_VIDEO != ifmt_ctx->streams[packet.stream_index]->codec->codec_type)
@@ -1237,11 +2179,20 @@ int main(int argc, char **argv)
     //while (av_thread_message_queue_recv(decode_input_queue, &packet, 0) >= 0)
     //    av_packet_unref(&packet);
 
-    // Wait for decode thread to exit
+    // Wait for decode thread to exit, it waits for the filter, convert, encode and write thread
     pthread_join(decode_thread, NULL);
 
+    // No more frames for the thumbnailer, write out the last sprite sheet and the index
+    close_thumbnailer();
+
     av_thread_message_queue_free(&g_decode_input_queue);
 
+    if ((ret = g_encode_error) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Transcoding stopped on an error, not flushing the outputs\n");
+        goto end;
+    }
+
     /* flush filters and encoders */
     for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
     {
@@ -1249,19 +2200,38 @@ int main(int argc, char **argv)
            g_ifmt_ctx->streams[i]->codec->codec_type != AVMEDIA_TYPE_VIDEO)
             continue;
 
+        if ((int) i == g_chunked_stream)
+            continue;
+
+        int flush_ret;
+
         /* flush filter */
-        if (g_filter_ctx && g_filter_ctx[i].filter_graph)
-            ret = filter_convert_encode_write_frame(NULL, i);
+        if (g_filter_ctx && (g_filter_ctx[i].filter_graph || g_filter_ctx[i].pipeline))
+            flush_ret = filter_convert_encode_write_frame(NULL, i);
         else
-            ret = convert_encode_write_frame(NULL, i, NULL);
+            flush_ret = convert_encode_write_frame(NULL, i, NULL);
 
         /* flush encoders */
-        ret = flush_encoder(i);
+        if (flush_ret >= 0)
+            flush_ret = flush_encoder(i);
 
-        if(ret == AVERROR_EOF)
-            ret = 0;
+        if(flush_ret == AVERROR_EOF)
+            flush_ret = 0;
+
+        // The other streams still get flushed, the first error is the one reported
+        if (ret >= 0 && flush_ret < 0)
+            ret = flush_ret;
     }
 
+    // Encoders are flushed, score the last reconstructed frames and write the aggregate
+    close_quality();
+
+    if (g_options.analysis || g_options.loudness)
+        write_analysis_sidecar(g_options.analysis_file.c_str());
+
+    // Everything went through the FIFOs, the peak files are complete
+    write_waveforms();
+
 end:
 
     if(g_ifmt_ctx)
@@ -1271,6 +2241,8 @@ end:
             if(g_stream_ctx[i].audio_fifo)
                 av_audio_fifo_free(g_stream_ctx[i].audio_fifo);
 
+            free_scaler(&g_stream_ctx[i].scaler);
+
             if(g_stream_ctx[i].dec_ctx)
                 avcodec_free_context(&g_stream_ctx[i].dec_ctx);
 
@@ -1280,12 +2252,36 @@ end:
 
             if (g_filter_ctx && g_filter_ctx[i].filter_graph)
                 avfilter_graph_free(&g_filter_ctx[i].filter_graph);
+
+            if (g_filter_ctx)
+                free_filter_pipeline(&g_filter_ctx[i].pipeline);
         }
     }
 
     if(g_resampler_context)
         swr_free(&g_resampler_context);
 
+    if(g_keyframe_manifest)
+        fclose(g_keyframe_manifest);
+
+    FreeWriteFrame();
+
+    close_thumbnailer();
+
+    close_quality();
+
+    close_frame_sink();
+
+    close_ladder();
+
+    close_muxer();
+
+    close_segmenter();
+
+    close_waveforms();
+
+    close_loudness();
+
     if(g_filter_ctx)
         av_free(g_filter_ctx);
 
@@ -1295,10 +2291,17 @@ end:
     if(g_ifmt_ctx)
         avformat_close_input(&g_ifmt_ctx);
 
+    if(g_input_pb)
+        g_close_input_pb(&g_input_pb);
+
+    // Everything queued goes out before the trailers
+    for (size_t i=0; i<g_output_writers.size(); i++)
+        close_output_writer(&g_output_writers[i]);
+
     for (int i=0; i<g_output_formats.size(); i++)
     {
         av_write_trailer(g_output_formats[i]);
-        avio_closep(&g_output_formats[i]->pb);
+        close_output_io(&g_output_formats[i]->pb);
         avformat_free_context(g_output_formats[i]);
     }
 
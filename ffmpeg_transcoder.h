@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include "scaler.h"
 
 extern "C"
 {
@@ -12,17 +15,64 @@ typedef struct StreamContext {
     AVCodecContext *dec_ctx;
     AVCodecContext *enc_ctx;
     AVAudioFifo *audio_fifo;
+    Scaler *scaler;             // Size and pixel format conversion after the filter graph
+    int64_t next_audio_pts;     // Of the next frame out of the audio FIFO, in the encoder's time base, for -m and -segment
+    bool audio_pts_started;     // next_audio_pts is set from the first filtered frame
 } StreamContext;
 
 typedef struct Options {
     std::string output_file;
     std::string input_file;
+    bool mmap_input;            // Read a local input_file through a memory mapping
+    int read_ahead;             // MB of input_file fetched ahead of the demuxer, 0 for none
+    int read_ahead_fetches;     // Parallel range requests for an HTTP input_file
     std::string audio_elementary_file;
     std::string video_elementary_file;
-    bool mux;
+    bool mux;                   // One interleaved output_file instead of an elementary file per stream
+    bool fragmented;            // Write the MP4 family outputs as fragmented MP4
+    std::vector<std::string> tee_outputs; // More containers for the same encoded streams
+    std::string output_format;  // Container of output_file when its name does not say, mpegts for stdout
+    std::string input_format;   // Demuxer for input_file, instead of probing
     int start_time;
     int end_time;
     bool avisynth;
     char avisynth_script[1024];
+    bool pitch_shift;           // PAL reclock: resample the audio instead of keeping its pitch
     AVRational frame_rate;
+    bool keyframes_only;
+    bool keyframe_images;
+    std::string keyframe_manifest_file;
+    double thumbnail_interval;
+    double thumbnail_scene_threshold;
+    int thumbnail_width;
+    int thumbnail_height;
+    int sprite_columns;
+    int sprite_rows;
+    bool quality_metrics;
+    bool analysis;
+    std::string analysis_file;
+    bool waveform;
+    bool loudness;
+    double loudness_target;     // LUFS, normalize when set
+    int cores;                  // Cores for all jobs on the machine, 0 for all CPUs
+    int jobs;                   // Jobs sharing the cores
+    bool affinity;              // Pin the stages to CPUs of one NUMA node
+    int numa_node;              // -1 for the node the job starts on
+    std::string cpu_list;       // Pin to these CPUs instead of a node
+    int filter_threads;         // Video filter graph slice threads, 0 picks from the graph
+    int filter_stages;          // Video filter pipeline threads, 0 picks from the filter costs
+    std::string filter_profile; // Measured filter costs, read to plan the pipeline and updated
+    std::string ladder;         // ABR renditions WxH[:kbps],... largest first, empty for one
+    int chunks;                 // GOP chunks of the video encoded in parallel, 0 or 1 for one encoder
+    int chunk_processes;        // Encode the chunks in worker processes, this many local ones, -1 for threads
+    std::string work_dir;       // Scratch volume shared with the chunk workers
+    int64_t write_buffer;       // Bytes an output's writer thread may fall behind before the encoder waits
+    int64_t output_buffer;      // Bytes the output files are written in, whole aligned blocks
+    bool direct_io;             // Write the output files past the page cache
+    double segment_duration;    // Seconds per HLS/DASH segment cut from the encoded packets, 0 for none
+    std::string segment_format; // ts or cmaf, as given
+    bool segment_cmaf;          // CMAF segments instead of MPEG-TS, with a DASH manifest too
+    std::string segment_dir;    // Segments, playlist and manifest go here
+    std::string frame_sink;     // Shared memory the filtered video frames are published to, empty for none
+    int frame_sink_slots;       // Frames the consumer may fall behind before the transcode waits
 } Options;
@@ -0,0 +1,730 @@
+#include "filter_pipeline.h"
+#include "core_budget.h"
+#include "ffmpeg_transcoder.h"
+#include "filters.h"
+
+#include <deque>
+#include <map>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+extern "C"
+{
+    #include <libavfilter/buffersink.h>
+    #include <libavfilter/buffersrc.h>
+    #include <libavutil/opt.h>
+    #include <libavutil/time.h>
+}
+
+extern Options g_options;
+
+// Frames queued in front of each stage
+#define FILTER_QUEUE_SIZE 8
+
+#define MAX_FILTER_STAGES 8
+
+// A stage only gets its own thread if the bottleneck without it would be
+// this much worse than with every stage the budget allows
+#define STAGE_BALANCE_SLACK 1.15
+
+typedef struct FilterCost {
+    const char *filter;
+    double cost;                // Microseconds per megapixel of frame
+} FilterCost;
+
+// Rough figures, only for filters the profile does not have
+static const FilterCost g_default_costs[] = {
+    { "yadif",      1800 },
+    { "fieldmatch", 1200 },
+    { "avisynth",   3000 },
+    { "decimate",    500 },
+    { "fps",          10 },
+    { "setpts",        5 },
+    { "trim",          5 },
+};
+
+#define DEFAULT_FILTER_COST 500
+
+// Filter name to measured microseconds per megapixel, from -filter_profile.
+// Only touched while the pipelines are set up and freed.
+static std::map<std::string, double> g_filter_costs;
+static bool g_filter_costs_loaded = false;
+
+typedef struct FilterCell {
+    std::string filter;
+    std::string name;
+    AVFilterGraph *graph;
+    AVFilterContext *src;
+    AVFilterContext *sink;
+    double megapixels;          // Of the frames going in
+    int64_t time;               // Microseconds spent in the graph
+    int64_t frames;             // Frames that went in
+    bool eof;
+} FilterCell;
+
+typedef struct FilterStage {
+    FilterPipeline *pipeline;
+    int index;
+    int first_cell;
+    int nb_cells;
+    pthread_t thread;
+} FilterStage;
+
+typedef struct FrameQueue {
+    std::deque<AVFrame *> frames;   // NULL marks the end of stream
+    bool closed;                    // The consumer has ended, frames sent are dropped
+} FrameQueue;
+
+struct FilterPipeline {
+    std::vector<FilterCell> cells;
+    std::vector<FilterStage> stages;
+    std::vector<FrameQueue> queues; // queues[i] feeds stage i, the last one is the output
+    int threads_started;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            // Signalled on every change to a queue
+    bool quit;
+    bool output_eof;
+    int error;
+};
+
+static void load_filter_profile()
+{
+    if (g_filter_costs_loaded)
+        return;
+
+    g_filter_costs_loaded = true;
+
+    if (g_options.filter_profile.empty())
+        return;
+
+    FILE *f = fopen(g_options.filter_profile.c_str(), "r");
+
+    // Not recorded yet
+    if (!f)
+        return;
+
+    char name[256];
+    double cost;
+
+    while (fscanf(f, "%255s %lf", name, &cost) == 2)
+    {
+        if (cost > 0)
+            g_filter_costs[name] = cost;
+    }
+
+    fclose(f);
+
+    av_log(NULL, AV_LOG_INFO, "Loaded %u filter costs from %s\n",
+           (unsigned) g_filter_costs.size(), g_options.filter_profile.c_str());
+}
+
+static void save_filter_profile(const FilterPipeline *p)
+{
+    if (g_options.filter_profile.empty())
+        return;
+
+    for (size_t c = 0; c < p->cells.size(); c++)
+    {
+        const FilterCell &cell = p->cells[c];
+
+        if (cell.frames > 0 && cell.megapixels > 0)
+            g_filter_costs[cell.filter] = cell.time / (double) cell.frames / cell.megapixels;
+    }
+
+    FILE *f = fopen(g_options.filter_profile.c_str(), "w");
+
+    if (!f)
+    {
+        av_log(NULL, AV_LOG_WARNING, "Could not write filter profile '%s'\n", g_options.filter_profile.c_str());
+        return;
+    }
+
+    for (std::map<std::string, double>::const_iterator it = g_filter_costs.begin(); it != g_filter_costs.end(); ++it)
+        fprintf(f, "%s %.3f\n", it->first.c_str(), it->second);
+
+    fclose(f);
+}
+
+static double get_filter_cost(const std::string &filter)
+{
+    std::map<std::string, double>::const_iterator it = g_filter_costs.find(filter);
+
+    if (it != g_filter_costs.end())
+        return it->second;
+
+    for (size_t i = 0; i < sizeof(g_default_costs) / sizeof(g_default_costs[0]); i++)
+    {
+        if (filter == g_default_costs[i].filter)
+            return g_default_costs[i].cost;
+    }
+
+    return DEFAULT_FILTER_COST;
+}
+
+/**
+ * Split the costs into k contiguous runs with the smallest largest sum. If
+ * first is set it gets the index of the first step of each run.
+ * Returns the largest sum, the cost of the bottleneck stage.
+ */
+static double partition_steps(const std::vector<double> &costs, int k, std::vector<int> *first)
+{
+    int n = (int) costs.size();
+
+    // best[j][i] is the bottleneck of the first i steps in j runs, the last
+    // of which starts at cut[j][i]
+    std::vector<std::vector<double> > best(k + 1, std::vector<double>(n + 1, HUGE_VAL));
+    std::vector<std::vector<int> > cut(k + 1, std::vector<int>(n + 1, 0));
+    std::vector<double> sum(n + 1, 0);
+
+    for (int i = 0; i < n; i++)
+        sum[i + 1] = sum[i] + costs[i];
+
+    best[0][0] = 0;
+
+    for (int j = 1; j <= k; j++)
+    {
+        for (int i = j; i <= n; i++)
+        {
+            for (int m = j - 1; m < i; m++)
+            {
+                double v = FFMAX(best[j - 1][m], sum[i] - sum[m]);
+
+                if (v < best[j][i])
+                {
+                    best[j][i] = v;
+                    cut[j][i] = m;
+                }
+            }
+        }
+    }
+
+    if (first)
+    {
+        first->resize(k);
+
+        for (int j = k, i = n; j > 0; j--)
+        {
+            (*first)[j - 1] = cut[j][i];
+            i = cut[j][i];
+        }
+    }
+
+    return best[k][n];
+}
+
+int get_filter_pipeline_stages(const std::vector<FilterStep> &steps)
+{
+    int n = FFMIN((int) steps.size(), MAX_FILTER_STAGES);
+
+    if (n < 1)
+        return 1;
+
+    if (g_options.filter_stages > 0)
+        return FFMIN(g_options.filter_stages, n);
+
+    load_filter_profile();
+
+    std::vector<double> costs;
+
+    for (size_t i = 0; i < steps.size(); i++)
+        costs.push_back(get_filter_cost(steps[i].filter));
+
+    int max_stages = FFMIN(n, get_core_plan()->filter);
+    double bottleneck = partition_steps(costs, max_stages, NULL);
+    int stages = 1;
+
+    while (stages < max_stages && partition_steps(costs, stages, NULL) > bottleneck * STAGE_BALANCE_SLACK)
+        stages++;
+
+    return stages;
+}
+
+/** Buffer source arguments for frames coming out of sink. */
+static void get_source_args(AVFilterContext *sink, char *args, size_t size)
+{
+    AVRational time_base = av_buffersink_get_time_base(sink);
+    AVRational sar = av_buffersink_get_sample_aspect_ratio(sink);
+    AVRational frame_rate = av_buffersink_get_frame_rate(sink);
+
+    if (sar.num <= 0 || sar.den <= 0)
+    {
+        sar.num = 0;
+        sar.den = 1;
+    }
+
+    if (frame_rate.num <= 0 || frame_rate.den <= 0)
+    {
+        frame_rate.num = 0;
+        frame_rate.den = 1;
+    }
+
+    snprintf(args, size,
+        "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d:frame_rate=%d/%d",
+        av_buffersink_get_w(sink), av_buffersink_get_h(sink),
+        av_buffersink_get_format(sink),
+        time_base.num, time_base.den,
+        sar.num, sar.den,
+        frame_rate.num, frame_rate.den);
+}
+
+/** A graph of src -> step -> sink. */
+static int init_filter_cell(FilterCell &cell, const FilterStep &step, const char *src_args,
+                            AVPixelFormat sink_fmt, int slice_threads)
+{
+    const AVFilter *filter = avfilter_get_by_name(step.filter.c_str());
+    int ret;
+
+    cell.filter = step.filter;
+    cell.name = step.name;
+    cell.graph = avfilter_graph_alloc();
+
+    if (!cell.graph)
+        return AVERROR(ENOMEM);
+
+    // Before the first filter, the graph's thread pool is created with it
+    cell.graph->nb_threads = (filter && (filter->flags & AVFILTER_FLAG_SLICE_THREADS)) ? slice_threads : 1;
+    cell.graph->thread_type = cell.graph->nb_threads > 1 ? AVFILTER_THREAD_SLICE : 0;
+
+    ret = avfilter_graph_create_filter(&cell.src, avfilter_get_by_name("buffer"), "src",
+                                       src_args, NULL, cell.graph);
+
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create video source for %s\n", step.name.c_str());
+        return ret;
+    }
+
+    AVFilterContext *prev_ctx = cell.src;
+
+    ret = append_filter(cell.graph, &prev_ctx, step.filter.c_str(), step.name.c_str(),
+                        step.args.empty() ? NULL : step.args.c_str());
+
+    if (ret < 0)
+        return ret;
+
+    ret = avfilter_graph_create_filter(&cell.sink, avfilter_get_by_name("buffersink"), "sink",
+                                       NULL, NULL, cell.graph);
+
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create video sink for %s\n", step.name.c_str());
+        return ret;
+    }
+
+    if (sink_fmt != AV_PIX_FMT_NONE)
+    {
+        ret = av_opt_set_bin(cell.sink, "pix_fmts", (uint8_t*)&sink_fmt, sizeof(sink_fmt),
+                             AV_OPT_SEARCH_CHILDREN);
+
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
+            return ret;
+        }
+    }
+
+    if ((ret = avfilter_link(prev_ctx, 0, cell.sink, 0)) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot link video sink for %s\n", step.name.c_str());
+        return ret;
+    }
+
+    if ((ret = avfilter_graph_config(cell.graph, NULL)) < 0)
+        return ret;
+
+    cell.megapixels = cell.src->outputs[0]->w * cell.src->outputs[0]->h / 1e6;
+
+    return 0;
+}
+
+/** Queue a frame for the given stage, or the output, taking ownership of it. */
+static int push_frame(FilterPipeline *p, int queue, AVFrame *frame)
+{
+    FrameQueue &q = p->queues[queue];
+
+    pthread_mutex_lock(&p->mutex);
+
+    while (!p->quit && !q.closed && q.frames.size() >= FILTER_QUEUE_SIZE)
+        pthread_cond_wait(&p->cond, &p->mutex);
+
+    if (p->quit || q.closed)
+    {
+        pthread_mutex_unlock(&p->mutex);
+        av_frame_free(&frame);
+        return AVERROR_EOF;
+    }
+
+    q.frames.push_back(frame);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    return 0;
+}
+
+/**
+ * Feed a frame, NULL to flush, through cell c and on through the rest of the
+ * stage's cells. The last one queues its output for the next stage.
+ * Returns AVERROR_EOF once the stage has no more output.
+ */
+static int run_cell(FilterStage *stage, int c, AVFrame *frame)
+{
+    FilterPipeline *p = stage->pipeline;
+    FilterCell &cell = p->cells[c];
+    bool last = c == stage->first_cell + stage->nb_cells - 1;
+
+    if (cell.eof)
+        return AVERROR_EOF;
+
+    if (frame)
+        cell.frames++;
+
+    int64_t start = av_gettime_relative();
+    int ret = av_buffersrc_add_frame_flags(cell.src, frame, 0);
+    cell.time += av_gettime_relative() - start;
+
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Error while feeding the %s filter\n", cell.name.c_str());
+        return ret;
+    }
+
+    while (1)
+    {
+        AVFrame *out = av_frame_alloc();
+
+        if (!out)
+            return AVERROR(ENOMEM);
+
+        start = av_gettime_relative();
+        ret = av_buffersink_get_frame_flags(cell.sink, out, 0);
+        cell.time += av_gettime_relative() - start;
+
+        if (ret < 0)
+        {
+            av_frame_free(&out);
+
+            if (ret == AVERROR(EAGAIN))
+                return 0;
+
+            if (ret != AVERROR_EOF)
+                return ret;
+
+            // Flushed, or ended early like a trim, the cells after it follow
+            cell.eof = true;
+
+            return last ? AVERROR_EOF : run_cell(stage, c + 1, NULL);
+        }
+
+        if (last)
+        {
+            ret = push_frame(p, stage->index + 1, out);
+        }
+        else
+        {
+            ret = run_cell(stage, c + 1, out);
+            av_frame_free(&out);
+        }
+
+        if (ret < 0)
+            return ret;
+    }
+}
+
+static void *stage_thread_proc(void *arg)
+{
+    FilterStage *stage = (FilterStage *) arg;
+    FilterPipeline *p = stage->pipeline;
+    FrameQueue &in = p->queues[stage->index];
+    int ret = 0;
+
+    while (1)
+    {
+        pthread_mutex_lock(&p->mutex);
+
+        while (!p->quit && in.frames.empty())
+            pthread_cond_wait(&p->cond, &p->mutex);
+
+        if (p->quit)
+        {
+            pthread_mutex_unlock(&p->mutex);
+            return NULL;
+        }
+
+        AVFrame *frame = in.frames.front();
+        in.frames.pop_front();
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->mutex);
+
+        bool flush = !frame;
+
+        ret = run_cell(stage, stage->first_cell, frame);
+        av_frame_free(&frame);
+
+        if (ret < 0 || flush)
+            break;
+    }
+
+    // Stop the stages before this one and pass the end on
+    pthread_mutex_lock(&p->mutex);
+
+    if (ret < 0 && ret != AVERROR_EOF && !p->error)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Filter pipeline stage %d failed\n", stage->index);
+        p->error = ret;
+    }
+
+    in.closed = true;
+
+    while (!in.frames.empty())
+    {
+        av_frame_free(&in.frames.front());
+        in.frames.pop_front();
+    }
+
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    push_frame(p, stage->index + 1, NULL);
+
+    return NULL;
+}
+
+int init_filter_pipeline(FilterPipeline **pipeline, const char *src_args, const std::vector<FilterStep> &steps,
+                         int stages, AVPixelFormat sink_fmt, int slice_threads)
+{
+    FilterPipeline *p = new FilterPipeline();
+    int n = (int) steps.size();
+    int ret;
+
+    p->threads_started = 0;
+    p->quit = false;
+    p->output_eof = false;
+    p->error = 0;
+
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    // Freed by the caller with free_filter_pipeline() on failure too
+    *pipeline = p;
+
+    stages = av_clip(stages, 1, n);
+
+    // Every step gets its own graph so its cost can be measured
+    p->cells.resize(n);
+
+    for (int c = 0; c < n; c++)
+    {
+        FilterCell &cell = p->cells[c];
+
+        cell.graph = NULL;
+        cell.src = NULL;
+        cell.sink = NULL;
+        cell.megapixels = 0;
+        cell.time = 0;
+        cell.frames = 0;
+        cell.eof = false;
+    }
+
+    char args[512];
+    snprintf(args, sizeof(args), "%s", src_args);
+
+    for (int c = 0; c < n; c++)
+    {
+        FilterCell &cell = p->cells[c];
+
+        ret = init_filter_cell(cell, steps[c], args, c == n - 1 ? sink_fmt : AV_PIX_FMT_NONE, slice_threads);
+
+        if (ret < 0)
+            return ret;
+
+        // The next step takes this one's output
+        get_source_args(cell.sink, args, sizeof(args));
+    }
+
+    std::vector<double> costs;
+    std::vector<int> first;
+
+    for (int c = 0; c < n; c++)
+        costs.push_back(get_filter_cost(steps[c].filter));
+
+    partition_steps(costs, stages, &first);
+
+    p->stages.resize(stages);
+    p->queues.resize(stages + 1);
+
+    for (int s = 0; s <= stages; s++)
+        p->queues[s].closed = false;
+
+    av_log(NULL, AV_LOG_INFO, "Video filter pipeline: %d stage%s\n", stages, stages > 1 ? "s" : "");
+
+    for (int s = 0; s < stages; s++)
+    {
+        FilterStage &stage = p->stages[s];
+
+        stage.pipeline = p;
+        stage.index = s;
+        stage.first_cell = first[s];
+        stage.nb_cells = (s + 1 < stages ? first[s + 1] : n) - first[s];
+
+        std::string names;
+        double cost = 0;
+
+        for (int c = stage.first_cell; c < stage.first_cell + stage.nb_cells; c++)
+        {
+            names += (c > stage.first_cell ? ", " : "") + p->cells[c].name;
+            cost += costs[c] * p->cells[c].megapixels;
+        }
+
+        av_log(NULL, AV_LOG_INFO, "  stage %d: %s, about %.1f ms per frame\n", s, names.c_str(), cost / 1000);
+    }
+
+    for (int s = 0; s < stages; s++)
+    {
+        if ((ret = pthread_create(&p->stages[s].thread, NULL, stage_thread_proc, &p->stages[s])))
+        {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s\n", strerror(ret));
+            return AVERROR(ret);
+        }
+
+        p->threads_started++;
+    }
+
+    return 0;
+}
+
+int send_filter_pipeline_frame(FilterPipeline *p, AVFrame *frame)
+{
+    FrameQueue &in = p->queues.front();
+    FrameQueue &out = p->queues.back();
+
+    pthread_mutex_lock(&p->mutex);
+
+    // Waiting on a full queue while the output is full too would stall every stage
+    while (!in.closed && in.frames.size() >= FILTER_QUEUE_SIZE && out.frames.empty())
+        pthread_cond_wait(&p->cond, &p->mutex);
+
+    if (in.closed)
+    {
+        pthread_mutex_unlock(&p->mutex);
+        return AVERROR_EOF;
+    }
+
+    if (in.frames.size() >= FILTER_QUEUE_SIZE)
+    {
+        pthread_mutex_unlock(&p->mutex);
+        return AVERROR(EAGAIN);
+    }
+
+    AVFrame *queued = NULL;
+
+    if (frame)
+    {
+        if (!(queued = av_frame_alloc()))
+        {
+            pthread_mutex_unlock(&p->mutex);
+            return AVERROR(ENOMEM);
+        }
+
+        av_frame_move_ref(queued, frame);
+    }
+
+    in.frames.push_back(queued);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    return 0;
+}
+
+int receive_filter_pipeline_frame(FilterPipeline *p, AVFrame *frame, bool wait)
+{
+    FrameQueue &out = p->queues.back();
+
+    pthread_mutex_lock(&p->mutex);
+
+    while (wait && !p->output_eof && out.frames.empty())
+        pthread_cond_wait(&p->cond, &p->mutex);
+
+    if (!p->output_eof && out.frames.empty())
+    {
+        pthread_mutex_unlock(&p->mutex);
+        return AVERROR(EAGAIN);
+    }
+
+    AVFrame *queued = NULL;
+
+    if (!p->output_eof)
+    {
+        queued = out.frames.front();
+        out.frames.pop_front();
+        pthread_cond_broadcast(&p->cond);
+
+        if (!queued)
+            p->output_eof = true;
+    }
+
+    int ret = p->error ? p->error : AVERROR_EOF;
+
+    pthread_mutex_unlock(&p->mutex);
+
+    if (!queued)
+        return ret;
+
+    av_frame_move_ref(frame, queued);
+    av_frame_free(&queued);
+
+    return 0;
+}
+
+AVRational get_filter_pipeline_time_base(FilterPipeline *p)
+{
+    return av_buffersink_get_time_base(p->cells.back().sink);
+}
+
+void free_filter_pipeline(FilterPipeline **pipeline)
+{
+    FilterPipeline *p = *pipeline;
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&p->mutex);
+    p->quit = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (int s = 0; s < p->threads_started; s++)
+        pthread_join(p->stages[s].thread, NULL);
+
+    for (size_t c = 0; c < p->cells.size(); c++)
+    {
+        const FilterCell &cell = p->cells[c];
+
+        if (cell.frames > 0)
+            av_log(NULL, AV_LOG_INFO, "Filter %s: %.2f ms per frame\n", cell.name.c_str(),
+                   cell.time / (double) cell.frames / 1000);
+    }
+
+    if (p->threads_started > 0)
+        save_filter_profile(p);
+
+    for (size_t q = 0; q < p->queues.size(); q++)
+    {
+        while (!p->queues[q].frames.empty())
+        {
+            av_frame_free(&p->queues[q].frames.front());
+            p->queues[q].frames.pop_front();
+        }
+    }
+
+    for (size_t c = 0; c < p->cells.size(); c++)
+        avfilter_graph_free(&p->cells[c].graph);
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+
+    delete p;
+    *pipeline = NULL;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+    #include <libavutil/pixfmt.h>
+    #include <libavutil/rational.h>
+}
+
+/** One filter of a chain, as passed to avfilter_graph_create_filter(). */
+typedef struct FilterStep {
+    std::string filter;
+    std::string name;
+    std::string args;           // Empty for the filter's defaults
+} FilterStep;
+
+typedef struct FilterPipeline FilterPipeline;
+
+/**
+ * Number of threads to split a video chain over, 1 to keep it one graph.
+ * -filter_stages sets it, otherwise it is the fewest stages that come within
+ * reach of the best throughput the core budget allows, going by the cost of
+ * each filter from the -filter_profile file or the built-in estimates.
+ * Stages are used even for 1 when a profile is being recorded.
+ */
+int get_filter_pipeline_stages(const std::vector<FilterStep> &steps);
+
+/**
+ * Build every step as its own graph, from a buffer source with src_args to a
+ * buffersink limited to sink_fmt unless AV_PIX_FMT_NONE, and start a thread
+ * per stage. Stages take contiguous steps balanced by cost and are linked by
+ * bounded frame queues. Steps that support slice threading get
+ * slice_threads threads.
+ */
+int init_filter_pipeline(FilterPipeline **pipeline, const char *src_args, const std::vector<FilterStep> &steps,
+                         int stages, AVPixelFormat sink_fmt, int slice_threads);
+
+/**
+ * Queue a frame for the first stage, taking its reference, NULL for end of
+ * stream. Waits while the queue is full, unless filtered frames are ready,
+ * then returns AVERROR(EAGAIN) without taking the frame; receive them and
+ * send again. AVERROR_EOF once the chain has ended, like after a trim.
+ */
+int send_filter_pipeline_frame(FilterPipeline *pipeline, AVFrame *frame);
+
+/**
+ * Get a filtered frame. AVERROR(EAGAIN) if none is ready, unless wait is
+ * set, then it waits for one. AVERROR_EOF after the last one.
+ */
+int receive_filter_pipeline_frame(FilterPipeline *pipeline, AVFrame *frame, bool wait);
+
+/** Time base of the frames coming out of the last stage. */
+AVRational get_filter_pipeline_time_base(FilterPipeline *pipeline);
+
+/**
+ * Stop the threads and free the graphs. The measured cost of each filter is
+ * logged and saved to the -filter_profile file.
+ */
+void free_filter_pipeline(FilterPipeline **pipeline);
@@ -1,4 +1,7 @@
+#include <inttypes.h>
+#include <math.h>
 #include <stdlib.h>
+#include "core_budget.h"
 #include "ffmpeg_transcoder.h"
 #include "filters.h"
 #include "fr_conversion.h"
@@ -14,445 +17,405 @@ extern StreamContext *g_stream_ctx;
 extern FilteringContext *g_filter_ctx;
 extern Options g_options;
 
-static int init_filter(FilteringContext *fctx,
-                       AVStream *st,
-                       AVCodecContext *enc_ctx,
-                       const char *filter_spec)
-{
-    char args[512];
-    int ret = 0;
+// Slice threads are not given fewer rows than this
+#define MIN_FILTER_SLICE_ROWS 64
 
-    const AVFilter *cur_filter = NULL;
-    AVFilterContext *cur_ctx = NULL;
-    AVFilterContext *prev_ctx = NULL;
+/** Frame rate conversion between a video stream and its encoder. */
+static EFrameRateConversionCode get_fr_code(AVStream *st, AVCodecContext *enc_ctx)
+{
+    // enc_ctx num and den are flipped at this point, store into dst un-flipped
+    AVRational dst;
+    dst.num = enc_ctx->time_base.den;
+    dst.den = enc_ctx->time_base.num;
 
-//    AVCodecContext *codec_ctx;
-//    ret = avcodec_parameters_to_context(codec_ctx, st->codecpar);
+    // TODO: Pull this in from the json.
+    bool bIsTelecine = false;
 
-    AVFilterGraph *filter_graph = avfilter_graph_alloc();
-    if (!filter_graph)
-    {
-        av_log(NULL, AV_LOG_ERROR, "Can not create filter graph\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
+    return CalculateFrameRateConversion(st->r_frame_rate, dst, bIsTelecine);
+}
 
-    fctx->filter_graph = filter_graph;
+/** The frame rate conversion of the first transcoded video stream, the audio follows it. */
+static EFrameRateConversionCode get_video_fr_code()
+{
+    // The video keeps its clock in keyframe only mode, so does the audio
+    if (g_options.keyframes_only)
+        return kNoConversion;
 
-    if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
     {
-        // Create Video Source
-        //////////////////////
-        cur_filter = avfilter_get_by_name("buffer");
-
-        if (!cur_filter)
-        {
-            av_log(NULL, AV_LOG_ERROR, "Filter video source not found\n");
-            ret = AVERROR_UNKNOWN;
-            goto end;
-        }
-
-        snprintf(args, sizeof(args),
-            "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d:frame_rate=%d/%d",
-            st->codecpar->width, st->codecpar->height,
-            st->codecpar->format,
-            st->time_base.num, st->time_base.den,
-            st->codecpar->sample_aspect_ratio.num, st->codecpar->sample_aspect_ratio.den,
-            st->r_frame_rate.num, st->r_frame_rate.den);
-
-        ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "src",
-                                           args, NULL, filter_graph);
-
-        if (ret < 0)
-        {
-            av_log(NULL, AV_LOG_ERROR, "Cannot create video source\n");
-            goto end;
-        }
-
-        fctx->buffersrc_ctx = cur_ctx;
-        prev_ctx = cur_ctx;
-
-        // enc_ctx num and den are flipped at this point, store into dst un-flipped
-        AVRational dst;
-        dst.num = enc_ctx->time_base.den;
-        dst.den = enc_ctx->time_base.num;
-
-        // TODO: Pull this in from the json.
-        bool bIsTelecine = false;
-        EFrameRateConversionCode fr_code = CalculateFrameRateConversion(st->r_frame_rate, dst, bIsTelecine);
-
-        // Perform deinterlacing?
-        /////////////////////////
-        if( IsDeinterlacing(fr_code) )
-        {
-            cur_filter = avfilter_get_by_name("yadif");
-
-            if (!cur_filter)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Filter yadif not found\n");
-                ret = AVERROR_UNKNOWN;
-                goto end;
-            }
-
-            ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "yadif",
-                                               NULL, NULL, filter_graph);
-
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot create yadif filter\n");
-                goto end;
-            }
+        if (g_ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            g_stream_ctx[i].enc_ctx)
+            return get_fr_code(g_ifmt_ctx->streams[i], g_stream_ctx[i].enc_ctx);
+    }
 
-            ret = avfilter_link(prev_ctx, 0,
-                                cur_ctx, 0);
+    return kNoConversion;
+}
 
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot link yadif filter\n");
-                goto end;
-            }
+/**
+ * True if the size or pixel format changes between the video stream and its
+ * encoder. The scaler does that after the graph, so the graph leaves both alone.
+ */
+static bool needs_scaler(AVStream *st, AVCodecContext *enc_ctx)
+{
+    return enc_ctx->width != st->codecpar->width ||
+           enc_ctx->height != st->codecpar->height ||
+           enc_ctx->pix_fmt != st->codecpar->format;
+}
 
-            prev_ctx = cur_ctx;
-        }
+/**
+ * Slice threads for a video graph. Filters without slice threading run on
+ * the calling thread whatever the graph is given, so chains without any get
+ * no thread pool. Otherwise the rows are split over the filter share of the
+ * core plan, shared between the stages of a pipeline. -filter_threads overrides the choice up
+ * to the budget.
+ */
+static int get_video_filter_threads(AVStream *st, const std::vector<FilterStep> &steps, int stages)
+{
+    int budget = FFMAX(1, get_core_plan()->filter / stages);
+    bool slice_threads = false;
 
-        // Perform frame rate conversion?
-        /////////////////////////////////
-        if(st->r_frame_rate.num != dst.num ||
-           st->r_frame_rate.den != dst.den)
-        {
-            /*
-            st->codec->field_order
-
-            enum AVFieldOrder {
-                AV_FIELD_UNKNOWN,
-                AV_FIELD_PROGRESSIVE,
-                AV_FIELD_TT,          //< Top coded_first, top displayed first
-                AV_FIELD_BB,          //< Bottom coded first, bottom displayed first
-                AV_FIELD_TB,          //< Top coded first, bottom displayed first
-                AV_FIELD_BT,          //< Bottom coded first, top displayed first
-            };
-            */
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        const AVFilter *filter = avfilter_get_by_name(steps[i].filter.c_str());
 
-            // All of the following code is based on CSourceAssembly::ConfigureAVISynthFRConverter()
+        if (filter && (filter->flags & AVFILTER_FLAG_SLICE_THREADS))
+            slice_threads = true;
+    }
 
-            /*
-            if (m_bSourceIsVFR)
-            {
-                // TODO: For the time being, don't convert VFR between PAL and NTSC.
-                // Currently the VFR->CFR is done in the MC FR Converter.
-                // Converting between NTSC/PAL here would lose sync.
-                m_hr = E_INVALIDARG;
-                SetError(ERR_UnsupportedFrameRate, L"BuildVideoPreprocessingPath", L"VFR unsupported in PAL<->NTSC conversion");
-                goto ConfigureAVISynthFRConverter_Failed;
-            }
-            */
+    if (g_options.filter_threads > 0)
+        return FFMIN(g_options.filter_threads, budget);
 
-            if(fr_code == kNTSCInverseTelecine_to_PAL ||
-               fr_code == kNTSCInverseTelecine_to_NTSCFilm ||
-               fr_code == kNTSC60pInverseTelecine_to_NTSCFilm ||
-               fr_code == kNTSC60pInverseTelecine_to_PAL)
-            {
-                //double frameRate = 23.976;
-                if (fr_code == EFrameRateConversionCode::kNTSC60pInverseTelecine_to_NTSCFilm ||
-                    fr_code == EFrameRateConversionCode::kNTSC60pInverseTelecine_to_PAL)
-                {
-                    // TODO
-                    //wcscpy_s(script, _countof(script), L"TDecimate(cycleR=3, Cycle=5)");
+    if (!slice_threads)
+        return 1;
 
-                    // Insert Decimate
-                    /*
-                    cur_filter = avfilter_get_by_name("decimate");
+    int threads = st->codecpar->height / MIN_FILTER_SLICE_ROWS;
 
-                    if (!cur_filter)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Filter decimate not found\n");
-                        ret = AVERROR_UNKNOWN;
-                        goto end;
-                    }
+    return av_clip(threads, 1, budget);
+}
 
-                    ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "decimate",
-                                                       NULL, NULL, filter_graph);
+int append_filter(AVFilterGraph *filter_graph, AVFilterContext **prev_ctx,
+                  const char *filter_name, const char *instance_name, const char *args)
+{
+    AVFilterContext *cur_ctx = NULL;
+    const AVFilter *cur_filter = avfilter_get_by_name(filter_name);
 
-                    if (ret < 0)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Cannot create decimate filter\n");
-                        goto end;
-                    }
+    if (!cur_filter)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Filter %s not found\n", filter_name);
+        return AVERROR_UNKNOWN;
+    }
 
-                    ret = avfilter_link(prev_ctx, 0, cur_ctx, 0);
+    int ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, instance_name,
+                                           args, NULL, filter_graph);
 
-                    if (ret < 0)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Cannot link decimate filter\n");
-                        goto end;
-                    }
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create %s filter\n", instance_name);
+        return ret;
+    }
 
-                    prev_ctx = cur_ctx;
-                    */
-                }
-                else
-                {
-                    //wcscpy_s(script, _countof(script), L"TFM()TDecimate()");
+    ret = avfilter_link(*prev_ctx, 0, cur_ctx, 0);
 
-                    // Insert FieldMatch
-                    cur_filter = avfilter_get_by_name("fieldmatch");
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot link %s filter\n", instance_name);
+        return ret;
+    }
 
-                    if (!cur_filter)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Filter fieldmatch not found\n");
-                        ret = AVERROR_UNKNOWN;
-                        goto end;
-                    }
+    *prev_ctx = cur_ctx;
 
-                    ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "fieldmatch",
-                                                       NULL, NULL, filter_graph);
+    return 0;
+}
 
-                    if (ret < 0)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Cannot create fieldmatch filter\n");
-                        goto end;
-                    }
+static void add_filter_step(std::vector<FilterStep> &steps, const char *filter_name,
+                            const char *instance_name, const char *args)
+{
+    FilterStep step;
 
-                    ret = avfilter_link(prev_ctx, 0, cur_ctx, 0);
+    step.filter = filter_name;
+    step.name = instance_name;
+    step.args = args ? args : "";
 
-                    if (ret < 0)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Cannot link fieldmatch filter\n");
-                        goto end;
-                    }
+    steps.push_back(step);
+}
 
-                    prev_ctx = cur_ctx;
+/** Buffer source arguments for the frames of a video stream. */
+static void get_video_source_args(AVStream *st, char *args, size_t size)
+{
+    snprintf(args, size,
+        "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d:frame_rate=%d/%d",
+        st->codecpar->width, st->codecpar->height,
+        st->codecpar->format,
+        st->time_base.num, st->time_base.den,
+        st->codecpar->sample_aspect_ratio.num, st->codecpar->sample_aspect_ratio.den,
+        st->r_frame_rate.num, st->r_frame_rate.den);
+}
 
-                    // Insert Decimate
-                    cur_filter = avfilter_get_by_name("decimate");
+/**
+ * The filters between the video source and sink, in order: deinterlacing,
+ * frame rate conversion, avisynth and, if trim is set, the trim.
+ */
+static void get_video_filter_steps(AVStream *st, AVCodecContext *enc_ctx, std::vector<FilterStep> &steps, bool trim)
+{
+    char args[512];
 
-                    if (!cur_filter)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Filter decimate not found\n");
-                        ret = AVERROR_UNKNOWN;
-                        goto end;
-                    }
+    // enc_ctx num and den are flipped at this point, store into dst un-flipped
+    AVRational dst;
+    dst.num = enc_ctx->time_base.den;
+    dst.den = enc_ctx->time_base.num;
 
-                    ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "decimate",
-                                                       NULL, NULL, filter_graph);
+    EFrameRateConversionCode fr_code = get_fr_code(st, enc_ctx);
 
-                    if (ret < 0)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Cannot create decimate filter\n");
-                        goto end;
-                    }
+    // Perform deinterlacing?
+    /////////////////////////
+    if( IsDeinterlacing(fr_code) )
+        add_filter_step(steps, "yadif", "yadif", NULL);
 
-                    ret = avfilter_link(prev_ctx, 0, cur_ctx, 0);
+    // Perform frame rate conversion? Not on the sparse frames of keyframe
+    // only mode, the fps filter would fill the gaps with repeats
+    /////////////////////////////////
+    if(!g_options.keyframes_only &&
+       (st->r_frame_rate.num != dst.num ||
+        st->r_frame_rate.den != dst.den))
+    {
+        /*
+        st->codec->field_order
+
+        enum AVFieldOrder {
+            AV_FIELD_UNKNOWN,
+            AV_FIELD_PROGRESSIVE,
+            AV_FIELD_TT,          //< Top coded_first, top displayed first
+            AV_FIELD_BB,          //< Bottom coded first, bottom displayed first
+            AV_FIELD_TB,          //< Top coded first, bottom displayed first
+            AV_FIELD_BT,          //< Bottom coded first, top displayed first
+        };
+        */
+
+        // All of the following code is based on CSourceAssembly::ConfigureAVISynthFRConverter()
+
+        /*
+        if (m_bSourceIsVFR)
+        {
+            // TODO: For the time being, don't convert VFR between PAL and NTSC.
+            // Currently the VFR->CFR is done in the MC FR Converter.
+            // Converting between NTSC/PAL here would lose sync.
+            m_hr = E_INVALIDARG;
+            SetError(ERR_UnsupportedFrameRate, L"BuildVideoPreprocessingPath", L"VFR unsupported in PAL<->NTSC conversion");
+            goto ConfigureAVISynthFRConverter_Failed;
+        }
+        */
 
-                    if (ret < 0)
-                    {
-                        av_log(NULL, AV_LOG_ERROR, "Cannot link decimate filter\n");
-                        goto end;
-                    }
+        if(fr_code == kNTSCInverseTelecine_to_PAL ||
+           fr_code == kNTSCInverseTelecine_to_NTSCFilm ||
+           fr_code == kNTSC60pInverseTelecine_to_NTSCFilm ||
+           fr_code == kNTSC60pInverseTelecine_to_PAL)
+        {
+            //double frameRate = 23.976;
+            if (fr_code == EFrameRateConversionCode::kNTSC60pInverseTelecine_to_NTSCFilm ||
+                fr_code == EFrameRateConversionCode::kNTSC60pInverseTelecine_to_PAL)
+            {
+                // TODO
+                //wcscpy_s(script, _countof(script), L"TDecimate(cycleR=3, Cycle=5)");
 
-                    prev_ctx = cur_ctx;
-                }
+                // Insert Decimate
+                //add_filter_step(steps, "decimate", "decimate", NULL);
+            }
+            else
+            {
+                //wcscpy_s(script, _countof(script), L"TFM()TDecimate()");
 
-                // Speed up video to 25fps if desired (e.g. NTSC film to PAL conversion)
-                if (fr_code == EFrameRateConversionCode::kNTSCInverseTelecine_to_PAL ||
-                    fr_code == EFrameRateConversionCode::kNTSC60pInverseTelecine_to_PAL)
-                {
-                    //wcscat_s(script, _countof(script), L"AssumeFPS(25, 1, sync_audio=false)");
-                    //frameRate = 25.0;
-                    dst.num = 25;
-                    dst.den = 1;
-                }
-                else
-                {
-                    dst.num = 24000;
-                    dst.den = 1001;
-                }
+                // Insert FieldMatch
+                add_filter_step(steps, "fieldmatch", "fieldmatch", NULL);
 
-                // Update output frame rate
-                // TODO: code review -- move otu to BuildFilterGraph everything that changes the output frame 
-                //if (m_pTUM->GetFrameRatePassThru() && m_iTranscodeStage == TranscodeStages::kMainContentStage)
-                //    m_pTUM->SetOutputFrameRate(frameRate);
+                // Insert Decimate
+                add_filter_step(steps, "decimate", "decimate", NULL);
             }
-            else if (fr_code == kNTSC60p_to_PAL)
+
+            // Speed up video to 25fps if desired (e.g. NTSC film to PAL conversion)
+            if (fr_code == EFrameRateConversionCode::kNTSCInverseTelecine_to_PAL ||
+                fr_code == EFrameRateConversionCode::kNTSC60pInverseTelecine_to_PAL)
             {
-                /*
-                // Perform frame rate conversion to 50i
-                wcscpy_s(script, _countof(script), L"ChangeFPS(50.00)\n"); // or blend via ConvertFPS
-
-                                                                           // Re-interlace
-                bool isTFF = m_pTUM->IsInterlacedTopFieldFirst();
-                wcscat_s(script, _countof(script), (isTFF) ? L"AssumeTFF()\n" : L"AssumeBFF()\n");
-                wcscat_s(script, _countof(script), L"SeparateFields()\n");
-                wcscat_s(script, _countof(script), L"SelectEvery(4,0,3)\n");
-                wcscat_s(script, _countof(script), L"Weave()\n");
-
-                wcscat_s(script, _countof(script), L"AssumeFPS(25, 1, sync_audio=false)");
-                */
+                //wcscat_s(script, _countof(script), L"AssumeFPS(25, 1, sync_audio=false)");
+                //frameRate = 25.0;
+                dst.num = 25;
+                dst.den = 1;
             }
-
-            cur_filter = avfilter_get_by_name("fps");
-            if (!cur_filter)
+            else
             {
-                av_log(NULL, AV_LOG_ERROR, "Filter fps not found\n");
-                ret = AVERROR_UNKNOWN;
-                goto end;
+                dst.num = 24000;
+                dst.den = 1001;
             }
 
-            char fps[32];
-            char num[10];
-            char den[10];
-            snprintf(num, sizeof(num), "%d", dst.num);
-            snprintf(den, sizeof(den), "%d", dst.den);
-            strcpy(fps, num);
-            strcat(fps, "/");
-            strcat(fps, den);
+            // Update output frame rate
+            // TODO: code review -- move otu to BuildFilterGraph everything that changes the output frame 
+            //if (m_pTUM->GetFrameRatePassThru() && m_iTranscodeStage == TranscodeStages::kMainContentStage)
+            //    m_pTUM->SetOutputFrameRate(frameRate);
+        }
+        else if (fr_code == kNTSC60p_to_PAL)
+        {
+            /*
+            // Perform frame rate conversion to 50i
+            wcscpy_s(script, _countof(script), L"ChangeFPS(50.00)\n"); // or blend via ConvertFPS
 
-            snprintf(args, sizeof(args), "fps=%s", fps);
+                                                                       // Re-interlace
+            bool isTFF = m_pTUM->IsInterlacedTopFieldFirst();
+            wcscat_s(script, _countof(script), (isTFF) ? L"AssumeTFF()\n" : L"AssumeBFF()\n");
+            wcscat_s(script, _countof(script), L"SeparateFields()\n");
+            wcscat_s(script, _countof(script), L"SelectEvery(4,0,3)\n");
+            wcscat_s(script, _countof(script), L"Weave()\n");
 
-            ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "fps",
-                                               args, NULL, filter_graph);
+            wcscat_s(script, _countof(script), L"AssumeFPS(25, 1, sync_audio=false)");
+            */
+        }
 
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot create fps\n");
-                goto end;
-            }
 
-            ret = avfilter_link(prev_ctx, 0,
-                                cur_ctx, 0);
+        // PAL reclock: speed the frames up so the fps filter passes them
+        // through instead of repeating every 24th, the audio is reclocked
+        // by the same factor
+        AVRational reclock = GetReclockFactor(fr_code);
 
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot link fps\n");
-                goto end;
-            }
+        if (reclock.num != reclock.den)
+        {
+            snprintf(args, sizeof(args), "expr=PTS*%d/%d", reclock.den, reclock.num);
+            add_filter_step(steps, "setpts", "reclock", args);
+        }
 
-            prev_ctx = cur_ctx;
+        snprintf(args, sizeof(args), "fps=%d/%d", dst.num, dst.den);
+        add_filter_step(steps, "fps", "fps", args);
+    }
+
+    // Create avisynth?
+    ///////////////////
+    if (g_options.avisynth)
+    {
+        snprintf(args, sizeof(args),
+                 "script=%s",
+                 g_options.avisynth_script);
+
+        add_filter_step(steps, "avisynth", "avisynth", args);
+    }
+
+    // Create Video Trim?
+    /////////////////////
+    if (trim && (g_options.start_time != -1 || g_options.end_time != -1))
+    {
+        memset(args, 0, sizeof(args));
+
+        if(g_options.start_time != -1)
+        {
+            snprintf(args, sizeof(args),
+                     "start=%d",
+                     g_options.start_time);
         }
 
-        // Create avisynth?
-        ///////////////////
-        if (g_options.avisynth)
+        if(g_options.end_time != -1)
         {
-            cur_filter = avfilter_get_by_name("avisynth");
-            if (!cur_filter)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Filter avisynth not found\n");
-                ret = AVERROR_UNKNOWN;
-                goto end;
-            }
+            char end[32];
+            snprintf(end, sizeof(end),
+                     (g_options.start_time != -1) ? ":end=%d" : "end=%d",
+                     g_options.end_time);
+            strcat(args, end);
+        }
 
-            snprintf(args, sizeof(args),
-                     "script=%s",
-                     g_options.avisynth_script);
+        add_filter_step(steps, "trim", "video_trim", args);
+    }
+}
 
-            ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "avisynth",
-                                               args, NULL, filter_graph);
+static int init_filter(FilteringContext *fctx,
+                       AVStream *st,
+                       AVCodecContext *enc_ctx,
+                       const char *filter_spec)
+{
+    char args[512];
+    int ret = 0;
 
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot create avisynth\n");
-                goto end;
-            }
+    const AVFilter *cur_filter = NULL;
+    AVFilterContext *cur_ctx = NULL;
+    AVFilterContext *prev_ctx = NULL;
 
-            ret = avfilter_link(prev_ctx, 0,
-                                cur_ctx, 0);
+    std::vector<FilterStep> steps;
 
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot link avisynth\n");
-                goto end;
-            }
+    if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        get_video_filter_steps(st, enc_ctx, steps, true);
 
-            prev_ctx = cur_ctx;
-        }
+        int stages = get_filter_pipeline_stages(steps);
 
-        // Create Video Scaler?
-        ///////////////////////
-        if (enc_ctx->width != st->codecpar->width || enc_ctx->height != st->codecpar->height)
+        // Split the chain over threads, a single stage still measures the
+        // filters for the profile
+        if (stages > 1 || (!steps.empty() && !g_options.filter_profile.empty()))
         {
-            cur_filter = avfilter_get_by_name("scale");
-            if (!cur_filter)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Filter video_scale not found\n");
-                ret = AVERROR_UNKNOWN;
-                goto end;
-            }
+            get_video_source_args(st, args, sizeof(args));
 
-            snprintf(args, sizeof(args),
-                     "width=%d:height=%d",
-                     enc_ctx->width, enc_ctx->height);
+            return init_filter_pipeline(&fctx->pipeline, args, steps, stages,
+                                        needs_scaler(st, enc_ctx) ? AV_PIX_FMT_NONE : enc_ctx->pix_fmt,
+                                        get_video_filter_threads(st, steps, stages));
+        }
+    }
 
-            ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "scale",
-                                               args, NULL, filter_graph);
+//    AVCodecContext *codec_ctx;
+//    ret = avcodec_parameters_to_context(codec_ctx, st->codecpar);
 
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot create video scaler\n");
-                goto end;
-            }
+    AVFilterGraph *filter_graph = avfilter_graph_alloc();
+    if (!filter_graph)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Can not create filter graph\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
 
-            ret = avfilter_link(prev_ctx, 0,
-                                cur_ctx, 0);
+    fctx->filter_graph = filter_graph;
 
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot link video scaler\n");
-                goto end;
-            }
+    // The graph's thread pool is created with its first filter
+    if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        filter_graph->nb_threads = get_video_filter_threads(st, steps, 1);
+        filter_graph->thread_type = filter_graph->nb_threads > 1 ? AVFILTER_THREAD_SLICE : 0;
 
-            prev_ctx = cur_ctx;
-        }
+        av_log(NULL, AV_LOG_INFO, "Video filter graph: %d thread%s\n",
+               filter_graph->nb_threads, filter_graph->nb_threads > 1 ? "s" : "");
+    }
+    else
+    {
+        filter_graph->nb_threads = 1;
+        filter_graph->thread_type = 0;
+    }
 
-        // Create Video Trim?
-        /////////////////////
-        if (g_options.start_time != -1 || g_options.end_time != -1)
+    if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        // Create Video Source
+        //////////////////////
+        cur_filter = avfilter_get_by_name("buffer");
+
+        if (!cur_filter)
         {
-            cur_filter = avfilter_get_by_name("trim");
-            if (!cur_filter)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Filter video_trim not found\n");
-                ret = AVERROR_UNKNOWN;
-                goto end;
-            }
+            av_log(NULL, AV_LOG_ERROR, "Filter video source not found\n");
+            ret = AVERROR_UNKNOWN;
+            goto end;
+        }
 
-            memset(args, 0, sizeof(args));
+        get_video_source_args(st, args, sizeof(args));
 
-            if(g_options.start_time != -1)
-            {
-                snprintf(args, sizeof(args),
-                         "start=%d",
-                         g_options.start_time);
-            }
-
-            if(g_options.end_time != -1)
-            {
-                char end[32];
-                snprintf(end, sizeof(end),
-                         (g_options.start_time != -1) ? ":end=%d" : "end=%d",
-                         g_options.end_time);
-                strcat(args, end);
-            }
+        ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "src",
+                                           args, NULL, filter_graph);
 
-            ret = avfilter_graph_create_filter(&cur_ctx, cur_filter, "video_trim",
-                                               args, NULL, filter_graph);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Cannot create video source\n");
+            goto end;
+        }
 
-            if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot create video trim\n");
-                goto end;
-            }
+        fctx->buffersrc_ctx = cur_ctx;
+        prev_ctx = cur_ctx;
 
-            ret = avfilter_link(prev_ctx, 0,
-                                cur_ctx, 0);
+        // Deinterlacing, frame rate conversion, avisynth and trim
+        for (size_t i = 0; i < steps.size(); i++)
+        {
+            ret = append_filter(filter_graph, &prev_ctx, steps[i].filter.c_str(), steps[i].name.c_str(),
+                                steps[i].args.empty() ? NULL : steps[i].args.c_str());
 
             if (ret < 0)
-            {
-                av_log(NULL, AV_LOG_ERROR, "Cannot link video trim\n");
                 goto end;
-            }
-
-            prev_ctx = cur_ctx;
         }
 
         // Create Video Sink
@@ -473,14 +436,19 @@ static int init_filter(FilteringContext *fctx,
             goto end;
         }
 
-        ret = av_opt_set_bin(cur_ctx, "pix_fmts",
-                             (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt),
-                             AV_OPT_SEARCH_CHILDREN);
-
-        if (ret < 0)
+        // Scaling and pixel format conversion are done by the scaler after the
+        // sink, in one pass, instead of by scale filters in the graph
+        if (!needs_scaler(st, enc_ctx))
         {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
-            goto end;
+            ret = av_opt_set_bin(cur_ctx, "pix_fmts",
+                                 (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt),
+                                 AV_OPT_SEARCH_CHILDREN);
+
+            if (ret < 0)
+            {
+                av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
+                goto end;
+            }
         }
 
         ret = avfilter_link(prev_ctx, 0,
@@ -524,6 +492,51 @@ static int init_filter(FilteringContext *fctx,
         fctx->buffersrc_ctx = cur_ctx;
         prev_ctx = cur_ctx;
 
+        // Reclock with the video for PAL speed-up?
+        ///////////////////////////////////////////
+        AVRational reclock = GetReclockFactor(get_video_fr_code());
+
+        if (reclock.num != reclock.den)
+        {
+            if (g_options.pitch_shift)
+            {
+                // Classic speed-up, play the samples faster and resample back
+                int sample_rate = st->codecpar->sample_rate;
+                int64_t reclocked_rate = av_rescale(sample_rate, reclock.num, reclock.den);
+                double residual = (double) sample_rate * reclock.num / reclock.den / reclocked_rate;
+
+                snprintf(args, sizeof(args), "sample_rate=%" PRId64, reclocked_rate);
+
+                if ((ret = append_filter(filter_graph, &prev_ctx, "asetrate", "reclock", args)) < 0)
+                    goto end;
+
+                snprintf(args, sizeof(args), "%d", sample_rate);
+
+                if ((ret = append_filter(filter_graph, &prev_ctx, "aresample", "reclock_resample", args)) < 0)
+                    goto end;
+
+                // The integer rate is not exact for 44.1 kHz, make up the difference
+                if (fabs(residual - 1.0) > 1e-9)
+                {
+                    snprintf(args, sizeof(args), "tempo=%.10f", residual);
+
+                    if ((ret = append_filter(filter_graph, &prev_ctx, "atempo", "reclock_residual", args)) < 0)
+                        goto end;
+                }
+            }
+            else
+            {
+                // Time stretch, keeps the pitch
+                snprintf(args, sizeof(args), "tempo=%.10f", av_q2d(reclock));
+
+                if ((ret = append_filter(filter_graph, &prev_ctx, "atempo", "reclock", args)) < 0)
+                    goto end;
+            }
+
+            av_log(NULL, AV_LOG_INFO, "Reclocking audio by %d/%d%s\n", reclock.num, reclock.den,
+                   g_options.pitch_shift ? " with pitch shift" : "");
+        }
+
         // Create audio trim?
         /////////////////////
         if (g_options.start_time != -1 || g_options.end_time != -1)
@@ -618,6 +631,91 @@ end:
     return ret;
 }
 
+int init_chunk_filter(FilteringContext *fctx, AVStream *st, AVCodecContext *enc_ctx, int threads)
+{
+    char args[512];
+    int ret;
+
+    std::vector<FilterStep> steps;
+    get_video_filter_steps(st, enc_ctx, steps, false);
+
+    fctx->buffersrc_ctx = NULL;
+    fctx->buffersink_ctx = NULL;
+    fctx->pipeline = NULL;
+
+    // Freed by the caller on failure too
+    fctx->filter_graph = avfilter_graph_alloc();
+
+    if (!fctx->filter_graph)
+        return AVERROR(ENOMEM);
+
+    fctx->filter_graph->nb_threads = threads;
+    fctx->filter_graph->thread_type = threads > 1 ? AVFILTER_THREAD_SLICE : 0;
+
+    get_video_source_args(st, args, sizeof(args));
+
+    ret = avfilter_graph_create_filter(&fctx->buffersrc_ctx, avfilter_get_by_name("buffer"), "src",
+                                       args, NULL, fctx->filter_graph);
+
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create video source\n");
+        return ret;
+    }
+
+    AVFilterContext *prev_ctx = fctx->buffersrc_ctx;
+
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        ret = append_filter(fctx->filter_graph, &prev_ctx, steps[i].filter.c_str(), steps[i].name.c_str(),
+                            steps[i].args.empty() ? NULL : steps[i].args.c_str());
+
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = avfilter_graph_create_filter(&fctx->buffersink_ctx, avfilter_get_by_name("buffersink"), "sink",
+                                       NULL, NULL, fctx->filter_graph);
+
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create video sink\n");
+        return ret;
+    }
+
+    if (!needs_scaler(st, enc_ctx))
+    {
+        ret = av_opt_set_bin(fctx->buffersink_ctx, "pix_fmts",
+                             (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt),
+                             AV_OPT_SEARCH_CHILDREN);
+
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
+            return ret;
+        }
+    }
+
+    if ((ret = avfilter_link(prev_ctx, 0, fctx->buffersink_ctx, 0)) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot link video sink\n");
+        return ret;
+    }
+
+    return avfilter_graph_config(fctx->filter_graph, NULL);
+}
+
+int64_t get_video_chain_pts(AVStream *st, AVCodecContext *enc_ctx, int64_t pts)
+{
+    AVRational reclock = GetReclockFactor(get_fr_code(st, enc_ctx));
+
+    // Like the reclock setpts, then rounded like the fps filter does
+    pts = av_rescale(pts, reclock.den, reclock.num);
+
+    return av_rescale_q_rnd(pts, st->time_base, enc_ctx->time_base,
+                            (AVRounding) (AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+}
+
 int init_filters(void)
 {
     const char *filter_spec;
@@ -638,11 +736,16 @@ int init_filters(void)
         g_filter_ctx[i].buffersrc_ctx = NULL;
         g_filter_ctx[i].buffersink_ctx = NULL;
         g_filter_ctx[i].filter_graph = NULL;
+        g_filter_ctx[i].pipeline = NULL;
 
         if (!(g_ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO
             || g_ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO))
             continue;
 
+        // Encoded somewhere else, like by the chunk workers
+        if (g_ifmt_ctx->streams[i]->discard == AVDISCARD_ALL)
+            continue;
+
         if (g_ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
             filter_spec = "null"; /* passthrough (dummy) filter for video */
         else
@@ -656,8 +759,20 @@ int init_filters(void)
         if (ret)
             return ret;
 
+        if (g_ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            needs_scaler(g_ifmt_ctx->streams[i], g_stream_ctx[i].enc_ctx))
+        {
+            AVCodecContext *enc_ctx = g_stream_ctx[i].enc_ctx;
+
+            ret = init_scaler(&g_stream_ctx[i].scaler, enc_ctx->width, enc_ctx->height, enc_ctx->pix_fmt, get_core_plan()->filter);
+
+            if (ret < 0)
+                return ret;
+        }
+
 #ifdef DEBUG
-        strcpy(p_graph, avfilter_graph_dump(g_filter_ctx[i].filter_graph, NULL));
+        if (g_filter_ctx[i].filter_graph)
+            strcpy(p_graph, avfilter_graph_dump(g_filter_ctx[i].filter_graph, NULL));
 #endif
     }
 
@@ -1,17 +1,36 @@
 #pragma once
 
+#include <string>
 #include <vector>
 
 extern "C"
 {
     #include <libavfilter/avfilter.h>
     #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
 }
 
+#include "filter_pipeline.h"
+
 typedef struct FilteringContext {
     AVFilterContext *buffersink_ctx;
     AVFilterContext *buffersrc_ctx;
     AVFilterGraph *filter_graph;
+    FilterPipeline *pipeline;   // Video chain split over threads, replaces the graph when set
 } FilteringContext;
 
-int init_filters(void);
\ No newline at end of file
+int init_filters(void);
+
+/**
+ * The video chain of init_filters() for a stream and its encoder, without the
+ * trim, as one graph with threads slice threads. For encoders fed outside the
+ * main pipeline, the caller frees the graph.
+ */
+int init_chunk_filter(FilteringContext *fctx, AVStream *st, AVCodecContext *enc_ctx, int threads);
+
+/** Where a timestamp of the stream ends up after the video chain, in the encoder's time base. */
+int64_t get_video_chain_pts(AVStream *st, AVCodecContext *enc_ctx, int64_t pts);
+
+/** Create a filter and link it after *prev_ctx, which then points to the new filter. */
+int append_filter(AVFilterGraph *filter_graph, AVFilterContext **prev_ctx,
+                  const char *filter_name, const char *instance_name, const char *args);
@@ -190,4 +190,31 @@ AVRational FRtoAVRational(double fr)
     }
 
     return avRet;
+}
+
+AVRational GetReclockFactor(EFrameRateConversionCode fr_code)
+{
+    AVRational factor;
+
+    switch (fr_code)
+    {
+        // Inverse telecine gives 23.976p, played back at 25 fps
+        case kNTSCInverseTelecine_to_PAL:
+        case kNTSC60pInverseTelecine_to_PAL:
+            factor.num = 25 * 1001;
+            factor.den = 24000;
+            break;
+
+        case kFilm_to_PAL:
+            factor.num = 25;
+            factor.den = 24;
+            break;
+
+        default:
+            factor.num = 1;
+            factor.den = 1;
+            break;
+    }
+
+    return factor;
 }
\ No newline at end of file
@@ -46,6 +46,9 @@ AVRational FRtoAVRational(double fr);
 
 bool IsDeinterlacing(EFrameRateConversionCode fr_code);
 
+// Speed-up of the conversions that reclock film to PAL (output rate / input rate), 1/1 for all others
+AVRational GetReclockFactor(EFrameRateConversionCode fr_code);
+
 bool IsInterlaced(EScanType es);
 bool IsProgressive(EScanType es);
 bool IsTelecine(EScanType es);
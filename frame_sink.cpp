@@ -0,0 +1,240 @@
+#include "frame_sink.h"
+
+extern "C"
+{
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/time.h>
+}
+
+#ifdef LINUX
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Planes start on this boundary in a slot, for SIMD on the consumer side
+#define PLANE_ALIGN 64
+
+#define PAGE_ALIGN(x) (((x) + 4095) & ~(uint64_t) 4095)
+
+// How often a producer waiting on the consumer says so, in seconds
+#define WAIT_LOG_INTERVAL 5
+
+static std::string g_name;
+static uint8_t *g_map = NULL;
+static size_t g_map_size = 0;
+static FrameRingHeader *g_header = NULL;
+static FrameDescriptor *g_descriptors = NULL;
+static unsigned int g_stream_index = 0;
+static enum AVPixelFormat g_format = AV_PIX_FMT_NONE;
+static int g_width = 0;
+static int g_height = 0;
+static AVRational g_time_base = {0, 1};
+
+// Stats
+static int64_t g_frames = 0;
+static int64_t g_wait_time = 0;
+
+static void futex_wait(uint32_t *word, uint32_t value, int seconds)
+{
+    struct timespec timeout = { seconds, 0 };
+
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int init_frame_sink(const char *name, int slot_count, unsigned int stream_index, AVCodecContext *enc_ctx)
+{
+    int slot_size = av_image_get_buffer_size(enc_ctx->pix_fmt, enc_ctx->width, enc_ctx->height, PLANE_ALIGN);
+
+    if (slot_size < 0 || slot_count < 1)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot publish %s frames of %dx%d\n",
+               av_get_pix_fmt_name(enc_ctx->pix_fmt), enc_ctx->width, enc_ctx->height);
+        return AVERROR(EINVAL);
+    }
+
+    uint64_t data_offset = PAGE_ALIGN(sizeof(FrameRingHeader) + slot_count * sizeof(FrameDescriptor));
+    uint64_t aligned_slot_size = PAGE_ALIGN(slot_size);
+
+    g_map_size = data_offset + slot_count * aligned_slot_size;
+
+    // A ring a previous run left under the name is unlinked rather than
+    // truncated, a consumer still mapping it would fault on the pages cut off
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0 || ftruncate(fd, g_map_size) < 0)
+    {
+        int ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not create shared memory %s: %s\n", name, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            shm_unlink(name);
+        }
+        return ret;
+    }
+
+    void *map = mmap(NULL, g_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int ret = AVERROR(errno);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not map shared memory %s\n", name);
+        shm_unlink(name);
+        return ret;
+    }
+
+    g_name = name;
+    g_map = (uint8_t *) map;
+    g_header = (FrameRingHeader *) map;
+    g_descriptors = (FrameDescriptor *) (g_header + 1);
+    g_stream_index = stream_index;
+    g_format = enc_ctx->pix_fmt;
+    g_width = enc_ctx->width;
+    g_height = enc_ctx->height;
+    g_time_base = enc_ctx->time_base;
+
+    g_header->version = FRAME_RING_VERSION;
+    g_header->slot_count = slot_count;
+    g_header->slot_size = (uint32_t) aligned_slot_size;
+    g_header->data_offset = data_offset;
+
+    // A consumer waiting for the name to appear checks the magic last
+    __atomic_store_n(&g_header->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+
+    av_log(NULL, AV_LOG_INFO, "Publishing %s %dx%d frames to shared memory %s, %d slots of %.1f MB\n",
+           av_get_pix_fmt_name(g_format), g_width, g_height, name, slot_count, aligned_slot_size / 1048576.0);
+
+    return 0;
+}
+
+int send_frame_sink_frame(unsigned int stream_index, const AVFrame *frame)
+{
+    if (!g_header || stream_index != g_stream_index)
+        return 0;
+
+    if (frame->format != g_format || frame->width != g_width || frame->height != g_height)
+    {
+        av_log(NULL, AV_LOG_WARNING, "Frame sink: skipping a %s %dx%d frame\n",
+               av_get_pix_fmt_name((enum AVPixelFormat) frame->format), frame->width, frame->height);
+        return 0;
+    }
+
+    uint32_t seq = g_header->write_seq;
+    uint32_t read_seq;
+    int64_t start = 0;
+    int64_t last_log = 0;
+
+    // The ring is full until the consumer is done with the oldest frame
+    while (seq - (read_seq = __atomic_load_n(&g_header->read_seq, __ATOMIC_ACQUIRE)) >= g_header->slot_count)
+    {
+        int64_t now = av_gettime_relative();
+
+        if (!start)
+            start = last_log = now;
+
+        if (now - last_log >= WAIT_LOG_INTERVAL * 1000000LL)
+        {
+            av_log(NULL, AV_LOG_WARNING, "Frame sink: waiting %.0f s for the consumer of %s\n",
+                   (now - start) / 1000000.0, g_name.c_str());
+            last_log = now;
+        }
+
+        futex_wait(&g_header->read_seq, read_seq, 1);
+    }
+
+    if (start)
+        g_wait_time += av_gettime_relative() - start;
+
+    uint32_t slot = seq % g_header->slot_count;
+    uint8_t *base = g_map + g_header->data_offset + (uint64_t) slot * g_header->slot_size;
+    FrameDescriptor *desc = &g_descriptors[slot];
+    uint8_t *data[4] = {0};
+    int linesize[4] = {0};
+
+    int size = av_image_fill_arrays(data, linesize, base, g_format, g_width, g_height, PLANE_ALIGN);
+    if (size < 0)
+        return size;
+
+    av_image_copy(data, linesize, (const uint8_t **) frame->data, frame->linesize, g_format, g_width, g_height);
+
+    memset(desc, 0, sizeof(*desc));
+    desc->sequence = seq;
+    desc->format = g_format;
+    desc->width = g_width;
+    desc->height = g_height;
+    desc->pts = frame->pts;
+    desc->time_base_num = g_time_base.num;
+    desc->time_base_den = g_time_base.den;
+    desc->size = size;
+
+    for (int i = 0; i < 4 && data[i]; i++)
+    {
+        desc->plane_offset[i] = (uint32_t) (data[i] - base);
+        desc->linesize[i] = linesize[i];
+    }
+
+    __atomic_store_n(&g_header->write_seq, seq + 1, __ATOMIC_RELEASE);
+    futex_wake(&g_header->write_seq);
+
+    g_frames++;
+
+    return 0;
+}
+
+void close_frame_sink()
+{
+    if (!g_header)
+        return;
+
+    __atomic_store_n(&g_header->closed, 1, __ATOMIC_RELEASE);
+
+    // Wakes a consumer waiting for a frame, it finds the ring closed
+    futex_wake(&g_header->write_seq);
+
+    av_log(NULL, AV_LOG_INFO, "Frame sink %s: %" PRId64 " frames, waited %.2f s for the consumer\n",
+           g_name.c_str(), g_frames, g_wait_time / 1000000.0);
+
+    // A consumer that has it mapped keeps it until it is done
+    munmap(g_map, g_map_size);
+    shm_unlink(g_name.c_str());
+
+    g_map = NULL;
+    g_header = NULL;
+    g_descriptors = NULL;
+}
+
+#else
+
+int init_frame_sink(const char *name, int slot_count, unsigned int stream_index, AVCodecContext *enc_ctx)
+{
+    av_log(NULL, AV_LOG_WARNING, "The shared memory frame sink is only supported on Linux\n");
+    return 0;
+}
+
+int send_frame_sink_frame(unsigned int stream_index, const AVFrame *frame)
+{
+    return 0;
+}
+
+void close_frame_sink()
+{
+}
+
+#endif
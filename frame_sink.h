@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+/*
+ * Shared memory layout of the -frame_sink ring, for the consumer to map:
+ *
+ *   FrameRingHeader
+ *   FrameDescriptor[slot_count]
+ *   slot_count slots of slot_size bytes from data_offset, page aligned
+ *
+ * The transcoder writes frame write_seq into slot write_seq % slot_count,
+ * fills its descriptor and then bumps write_seq. The consumer reads frame
+ * read_seq in place while read_seq != write_seq, then bumps read_seq. Both
+ * counters are 32 bit futex words that wrap, compare them by difference.
+ * Whoever waits does FUTEX_WAIT on the other side's counter, whoever bumps
+ * one does FUTEX_WAKE on it, without FUTEX_PRIVATE_FLAG as the mapping is
+ * shared between processes. Once closed is set and read_seq has caught up
+ * with write_seq there are no more frames. Closing only wakes the consumer,
+ * it waits with a timeout so as not to miss it between its check and wait.
+ * Each run creates a new object under the name, a consumer of an earlier
+ * run keeps its mapping and never sees frames from the new one.
+ */
+
+#define FRAME_RING_MAGIC 0x474e5246     // "FRNG"
+#define FRAME_RING_VERSION 1
+
+typedef struct FrameRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint64_t data_offset;
+    uint32_t write_seq;             // Frames published
+    uint32_t read_seq;              // Frames the consumer is done with
+    uint32_t closed;                // No frames after write_seq
+    uint32_t reserved[9];
+} FrameRingHeader;
+
+typedef struct FrameDescriptor {
+    uint32_t sequence;              // Frame number, the write_seq it was published at
+    int32_t format;                 // AVPixelFormat
+    int32_t width;
+    int32_t height;
+    int64_t pts;                    // In time_base, AV_NOPTS_VALUE if none
+    int32_t time_base_num;
+    int32_t time_base_den;
+    uint32_t size;                  // Bytes of the slot used
+    uint32_t plane_offset[4];       // From the start of the slot
+    int32_t linesize[4];
+    uint32_t reserved[3];
+} FrameDescriptor;
+
+/**
+ * Create the POSIX shared memory object name ("/name") holding a ring of
+ * slot_count frames of the size and pixel format enc_ctx encodes, and
+ * publish the frames of stream stream_index into it. Linux only.
+ */
+int init_frame_sink(const char *name, int slot_count, unsigned int stream_index, AVCodecContext *enc_ctx);
+
+/**
+ * Copy a filtered frame on its way to the encoder into the next slot, pts
+ * in the encoder's time base. Waits while the ring is full, so a consumer
+ * that falls behind holds up the transcode rather than missing frames.
+ * Frames of other streams are ignored.
+ */
+int send_frame_sink_frame(unsigned int stream_index, const AVFrame *frame);
+
+/** Mark the ring closed, wake the consumer and remove the name. */
+void close_frame_sink();
@@ -0,0 +1,391 @@
+#include "ladder.h"
+#include "core_budget.h"
+#include "fast_scale.h"
+#include "output_io.h"
+#include "output_writer.h"
+#include "scaler.h"
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+    #include <libavutil/opt.h>
+}
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+typedef struct LadderRung {
+    int     width;
+    int     height;
+    int64_t bit_rate;           // 0 scales the source bit rate by the pixel count
+} LadderRung;
+
+typedef struct LadderOutput {
+    AVCodecContext  *enc_ctx;
+    AVFormatContext *ofmt_ctx;
+    Scaler          *scaler;
+    OutputWriter    *writer;
+    int             source;     // Rung this one is scaled from
+    bool            header_written;
+} LadderOutput;
+
+static char g_error[AV_ERROR_MAX_STRING_SIZE] = {0};
+
+static std::vector<LadderRung> g_rungs;
+
+// Index 0 stays empty, rung 0 is the video stream's own encoder
+static std::vector<LadderOutput> g_outputs;
+static int g_gop_size = 0;
+static int64_t g_frame_num = 0;
+static bool g_flushed = false;
+
+int set_ladder(const char *spec)
+{
+    g_rungs.clear();
+
+    const char *p = spec;
+    while (*p)
+    {
+        LadderRung rung = {0};
+        char *end = NULL;
+
+        rung.width = (int) strtol(p, &end, 10);
+        if (end == p || *end != 'x')
+            break;
+
+        p = end + 1;
+        rung.height = (int) strtol(p, &end, 10);
+        if (end == p)
+            break;
+
+        p = end;
+        if (*p == ':')
+        {
+            rung.bit_rate = strtoll(p + 1, &end, 10) * 1000;
+            if (end == p + 1)
+                break;
+
+            p = end;
+        }
+
+        // The rungs share the encoder's chroma subsampling
+        if (rung.width <= 0 || rung.height <= 0 || (rung.width & 1) || (rung.height & 1) ||
+            (!g_rungs.empty() && (rung.width > g_rungs.back().width || rung.height > g_rungs.back().height)))
+        {
+            av_log(NULL, AV_LOG_ERROR, "Ladder rung %dx%d must be even and no larger than the one before it\n",
+                   rung.width, rung.height);
+            g_rungs.clear();
+            return AVERROR(EINVAL);
+        }
+
+        g_rungs.push_back(rung);
+
+        if (*p == ',')
+            p++;
+        else if (*p)
+            break;
+    }
+
+    if (*p || g_rungs.empty())
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not parse the ladder \"%s\", expected WxH[:kbps],...\n", spec);
+        g_rungs.clear();
+        return AVERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+bool have_ladder()
+{
+    return !g_rungs.empty();
+}
+
+void configure_ladder_encoder(AVCodecContext *enc_ctx, int rung, int threads)
+{
+    const LadderRung &r = g_rungs[rung];
+
+    int64_t pixels = (int64_t) r.width * r.height;
+    int64_t total_pixels = 0;
+    for (size_t i = 0; i < g_rungs.size(); i++)
+        total_pixels += (int64_t) g_rungs[i].width * g_rungs[i].height;
+
+    if (r.bit_rate > 0)
+        enc_ctx->bit_rate = r.bit_rate;
+    else if (enc_ctx->width > 0 && enc_ctx->height > 0)
+        enc_ctx->bit_rate = av_rescale(enc_ctx->bit_rate, pixels, (int64_t) enc_ctx->width * enc_ctx->height);
+
+    enc_ctx->width = r.width;
+    enc_ctx->height = r.height;
+
+    // Keyframes where encode_ladder_frame() asks for them, and only there.
+    // Options the encoder does not have are left alone
+    av_opt_set(enc_ctx->priv_data, "forced-idr", "1", 0);
+    av_opt_set(enc_ctx->priv_data, "x264-params", "scenecut=0", 0);
+
+    // The rungs encode side by side, each gets threads for its share of the pixels
+    set_codec_threads(enc_ctx, enc_ctx->codec, FFMAX(1, (int) (threads * pixels / total_pixels)));
+}
+
+/** video_out.mp4 becomes video_out_720p.mp4. */
+static std::string get_rung_file(const std::string &video_file, int height)
+{
+    size_t dot = video_file.find_last_of('.');
+    size_t slash = video_file.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = video_file.size();
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "_%dp", height);
+
+    return video_file.substr(0, dot) + suffix + video_file.substr(dot);
+}
+
+static int open_rung(AVCodecContext *template_ctx, int rung, const std::string &file_name, LadderOutput &out)
+{
+    int ret;
+
+    avformat_alloc_output_context2(&out.ofmt_ctx, NULL, NULL, file_name.c_str());
+    if (!out.ofmt_ctx)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not create output context for %s\n", file_name.c_str());
+        return AVERROR_UNKNOWN;
+    }
+
+    out.enc_ctx = avcodec_alloc_context3(template_ctx->codec);
+    if (!out.enc_ctx)
+        return AVERROR(ENOMEM);
+
+    AVCodecContext *enc_ctx = out.enc_ctx;
+    enc_ctx->width = template_ctx->width;
+    enc_ctx->height = template_ctx->height;
+    enc_ctx->bit_rate = template_ctx->bit_rate;
+    enc_ctx->sample_aspect_ratio = template_ctx->sample_aspect_ratio;
+    enc_ctx->pix_fmt = template_ctx->pix_fmt;
+    enc_ctx->time_base = template_ctx->time_base;
+    enc_ctx->framerate = template_ctx->framerate;
+    enc_ctx->gop_size = template_ctx->gop_size;
+    enc_ctx->max_b_frames = template_ctx->max_b_frames;
+
+    if (out.ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    configure_ladder_encoder(enc_ctx, rung, get_core_plan()->encode);
+
+    ret = avcodec_open2(enc_ctx, enc_ctx->codec, NULL);
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open the encoder for ladder rung %dx%d: %s\n",
+               enc_ctx->width, enc_ctx->height, av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+        return ret;
+    }
+
+    AVStream *out_stream = avformat_new_stream(out.ofmt_ctx, NULL);
+    if (!out_stream)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Failed allocating output stream\n");
+        return AVERROR_UNKNOWN;
+    }
+
+    ret = avcodec_parameters_from_context(out_stream->codecpar, enc_ctx);
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters to ladder rung %dx%d\n", enc_ctx->width, enc_ctx->height);
+        return ret;
+    }
+
+    out_stream->time_base = enc_ctx->time_base;
+
+    av_dump_format(out.ofmt_ctx, 0, file_name.c_str(), 1);
+    if (!(out.ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+    {
+        ret = open_output_io(&out.ofmt_ctx->pb, file_name.c_str(), enc_ctx->bit_rate);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = avformat_write_header(out.ofmt_ctx, NULL);
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file '%s'\n", file_name.c_str());
+        return ret;
+    }
+
+    out.header_written = true;
+    return 0;
+}
+
+/** Through the rung's muxer, the trailer in close_ladder() finishes the container. */
+static int write_rung_packet(void *opaque, AVPacket *pkt)
+{
+    return av_interleaved_write_frame((AVFormatContext *) opaque, pkt);
+}
+
+static void flush_rung(void *opaque)
+{
+    avio_flush(((AVFormatContext *) opaque)->pb);
+}
+
+int init_ladder(AVCodecContext *enc_ctx, const std::string &video_file)
+{
+    int ret;
+
+    g_gop_size = FFMAX(1, enc_ctx->gop_size);
+    g_frame_num = 0;
+    g_flushed = false;
+
+    LadderOutput empty = {0};
+    g_outputs.assign(g_rungs.size(), empty);
+
+    for (int i = 1; i < (int) g_rungs.size(); i++)
+    {
+        LadderOutput &out = g_outputs[i];
+
+        std::string file_name = get_rung_file(video_file, g_rungs[i].height);
+
+        ret = open_rung(enc_ctx, i, file_name, out);
+        if (ret < 0)
+            return ret;
+
+        ret = init_output_writer(&out.writer, file_name.c_str(), write_rung_packet, flush_rung, out.ofmt_ctx);
+        if (ret < 0)
+            return ret;
+
+        // Scale from the next larger rung, unless a larger one is an exact
+        // fast path away, which is both quicker and one resampling fewer
+        out.source = i - 1;
+        for (int j = i - 1; j >= 0; j--)
+        {
+            if (find_fast_scale(g_rungs[j].width, g_rungs[j].height, enc_ctx->pix_fmt,
+                                g_rungs[i].width, g_rungs[i].height, enc_ctx->pix_fmt) != kNoFastScale)
+            {
+                out.source = j;
+                break;
+            }
+        }
+
+        ret = init_scaler(&out.scaler, g_rungs[i].width, g_rungs[i].height, enc_ctx->pix_fmt,
+                          get_core_plan()->filter);
+        if (ret < 0)
+            return ret;
+
+        av_log(NULL, AV_LOG_INFO, "Ladder rung %dx%d at %" PRId64 " b/s, scaled from %dx%d\n",
+               g_rungs[i].width, g_rungs[i].height, (int64_t) out.enc_ctx->bit_rate,
+               g_rungs[out.source].width, g_rungs[out.source].height);
+    }
+
+    return 0;
+}
+
+static int encode_rung(LadderOutput &out, AVFrame *frame)
+{
+    int ret = avcodec_send_frame(out.enc_ctx, frame);
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Error sending a frame to ladder rung %dx%d: %s\n",
+               out.enc_ctx->width, out.enc_ctx->height, av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+        return ret;
+    }
+
+    while (ret >= 0)
+    {
+        AVPacket enc_pkt = {0};
+
+        av_init_packet(&enc_pkt);
+
+        ret = avcodec_receive_packet(out.enc_ctx, &enc_pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Error during encoding of ladder rung %dx%d\n",
+                   out.enc_ctx->width, out.enc_ctx->height);
+            return ret;
+        }
+
+        // The muxer may have picked its own time base in the header
+        enc_pkt.stream_index = 0;
+        av_packet_rescale_ts(&enc_pkt, out.enc_ctx->time_base, out.ofmt_ctx->streams[0]->time_base);
+
+        ret = send_output_packet(out.writer, &enc_pkt);
+
+        av_packet_unref(&enc_pkt);
+    }
+
+    return ret;
+}
+
+int encode_ladder_frame(AVFrame *frame)
+{
+    int ret = 0;
+
+    if (!frame)
+    {
+        // flush_encoder() comes back until rung 0 runs dry, flush the rest once
+        if (g_flushed)
+            return 0;
+
+        g_flushed = true;
+        for (size_t i = 1; i < g_outputs.size() && ret >= 0; i++)
+            ret = encode_rung(g_outputs[i], NULL);
+
+        return ret;
+    }
+
+    // The same frames start a GOP on every rung, the copies made by the
+    // scalers below carry the picture type along
+    frame->pict_type = g_frame_num++ % g_gop_size == 0 ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    std::vector<AVFrame *> scaled(g_outputs.size(), NULL);
+    scaled[0] = frame;
+
+    for (size_t i = 1; i < g_outputs.size() && ret >= 0; i++)
+    {
+        LadderOutput &out = g_outputs[i];
+
+        ret = scale_frame(out.scaler, scaled[out.source], &scaled[i]);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not scale the frame for ladder rung %dx%d\n",
+                   g_rungs[i].width, g_rungs[i].height);
+            break;
+        }
+
+        ret = encode_rung(out, scaled[i]);
+    }
+
+    for (size_t i = 1; i < scaled.size(); i++)
+        av_frame_free(&scaled[i]);
+
+    return ret;
+}
+
+void close_ladder()
+{
+    for (size_t i = 1; i < g_outputs.size(); i++)
+    {
+        LadderOutput &out = g_outputs[i];
+
+        // Everything queued goes out before the trailer
+        close_output_writer(&out.writer);
+
+        if (out.ofmt_ctx)
+        {
+            if (out.header_written)
+                av_write_trailer(out.ofmt_ctx);
+
+            if (!(out.ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+                close_output_io(&out.ofmt_ctx->pb);
+
+            avformat_free_context(out.ofmt_ctx);
+        }
+
+        avcodec_free_context(&out.enc_ctx);
+        free_scaler(&out.scaler);
+    }
+
+    g_outputs.clear();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/frame.h>
+}
+
+/**
+ * Set the ABR ladder from "1920x1080:5000,1280x720:3000,640x360", largest
+ * rung first, bit rates in kb/s and optional. Rung 0 is the video stream's
+ * own encoder and output, every other rung gets an encoder and output of its
+ * own, all from the one decode.
+ */
+int set_ladder(const char *spec);
+
+bool have_ladder();
+
+/**
+ * Give a video encoder a rung's size and bit rate, keyframes only where
+ * encode_ladder_frame() forces them so the GOPs of all rungs line up, and its
+ * pixel share of threads. Call before avcodec_open2(), with rung 0 for the
+ * stream's own encoder.
+ */
+void configure_ladder_encoder(AVCodecContext *enc_ctx, int rung, int threads);
+
+/**
+ * Open encoders and outputs for the rungs after the first, with the settings
+ * of enc_ctx, the opened rung 0 encoder. Outputs are named after video_file
+ * with the rung's height added, like video_out_720p.mp4, and the packets are
+ * muxed into the container the name picks. Each rung is scaled
+ * from the next larger one, or from a larger one it is an exact 2:1 or 3:2 of.
+ */
+int init_ladder(AVCodecContext *enc_ctx, const std::string &video_file);
+
+/**
+ * Call with each frame before rung 0 encodes it: marks it a keyframe at the
+ * start of every GOP, then scales it down the ladder and encodes the other
+ * rungs. NULL flushes their encoders.
+ */
+int encode_ladder_frame(AVFrame *frame);
+
+/** Write the trailers and free the rungs' encoders, scalers and outputs. */
+void close_ladder();
@@ -0,0 +1,790 @@
+#include "loudness.h"
+
+extern "C"
+{
+    #include <libavutil/channel_layout.h>
+    #include <libavutil/common.h>
+}
+
+#include <deque>
+#include <math.h>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define HAVE_SSE2_INTRINSICS 1
+#endif
+
+// Gating blocks are built from 100 ms sub-blocks: 4 for the 400 ms momentary
+// blocks of the integrated loudness, 30 for the 3 s short-term blocks of the
+// loudness range
+#define SUBBLOCKS_PER_SECOND 10
+#define MOMENTARY_SUBBLOCKS 4
+#define SHORT_TERM_SUBBLOCKS 30
+
+#define ABSOLUTE_GATE -70.0
+#define INTEGRATED_RELATIVE_GATE -10.0
+#define RANGE_RELATIVE_GATE -20.0
+
+// Gated loudness histograms, 0.01 LU bins from the absolute gate up
+#define HISTOGRAM_STEP 0.01
+#define HISTOGRAM_BINS 8000
+
+// 4x oversampling for true peak, 48 taps in 4 phases
+#define TRUE_PEAK_PHASES 4
+#define TRUE_PEAK_TAPS 12
+
+// Gain stage
+#define LIMITER_CEILING -1.0        // dBFS sample peak, leaves headroom for inter-sample peaks
+#define LIMITER_LOOKAHEAD 0.01      // seconds
+#define LIMITER_RELEASE 0.1         // seconds
+#define GAIN_SMOOTHING 3.0          // seconds
+#define MAX_GAIN 20.0               // dB
+
+typedef struct Biquad {
+    double b0, b1, b2, a1, a2;
+} Biquad;
+
+typedef struct Histogram {
+    std::vector<uint32_t> count;
+    std::vector<double> energy;
+} Histogram;
+
+/** Streaming BS.1770 meter for one set of channels. */
+typedef struct LoudnessMeter {
+    int channels;
+    std::vector<double> weights;
+    Biquad shelf;
+    Biquad highpass;
+    std::vector<double> state;          // 4 per channel, two DF2T biquads
+
+    int subblock_size;
+    int subblock_fill;
+    double subblock_sum;
+    double subblocks[SHORT_TERM_SUBBLOCKS];
+    int64_t subblock_count;
+
+    Histogram momentary;
+    Histogram short_term;
+
+    std::vector<float> history;         // TRUE_PEAK_TAPS - 1 per channel
+    std::vector<float> scratch;
+    float true_peak;
+} LoudnessMeter;
+
+static bool g_init = false;
+static unsigned int g_stream_index = 0;
+static AVSampleFormat g_sample_fmt;
+static int g_channels = 0;
+static int g_sample_rate = 0;
+static LoudnessMeter g_input;
+
+// The taps of each phase, interleaved so one tap of all 4 phases is one vector
+static float g_true_peak_taps[TRUE_PEAK_TAPS][TRUE_PEAK_PHASES];
+
+// Gain stage, owned by the encode thread
+static bool g_normalize = false;
+static double g_target = 0;
+static LoudnessMeter g_output;
+static double g_gain = 0;               // dB
+static int g_lookahead = 0;
+static double g_release = 0;
+static double g_limit = 1.0;            // Last limiter gain before smoothing
+static std::vector<double> g_limit_window;
+static int g_limit_pos = 0;
+static double g_limit_sum = 0;
+static bool g_limit_primed = false;
+static std::vector<std::vector<float> > g_planes;
+static std::vector<const float *> g_pointers;
+static std::vector<double> g_required;
+static std::vector<float> g_gains;
+static std::deque<int> g_window;
+
+static inline double energy_to_lufs(double energy)
+{
+    return energy > 0 ? -0.691 + 10.0 * log10(energy) : -INFINITY;
+}
+
+static inline double linear_to_db(double v)
+{
+    return v > 0 ? 20.0 * log10(v) : -INFINITY;
+}
+
+/** K-weighting filter coefficients for any sample rate, after BS.1770 and libebur128. */
+static void init_k_weighting(LoudnessMeter &m, int sample_rate)
+{
+    double f0 = 1681.974450955533;
+    double G = 3.999843853973347;
+    double Q = 0.7071752369554196;
+
+    double K = tan(M_PI * f0 / sample_rate);
+    double Vh = pow(10.0, G / 20.0);
+    double Vb = pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+
+    m.shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+    m.shelf.b1 = 2.0 * (K * K - Vh) / a0;
+    m.shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+    m.shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+    m.shelf.a2 = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = tan(M_PI * f0 / sample_rate);
+    a0 = 1.0 + K / Q + K * K;
+
+    m.highpass.b0 = 1.0;
+    m.highpass.b1 = -2.0;
+    m.highpass.b2 = 1.0;
+    m.highpass.a1 = 2.0 * (K * K - 1.0) / a0;
+    m.highpass.a2 = (1.0 - K / Q + K * K) / a0;
+}
+
+/** Windowed sinc interpolator, each phase normalized to unity gain. */
+static void init_true_peak_taps()
+{
+    const int length = TRUE_PEAK_TAPS * TRUE_PEAK_PHASES;
+
+    for (int p = 0; p < TRUE_PEAK_PHASES; p++)
+    {
+        double sum = 0;
+
+        for (int k = 0; k < TRUE_PEAK_TAPS; k++)
+        {
+            int n = k * TRUE_PEAK_PHASES + p;
+            double x = (n - (length - 1) / 2.0) / TRUE_PEAK_PHASES;
+            double sinc = x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+            double window = 0.5 - 0.5 * cos(2.0 * M_PI * (n + 0.5) / length);
+
+            g_true_peak_taps[k][p] = (float) (sinc * window);
+            sum += g_true_peak_taps[k][p];
+        }
+
+        for (int k = 0; k < TRUE_PEAK_TAPS; k++)
+            g_true_peak_taps[k][p] = (float) (g_true_peak_taps[k][p] / sum);
+    }
+}
+
+static void init_meter(LoudnessMeter &m, int channels, uint64_t channel_layout, int sample_rate)
+{
+    if (!channel_layout)
+        channel_layout = av_get_default_channel_layout(channels);
+
+    m.channels = channels;
+    m.weights.resize(channels);
+
+    // LFE does not count, surrounds are weighted +1.5 dB
+    for (int ch = 0; ch < channels; ch++)
+    {
+        uint64_t channel = av_channel_layout_extract_channel(channel_layout, ch);
+
+        if (channel & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2))
+            m.weights[ch] = 0.0;
+        else if (channel & (AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT | AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT))
+            m.weights[ch] = 1.41;
+        else
+            m.weights[ch] = 1.0;
+    }
+
+    init_k_weighting(m, sample_rate);
+    m.state.assign(4 * channels, 0.0);
+
+    m.subblock_size = FFMAX(1, sample_rate / SUBBLOCKS_PER_SECOND);
+    m.subblock_fill = 0;
+    m.subblock_sum = 0;
+    m.subblock_count = 0;
+
+    m.momentary.count.assign(HISTOGRAM_BINS, 0);
+    m.momentary.energy.assign(HISTOGRAM_BINS, 0.0);
+    m.short_term.count.assign(HISTOGRAM_BINS, 0);
+    m.short_term.energy.assign(HISTOGRAM_BINS, 0.0);
+
+    m.history.assign((TRUE_PEAK_TAPS - 1) * channels, 0.0f);
+    m.true_peak = 0;
+}
+
+static void histogram_add(Histogram &h, double energy)
+{
+    double lufs = energy_to_lufs(energy);
+
+    if (!(lufs >= ABSOLUTE_GATE))
+        return;
+
+    int bin = FFMIN((int) ((lufs - ABSOLUTE_GATE) / HISTOGRAM_STEP), HISTOGRAM_BINS - 1);
+
+    h.count[bin]++;
+    h.energy[bin] += energy;
+}
+
+static inline int histogram_bin(double lufs)
+{
+    return av_clip((int) ceil((lufs - ABSOLUTE_GATE) / HISTOGRAM_STEP), 0, HISTOGRAM_BINS - 1);
+}
+
+/** Loudness of the blocks above the relative gate, optionally the gate itself. */
+static double gated_loudness(const Histogram &h, double relative_gate, int *gate_bin)
+{
+    double energy = 0;
+    uint64_t count = 0;
+
+    for (int i = 0; i < HISTOGRAM_BINS; i++)
+    {
+        energy += h.energy[i];
+        count += h.count[i];
+    }
+
+    if (!count)
+        return -INFINITY;
+
+    int start = histogram_bin(energy_to_lufs(energy / count) + relative_gate);
+
+    if (gate_bin)
+        *gate_bin = start;
+
+    energy = 0;
+    count = 0;
+
+    for (int i = start; i < HISTOGRAM_BINS; i++)
+    {
+        energy += h.energy[i];
+        count += h.count[i];
+    }
+
+    return count ? energy_to_lufs(energy / count) : -INFINITY;
+}
+
+static double integrated_loudness(const LoudnessMeter &m)
+{
+    return gated_loudness(m.momentary, INTEGRATED_RELATIVE_GATE, NULL);
+}
+
+/** EBU Tech 3342 loudness range, the 10th to 95th percentile of the gated short-term loudness. */
+static double loudness_range(const LoudnessMeter &m)
+{
+    int start = 0;
+
+    if (!isfinite(gated_loudness(m.short_term, RANGE_RELATIVE_GATE, &start)))
+        return 0;
+
+    uint64_t total = 0;
+    for (int i = start; i < HISTOGRAM_BINS; i++)
+        total += m.short_term.count[i];
+
+    if (!total)
+        return 0;
+
+    uint64_t low_rank = (uint64_t) (total * 0.10);
+    uint64_t high_rank = (uint64_t) (total * 0.95);
+    uint64_t seen = 0;
+    double low = 0, high = 0;
+    bool have_low = false;
+
+    for (int i = start; i < HISTOGRAM_BINS; i++)
+    {
+        seen += m.short_term.count[i];
+
+        if (!have_low && seen > low_rank)
+        {
+            low = ABSOLUTE_GATE + i * HISTOGRAM_STEP;
+            have_low = true;
+        }
+
+        if (seen > high_rank)
+        {
+            high = ABSOLUTE_GATE + i * HISTOGRAM_STEP;
+            break;
+        }
+    }
+
+    return high - low;
+}
+
+/** Sum of squares of n floats. */
+static double sum_squares(const float *p, int n)
+{
+    double sum = 0;
+    int i = 0;
+
+#if HAVE_SSE2_INTRINSICS
+    __m128 acc = _mm_setzero_ps();
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(p + i);
+        acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum = (double) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    for (; i < n; i++)
+        sum += p[i] * p[i];
+
+    return sum;
+}
+
+/**
+ * Peak of the 4x oversampled signal. p must be preceded by TRUE_PEAK_TAPS - 1
+ * samples of history.
+ */
+static float oversampled_peak(const float *p, int n)
+{
+    float peak = 0;
+
+#if HAVE_SSE2_INTRINSICS
+    const __m128 sign = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 taps[TRUE_PEAK_TAPS];
+    __m128 vmax = _mm_setzero_ps();
+
+    for (int k = 0; k < TRUE_PEAK_TAPS; k++)
+        taps[k] = _mm_loadu_ps(g_true_peak_taps[k]);
+
+    // All 4 phases of one input sample in one vector
+    for (int i = 0; i < n; i++)
+    {
+        __m128 acc = _mm_setzero_ps();
+
+        for (int k = 0; k < TRUE_PEAK_TAPS; k++)
+            acc = _mm_add_ps(acc, _mm_mul_ps(taps[k], _mm_set1_ps(p[i - k])));
+
+        vmax = _mm_max_ps(vmax, _mm_and_ps(acc, sign));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, vmax);
+    peak = FFMAX(FFMAX(lanes[0], lanes[1]), FFMAX(lanes[2], lanes[3]));
+#else
+    for (int i = 0; i < n; i++)
+    {
+        for (int ph = 0; ph < TRUE_PEAK_PHASES; ph++)
+        {
+            float acc = 0;
+
+            for (int k = 0; k < TRUE_PEAK_TAPS; k++)
+                acc += g_true_peak_taps[k][ph] * p[i - k];
+
+            peak = FFMAX(peak, fabsf(acc));
+        }
+    }
+#endif
+
+    return peak;
+}
+
+/** Run the K-weighting filter of one channel over count samples into out. */
+static void k_weight(LoudnessMeter &m, int ch, const float *in, float *out, int count)
+{
+    const Biquad &s = m.shelf;
+    const Biquad &h = m.highpass;
+    double *z = &m.state[4 * ch];
+
+    double z0 = z[0], z1 = z[1], z2 = z[2], z3 = z[3];
+
+    for (int i = 0; i < count; i++)
+    {
+        double x = in[i];
+        double y = s.b0 * x + z0;
+        z0 = s.b1 * x - s.a1 * y + z1;
+        z1 = s.b2 * x - s.a2 * y;
+
+        double w = h.b0 * y + z2;
+        z2 = h.b1 * y - h.a1 * w + z3;
+        z3 = h.b2 * y - h.a2 * w;
+
+        out[i] = (float) w;
+    }
+
+    z[0] = z0; z[1] = z1; z[2] = z2; z[3] = z3;
+}
+
+static void end_subblock(LoudnessMeter &m)
+{
+    m.subblocks[m.subblock_count % SHORT_TERM_SUBBLOCKS] = m.subblock_sum / m.subblock_size;
+    m.subblock_count++;
+    m.subblock_sum = 0;
+    m.subblock_fill = 0;
+
+    // A 400 ms block every 100 ms, 75% overlap
+    if (m.subblock_count >= MOMENTARY_SUBBLOCKS)
+    {
+        double energy = 0;
+        for (int i = 1; i <= MOMENTARY_SUBBLOCKS; i++)
+            energy += m.subblocks[(m.subblock_count - i) % SHORT_TERM_SUBBLOCKS];
+
+        histogram_add(m.momentary, energy / MOMENTARY_SUBBLOCKS);
+    }
+
+    // A 3 s block every 100 ms
+    if (m.subblock_count >= SHORT_TERM_SUBBLOCKS)
+    {
+        double energy = 0;
+        for (int i = 0; i < SHORT_TERM_SUBBLOCKS; i++)
+            energy += m.subblocks[i];
+
+        histogram_add(m.short_term, energy / SHORT_TERM_SUBBLOCKS);
+    }
+}
+
+/** Measure nb_samples of planar float channels. */
+static void meter_add(LoudnessMeter &m, const float **planes, int nb_samples)
+{
+    const int history = TRUE_PEAK_TAPS - 1;
+
+    if ((int) m.scratch.size() < history + nb_samples)
+        m.scratch.resize(history + nb_samples);
+
+    float *scratch = m.scratch.data();
+
+    for (int ch = 0; ch < m.channels; ch++)
+    {
+        // True peak on the unweighted signal, with the previous call's tail as history
+        float *h = &m.history[history * ch];
+
+        memcpy(scratch, h, history * sizeof(float));
+        memcpy(scratch + history, planes[ch], nb_samples * sizeof(float));
+
+        m.true_peak = FFMAX(m.true_peak, oversampled_peak(scratch + history, nb_samples));
+        memcpy(h, scratch + nb_samples, history * sizeof(float));
+    }
+
+    int offset = 0;
+
+    while (offset < nb_samples)
+    {
+        int count = FFMIN(nb_samples - offset, m.subblock_size - m.subblock_fill);
+
+        for (int ch = 0; ch < m.channels; ch++)
+        {
+            k_weight(m, ch, planes[ch] + offset, scratch, count);
+
+            if (m.weights[ch] > 0)
+                m.subblock_sum += m.weights[ch] * sum_squares(scratch, count);
+        }
+
+        offset += count;
+        m.subblock_fill += count;
+
+        if (m.subblock_fill == m.subblock_size)
+            end_subblock(m);
+    }
+}
+
+/** Read count samples of channel ch, from sample offset, as float. */
+static void load_channel(uint8_t **samples, int ch, int offset, int count, float *out)
+{
+    switch (g_sample_fmt)
+    {
+        case AV_SAMPLE_FMT_FLTP:
+            memcpy(out, (const float *) samples[ch] + offset, count * sizeof(float));
+            break;
+
+        case AV_SAMPLE_FMT_FLT:
+            for (int i = 0; i < count; i++)
+                out[i] = ((const float *) samples[0])[(offset + i) * g_channels + ch];
+            break;
+
+        case AV_SAMPLE_FMT_S16P:
+            for (int i = 0; i < count; i++)
+                out[i] = ((const int16_t *) samples[ch])[offset + i] / 32768.0f;
+            break;
+
+        case AV_SAMPLE_FMT_S16:
+            for (int i = 0; i < count; i++)
+                out[i] = ((const int16_t *) samples[0])[(offset + i) * g_channels + ch] / 32768.0f;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/** Write count float samples of channel ch back in the sample format. */
+static void store_channel(uint8_t **samples, int ch, int count, const float *in)
+{
+    switch (g_sample_fmt)
+    {
+        case AV_SAMPLE_FMT_FLTP:
+            memcpy(samples[ch], in, count * sizeof(float));
+            break;
+
+        case AV_SAMPLE_FMT_FLT:
+            for (int i = 0; i < count; i++)
+                ((float *) samples[0])[i * g_channels + ch] = in[i];
+            break;
+
+        case AV_SAMPLE_FMT_S16P:
+            for (int i = 0; i < count; i++)
+                ((int16_t *) samples[ch])[i] = av_clip_int16(lrintf(in[i] * 32768.0f));
+            break;
+
+        case AV_SAMPLE_FMT_S16:
+            for (int i = 0; i < count; i++)
+                ((int16_t *) samples[0])[i * g_channels + ch] = av_clip_int16(lrintf(in[i] * 32768.0f));
+            break;
+
+        default:
+            break;
+    }
+}
+
+/** Convert samples to the planar float scratch planes, returns them as meter input. */
+static const float **load_planes(uint8_t **samples, int nb_samples)
+{
+    for (int ch = 0; ch < g_channels; ch++)
+    {
+        if (g_sample_fmt == AV_SAMPLE_FMT_FLTP)
+        {
+            g_pointers[ch] = (const float *) samples[ch];
+            continue;
+        }
+
+        if ((int) g_planes[ch].size() < nb_samples)
+            g_planes[ch].resize(nb_samples);
+
+        load_channel(samples, ch, 0, nb_samples, g_planes[ch].data());
+        g_pointers[ch] = g_planes[ch].data();
+    }
+
+    return g_pointers.data();
+}
+
+int init_loudness(unsigned int stream_index, AVCodecContext *enc_ctx, bool normalize, double target)
+{
+    switch (enc_ctx->sample_fmt)
+    {
+        case AV_SAMPLE_FMT_FLT:
+        case AV_SAMPLE_FMT_FLTP:
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S16P:
+            break;
+
+        default:
+            av_log(NULL, AV_LOG_WARNING, "Loudness measurement does not support sample format %s\n", av_get_sample_fmt_name(enc_ctx->sample_fmt));
+            return AVERROR(ENOSYS);
+    }
+
+    g_stream_index = stream_index;
+    g_sample_fmt = enc_ctx->sample_fmt;
+    g_channels = enc_ctx->channels;
+    g_sample_rate = enc_ctx->sample_rate;
+    g_planes.resize(g_channels);
+    g_pointers.resize(g_channels);
+
+    init_true_peak_taps();
+    init_meter(g_input, g_channels, enc_ctx->channel_layout, g_sample_rate);
+
+    g_normalize = normalize;
+    g_target = target;
+
+    if (normalize)
+    {
+        init_meter(g_output, g_channels, enc_ctx->channel_layout, g_sample_rate);
+
+        g_gain = 0;
+        g_lookahead = FFMAX(1, (int) (LIMITER_LOOKAHEAD * g_sample_rate));
+        g_release = 1.0 - exp(-1.0 / (LIMITER_RELEASE * g_sample_rate));
+        g_limit = 1.0;
+        g_limit_window.assign(g_lookahead, 1.0);
+        g_limit_pos = 0;
+        g_limit_sum = g_lookahead;
+        g_limit_primed = false;
+    }
+
+    g_init = true;
+
+    return 0;
+}
+
+void measure_loudness(unsigned int stream_index, uint8_t **samples, int nb_samples)
+{
+    if (!g_init || stream_index != g_stream_index)
+        return;
+
+    meter_add(g_input, load_planes(samples, nb_samples), nb_samples);
+}
+
+int loudness_lookahead(unsigned int stream_index)
+{
+    return g_init && g_normalize && stream_index == g_stream_index ? g_lookahead : 0;
+}
+
+void apply_loudness_gain(unsigned int stream_index, AVFrame *frame, AVAudioFifo *fifo)
+{
+    if (!g_init || !g_normalize || !frame || stream_index != g_stream_index)
+        return;
+
+    // The planes and the meter are sized for the encoder's channels
+    if (frame->channels != g_channels)
+    {
+        av_log(NULL, AV_LOG_WARNING, "Loudness normalization: skipping a frame of %d channels, expected %d\n",
+               frame->channels, g_channels);
+        return;
+    }
+
+    const int n = frame->nb_samples;
+    const int L = g_lookahead;
+    const double ceiling = pow(10.0, LIMITER_CEILING / 20.0);
+
+    // Move the normalization gain towards the running integrated loudness
+    double start_gain = g_gain;
+    double integrated = integrated_loudness(g_input);
+
+    if (isfinite(integrated))
+    {
+        double wanted = av_clipd(g_target - integrated, -MAX_GAIN, MAX_GAIN);
+        g_gain += (wanted - g_gain) * (1.0 - exp(-n / (GAIN_SMOOTHING * g_sample_rate)));
+    }
+
+    double g0 = pow(10.0, start_gain / 20.0);
+    double g1 = pow(10.0, g_gain / 20.0);
+
+    // The frame and the lookahead still in the FIFO as planar float
+    int lookahead = FFMIN(L, av_audio_fifo_size(fifo));
+    int total = n + lookahead;
+
+    for (int ch = 0; ch < g_channels; ch++)
+        if ((int) g_planes[ch].size() < total)
+            g_planes[ch].resize(total);
+
+    for (int ch = 0; ch < g_channels; ch++)
+        load_channel(frame->extended_data, ch, 0, n, g_planes[ch].data());
+
+    if (lookahead > 0)
+    {
+        uint8_t *peek[AV_NUM_DATA_POINTERS] = { NULL };
+        int planes = av_sample_fmt_is_planar(g_sample_fmt) ? g_channels : 1;
+        int size = av_samples_get_buffer_size(NULL, g_channels, lookahead, g_sample_fmt, 1);
+        uint8_t *buffer = (uint8_t *) av_malloc(size);
+
+        if (buffer && planes <= AV_NUM_DATA_POINTERS)
+        {
+            av_samples_fill_arrays(peek, NULL, buffer, g_channels, lookahead, g_sample_fmt, 1);
+
+            if (av_audio_fifo_peek(fifo, (void **) peek, lookahead) == lookahead)
+            {
+                for (int ch = 0; ch < g_channels; ch++)
+                    load_channel(peek, ch, 0, lookahead, g_planes[ch].data() + n);
+            }
+            else
+                lookahead = 0;
+        }
+        else
+            lookahead = 0;
+
+        av_free(buffer);
+        total = n + lookahead;
+    }
+
+    // Limiter gain each sample needs to stay under the ceiling, past the
+    // available lookahead nothing is required
+    g_required.assign(n + L, 1.0);
+
+    for (int i = 0; i < total; i++)
+    {
+        double peak = 0;
+        for (int ch = 0; ch < g_channels; ch++)
+            peak = FFMAX(peak, (double) fabsf(g_planes[ch][i]));
+
+        double gain = i < n ? g0 + (g1 - g0) * i / n : g1;
+
+        if (peak * gain > ceiling)
+            g_required[i] = ceiling / (peak * gain);
+    }
+
+    // Minimum over the next L samples, released, then averaged over the last
+    // L samples. Every value in the average is at most the requirement of
+    // the current sample, so the ceiling holds while the gain stays smooth.
+    std::deque<int> &window = g_window;
+
+    if ((int) g_gains.size() < n)
+        g_gains.resize(n);
+
+    float *gains = g_gains.data();
+    window.clear();
+
+    for (int i = 0; i < L - 1; i++)
+    {
+        while (!window.empty() && g_required[window.back()] >= g_required[i])
+            window.pop_back();
+        window.push_back(i);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        int next = i + L - 1;
+
+        while (!window.empty() && g_required[window.back()] >= g_required[next])
+            window.pop_back();
+        window.push_back(next);
+
+        while (window.front() < i)
+            window.pop_front();
+
+        // Nothing precedes the first sample to ramp down from
+        if (!g_limit_primed)
+        {
+            g_limit = g_required[window.front()];
+            g_limit_window.assign(L, g_limit);
+            g_limit_sum = g_limit * L;
+            g_limit_primed = true;
+        }
+
+        g_limit = FFMIN(g_required[window.front()], g_limit + (1.0 - g_limit) * g_release);
+
+        g_limit_sum += g_limit - g_limit_window[g_limit_pos];
+        g_limit_window[g_limit_pos] = g_limit;
+        g_limit_pos = (g_limit_pos + 1) % L;
+
+        gains[i] = (float) ((g0 + (g1 - g0) * i / n) * g_limit_sum / L);
+    }
+
+    for (int ch = 0; ch < g_channels; ch++)
+    {
+        float *p = g_planes[ch].data();
+
+        for (int i = 0; i < n; i++)
+            p[i] *= gains[i];
+
+        store_channel(frame->extended_data, ch, n, p);
+    }
+
+    for (int ch = 0; ch < g_channels; ch++)
+        g_pointers[ch] = g_planes[ch].data();
+
+    meter_add(g_output, g_pointers.data(), n);
+}
+
+bool get_loudness_results(LoudnessResults *results)
+{
+    if (!g_init)
+        return false;
+
+    int gate_bin = 0;
+
+    results->integrated = gated_loudness(g_input.momentary, INTEGRATED_RELATIVE_GATE, &gate_bin);
+    results->threshold = isfinite(results->integrated) ? ABSOLUTE_GATE + gate_bin * HISTOGRAM_STEP : ABSOLUTE_GATE;
+    results->range = loudness_range(g_input);
+    results->true_peak = linear_to_db(g_input.true_peak);
+
+    results->normalized = g_normalize;
+    results->target = g_target;
+    results->output_integrated = g_normalize ? integrated_loudness(g_output) : results->integrated;
+    results->output_true_peak = g_normalize ? linear_to_db(g_output.true_peak) : results->true_peak;
+    results->final_gain = g_normalize ? g_gain : 0;
+
+    return true;
+}
+
+void close_loudness()
+{
+    g_init = false;
+    g_normalize = false;
+    g_planes.clear();
+    g_pointers.clear();
+    g_required.clear();
+    g_gains.clear();
+    g_window.clear();
+    g_limit_window.clear();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/audio_fifo.h>
+    #include <libavutil/frame.h>
+}
+
+typedef struct LoudnessResults {
+    double integrated;          // LUFS
+    double range;               // LU
+    double true_peak;           // dBTP
+    double threshold;           // Relative gate of the integrated loudness, LUFS
+    bool   normalized;
+    double target;              // LUFS
+    double output_integrated;   // LUFS, after the gain stage
+    double output_true_peak;    // dBTP, after the gain stage
+    double final_gain;          // dB
+} LoudnessResults;
+
+/**
+ * Start EBU R128 measurement of one audio stream, in its encoder's sample
+ * format. If normalize is set the samples read from its audio FIFO are also
+ * gain corrected towards target (LUFS) by a gain that follows the running
+ * integrated loudness, and limited with a short lookahead below -1 dBFS.
+ */
+int init_loudness(unsigned int stream_index, AVCodecContext *enc_ctx, bool normalize, double target);
+
+/**
+ * Measure converted audio samples on their way into the audio FIFO.
+ * Samples of other streams are ignored.
+ */
+void measure_loudness(unsigned int stream_index, uint8_t **samples, int nb_samples);
+
+/**
+ * Samples the gain stage needs to stay in the stream's FIFO behind the frame
+ * being read, 0 when not normalizing it.
+ */
+int loudness_lookahead(unsigned int stream_index);
+
+/**
+ * Apply the normalization gain and limiter to a frame just read from the
+ * FIFO. The lookahead is peeked from the samples left in the FIFO. Frames of
+ * other streams are left alone.
+ */
+void apply_loudness_gain(unsigned int stream_index, AVFrame *frame, AVAudioFifo *fifo);
+
+/** Returns false if no loudness was measured. */
+bool get_loudness_results(LoudnessResults *results);
+
+void close_loudness();
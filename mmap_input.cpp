@@ -0,0 +1,213 @@
+#include "mmap_input.h"
+
+extern "C"
+{
+    #include <libavutil/mem.h>
+}
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef WINDOWS
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Small, every read larger than this is copied straight out of the mapping
+#define AVIO_BUFFER_SIZE 4096
+
+// Pages asked for ahead of the read position, and how far the reads go before asking again
+#define READ_AHEAD_SIZE (32 * 1024 * 1024)
+#define READ_AHEAD_STEP (8 * 1024 * 1024)
+
+typedef struct MappedInput {
+    const uint8_t *data;
+    int64_t size;
+    int64_t pos;
+    int64_t read_ahead_end;     // End of the range last asked for
+#ifdef WINDOWS
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MappedInput;
+
+static void read_ahead(MappedInput *in)
+{
+#ifndef WINDOWS
+    // Whole pages from the one holding pos
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start = in->pos & ~(page - 1);
+    int64_t end = FFMIN(in->pos + READ_AHEAD_SIZE, in->size);
+
+    if (start < end)
+        madvise((void *) (in->data + start), end - start, MADV_WILLNEED);
+
+    in->read_ahead_end = end;
+#endif
+}
+
+static int read_mmap_input(void *opaque, uint8_t *buf, int buf_size)
+{
+    MappedInput *in = (MappedInput *) opaque;
+    int64_t len = FFMIN(buf_size, in->size - in->pos);
+
+    if (len <= 0)
+        return AVERROR_EOF;
+
+    memcpy(buf, in->data + in->pos, len);
+    in->pos += len;
+
+    if (in->pos + READ_AHEAD_SIZE - READ_AHEAD_STEP > in->read_ahead_end && in->read_ahead_end < in->size)
+        read_ahead(in);
+
+    return (int) len;
+}
+
+static int64_t seek_mmap_input(void *opaque, int64_t offset, int whence)
+{
+    MappedInput *in = (MappedInput *) opaque;
+
+    whence &= ~AVSEEK_FORCE;
+
+    if (whence == AVSEEK_SIZE)
+        return in->size;
+
+    if (whence == SEEK_CUR)
+        offset += in->pos;
+    else if (whence == SEEK_END)
+        offset += in->size;
+    else if (whence != SEEK_SET)
+        return AVERROR(EINVAL);
+
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    // Past the end reads as EOF, as with a file
+    in->pos = offset;
+
+    if (in->pos < in->size)
+        read_ahead(in);
+
+    return offset;
+}
+
+static void unmap_input(MappedInput *in)
+{
+#ifdef WINDOWS
+    if (in->data)
+        UnmapViewOfFile(in->data);
+    if (in->mapping)
+        CloseHandle(in->mapping);
+    if (in->file != INVALID_HANDLE_VALUE)
+        CloseHandle(in->file);
+#else
+    if (in->data)
+        munmap((void *) in->data, in->size);
+#endif
+
+    av_free(in);
+}
+
+static int map_input(MappedInput *in, const char *file_name)
+{
+#ifdef WINDOWS
+    LARGE_INTEGER size;
+
+    in->file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (in->file == INVALID_HANDLE_VALUE)
+        return AVERROR(ENOENT);
+
+    if (GetFileType(in->file) != FILE_TYPE_DISK || !GetFileSizeEx(in->file, &size) || size.QuadPart <= 0)
+        return AVERROR(EINVAL);
+
+    in->size = size.QuadPart;
+
+    in->mapping = CreateFileMappingA(in->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!in->mapping)
+        return AVERROR(ENOMEM);
+
+    in->data = (const uint8_t *) MapViewOfFile(in->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!in->data)
+        return AVERROR(ENOMEM);
+#else
+    struct stat st;
+    int fd = open(file_name, O_RDONLY);
+
+    if (fd < 0)
+        return AVERROR(errno);
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    {
+        close(fd);
+        return AVERROR(EINVAL);
+    }
+
+    in->size = st.st_size;
+
+    // The mapping holds its own reference to the file
+    void *data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int ret = AVERROR(errno);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return ret;
+
+    in->data = (const uint8_t *) data;
+
+    madvise(data, in->size, MADV_SEQUENTIAL);
+    read_ahead(in);
+#endif
+
+    return 0;
+}
+
+int open_mmap_input(AVIOContext **pb, const char *file_name)
+{
+    MappedInput *in = (MappedInput *) av_mallocz(sizeof(MappedInput));
+
+    *pb = NULL;
+
+    if (!in)
+        return AVERROR(ENOMEM);
+
+#ifdef WINDOWS
+    in->file = INVALID_HANDLE_VALUE;
+#endif
+
+    int ret = map_input(in, file_name);
+    if (ret < 0)
+    {
+        unmap_input(in);
+        return ret;
+    }
+
+    uint8_t *buffer = (uint8_t *) av_malloc(AVIO_BUFFER_SIZE);
+
+    if (buffer)
+        *pb = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, in, read_mmap_input, NULL, seek_mmap_input);
+
+    if (!*pb)
+    {
+        av_free(buffer);
+        unmap_input(in);
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+void close_mmap_input(AVIOContext **pb)
+{
+    if (!*pb)
+        return;
+
+    unmap_input((MappedInput *) (*pb)->opaque);
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
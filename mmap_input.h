@@ -0,0 +1,21 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavformat/avio.h>
+}
+
+/**
+ * Map a local file into memory and read it through an AVIOContext, for
+ * avformat_open_input with AVFMT_FLAG_CUSTOM_IO. Reads are copies out of
+ * the mapping, no system calls, and the packet payloads larger than the
+ * small AVIO buffer are copied straight into the packets. The kernel is told
+ * the file is read front to back and the pages ahead of the read position,
+ * or of where a seek lands, are asked for early. Seeks are free, so an MP4
+ * with its moov at the end costs nothing extra. Fails for anything other than
+ * a regular file, the caller opens those as usual. The file must not shrink
+ * while it is mapped.
+ */
+int open_mmap_input(AVIOContext **pb, const char *file_name);
+
+void close_mmap_input(AVIOContext **pb);
@@ -0,0 +1,309 @@
+#include "muxer.h"
+#include "output_io.h"
+#include "output_writer.h"
+
+extern "C"
+{
+    #include <libavutil/avstring.h>
+    #include <libavutil/dict.h>
+    #include <libavutil/opt.h>
+}
+
+#include <string>
+#include <vector>
+
+// Longest the interleaver holds packets back waiting for another stream, in microseconds
+#define MAX_INTERLEAVE_DELTA 1000000
+
+typedef struct MuxOutput {
+    AVFormatContext *ctx;
+    std::string     file_name;
+    bool            fragmented;
+    bool            pipe;               // Not seekable, written through the pipe protocol
+    bool            header_written;
+    std::vector<AVBSFContext *> bsfs;   // Parameter sets in front of keyframes, by output stream
+    OutputWriter    *writer;
+    bool            failed;             // Only touched by the thread that queues the packets
+} MuxOutput;
+
+static char g_error[AV_ERROR_MAX_STRING_SIZE] = {0};
+
+static std::vector<MuxOutput *> g_mux_outputs;
+
+// Output stream of each input stream, -1 for none, the same in every output
+static std::vector<int> g_mux_streams;
+
+int add_muxer_output(const char *file_name, const char *format_name, bool fragmented)
+{
+    MuxOutput *out = new MuxOutput();
+
+    out->file_name = file_name;
+    out->pipe = av_strstart(file_name, "pipe:", NULL);
+    out->fragmented = fragmented || out->pipe;
+    g_mux_outputs.push_back(out);
+
+    avformat_alloc_output_context2(&out->ctx, NULL, format_name, file_name);
+    if (!out->ctx)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not create output context for %s\n", file_name);
+        return AVERROR_UNKNOWN;
+    }
+
+    out->ctx->max_interleave_delta = MAX_INTERLEAVE_DELTA;
+
+    return 0;
+}
+
+bool have_muxer()
+{
+    return !g_mux_outputs.empty();
+}
+
+bool muxer_needs_global_header()
+{
+    for (size_t i = 0; i < g_mux_outputs.size(); i++)
+    {
+        if (g_mux_outputs[i]->ctx->oformat->flags & AVFMT_GLOBALHEADER)
+            return true;
+    }
+
+    return false;
+}
+
+int add_mux_stream(unsigned int stream_index, AVCodecContext *enc_ctx)
+{
+    int index = -1;
+
+    for (size_t i = 0; i < g_mux_outputs.size(); i++)
+    {
+        AVStream *out_stream = avformat_new_stream(g_mux_outputs[i]->ctx, NULL);
+        if (!out_stream)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Failed allocating output stream\n");
+            return AVERROR_UNKNOWN;
+        }
+
+        int ret = avcodec_parameters_from_context(out_stream->codecpar, enc_ctx);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters to output stream #%u\n", stream_index);
+            return ret;
+        }
+
+        out_stream->time_base = enc_ctx->time_base;
+        index = out_stream->index;
+    }
+
+    if (g_mux_streams.size() <= stream_index)
+        g_mux_streams.resize(stream_index + 1, -1);
+
+    g_mux_streams[stream_index] = index;
+
+    return 0;
+}
+
+/**
+ * Containers without global headers need the parameter sets in the stream.
+ * The encoders only put them in the extradata when another output wants
+ * global headers.
+ */
+static int init_output_bsfs(MuxOutput *out)
+{
+    out->bsfs.assign(out->ctx->nb_streams, NULL);
+
+    if (out->ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        return 0;
+
+    for (unsigned int i = 0; i < out->ctx->nb_streams; i++)
+    {
+        AVStream *st = out->ctx->streams[i];
+        int ret;
+
+        if (st->codecpar->codec_type != AVMEDIA_TYPE_VIDEO || st->codecpar->extradata_size <= 0)
+            continue;
+
+        const AVBitStreamFilter *filter = av_bsf_get_by_name("dump_extra");
+        if (!filter)
+            return AVERROR_BSF_NOT_FOUND;
+
+        if ((ret = av_bsf_alloc(filter, &out->bsfs[i])) < 0 ||
+            (ret = avcodec_parameters_copy(out->bsfs[i]->par_in, st->codecpar)) < 0)
+            return ret;
+
+        out->bsfs[i]->time_base_in = st->time_base;
+
+        if ((ret = av_bsf_init(out->bsfs[i])) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/** Runs on the output's writer thread, the packet is in the output stream's time base. */
+static int write_mux_packet(void *opaque, AVPacket *pkt)
+{
+    MuxOutput *out = (MuxOutput *) opaque;
+    AVBSFContext *bsf = out->bsfs[pkt->stream_index];
+    int ret;
+
+    if (!bsf)
+        return av_interleaved_write_frame(out->ctx, pkt);
+
+    if ((ret = av_bsf_send_packet(bsf, pkt)) < 0)
+        return ret;
+
+    while ((ret = av_bsf_receive_packet(bsf, pkt)) >= 0)
+    {
+        if ((ret = av_interleaved_write_frame(out->ctx, pkt)) < 0)
+            return ret;
+    }
+
+    return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+static void flush_mux_output(void *opaque)
+{
+    MuxOutput *out = (MuxOutput *) opaque;
+
+    if (out->ctx->pb)
+        avio_flush(out->ctx->pb);
+}
+
+static int start_output(MuxOutput *out)
+{
+    AVDictionary *opts = NULL;
+    int ret;
+
+    av_dump_format(out->ctx, 0, out->file_name.c_str(), 1);
+
+    if (out->pipe)
+    {
+        ret = avio_open(&out->ctx->pb, out->file_name.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not open output '%s'\n", out->file_name.c_str());
+            return ret;
+        }
+    }
+    else if (!(out->ctx->oformat->flags & AVFMT_NOFILE))
+    {
+        int64_t bit_rate = 0;
+
+        for (unsigned int i = 0; i < out->ctx->nb_streams; i++)
+            bit_rate += out->ctx->streams[i]->codecpar->bit_rate;
+
+        if ((ret = open_output_io(&out->ctx->pb, out->file_name.c_str(), bit_rate)) < 0)
+            return ret;
+    }
+
+    // A fragment starts at every video keyframe, each one self-contained.
+    // Only the MP4 family muxers have movflags
+    if (out->fragmented &&
+        out->ctx->oformat->priv_class &&
+        av_opt_find((void *) &out->ctx->oformat->priv_class, "movflags", NULL, 0, AV_OPT_SEARCH_FAKE_OBJ))
+        av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+
+    ret = avformat_write_header(out->ctx, &opts);
+    av_dict_free(&opts);
+
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file '%s': %s\n", out->file_name.c_str(), av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+        return ret;
+    }
+
+    out->header_written = true;
+
+    // The muxer has settled on its time bases, the bitstream filters go by them
+    if ((ret = init_output_bsfs(out)) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not set up the parameter sets for %s\n", out->file_name.c_str());
+        return ret;
+    }
+
+    return init_output_writer(&out->writer, out->file_name.c_str(), write_mux_packet, flush_mux_output, out);
+}
+
+int start_muxer()
+{
+    for (size_t i = 0; i < g_mux_outputs.size(); i++)
+    {
+        int ret = start_output(g_mux_outputs[i]);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int mux_packet(const AVPacket *pkt, unsigned int stream_index, AVRational time_base)
+{
+    int ret = 0;
+    int written = 0;
+
+    if (stream_index >= g_mux_streams.size() || g_mux_streams[stream_index] < 0)
+        return 0;
+
+    for (size_t i = 0; i < g_mux_outputs.size(); i++)
+    {
+        MuxOutput *out = g_mux_outputs[i];
+
+        if (out->failed)
+            continue;
+
+        // Shares the encoder's buffer, only the packet fields are copied
+        AVPacket copy = {0};
+
+        av_init_packet(&copy);
+
+        if ((ret = av_packet_ref(&copy, pkt)) < 0)
+            return ret;
+
+        copy.stream_index = g_mux_streams[stream_index];
+        av_packet_rescale_ts(&copy, time_base, out->ctx->streams[copy.stream_index]->time_base);
+
+        ret = send_output_packet(out->writer, &copy);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "%s failed, leaving it out\n", out->file_name.c_str());
+            out->failed = true;
+            continue;
+        }
+
+        written++;
+    }
+
+    return written ? 0 : (ret < 0 ? ret : AVERROR(EIO));
+}
+
+void close_muxer()
+{
+    for (size_t i = 0; i < g_mux_outputs.size(); i++)
+    {
+        MuxOutput *out = g_mux_outputs[i];
+
+        // Everything queued is in, then out with what the interleaver still holds
+        int ret = close_output_writer(&out->writer);
+
+        for (size_t j = 0; j < out->bsfs.size(); j++)
+            av_bsf_free(&out->bsfs[j]);
+
+        if (out->ctx)
+        {
+            if (out->header_written && ret >= 0)
+                av_write_trailer(out->ctx);
+
+            if (out->pipe)
+                avio_closep(&out->ctx->pb);
+            else if (!(out->ctx->oformat->flags & AVFMT_NOFILE))
+                close_output_io(&out->ctx->pb);
+
+            avformat_free_context(out->ctx);
+        }
+
+        delete out;
+    }
+
+    g_mux_outputs.clear();
+    g_mux_streams.clear();
+}
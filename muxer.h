@@ -0,0 +1,45 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+/**
+ * Add a container output for every transcoded stream: the single output of
+ * -m and each -tee output. The container goes by format_name, or by the file
+ * name when NULL. fragmented writes MP4 family outputs as fragmented MP4: an
+ * empty moov up front and a moof/mdat pair per video GOP as it goes, so the
+ * file is playable while it grows and needs neither a moov rewrite nor a
+ * faststart pass at the end. A "pipe:" file name writes to that descriptor,
+ * flushed after every batch of packets; MP4 there is always fragmented.
+ */
+int add_muxer_output(const char *file_name, const char *format_name, bool fragmented);
+
+bool have_muxer();
+
+/** True if the encoders must be opened with AV_CODEC_FLAG_GLOBAL_HEADER for any of the outputs. */
+bool muxer_needs_global_header();
+
+/** Add an output stream for input stream stream_index to every output, with the parameters of the opened encoder. */
+int add_mux_stream(unsigned int stream_index, AVCodecContext *enc_ctx);
+
+/**
+ * Open the files, write the headers and start a writer thread per output,
+ * once all the streams are added.
+ */
+int start_muxer();
+
+/**
+ * Queue a reference to a packet of input stream stream_index, timestamps in
+ * time_base, for every output. Each output's thread interleaves its packets,
+ * holding them back no longer than about a second for the other streams to
+ * catch up, and writes them. A slow output only holds up the encoder once its
+ * queue is full, an output that failed is left out from then on. Fails once
+ * every output has.
+ */
+int mux_packet(const AVPacket *pkt, unsigned int stream_index, AVRational time_base);
+
+/** Write out the queued packets and the trailers, stop the threads and close the outputs. */
+void close_muxer();
@@ -0,0 +1,325 @@
+#include "output_io.h"
+#include "ffmpeg_transcoder.h"
+
+extern "C"
+{
+    #include <libavutil/mem.h>
+}
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+
+#ifdef WINDOWS
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+// Alignment of the blocks in memory and in the file, a multiple of the
+// logical block size of the disks direct I/O goes to
+#define BLOCK_ALIGN 4096
+
+// Size of the buffer the muxers write into, handed on when full or flushed
+#define AVIO_BUFFER_SIZE 65536
+
+// Headroom on the estimated size, the rest is trimmed at close
+#define PREALLOCATE_MARGIN 1.1
+
+extern Options g_options;
+
+typedef struct OutputIO {
+    int fd;
+    std::string file_name;
+    uint8_t *block_alloc;
+    uint8_t *block;             // BLOCK_ALIGN aligned
+    int64_t block_size;
+    int64_t block_pos;          // File offset of block[0]
+    int64_t block_fill;
+    int64_t size;               // End of the data written, the preallocation aside
+    int64_t preallocated;
+    bool direct;                // O_DIRECT, dropped at the first write that is not aligned
+    bool drop_cache;            // No O_DIRECT on this file system, drop the pages once written
+    int64_t writes;
+} OutputIO;
+
+static double g_duration = 0;
+
+void set_output_duration(double seconds)
+{
+    g_duration = seconds;
+}
+
+static int write_at(OutputIO *io, const uint8_t *buf, int64_t len, int64_t pos)
+{
+#ifdef WINDOWS
+    if (_lseeki64(io->fd, pos, SEEK_SET) < 0)
+        return AVERROR(errno);
+
+    while (len > 0)
+    {
+        int n = _write(io->fd, buf, (unsigned int) FFMIN(len, INT_MAX));
+        if (n < 0)
+            return AVERROR(errno);
+
+        buf += n;
+        len -= n;
+    }
+#else
+#ifdef LINUX
+    int64_t start = pos;
+#endif
+
+#ifdef O_DIRECT
+    if (io->direct && ((pos | len) & (BLOCK_ALIGN - 1)))
+    {
+        fcntl(io->fd, F_SETFL, fcntl(io->fd, F_GETFL) & ~O_DIRECT);
+        io->direct = false;
+    }
+#endif
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(io->fd, buf, len, pos);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+
+        buf += n;
+        len -= n;
+        pos += n;
+    }
+
+#ifdef LINUX
+    // Written back and out of the cache before the next block goes in
+    if (io->drop_cache)
+    {
+        sync_file_range(io->fd, start, pos - start,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(io->fd, start, pos - start, POSIX_FADV_DONTNEED);
+    }
+#endif
+#endif
+
+    io->writes++;
+    return 0;
+}
+
+/**
+ * Write the buffered blocks. Unless all, the bytes past the last aligned
+ * offset stay in the buffer for the next block.
+ */
+static int write_blocks(OutputIO *io, bool all)
+{
+    int64_t len = io->block_fill;
+
+    if (!all)
+        len = ((io->block_pos + io->block_fill) & ~(int64_t) (BLOCK_ALIGN - 1)) - io->block_pos;
+
+    if (len <= 0)
+        return 0;
+
+    int ret = write_at(io, io->block, len, io->block_pos);
+    if (ret < 0)
+        return ret;
+
+    memmove(io->block, io->block + len, io->block_fill - len);
+    io->block_pos += len;
+    io->block_fill -= len;
+
+    return 0;
+}
+
+static int write_output_io(void *opaque, uint8_t *buf, int buf_size)
+{
+    OutputIO *io = (OutputIO *) opaque;
+
+    while (buf_size > 0)
+    {
+        int len = (int) FFMIN(buf_size, io->block_size - io->block_fill);
+
+        memcpy(io->block + io->block_fill, buf, len);
+        io->block_fill += len;
+        buf += len;
+        buf_size -= len;
+
+        if (io->block_fill == io->block_size)
+        {
+            int ret = write_blocks(io, false);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    io->size = FFMAX(io->size, io->block_pos + io->block_fill);
+
+    return 0;
+}
+
+/** The MP4 muxer seeks back to patch sizes, the buffer goes out first and starts over at the new offset. */
+static int64_t seek_output_io(void *opaque, int64_t offset, int whence)
+{
+    OutputIO *io = (OutputIO *) opaque;
+    int64_t pos = io->block_pos + io->block_fill;
+
+    whence &= ~AVSEEK_FORCE;
+
+    if (whence == AVSEEK_SIZE)
+        return io->size;
+
+    if (whence == SEEK_CUR)
+        offset += pos;
+    else if (whence == SEEK_END)
+        offset += io->size;
+    else if (whence != SEEK_SET)
+        return AVERROR(EINVAL);
+
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    if (offset == pos)
+        return pos;
+
+    int ret = write_blocks(io, true);
+    if (ret < 0)
+        return ret;
+
+    io->block_pos = offset;
+
+    return offset;
+}
+
+static void preallocate(OutputIO *io, int64_t bit_rate)
+{
+    int64_t estimate = (int64_t) (bit_rate / 8 * g_duration * PREALLOCATE_MARGIN);
+
+    if (estimate < io->block_size)
+        return;
+
+#if defined(LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+    // The file keeps its size, a transcode that dies leaves no zeros behind.
+    // Unlike posix_fallocate this never falls back to writing the zeros
+    if (fallocate(io->fd, FALLOC_FL_KEEP_SIZE, 0, estimate) < 0)
+    {
+        av_log(NULL, AV_LOG_VERBOSE, "Could not preallocate %" PRId64 " bytes for %s: %s\n",
+               estimate, io->file_name.c_str(), strerror(errno));
+        return;
+    }
+
+    io->preallocated = estimate;
+#endif
+}
+
+static void free_output_io(OutputIO *io)
+{
+    if (io->fd >= 0)
+    {
+#ifdef WINDOWS
+        _close(io->fd);
+#else
+        close(io->fd);
+#endif
+    }
+
+    av_free(io->block_alloc);
+    delete io;
+}
+
+int open_output_io(AVIOContext **pb, const char *file_name, int64_t bit_rate)
+{
+    OutputIO *io = new OutputIO();
+
+    *pb = NULL;
+    io->fd = -1;
+    io->file_name = file_name;
+    io->block_size = FFMAX(g_options.output_buffer + BLOCK_ALIGN - 1, BLOCK_ALIGN) & ~(int64_t) (BLOCK_ALIGN - 1);
+
+#ifdef WINDOWS
+    io->fd = _open(file_name, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+#ifdef O_DIRECT
+    if (g_options.direct_io)
+    {
+        io->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+        io->direct = io->fd >= 0;
+    }
+#endif
+
+    if (io->fd < 0)
+    {
+        io->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        io->drop_cache = g_options.direct_io;
+    }
+#endif
+
+    if (io->fd < 0)
+    {
+        int ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not open output file '%s': %s\n", file_name, strerror(errno));
+        free_output_io(io);
+        return ret;
+    }
+
+    io->block_alloc = (uint8_t *) av_malloc(io->block_size + BLOCK_ALIGN);
+    uint8_t *avio_buffer = (uint8_t *) av_malloc(AVIO_BUFFER_SIZE);
+
+    if (io->block_alloc)
+        io->block = (uint8_t *) (((uintptr_t) io->block_alloc + BLOCK_ALIGN - 1) & ~(uintptr_t) (BLOCK_ALIGN - 1));
+
+    if (avio_buffer && io->block)
+        *pb = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, io, NULL, write_output_io, seek_output_io);
+
+    if (!*pb)
+    {
+        av_free(avio_buffer);
+        free_output_io(io);
+        return AVERROR(ENOMEM);
+    }
+
+    if (bit_rate > 0 && g_duration > 0)
+        preallocate(io, bit_rate);
+
+    return 0;
+}
+
+int close_output_io(AVIOContext **pb)
+{
+    if (!*pb)
+        return 0;
+
+    OutputIO *io = (OutputIO *) (*pb)->opaque;
+
+    avio_flush(*pb);
+
+    int ret = (*pb)->error;
+
+    if (ret >= 0)
+        ret = write_blocks(io, true);
+
+#ifndef WINDOWS
+    // Give back what the estimate allocated past the end
+    if (io->preallocated > io->size && ftruncate(io->fd, io->size) < 0 && ret >= 0)
+        ret = AVERROR(errno);
+#endif
+
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not write to %s\n", io->file_name.c_str());
+    else
+        av_log(NULL, AV_LOG_VERBOSE, "%s: %.1f MB in %" PRId64 " writes of up to %.1f MB, %.1f MB preallocated%s\n",
+               io->file_name.c_str(), io->size / 1048576.0, io->writes, io->block_size / 1048576.0,
+               io->preallocated / 1048576.0, g_options.direct_io ? (io->drop_cache ? ", page cache dropped" : ", direct") : "");
+
+    free_output_io(io);
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+
+    return ret;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavformat/avio.h>
+}
+
+/** Seconds of output the transcode will write, for the preallocation estimate. 0 if not known. */
+void set_output_duration(double seconds);
+
+/**
+ * Open an output file for writing through a large block buffer of
+ * -output_buffer bytes. The muxers' small writes and flushes are gathered
+ * into blocks aligned to the file system's, which only go to the file once
+ * full, at a seek or at close. bit_rate and the duration estimate the file's
+ * size, that much space is allocated up front so the file lies in few
+ * extents. With -direct_io the blocks bypass the page cache.
+ */
+int open_output_io(AVIOContext **pb, const char *file_name, int64_t bit_rate);
+
+/**
+ * Write what is buffered, trim the preallocated space to what was written
+ * and close the file. Returns the error a write failed with, if any.
+ */
+int close_output_io(AVIOContext **pb);
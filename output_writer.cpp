@@ -0,0 +1,221 @@
+#include "output_writer.h"
+#include "ffmpeg_transcoder.h"
+
+extern "C"
+{
+    #include <libavutil/time.h>
+}
+
+#include <deque>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <string>
+
+// A batch taking longer than this is logged, in microseconds
+#define SLOW_WRITE_TIME 100000
+
+extern Options g_options;
+
+struct OutputWriter {
+    std::string name;
+    WriteOutputPacket write;
+    FlushOutput flush;
+    void *opaque;
+
+    std::deque<AVPacket *> queue;
+    int64_t queued_bytes;           // Queued and being written
+    bool eof;
+    int error;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            // Signalled on every change to the queue
+    pthread_t thread;
+    bool thread_started;
+
+    // Stats
+    int64_t packets;
+    int64_t bytes;
+    int64_t batches;
+    int64_t write_time;
+    int64_t max_write_time;
+    int64_t max_queued_bytes;
+    size_t max_queued_packets;
+    int64_t wait_time;              // The encoder waiting for room
+};
+
+static void *output_writer_thread_proc(void *arg)
+{
+    OutputWriter *w = (OutputWriter *) arg;
+    std::deque<AVPacket *> batch;
+
+    pthread_mutex_lock(&w->mutex);
+
+    while (1)
+    {
+        while (w->queue.empty() && !w->eof)
+            pthread_cond_wait(&w->cond, &w->mutex);
+
+        if (w->queue.empty())
+            break;
+
+        batch.swap(w->queue);
+        pthread_mutex_unlock(&w->mutex);
+
+        int64_t start = av_gettime_relative();
+        int64_t batch_bytes = 0;
+
+        // Once a write has failed the rest are only freed, only this thread sets the error
+        int ret = w->error;
+
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            batch_bytes += batch[i]->size;
+
+            if (ret >= 0)
+                ret = w->write(w->opaque, batch[i]);
+
+            av_packet_free(&batch[i]);
+        }
+
+        if (ret >= 0 && w->flush)
+            w->flush(w->opaque);
+
+        int64_t time = av_gettime_relative() - start;
+
+        if (time > SLOW_WRITE_TIME)
+            av_log(NULL, AV_LOG_VERBOSE, "%s: writing %" PRId64 " bytes took %.1f ms\n",
+                   w->name.c_str(), batch_bytes, time / 1000.0);
+
+        pthread_mutex_lock(&w->mutex);
+
+        w->packets += batch.size();
+        w->bytes += batch_bytes;
+        w->batches++;
+        w->write_time += time;
+        w->max_write_time = FFMAX(w->max_write_time, time);
+        w->queued_bytes -= batch_bytes;
+
+        if (ret < 0 && !w->error)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not write to %s\n", w->name.c_str());
+            w->error = ret;
+        }
+
+        batch.clear();
+        pthread_cond_broadcast(&w->cond);
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+int init_output_writer(OutputWriter **writer, const char *name,
+                       WriteOutputPacket write, FlushOutput flush, void *opaque)
+{
+    OutputWriter *w = new OutputWriter();
+
+    w->name = name;
+    w->write = write;
+    w->flush = flush;
+    w->opaque = opaque;
+
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    *writer = w;
+
+    int ret = pthread_create(&w->thread, NULL, output_writer_thread_proc, w);
+    if (ret)
+    {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        return AVERROR(ret);
+    }
+
+    w->thread_started = true;
+    return 0;
+}
+
+int send_output_packet(OutputWriter *w, AVPacket *pkt)
+{
+    AVPacket *queued = av_packet_alloc();
+
+    if (!queued)
+    {
+        av_packet_unref(pkt);
+        return AVERROR(ENOMEM);
+    }
+
+    av_packet_move_ref(queued, pkt);
+
+    pthread_mutex_lock(&w->mutex);
+
+    // A packet larger than the whole buffer still goes once the queue is empty
+    if (!w->error && w->queued_bytes > 0 && w->queued_bytes + queued->size > g_options.write_buffer)
+    {
+        int64_t start = av_gettime_relative();
+
+        while (!w->error && w->queued_bytes > 0 && w->queued_bytes + queued->size > g_options.write_buffer)
+            pthread_cond_wait(&w->cond, &w->mutex);
+
+        w->wait_time += av_gettime_relative() - start;
+    }
+
+    int ret = w->error;
+
+    if (ret >= 0)
+    {
+        w->queued_bytes += queued->size;
+        w->queue.push_back(queued);
+        w->max_queued_bytes = FFMAX(w->max_queued_bytes, w->queued_bytes);
+        w->max_queued_packets = FFMAX(w->max_queued_packets, w->queue.size());
+        queued = NULL;
+
+        pthread_cond_broadcast(&w->cond);
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+
+    av_packet_free(&queued);
+
+    return ret;
+}
+
+int close_output_writer(OutputWriter **writer)
+{
+    OutputWriter *w = *writer;
+
+    if (!w)
+        return 0;
+
+    if (w->thread_started)
+    {
+        pthread_mutex_lock(&w->mutex);
+        w->eof = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+
+        pthread_join(w->thread, NULL);
+    }
+
+    if (w->batches)
+        av_log(NULL, AV_LOG_INFO,
+               "%s: %" PRId64 " packets, %.1f MB in %" PRId64 " batches, write latency avg %.1f ms max %.1f ms, "
+               "queue max %.1f MB in %u packets, encoder waited %.2f s\n",
+               w->name.c_str(), w->packets, w->bytes / 1048576.0, w->batches,
+               w->write_time / 1000.0 / w->batches, w->max_write_time / 1000.0,
+               w->max_queued_bytes / 1048576.0, (unsigned) w->max_queued_packets, w->wait_time / 1000000.0);
+
+    for (size_t i = 0; i < w->queue.size(); i++)
+        av_packet_free(&w->queue[i]);
+
+    int ret = w->error;
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    delete w;
+    *writer = NULL;
+
+    return ret;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+typedef struct OutputWriter OutputWriter;
+
+/** Writes one packet to the output, a negative AVERROR stops the writer. */
+typedef int (*WriteOutputPacket)(void *opaque, AVPacket *pkt);
+
+/** Pushes the buffered bytes of the output out after a batch of packets. */
+typedef void (*FlushOutput)(void *opaque);
+
+/**
+ * Start a thread that writes the packets of one output off the encode
+ * thread, so a slow write only holds up the encoder once the output has
+ * fallen -write_buffer bytes behind. Whatever is queued when the thread gets
+ * to it is written as one batch, then flushed. name is for the log.
+ */
+int init_output_writer(OutputWriter **writer, const char *name,
+                       WriteOutputPacket write, FlushOutput flush, void *opaque);
+
+/**
+ * Queue a packet, taking its reference. Waits while the queue holds more
+ * than -write_buffer bytes. Fails once a write has failed.
+ */
+int send_output_packet(OutputWriter *writer, AVPacket *pkt);
+
+/**
+ * Write what is queued, stop the thread and log the write latency and queue
+ * depth. Returns the error a write failed with, if any.
+ */
+int close_output_writer(OutputWriter **writer);
@@ -0,0 +1,505 @@
+#include "quality.h"
+
+extern "C"
+{
+    #include <libavutil/pixdesc.h>
+}
+
+#include <math.h>
+#include <stdio.h>
+#include <deque>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define HAVE_SSE2_INTRINSICS 1
+#endif
+
+#define QUALITY_FILE "quality.json"
+
+// PSNR reported for identical planes instead of infinity
+#define MAX_PSNR 100.0
+
+static char g_error[AV_ERROR_MAX_STRING_SIZE] = {0};
+
+static unsigned int g_stream_index = 0;
+static AVCodecContext *g_recon_ctx = NULL;
+static AVFrame *g_recon_frame = NULL;
+static std::deque<AVFrame *> g_source_frames;
+static FILE *g_quality_file = NULL;
+
+// Aggregates
+static int g_scored_frames = 0;
+static double g_total_sse[3] = {0};
+static double g_total_samples[3] = {0};
+static int g_ssim_frames = 0;
+static double g_total_ssim = 0;
+static double g_min_ssim = 1.0;
+static bool g_pts_mismatch_logged = false;
+static int g_depth = 8;
+
+/** Sum of squared differences of one row of 8 bit samples. */
+static uint64_t sse_row_8(const uint8_t *a, const uint8_t *b, int w)
+{
+    uint64_t sse = 0;
+    int x = 0;
+
+#if HAVE_SSE2_INTRINSICS
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+
+    for (; x + 16 <= w; x += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + x));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + x));
+
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+
+        // A lane gains at most 4 * 255^2 per step, no overflow for any sane row width
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    sse += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    for (; x < w; x++)
+    {
+        int d = a[x] - b[x];
+        sse += d * d;
+    }
+
+    return sse;
+}
+
+/** Sum of squared differences of one row of high bit depth samples. */
+static uint64_t sse_row_16(const uint16_t *a, const uint16_t *b, int w)
+{
+    uint64_t sse = 0;
+
+    for (int x = 0; x < w; x++)
+    {
+        int64_t d = (int) a[x] - (int) b[x];
+        sse += d * d;
+    }
+
+    return sse;
+}
+
+static uint64_t sse_plane(const uint8_t *a, int as, const uint8_t *b, int bs, int w, int h, int bytes)
+{
+    uint64_t sse = 0;
+
+    for (int y = 0; y < h; y++, a += as, b += bs)
+    {
+        if (bytes == 1)
+            sse += sse_row_8(a, b, w);
+        else
+            sse += sse_row_16((const uint16_t *) a, (const uint16_t *) b, w);
+    }
+
+    return sse;
+}
+
+/** Sums of an 8 bit 4x4 block: sum a, sum b, sum a*a + b*b, sum a*b. */
+static void ssim_4x4_8(const uint8_t *a, int as, const uint8_t *b, int bs, int64_t sums[4])
+{
+    int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+
+    for (int y = 0; y < 4; y++, a += as, b += bs)
+    {
+        for (int x = 0; x < 4; x++)
+        {
+            int va = a[x];
+            int vb = b[x];
+
+            s1 += va;
+            s2 += vb;
+            ss += va * va + vb * vb;
+            s12 += va * vb;
+        }
+    }
+
+    sums[0] = s1;
+    sums[1] = s2;
+    sums[2] = ss;
+    sums[3] = s12;
+}
+
+#if HAVE_SSE2_INTRINSICS
+/**
+ * Sums of two side by side 8 bit 4x4 blocks, as for ssim_4x4_8, from one
+ * 8 sample load per row. madd adds neighbouring lanes, so lanes 0 and 1
+ * belong to the left block and lanes 2 and 3 to the right one.
+ */
+static void ssim_4x4x2_8_sse2(const uint8_t *a, int as, const uint8_t *b, int bs, int64_t sums[8])
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i s1 = _mm_setzero_si128();
+    __m128i s2 = _mm_setzero_si128();
+    __m128i ss = _mm_setzero_si128();
+    __m128i s12 = _mm_setzero_si128();
+
+    for (int y = 0; y < 4; y++, a += as, b += bs)
+    {
+        __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) a), zero);
+        __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) b), zero);
+
+        s1 = _mm_add_epi32(s1, _mm_madd_epi16(va, one));
+        s2 = _mm_add_epi32(s2, _mm_madd_epi16(vb, one));
+        ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(va, va), _mm_madd_epi16(vb, vb)));
+        s12 = _mm_add_epi32(s12, _mm_madd_epi16(va, vb));
+    }
+
+    int32_t lanes[4][4];
+    _mm_storeu_si128((__m128i *) lanes[0], s1);
+    _mm_storeu_si128((__m128i *) lanes[1], s2);
+    _mm_storeu_si128((__m128i *) lanes[2], ss);
+    _mm_storeu_si128((__m128i *) lanes[3], s12);
+
+    for (int i = 0; i < 4; i++)
+    {
+        sums[i] = lanes[i][0] + lanes[i][1];
+        sums[4 + i] = lanes[i][2] + lanes[i][3];
+    }
+}
+#endif
+
+/** Sums of a high bit depth 4x4 block, as for ssim_4x4_8. */
+static void ssim_4x4_16(const uint8_t *a, int as, const uint8_t *b, int bs, int64_t sums[4])
+{
+    int64_t s1 = 0, s2 = 0, ss = 0, s12 = 0;
+
+    for (int y = 0; y < 4; y++, a += as, b += bs)
+    {
+        const uint16_t *ra = (const uint16_t *) a;
+        const uint16_t *rb = (const uint16_t *) b;
+
+        for (int x = 0; x < 4; x++)
+        {
+            int64_t va = ra[x];
+            int64_t vb = rb[x];
+
+            s1 += va;
+            s2 += vb;
+            ss += va * va + vb * vb;
+            s12 += va * vb;
+        }
+    }
+
+    sums[0] = s1;
+    sums[1] = s2;
+    sums[2] = ss;
+    sums[3] = s12;
+}
+
+/** SSIM of one 8x8 window given the sums of its four 4x4 blocks. */
+static double ssim_end(const int64_t *s00, const int64_t *s01, const int64_t *s10, const int64_t *s11, int depth)
+{
+    double max = (double) ((1 << depth) - 1);
+    double c1 = .01 * .01 * max * max * 64;
+    double c2 = .03 * .03 * max * max * 64 * 63;
+
+    double s1 = (double) (s00[0] + s01[0] + s10[0] + s11[0]);
+    double s2 = (double) (s00[1] + s01[1] + s10[1] + s11[1]);
+    double ss = (double) (s00[2] + s01[2] + s10[2] + s11[2]);
+    double s12 = (double) (s00[3] + s01[3] + s10[3] + s11[3]);
+
+    double vars = ss * 64 - s1 * s1 - s2 * s2;
+    double covar = s12 * 64 - s1 * s2;
+
+    return (2 * s1 * s2 + c1) * (2 * covar + c2) / ((s1 * s1 + s2 * s2 + c1) * (vars + c2));
+}
+
+/**
+ * SSIM of a plane over overlapping 8x8 windows on a 4 pixel grid, the same
+ * approach as x264 and the ssim filter.
+ */
+static double ssim_plane(const uint8_t *a, int as, const uint8_t *b, int bs, int w, int h, int bytes, int depth)
+{
+    int bw = w / 4;
+    int bh = h / 4;
+
+    if (bw < 2 || bh < 2)
+        return 1.0;
+
+    std::vector<int64_t> rows(2 * bw * 4);
+    int64_t *prev = &rows[0];
+    int64_t *cur = &rows[bw * 4];
+    double ssim = 0;
+
+    for (int by = 0; by < bh; by++)
+    {
+        const uint8_t *ra = a + by * 4 * as;
+        const uint8_t *rb = b + by * 4 * bs;
+
+        int bx = 0;
+
+#if HAVE_SSE2_INTRINSICS
+        // Two blocks at a time, the odd one out goes through the scalar sums
+        for (; bytes == 1 && bx + 2 <= bw; bx += 2)
+            ssim_4x4x2_8_sse2(ra + bx * 4, as, rb + bx * 4, bs, cur + bx * 4);
+#endif
+
+        for (; bx < bw; bx++)
+        {
+            if (bytes == 1)
+                ssim_4x4_8(ra + bx * 4, as, rb + bx * 4, bs, cur + bx * 4);
+            else
+                ssim_4x4_16(ra + bx * 8, as, rb + bx * 8, bs, cur + bx * 4);
+        }
+
+        if (by)
+            for (int bx = 0; bx < bw - 1; bx++)
+                ssim += ssim_end(prev + bx * 4, prev + bx * 4 + 4, cur + bx * 4, cur + bx * 4 + 4, depth);
+
+        int64_t *tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    return ssim / ((double) (bw - 1) * (bh - 1));
+}
+
+static double psnr(double sse, double samples, int depth)
+{
+    double max = (double) ((1 << depth) - 1);
+
+    if (sse <= 0)
+        return MAX_PSNR;
+
+    return FFMIN(MAX_PSNR, 10.0 * log10(max * max * samples / sse));
+}
+
+static void score_frame(AVFrame *source, AVFrame *recon)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat) source->format);
+
+    if (!desc || source->format != recon->format ||
+        source->width != recon->width || source->height != recon->height)
+    {
+        av_log(NULL, AV_LOG_WARNING, "Quality: reconstructed frame does not match the source frame\n");
+        return;
+    }
+
+    int depth = desc->comp[0].depth;
+    g_depth = depth;
+    int bytes = depth > 8 ? 2 : 1;
+    int planes = FFMIN(desc->nb_components, 3);
+    double sse[3] = {0};
+    double samples[3] = {0};
+    double frame_sse = 0;
+    double frame_samples = 0;
+
+    for (int p = 0; p < planes; p++)
+    {
+        int w = p ? AV_CEIL_RSHIFT(source->width, desc->log2_chroma_w) : source->width;
+        int h = p ? AV_CEIL_RSHIFT(source->height, desc->log2_chroma_h) : source->height;
+
+        sse[p] = (double) sse_plane(source->data[p], source->linesize[p],
+                                    recon->data[p], recon->linesize[p], w, h, bytes);
+        samples[p] = (double) w * h;
+
+        frame_sse += sse[p];
+        frame_samples += samples[p];
+
+        g_total_sse[p] += sse[p];
+        g_total_samples[p] += samples[p];
+    }
+
+    double ssim = ssim_plane(source->data[0], source->linesize[0],
+                             recon->data[0], recon->linesize[0], source->width, source->height, bytes, depth);
+
+    g_total_ssim += ssim;
+    g_min_ssim = FFMIN(g_min_ssim, ssim);
+    g_ssim_frames++;
+
+    if (g_quality_file)
+    {
+        fprintf(g_quality_file, "%s\n    { \"frame\": %d, \"pts\": %lld, \"psnr_y\": %.4f, \"psnr_u\": %.4f, \"psnr_v\": %.4f, \"psnr\": %.4f, \"ssim_y\": %.6f }",
+                g_scored_frames ? "," : "", g_scored_frames, (long long) source->pts,
+                psnr(sse[0], samples[0], depth),
+                planes > 1 ? psnr(sse[1], samples[1], depth) : MAX_PSNR,
+                planes > 2 ? psnr(sse[2], samples[2], depth) : MAX_PSNR,
+                psnr(frame_sse, frame_samples, depth), ssim);
+    }
+
+    g_scored_frames++;
+}
+
+static int receive_recon_frames()
+{
+    int ret = 0;
+
+    while (ret >= 0)
+    {
+        ret = avcodec_receive_frame(g_recon_ctx, g_recon_frame);
+
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Quality: error receiving reconstructed frame\n");
+            return ret;
+        }
+
+        // Decoder output is in presentation order, same as what went into the encoder
+        if (g_source_frames.empty())
+        {
+            av_log(NULL, AV_LOG_WARNING, "Quality: reconstructed frame without a source frame\n");
+        }
+        else
+        {
+            AVFrame *source = g_source_frames.front();
+            g_source_frames.pop_front();
+
+            if (!g_pts_mismatch_logged && source->pts != g_recon_frame->pts)
+            {
+                av_log(NULL, AV_LOG_WARNING, "Quality: source and reconstructed timestamps differ, matching frames in order\n");
+                g_pts_mismatch_logged = true;
+            }
+
+            score_frame(source, g_recon_frame);
+            av_frame_free(&source);
+        }
+
+        av_frame_unref(g_recon_frame);
+    }
+
+    return ret;
+}
+
+int init_quality(unsigned int stream_index, AVCodecContext *enc_ctx)
+{
+    AVCodec *decoder = avcodec_find_decoder(enc_ctx->codec_id);
+    int ret;
+
+    if (!decoder)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Quality: no decoder for the encoded stream\n");
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+
+    g_stream_index = stream_index;
+    g_recon_ctx = avcodec_alloc_context3(decoder);
+    g_recon_frame = av_frame_alloc();
+
+    if (!g_recon_ctx || !g_recon_frame)
+        return AVERROR(ENOMEM);
+
+    g_recon_ctx->width = enc_ctx->width;
+    g_recon_ctx->height = enc_ctx->height;
+    g_recon_ctx->pix_fmt = enc_ctx->pix_fmt;
+    g_recon_ctx->time_base = enc_ctx->time_base;
+
+    if (enc_ctx->extradata_size)
+    {
+        g_recon_ctx->extradata = (uint8_t *) av_mallocz(enc_ctx->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!g_recon_ctx->extradata)
+            return AVERROR(ENOMEM);
+
+        memcpy(g_recon_ctx->extradata, enc_ctx->extradata, enc_ctx->extradata_size);
+        g_recon_ctx->extradata_size = enc_ctx->extradata_size;
+    }
+
+    if ((ret = avcodec_open2(g_recon_ctx, decoder, NULL)) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Quality: cannot open reconstruction decoder: %s\n", av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+        return ret;
+    }
+
+    g_quality_file = fopen(QUALITY_FILE, "w");
+    if (!g_quality_file)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Quality: could not open %s\n", QUALITY_FILE);
+        return AVERROR(EIO);
+    }
+
+    fprintf(g_quality_file, "{\n  \"frames\": [");
+
+    return 0;
+}
+
+int quality_add_source_frame(unsigned int stream_index, AVFrame *frame)
+{
+    if (!g_recon_ctx || !frame || stream_index != g_stream_index)
+        return 0;
+
+    AVFrame *ref = av_frame_clone(frame);
+    if (!ref)
+        return AVERROR(ENOMEM);
+
+    g_source_frames.push_back(ref);
+
+    return 0;
+}
+
+int quality_add_packet(unsigned int stream_index, AVPacket *pkt)
+{
+    if (!g_recon_ctx || stream_index != g_stream_index)
+        return 0;
+
+    int ret = avcodec_send_packet(g_recon_ctx, pkt);
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Quality: error sending packet to reconstruction decoder\n");
+        return ret;
+    }
+
+    return receive_recon_frames();
+}
+
+void close_quality()
+{
+    if (g_recon_ctx && avcodec_is_open(g_recon_ctx))
+    {
+        // Drain the reconstruction decoder
+        avcodec_send_packet(g_recon_ctx, NULL);
+        receive_recon_frames();
+    }
+
+    if (g_quality_file)
+    {
+        double sse = g_total_sse[0] + g_total_sse[1] + g_total_sse[2];
+        double samples = g_total_samples[0] + g_total_samples[1] + g_total_samples[2];
+        int depth = g_depth;
+        double ssim = g_ssim_frames ? g_total_ssim / g_ssim_frames : 0;
+        char ssim_average[32] = "null";
+        char ssim_min[32] = "null";
+
+        // No SSIM without a scored frame, rather than a made up one
+        if (g_ssim_frames)
+        {
+            snprintf(ssim_average, sizeof(ssim_average), "%.6f", ssim);
+            snprintf(ssim_min, sizeof(ssim_min), "%.6f", g_min_ssim);
+        }
+
+        fprintf(g_quality_file, "\n  ],\n  \"average\": { \"frames\": %d, \"psnr_y\": %.4f, \"psnr_u\": %.4f, \"psnr_v\": %.4f, \"psnr\": %.4f, \"ssim_y\": %s, \"ssim_y_min\": %s }\n}\n",
+                g_scored_frames,
+                psnr(g_total_sse[0], g_total_samples[0], depth),
+                psnr(g_total_sse[1], g_total_samples[1], depth),
+                psnr(g_total_sse[2], g_total_samples[2], depth),
+                psnr(sse, samples, depth), ssim_average, ssim_min);
+
+        fclose(g_quality_file);
+        g_quality_file = NULL;
+
+        av_log(NULL, AV_LOG_INFO, "Quality: %d frames, PSNR %.2f dB, SSIM %s\n",
+               g_scored_frames, psnr(sse, samples, depth), ssim_average);
+    }
+
+    while (!g_source_frames.empty())
+    {
+        AVFrame *frame = g_source_frames.front();
+        g_source_frames.pop_front();
+        av_frame_free(&frame);
+    }
+
+    av_frame_free(&g_recon_frame);
+    avcodec_free_context(&g_recon_ctx);
+}
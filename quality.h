@@ -0,0 +1,29 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/frame.h>
+}
+
+/**
+ * Open a reconstruction decoder for the packets produced by enc_ctx, the
+ * encoder of stream stream_index, and the per-frame PSNR/SSIM sidecar
+ * (quality.json in the working directory).
+ */
+int init_quality(unsigned int stream_index, AVCodecContext *enc_ctx);
+
+/**
+ * Keep a reference to a frame just before it is sent to the encoder.
+ * Frames of other streams are ignored.
+ */
+int quality_add_source_frame(unsigned int stream_index, AVFrame *frame);
+
+/**
+ * Decode an encoded packet and score every reconstructed frame against the
+ * matching source frame. Packets of other streams are ignored.
+ */
+int quality_add_packet(unsigned int stream_index, AVPacket *pkt);
+
+/** Drain the reconstruction decoder, write the aggregate scores and close the sidecar. */
+void close_quality();
@@ -0,0 +1,504 @@
+#include "read_ahead.h"
+#include "ffmpeg_transcoder.h"
+
+extern "C"
+{
+    #include <libavutil/avstring.h>
+    #include <libavutil/dict.h>
+    #include <libavutil/mem.h>
+    #include <libavutil/time.h>
+}
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Unit of the ring
+#define BLOCK_SIZE (1024 * 1024)
+
+// Most blocks a fetcher takes at once, one range request for an HTTP input
+#define MAX_RUN_BLOCKS 16
+
+// Size of the buffer the demuxer reads through, larger reads are copied straight out of the ring
+#define AVIO_BUFFER_SIZE 32768
+
+extern Options g_options;
+
+enum BlockState { kBlockEmpty, kBlockFetching, kBlockReady, kBlockFailed };
+
+typedef struct Block {
+    uint8_t *data;
+    int64_t index;              // Which block of the input, -1 for none
+    int len;
+    BlockState state;
+    int error;
+} Block;
+
+struct ReadAhead;
+
+typedef struct Fetcher {
+    ReadAhead *ra;
+    AVIOContext *source;        // Open during a run when ranged, else kept and seeked
+    pthread_t thread;
+    bool thread_started;
+} Fetcher;
+
+typedef struct ReadAhead {
+    std::string url;
+    bool ranged;                // HTTP with range support, a bounded request per run
+    int run_blocks;             // Blocks a fetcher claims at once
+    std::vector<Block> blocks;
+    std::vector<Fetcher> fetchers;
+
+    int64_t pos;                // The demuxer's read position
+    int64_t next_fetch;         // Next block to fetch
+    int64_t eof;                // Input size once known, INT64_MAX until then
+    bool stop;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // Signalled when a block is fetched or the demuxer moves on
+
+    // Stats
+    int64_t fetched_bytes;
+    int64_t wait_time;
+} ReadAhead;
+
+static Block *get_block(ReadAhead *ra, int64_t index)
+{
+    return &ra->blocks[index % ra->blocks.size()];
+}
+
+static bool in_window(ReadAhead *ra, int64_t index)
+{
+    int64_t first = ra->pos / BLOCK_SIZE;
+
+    return index >= first && index < first + (int64_t) ra->blocks.size();
+}
+
+/**
+ * Claim the next run of up to run_blocks consecutive blocks that fit in the
+ * ring, marking them fetching. Returns the first, -1 if none for now. Called
+ * locked.
+ */
+static int64_t claim_run(ReadAhead *ra, int *count)
+{
+    int64_t window_end = ra->pos / BLOCK_SIZE + (int64_t) ra->blocks.size();
+    int64_t start = -1;
+
+    *count = 0;
+
+    while (ra->next_fetch < window_end && ra->next_fetch * BLOCK_SIZE < ra->eof && *count < ra->run_blocks)
+    {
+        Block *block = get_block(ra, ra->next_fetch);
+
+        // Still there from before a seek back, or another fetcher has it
+        if (block->index == ra->next_fetch && (block->state == kBlockReady || block->state == kBlockFetching))
+        {
+            if (start >= 0)
+                break;
+
+            ra->next_fetch++;
+            continue;
+        }
+
+        // The slot is being filled with a block the demuxer seeked away from
+        if (block->state == kBlockFetching)
+            break;
+
+        if (start < 0)
+            start = ra->next_fetch;
+
+        block->index = ra->next_fetch++;
+        block->state = kBlockFetching;
+        (*count)++;
+    }
+
+    return start;
+}
+
+/** Open the input, from offset up to end_offset when end_offset is set. */
+static int open_source(AVIOContext **source, const char *url, int64_t offset, int64_t end_offset)
+{
+    AVDictionary *opts = NULL;
+
+    av_dict_set(&opts, "reconnect", "1", 0);
+
+    if (end_offset > 0)
+    {
+        av_dict_set_int(&opts, "offset", offset, 0);
+        av_dict_set_int(&opts, "end_offset", end_offset, 0);
+    }
+
+    int ret = avio_open2(source, url, AVIO_FLAG_READ, NULL, &opts);
+    av_dict_free(&opts);
+
+    return ret;
+}
+
+/**
+ * Get the fetcher's source to the start of a run. The HTTP protocol opens
+ * a new connection for every seek, asking for everything from there to the
+ * end of the input, so a ranged input gets a request of its own bounded to
+ * the run instead. Anything else is opened once and seeked.
+ */
+static int start_run(Fetcher *f, int64_t start, int count)
+{
+    ReadAhead *ra = f->ra;
+    int64_t offset = start * BLOCK_SIZE;
+    int ret;
+
+    if (ra->ranged)
+        return open_source(&f->source, ra->url.c_str(), offset, offset + (int64_t) count * BLOCK_SIZE);
+
+    if (!f->source && (ret = open_source(&f->source, ra->url.c_str(), 0, 0)) < 0)
+        return ret;
+
+    if (avio_tell(f->source) != offset && (ret = (int) avio_seek(f->source, offset, SEEK_SET)) < 0)
+        return ret;
+
+    return 0;
+}
+
+static int fetch_block(Fetcher *f, Block *block)
+{
+    // avio_read only comes back short at the end of the input, or when the read failed
+    int ret = avio_read(f->source, block->data, BLOCK_SIZE);
+
+    if (ret < BLOCK_SIZE && f->source->error < 0 && f->source->error != AVERROR_EOF)
+        return f->source->error;
+
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+static void *fetch_thread_proc(void *arg)
+{
+    Fetcher *f = (Fetcher *) arg;
+    ReadAhead *ra = f->ra;
+
+    pthread_mutex_lock(&ra->mutex);
+
+    while (!ra->stop)
+    {
+        int count = 0;
+        int64_t start = claim_run(ra, &count);
+
+        if (start < 0)
+        {
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&ra->mutex);
+
+        int ret = start_run(f, start, count);
+
+        pthread_mutex_lock(&ra->mutex);
+
+        // Block by block, the demuxer reads each as soon as it is there
+        int i = 0;
+
+        for (; i < count && !ra->stop && in_window(ra, start + i); i++)
+        {
+            int64_t index = start + i;
+            Block *block = get_block(ra, index);
+
+            if (ret >= 0)
+            {
+                pthread_mutex_unlock(&ra->mutex);
+                ret = fetch_block(f, block);
+                pthread_mutex_lock(&ra->mutex);
+            }
+
+            if (ret < 0)
+            {
+                block->state = kBlockFailed;
+                block->error = ret;
+                i++;
+                break;
+            }
+
+            block->state = kBlockReady;
+            block->len = ret;
+            ra->fetched_bytes += ret;
+            pthread_cond_broadcast(&ra->cond);
+
+            if (ret < BLOCK_SIZE)
+            {
+                ra->eof = FFMIN(ra->eof, index * BLOCK_SIZE + ret);
+                i++;
+                break;
+            }
+        }
+
+        // The rest of the run after a failure or a seek away is up for
+        // fetching again, from where the demuxer is
+        for (; i < count; i++)
+        {
+            int64_t index = start + i;
+
+            get_block(ra, index)->state = kBlockEmpty;
+
+            if (in_window(ra, index))
+                ra->next_fetch = FFMIN(ra->next_fetch, index);
+        }
+
+        pthread_cond_broadcast(&ra->cond);
+
+        if (ra->ranged)
+        {
+            pthread_mutex_unlock(&ra->mutex);
+            avio_closep(&f->source);
+            pthread_mutex_lock(&ra->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&ra->mutex);
+
+    return NULL;
+}
+
+static int read_read_ahead(void *opaque, uint8_t *buf, int buf_size)
+{
+    ReadAhead *ra = (ReadAhead *) opaque;
+    int64_t start = 0;
+
+    pthread_mutex_lock(&ra->mutex);
+
+    while (1)
+    {
+        int64_t index = ra->pos / BLOCK_SIZE;
+        Block *block = get_block(ra, index);
+
+        if (ra->pos >= ra->eof)
+        {
+            pthread_mutex_unlock(&ra->mutex);
+            return AVERROR_EOF;
+        }
+
+        if (block->index == index && block->state == kBlockFailed)
+        {
+            int ret = block->error;
+
+            // Fetched again if the demuxer tries once more
+            block->state = kBlockEmpty;
+            ra->next_fetch = FFMIN(ra->next_fetch, index);
+
+            pthread_mutex_unlock(&ra->mutex);
+            return ret;
+        }
+
+        if (block->index == index && block->state == kBlockReady)
+            break;
+
+        // Past what was fetched ahead of a seek back, fetching picks up from here
+        if (!(block->index == index && block->state == kBlockFetching) && ra->next_fetch > index)
+        {
+            ra->next_fetch = index;
+            pthread_cond_broadcast(&ra->cond);
+        }
+
+        if (!start)
+            start = av_gettime_relative();
+
+        pthread_cond_wait(&ra->cond, &ra->mutex);
+    }
+
+    if (start)
+        ra->wait_time += av_gettime_relative() - start;
+
+    Block *block = get_block(ra, ra->pos / BLOCK_SIZE);
+    int offset = (int) (ra->pos % BLOCK_SIZE);
+    int len = FFMIN(buf_size, block->len - offset);
+
+    pthread_mutex_unlock(&ra->mutex);
+
+    // The fetchers leave the block under the read position alone
+    memcpy(buf, block->data + offset, len);
+
+    pthread_mutex_lock(&ra->mutex);
+
+    ra->pos += len;
+
+    // Moving on to the next block frees a slot at the far end of the ring
+    if (ra->pos % BLOCK_SIZE == 0)
+        pthread_cond_broadcast(&ra->cond);
+
+    pthread_mutex_unlock(&ra->mutex);
+
+    return len;
+}
+
+static int64_t seek_read_ahead(void *opaque, int64_t offset, int whence)
+{
+    ReadAhead *ra = (ReadAhead *) opaque;
+
+    whence &= ~AVSEEK_FORCE;
+
+    pthread_mutex_lock(&ra->mutex);
+
+    if (whence == AVSEEK_SIZE)
+    {
+        int64_t size = ra->eof == INT64_MAX ? AVERROR(ENOSYS) : ra->eof;
+        pthread_mutex_unlock(&ra->mutex);
+        return size;
+    }
+
+    if (whence == SEEK_CUR)
+        offset += ra->pos;
+    else if (whence == SEEK_END)
+        offset = ra->eof == INT64_MAX ? -1 : ra->eof + offset;
+    else if (whence != SEEK_SET)
+        offset = -1;
+
+    if (offset < 0)
+    {
+        pthread_mutex_unlock(&ra->mutex);
+        return AVERROR(EINVAL);
+    }
+
+    int64_t index = offset / BLOCK_SIZE;
+    Block *block = get_block(ra, index);
+
+    ra->pos = offset;
+
+    // Fetching goes on from the new position unless the block is there or on its way
+    if (!(block->index == index && (block->state == kBlockReady || block->state == kBlockFetching)))
+        ra->next_fetch = index;
+
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+
+    return offset;
+}
+
+static void free_read_ahead(ReadAhead *ra)
+{
+    pthread_mutex_lock(&ra->mutex);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+
+    for (size_t i = 0; i < ra->fetchers.size(); i++)
+    {
+        if (ra->fetchers[i].thread_started)
+            pthread_join(ra->fetchers[i].thread, NULL);
+
+        avio_closep(&ra->fetchers[i].source);
+    }
+
+    for (size_t i = 0; i < ra->blocks.size(); i++)
+        av_free(ra->blocks[i].data);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    delete ra;
+}
+
+int open_read_ahead_input(AVIOContext **pb, const char *url)
+{
+    ReadAhead *ra = new ReadAhead();
+    AVIOContext *source = NULL;
+    int ret;
+
+    *pb = NULL;
+    ra->url = url;
+    ra->eof = INT64_MAX;
+
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    if ((ret = open_source(&source, url, 0, 0)) < 0)
+    {
+        free_read_ahead(ra);
+        return ret;
+    }
+
+    int64_t size = avio_size(source);
+    bool seekable = source->seekable & AVIO_SEEKABLE_NORMAL;
+
+    if (size > 0)
+        ra->eof = size;
+
+    // Parallel fetches need range requests, anything else is read by one thread front to back
+    int fetchers = 1;
+
+    ra->ranged = seekable && size > 0 && (av_strstart(url, "http:", NULL) || av_strstart(url, "https:", NULL));
+
+    if (ra->ranged)
+        fetchers = FFMAX(g_options.read_ahead_fetches, 1);
+
+    int blocks = (int) FFMAX((int64_t) g_options.read_ahead * 1024 * 1024 / BLOCK_SIZE, (int64_t) 2 * fetchers);
+
+    // Runs short enough that every fetcher has one in the ring at once
+    ra->run_blocks = av_clip(blocks / fetchers, 1, MAX_RUN_BLOCKS);
+
+    ra->blocks.resize(blocks);
+    for (int i = 0; i < blocks; i++)
+    {
+        ra->blocks[i].index = -1;
+        ra->blocks[i].data = (uint8_t *) av_malloc(BLOCK_SIZE);
+        if (!ra->blocks[i].data)
+            ret = AVERROR(ENOMEM);
+    }
+
+    ra->fetchers.resize(fetchers);
+
+    // The ranged fetchers open a request per run
+    if (ra->ranged)
+        avio_closep(&source);
+    else
+        ra->fetchers[0].source = source;
+
+    for (int i = 0; i < fetchers && ret >= 0; i++)
+    {
+        ra->fetchers[i].ra = ra;
+
+        int err = pthread_create(&ra->fetchers[i].thread, NULL, fetch_thread_proc, &ra->fetchers[i]);
+        if (err)
+        {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(err));
+            ret = AVERROR(err);
+            break;
+        }
+
+        ra->fetchers[i].thread_started = true;
+    }
+
+    uint8_t *buffer = ret >= 0 ? (uint8_t *) av_malloc(AVIO_BUFFER_SIZE) : NULL;
+
+    if (buffer)
+        *pb = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, ra, read_read_ahead, NULL, seek_read_ahead);
+
+    if (!*pb)
+    {
+        av_free(buffer);
+        free_read_ahead(ra);
+        return ret < 0 ? ret : AVERROR(ENOMEM);
+    }
+
+    if (!seekable)
+        (*pb)->seekable = 0;
+
+    av_log(NULL, AV_LOG_VERBOSE, "Reading %s ahead %d MB with %d fetch thread(s), %d MB per request\n",
+           url, blocks * (BLOCK_SIZE / (1024 * 1024)), fetchers, ra->run_blocks * (BLOCK_SIZE / (1024 * 1024)));
+
+    return 0;
+}
+
+void close_read_ahead_input(AVIOContext **pb)
+{
+    if (!*pb)
+        return;
+
+    ReadAhead *ra = (ReadAhead *) (*pb)->opaque;
+
+    av_log(NULL, AV_LOG_INFO, "%s: %.1f MB fetched ahead, demuxer waited %.2f s\n",
+           ra->url.c_str(), ra->fetched_bytes / 1048576.0, ra->wait_time / 1000000.0);
+
+    free_read_ahead(ra);
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
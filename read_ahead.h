@@ -0,0 +1,21 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavformat/avio.h>
+}
+
+/**
+ * Open an input, any URL libavformat reads, behind a read-ahead buffer of
+ * -read_ahead MB, for avformat_open_input with AVFMT_FLAG_CUSTOM_IO. The
+ * buffer is a ring of blocks that background threads keep filled ahead of
+ * the demuxer, so it only waits on the network or the file server once it
+ * has read all that was fetched. HTTP inputs are fetched by -read_ahead_fetches
+ * threads at once, each taking a run of consecutive blocks and asking for it
+ * with one range request bounded to the run. A seek to a block still in the
+ * ring costs nothing, elsewhere the fetching starts over from there.
+ */
+int open_read_ahead_input(AVIOContext **pb, const char *url);
+
+/** Stop the fetch threads, log how long the demuxer waited and close the input. */
+void close_read_ahead_input(AVIOContext **pb);
@@ -0,0 +1,446 @@
+#include "scaler.h"
+#include "fast_scale.h"
+
+extern "C"
+{
+    #include <libavutil/cpu.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/mathematics.h>
+    #include <libavutil/pixdesc.h>
+    #include <libswscale/swscale.h>
+}
+
+#include <pthread.h>
+#include <vector>
+
+#define MAX_SCALER_THREADS 16
+
+// Bands are not made smaller than this many destination rows
+#define MIN_BAND_ROWS 64
+
+#define SCALER_FLAGS SWS_BICUBIC
+
+typedef struct ScalerBand {
+    int src_y;              // Source rows fed to the band's context, margins included
+    int src_h;
+    int skip;               // Margin rows at the top of the context's output
+    int out_y;              // Destination rows the band owns
+    int out_h;
+    struct SwsContext *ctx;
+    AVFrame *tmp;           // Band output with margins, NULL for a single band
+} ScalerBand;
+
+typedef struct BandThread {
+    Scaler   *scaler;
+    int      index;
+    pthread_t thread;
+} BandThread;
+
+struct Scaler {
+    int dst_width;
+    int dst_height;
+    AVPixelFormat dst_fmt;
+
+    // Input the bands are configured for
+    int src_width;
+    int src_height;
+    AVPixelFormat src_fmt;
+    EFastScaleKind fast;    // Hand-written conversion instead of the SwsContexts
+
+    std::vector<ScalerBand> bands;
+    std::vector<BandThread> threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned generation;
+    int pending;
+    int error;
+    bool quit;
+
+    const AVFrame *src;
+    AVFrame *dst;
+};
+
+/** Vertical chroma shift of a plane, 0 for luma, alpha and packed formats. */
+static int plane_shift(const AVPixFmtDescriptor *desc, int plane)
+{
+    return (plane == 1 || plane == 2) ? desc->log2_chroma_h : 0;
+}
+
+static int scale_band(Scaler *s, ScalerBand &band)
+{
+    if (s->fast != kNoFastScale)
+    {
+        fast_scale(s->fast, s->src, s->dst, band.out_y, band.out_h);
+        return 0;
+    }
+
+    const AVFrame *src = s->src;
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(s->src_fmt);
+    const uint8_t *src_data[AV_NUM_DATA_POINTERS] = { NULL };
+
+    for (int p = 0; p < AV_NUM_DATA_POINTERS && src->data[p]; p++)
+        src_data[p] = src->data[p] + (band.src_y >> plane_shift(src_desc, p)) * src->linesize[p];
+
+    AVFrame *out = band.tmp ? band.tmp : s->dst;
+
+    if (sws_scale(band.ctx, src_data, src->linesize, 0, band.src_h, out->data, out->linesize) <= 0)
+        return AVERROR(EINVAL);
+
+    if (!band.tmp)
+        return 0;
+
+    // Copy the rows the band owns, dropping the margins
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(s->dst_fmt);
+    int planes = av_pix_fmt_count_planes(s->dst_fmt);
+
+    for (int p = 0; p < planes; p++)
+    {
+        int shift = plane_shift(dst_desc, p);
+        int bytewidth = av_image_get_linesize(s->dst_fmt, s->dst_width, p);
+
+        av_image_copy_plane(s->dst->data[p] + (band.out_y >> shift) * s->dst->linesize[p], s->dst->linesize[p],
+                            band.tmp->data[p] + (band.skip >> shift) * band.tmp->linesize[p], band.tmp->linesize[p],
+                            bytewidth, band.out_h >> shift);
+    }
+
+    return 0;
+}
+
+static void *band_thread_proc(void *arg)
+{
+    BandThread *t = (BandThread *) arg;
+    Scaler *s = t->scaler;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&s->mutex);
+
+    while (1)
+    {
+        while (!s->quit && s->generation == seen)
+            pthread_cond_wait(&s->work_cond, &s->mutex);
+
+        if (s->quit)
+            break;
+
+        seen = s->generation;
+
+        // Band 0 is scaled by the calling thread
+        size_t band = t->index + 1;
+
+        if (band < s->bands.size())
+        {
+            pthread_mutex_unlock(&s->mutex);
+            int ret = scale_band(s, s->bands[band]);
+            pthread_mutex_lock(&s->mutex);
+
+            if (ret < 0)
+                s->error = ret;
+
+            if (--s->pending == 0)
+                pthread_cond_signal(&s->done_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+static void free_bands(Scaler *s)
+{
+    for (size_t i = 0; i < s->bands.size(); i++)
+    {
+        sws_freeContext(s->bands[i].ctx);
+        av_frame_free(&s->bands[i].tmp);
+    }
+
+    s->bands.clear();
+}
+
+/**
+ * Split the picture into bands on rows where source and destination line up
+ * exactly, every unit of src_unit source rows gives dst_unit destination
+ * rows. Each band's context also scales a margin of units above and below,
+ * so the filter taps at the band edges see the same rows as a single
+ * context would. The margins are scaled twice and dropped. The fast paths
+ * work on independent units and need no margin.
+ * Returns the number of bands, 1 if the sizes do not split.
+ */
+static int plan_bands(Scaler *s, int *src_unit, int *dst_unit, int *margin_units)
+{
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(s->src_fmt);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(s->dst_fmt);
+    int threads = (int) s->threads.size() + 1;
+
+    if (s->fast != kNoFastScale)
+    {
+        get_fast_scale_unit(s->fast, src_unit, dst_unit);
+        *margin_units = 0;
+
+        int units = s->dst_height / *dst_unit;
+        int min_units = FFMAX(1, MIN_BAND_ROWS / *dst_unit);
+
+        return FFMAX(1, FFMIN(threads, units / min_units));
+    }
+
+    if (threads < 2 ||
+        (src_desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        (dst_desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)))
+        return 1;
+
+    int g = (int) av_gcd(s->src_height, s->dst_height);
+    int su = s->src_height / g;
+    int du = s->dst_height / g;
+
+    // Units must start on a chroma row on both sides
+    int src_align = 1 << src_desc->log2_chroma_h;
+    int dst_align = 1 << dst_desc->log2_chroma_h;
+    int k = 1;
+
+    while (k <= 4 && ((su * k) % src_align || (du * k) % dst_align))
+        k++;
+
+    if (k > 4 || s->dst_height % (du * k))
+        return 1;
+
+    su *= k;
+    du *= k;
+
+    int units = s->dst_height / du;
+
+    // Bicubic taps reach two source rows, times the downscale ratio, on
+    // each side, twice that for subsampled chroma
+    int margin_rows = 8 + 4 * ((su + du - 1) / du);
+    int margin = (margin_rows + su - 1) / su;
+
+    int min_units = FFMAX(1, (MIN_BAND_ROWS + du - 1) / du);
+    int bands = FFMIN(threads, units / min_units);
+
+    if (bands < 2)
+        return 1;
+
+    *src_unit = su;
+    *dst_unit = du;
+    *margin_units = margin;
+
+    return bands;
+}
+
+static int configure_bands(Scaler *s, const AVFrame *src)
+{
+    free_bands(s);
+
+    s->src_width = src->width;
+    s->src_height = src->height;
+    s->src_fmt = (AVPixelFormat) src->format;
+    s->fast = find_fast_scale(s->src_width, s->src_height, s->src_fmt,
+                              s->dst_width, s->dst_height, s->dst_fmt);
+
+    int su = 0, du = 0, margin = 0;
+    int nb_bands = plan_bands(s, &su, &du, &margin);
+
+    s->bands.resize(nb_bands);
+
+    if (nb_bands == 1 && s->fast == kNoFastScale)
+    {
+        ScalerBand &band = s->bands[0];
+
+        band.src_y = 0;
+        band.src_h = s->src_height;
+        band.skip = 0;
+        band.out_y = 0;
+        band.out_h = s->dst_height;
+        band.tmp = NULL;
+        band.ctx = sws_getContext(s->src_width, s->src_height, s->src_fmt,
+                                  s->dst_width, s->dst_height, s->dst_fmt,
+                                  SCALER_FLAGS, NULL, NULL, NULL);
+
+        return band.ctx ? 0 : AVERROR(EINVAL);
+    }
+
+    int units = s->dst_height / du;
+
+    for (int b = 0; b < nb_bands; b++)
+    {
+        ScalerBand &band = s->bands[b];
+
+        int u0 = units * b / nb_bands;
+        int u1 = units * (b + 1) / nb_bands;
+        int m0 = FFMAX(0, u0 - margin);
+        int m1 = FFMIN(units, u1 + margin);
+
+        band.src_y = m0 * su;
+        band.src_h = (m1 - m0) * su;
+        band.skip = (u0 - m0) * du;
+        band.out_y = u0 * du;
+        band.out_h = (u1 - u0) * du;
+        band.ctx = NULL;
+        band.tmp = NULL;
+
+        if (s->fast != kNoFastScale)
+            continue;
+
+        band.ctx = sws_getContext(s->src_width, band.src_h, s->src_fmt,
+                                  s->dst_width, (m1 - m0) * du, s->dst_fmt,
+                                  SCALER_FLAGS, NULL, NULL, NULL);
+        band.tmp = av_frame_alloc();
+
+        if (!band.ctx || !band.tmp)
+            return AVERROR(ENOMEM);
+
+        band.tmp->width = s->dst_width;
+        band.tmp->height = (m1 - m0) * du;
+        band.tmp->format = s->dst_fmt;
+
+        int ret = av_frame_get_buffer(band.tmp, 32);
+        if (ret < 0)
+            return ret;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Scaler %dx%d %s -> %dx%d %s in %d bands%s\n",
+           s->src_width, s->src_height, av_get_pix_fmt_name(s->src_fmt),
+           s->dst_width, s->dst_height, av_get_pix_fmt_name(s->dst_fmt), nb_bands,
+           s->fast != kNoFastScale ? (have_fast_scale_simd() ? ", AVX2 fast path" : ", fast path") : "");
+
+    return 0;
+}
+
+int init_scaler(Scaler **scaler, int dst_width, int dst_height, AVPixelFormat dst_fmt, int threads)
+{
+    Scaler *s = new Scaler();
+
+    s->dst_width = dst_width;
+    s->dst_height = dst_height;
+    s->dst_fmt = dst_fmt;
+    s->src_width = 0;
+    s->src_height = 0;
+    s->src_fmt = AV_PIX_FMT_NONE;
+    s->fast = kNoFastScale;
+    s->generation = 0;
+    s->pending = 0;
+    s->error = 0;
+    s->quit = false;
+    s->src = NULL;
+    s->dst = NULL;
+
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->work_cond, NULL);
+    pthread_cond_init(&s->done_cond, NULL);
+
+    if (threads <= 0)
+        threads = av_cpu_count();
+
+    threads = av_clip(threads, 1, MAX_SCALER_THREADS);
+
+    // The calling thread scales the first band
+    s->threads.resize(threads - 1);
+
+    for (int i = 0; i < threads - 1; i++)
+    {
+        s->threads[i].scaler = s;
+        s->threads[i].index = i;
+
+        int ret = pthread_create(&s->threads[i].thread, NULL, band_thread_proc, &s->threads[i]);
+        if (ret)
+        {
+            av_log(NULL, AV_LOG_WARNING, "Could not create scaler thread: %s\n", strerror(ret));
+            s->threads.resize(i);
+            break;
+        }
+    }
+
+    *scaler = s;
+
+    return 0;
+}
+
+int scale_frame(Scaler *s, const AVFrame *src, AVFrame **dst)
+{
+    int ret;
+
+    if (src->width != s->src_width || src->height != s->src_height || src->format != s->src_fmt)
+    {
+        if ((ret = configure_bands(s, src)) < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Cannot convert %dx%d %s to %dx%d %s\n",
+                   src->width, src->height, av_get_pix_fmt_name((AVPixelFormat) src->format),
+                   s->dst_width, s->dst_height, av_get_pix_fmt_name(s->dst_fmt));
+            free_bands(s);
+            s->src_fmt = AV_PIX_FMT_NONE;
+            return ret;
+        }
+    }
+
+    AVFrame *out = av_frame_alloc();
+    if (!out)
+        return AVERROR(ENOMEM);
+
+    out->width = s->dst_width;
+    out->height = s->dst_height;
+    out->format = s->dst_fmt;
+
+    if ((ret = av_frame_get_buffer(out, 32)) < 0)
+    {
+        av_frame_free(&out);
+        return ret;
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    s->src = src;
+    s->dst = out;
+    s->error = 0;
+    s->pending = (int) s->bands.size() - 1;
+    s->generation++;
+    pthread_cond_broadcast(&s->work_cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    ret = scale_band(s, s->bands[0]);
+
+    pthread_mutex_lock(&s->mutex);
+    while (s->pending > 0)
+        pthread_cond_wait(&s->done_cond, &s->mutex);
+
+    if (s->error < 0)
+        ret = s->error;
+    pthread_mutex_unlock(&s->mutex);
+
+    if (ret >= 0)
+        ret = av_frame_copy_props(out, src);
+
+    if (ret < 0)
+    {
+        av_frame_free(&out);
+        return ret;
+    }
+
+    *dst = out;
+
+    return 0;
+}
+
+void free_scaler(Scaler **scaler)
+{
+    Scaler *s = *scaler;
+
+    if (!s)
+        return;
+
+    pthread_mutex_lock(&s->mutex);
+    s->quit = true;
+    pthread_cond_broadcast(&s->work_cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    for (size_t i = 0; i < s->threads.size(); i++)
+        pthread_join(s->threads[i].thread, NULL);
+
+    free_bands(s);
+
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->work_cond);
+    pthread_cond_destroy(&s->done_cond);
+
+    delete s;
+    *scaler = NULL;
+}
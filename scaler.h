@@ -0,0 +1,23 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+    #include <libavutil/pixfmt.h>
+}
+
+typedef struct Scaler Scaler;
+
+/**
+ * Create a persistent scaler to the given size and pixel format, for frames
+ * of any input size and format. The picture is split into horizontal bands
+ * that are scaled in parallel, each band by its own thread and SwsContext.
+ * threads 0 picks the number of CPUs.
+ */
+int init_scaler(Scaler **scaler, int dst_width, int dst_height, AVPixelFormat dst_fmt, int threads);
+
+/** Scale and convert src into a newly allocated frame with src's properties. */
+int scale_frame(Scaler *scaler, const AVFrame *src, AVFrame **dst);
+
+/** Stop the band threads and free the scaler. */
+void free_scaler(Scaler **scaler);
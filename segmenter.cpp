@@ -0,0 +1,560 @@
+#include "segmenter.h"
+#include "ffmpeg_transcoder.h"
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+    #include <libavutil/threadmessage.h>
+}
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <vector>
+
+#ifdef WINDOWS
+    #include <direct.h>
+    #define make_dir(path) _mkdir(path)
+#else
+    #define make_dir(path) mkdir(path, 0755)
+#endif
+
+#define SEGMENT_QUEUE_SIZE 8
+
+#define SEGMENT_PLAYLIST "stream.m3u8"
+#define SEGMENT_MANIFEST "stream.mpd"
+#define SEGMENT_INIT "init.mp4"
+
+// Milliseconds, the DASH manifest time scale
+#define MANIFEST_TIMESCALE 1000
+
+extern AVFormatContext *g_ifmt_ctx;
+extern StreamContext *g_stream_ctx;
+extern Options g_options;
+
+/** A finished segment on its way to the writer thread. */
+typedef struct SegmentFile {
+    uint8_t *data;
+    int     size;
+    int     index;              // -1 for the CMAF initialization segment
+    int64_t start;              // Microseconds, in the timeline of the encoded streams
+    int64_t duration;
+} SegmentFile;
+
+typedef struct SegmentEntry {
+    int     index;
+    int64_t start;
+    int64_t duration;
+    int     size;
+} SegmentEntry;
+
+static char g_error[AV_ERROR_MAX_STRING_SIZE] = {0};
+
+// Encode thread state
+static AVFormatContext *g_seg_ctx = NULL;
+static std::vector<int> g_seg_streams;         // Output stream of each input stream, -1 for none
+static std::vector<AVBSFContext *> g_seg_bsfs;  // Parameter sets in front of TS keyframes
+static int g_cut_stream = -1;
+static int g_segment_index = 0;
+static int64_t g_segment_start = AV_NOPTS_VALUE;
+static int64_t g_segment_end = AV_NOPTS_VALUE;
+static bool g_segment_open = false;
+
+// Writer thread state
+static AVThreadMessageQueue *g_segment_queue = NULL;
+static pthread_t g_segment_thread;
+static bool g_thread_started = false;
+static std::vector<SegmentEntry> g_entries;
+static char g_availability_start[32] = {0};
+static int64_t g_bandwidth = 0;
+
+static std::string get_segment_path(const char *name)
+{
+    std::string path = g_options.segment_dir;
+
+    if (!path.empty() && path[path.size() - 1] != '/' && path[path.size() - 1] != '\\')
+        path += "/";
+
+    return path + name;
+}
+
+static std::string get_segment_name(int index)
+{
+    char name[32];
+
+    if (index < 0)
+        return SEGMENT_INIT;
+
+    snprintf(name, sizeof(name), "seg_%05d.%s", index, g_options.segment_cmaf ? "m4s" : "ts");
+    return name;
+}
+
+/** Write to a file aside and rename it into place, so readers never see half of it. */
+static int write_file_atomic(const std::string &path, const void *data, size_t size)
+{
+    std::string part = path + ".part";
+    FILE *f = fopen(part.c_str(), "wb");
+
+    if (!f)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not create '%s'\n", part.c_str());
+        return AVERROR(errno);
+    }
+
+    size_t written = fwrite(data, 1, size, f);
+
+    if (fclose(f) || written != size)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not write '%s'\n", part.c_str());
+        remove(part.c_str());
+        return AVERROR(EIO);
+    }
+
+    // Windows does not rename over an existing file
+    remove(path.c_str());
+
+    if (rename(part.c_str(), path.c_str()))
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not rename '%s'\n", part.c_str());
+        return AVERROR(errno);
+    }
+
+    return 0;
+}
+
+static void write_playlist(bool ended)
+{
+    int64_t max_duration = (int64_t) (g_options.segment_duration * AV_TIME_BASE);
+    std::string text;
+    char line[256];
+
+    for (size_t i = 0; i < g_entries.size(); i++)
+        max_duration = FFMAX(max_duration, g_entries[i].duration);
+
+    snprintf(line, sizeof(line),
+             "#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:%s\n",
+             g_options.segment_cmaf ? 7 : 3, (int) ceil(max_duration / (double) AV_TIME_BASE),
+             ended ? "VOD" : "EVENT");
+    text += line;
+
+    if (g_options.segment_cmaf)
+        text += "#EXT-X-MAP:URI=\"" SEGMENT_INIT "\"\n";
+
+    for (size_t i = 0; i < g_entries.size(); i++)
+    {
+        snprintf(line, sizeof(line), "#EXTINF:%.3f,\n%s\n",
+                 g_entries[i].duration / (double) AV_TIME_BASE, get_segment_name(g_entries[i].index).c_str());
+        text += line;
+    }
+
+    if (ended)
+        text += "#EXT-X-ENDLIST\n";
+
+    write_file_atomic(get_segment_path(SEGMENT_PLAYLIST), text.data(), text.size());
+}
+
+/** A live profile manifest with the segments so far, static once the last is in. */
+static void write_manifest(bool ended)
+{
+    int64_t total = 0;
+    int64_t bytes = 0;
+    std::string text;
+    char line[512];
+
+    for (size_t i = 0; i < g_entries.size(); i++)
+    {
+        total += g_entries[i].duration;
+        bytes += g_entries[i].size;
+    }
+
+    // Declared bit rates first, measured ones when the encoders have none
+    int64_t bandwidth = g_bandwidth;
+    if (bandwidth <= 0 && total > 0)
+        bandwidth = av_rescale(bytes * 8, AV_TIME_BASE, total);
+
+    text += "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+
+    if (ended)
+        snprintf(line, sizeof(line),
+                 "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+                 "type=\"static\" mediaPresentationDuration=\"PT%.3fS\" minBufferTime=\"PT%.1fS\">\n",
+                 total / (double) AV_TIME_BASE, g_options.segment_duration);
+    else
+        snprintf(line, sizeof(line),
+                 "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+                 "type=\"dynamic\" availabilityStartTime=\"%s\" minimumUpdatePeriod=\"PT%.1fS\" minBufferTime=\"PT%.1fS\">\n",
+                 g_availability_start, g_options.segment_duration, g_options.segment_duration);
+    text += line;
+
+    snprintf(line, sizeof(line),
+             "  <Period id=\"0\" start=\"PT0S\">\n"
+             "    <AdaptationSet mimeType=\"video/mp4\" segmentAlignment=\"true\" startWithSAP=\"1\">\n"
+             "      <Representation id=\"0\" bandwidth=\"%" PRId64 "\">\n"
+             "        <SegmentTemplate timescale=\"%d\" initialization=\"" SEGMENT_INIT "\" media=\"seg_$Number%%05d$.m4s\" startNumber=\"0\">\n"
+             "          <SegmentTimeline>\n",
+             bandwidth, MANIFEST_TIMESCALE);
+    text += line;
+
+    for (size_t i = 0; i < g_entries.size(); i++)
+    {
+        snprintf(line, sizeof(line), "            <S t=\"%" PRId64 "\" d=\"%" PRId64 "\"/>\n",
+                 av_rescale(g_entries[i].start, MANIFEST_TIMESCALE, AV_TIME_BASE),
+                 av_rescale(g_entries[i].duration, MANIFEST_TIMESCALE, AV_TIME_BASE));
+        text += line;
+    }
+
+    text += "          </SegmentTimeline>\n"
+            "        </SegmentTemplate>\n"
+            "      </Representation>\n"
+            "    </AdaptationSet>\n"
+            "  </Period>\n"
+            "</MPD>\n";
+
+    write_file_atomic(get_segment_path(SEGMENT_MANIFEST), text.data(), text.size());
+}
+
+static void *segment_thread_proc(void *)
+{
+    SegmentFile file;
+
+    while (av_thread_message_queue_recv(g_segment_queue, &file, 0) >= 0)
+    {
+        int ret = write_file_atomic(get_segment_path(get_segment_name(file.index).c_str()), file.data, file.size);
+
+        av_free(file.data);
+
+        if (ret < 0 || file.index < 0)
+            continue;
+
+        SegmentEntry entry = { file.index, file.start, file.duration, file.size };
+        g_entries.push_back(entry);
+
+        // Only listed once the segment is in place
+        write_playlist(false);
+
+        if (g_options.segment_cmaf)
+            write_manifest(false);
+    }
+
+    write_playlist(true);
+
+    if (g_options.segment_cmaf)
+        write_manifest(true);
+
+    return NULL;
+}
+
+/** Hand what the muxer wrote since the last call to the writer thread. */
+static int send_segment(int index, int64_t start, int64_t duration)
+{
+    SegmentFile file = { NULL, 0, index, start, duration };
+
+    file.size = avio_close_dyn_buf(g_seg_ctx->pb, &file.data);
+    g_seg_ctx->pb = NULL;
+
+    int ret = av_thread_message_queue_send(g_segment_queue, &file, 0);
+    if (ret < 0)
+    {
+        av_free(file.data);
+        av_log(NULL, AV_LOG_ERROR, "Could not queue segment %d: %s\n", index, av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+    }
+
+    return ret;
+}
+
+static int start_segment()
+{
+    int ret = avio_open_dyn_buf(&g_seg_ctx->pb);
+    if (ret < 0)
+        return ret;
+
+    // Every TS segment starts with its own PAT and PMT
+    if (!g_options.segment_cmaf)
+        av_opt_set(g_seg_ctx->priv_data, "mpegts_flags", "+resend_headers", 0);
+
+    g_segment_open = true;
+    return 0;
+}
+
+/** Flush the muxer into the current segment and send it, ending at end. */
+static int end_segment(int64_t end)
+{
+    // Out with the buffered PES packets or the pending fragment
+    av_write_frame(g_seg_ctx, NULL);
+
+    g_segment_open = false;
+
+    int64_t start = g_segment_start != AV_NOPTS_VALUE ? g_segment_start : 0;
+    int ret = send_segment(g_segment_index++, start, FFMAX(0, end - start));
+
+    g_segment_start = end;
+    return ret;
+}
+
+static int init_segment_bsf(AVStream *st, AVBSFContext **bsf)
+{
+    const AVBitStreamFilter *filter = av_bsf_get_by_name("dump_extra");
+    int ret;
+
+    if (!filter)
+        return AVERROR_BSF_NOT_FOUND;
+
+    if ((ret = av_bsf_alloc(filter, bsf)) < 0)
+        return ret;
+
+    if ((ret = avcodec_parameters_copy((*bsf)->par_in, st->codecpar)) < 0)
+        return ret;
+
+    (*bsf)->time_base_in = st->time_base;
+
+    return av_bsf_init(*bsf);
+}
+
+bool segmenter_needs_global_header()
+{
+    return g_options.segment_duration > 0 && g_options.segment_cmaf;
+}
+
+int init_segmenter()
+{
+    AVDictionary *opts = NULL;
+    int ret;
+
+    if (make_dir(g_options.segment_dir.c_str()) && errno != EEXIST)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not create segment directory '%s'\n", g_options.segment_dir.c_str());
+        return AVERROR(errno);
+    }
+
+    avformat_alloc_output_context2(&g_seg_ctx, NULL, g_options.segment_cmaf ? "mp4" : "mpegts", NULL);
+    if (!g_seg_ctx)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not create segment output context\n");
+        return AVERROR_UNKNOWN;
+    }
+
+    g_seg_streams.assign(g_ifmt_ctx->nb_streams, -1);
+    g_seg_bsfs.assign(g_ifmt_ctx->nb_streams, NULL);
+    g_bandwidth = 0;
+
+    for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
+    {
+        AVCodecContext *enc_ctx = g_stream_ctx[i].enc_ctx;
+
+        if (!enc_ctx)
+            continue;
+
+        AVStream *out_stream = avformat_new_stream(g_seg_ctx, NULL);
+        if (!out_stream)
+            return AVERROR(ENOMEM);
+
+        if ((ret = avcodec_parameters_from_context(out_stream->codecpar, enc_ctx)) < 0)
+            return ret;
+
+        out_stream->time_base = enc_ctx->time_base;
+        g_seg_streams[i] = out_stream->index;
+        g_bandwidth += enc_ctx->bit_rate;
+
+        // Cut on the video keyframes, or on the audio if there is no video
+        if (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+            (g_cut_stream < 0 || g_stream_ctx[g_cut_stream].enc_ctx->codec_type != AVMEDIA_TYPE_VIDEO))
+            g_cut_stream = i;
+        else if (g_cut_stream < 0)
+            g_cut_stream = i;
+    }
+
+    if (g_cut_stream < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Nothing to segment, no audio or video is encoded\n");
+        return AVERROR(EINVAL);
+    }
+
+    // An empty moov in the initialization segment, a fragment per segment
+    if (g_options.segment_cmaf)
+        av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+
+    if ((ret = start_segment()) < 0)
+        return ret;
+
+    ret = avformat_write_header(g_seg_ctx, &opts);
+    av_dict_free(&opts);
+
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not start the segmenter: %s\n", av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+        return ret;
+    }
+
+    // The muxer has settled on its time bases, the bitstream filters go by them
+    for (unsigned int i = 0; i < g_ifmt_ctx->nb_streams; i++)
+    {
+        if (g_seg_streams[i] < 0)
+            continue;
+
+        AVStream *st = g_seg_ctx->streams[g_seg_streams[i]];
+
+        // The encoders keep the parameter sets in the extradata when they have global headers
+        if (!g_options.segment_cmaf &&
+            st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            st->codecpar->extradata_size > 0 &&
+            (ret = init_segment_bsf(st, &g_seg_bsfs[i])) < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not set up the parameter sets for TS segments\n");
+            return ret;
+        }
+    }
+
+    time_t now = time(NULL);
+    strftime(g_availability_start, sizeof(g_availability_start), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    if ((ret = av_thread_message_queue_alloc(&g_segment_queue, SEGMENT_QUEUE_SIZE, sizeof(SegmentFile))) < 0)
+        return ret;
+
+    if ((ret = pthread_create(&g_segment_thread, NULL, segment_thread_proc, NULL)))
+    {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        av_thread_message_queue_free(&g_segment_queue);
+        return AVERROR(ret);
+    }
+
+    g_thread_started = true;
+
+    // The initialization segment is what the header wrote
+    if (g_options.segment_cmaf &&
+        ((ret = send_segment(-1, 0, 0)) < 0 || (ret = start_segment()) < 0))
+        return ret;
+
+    av_log(NULL, AV_LOG_INFO, "Writing %.1f second %s segments to %s\n", g_options.segment_duration,
+           g_options.segment_cmaf ? "CMAF" : "MPEG-TS", g_options.segment_dir.c_str());
+
+    return 0;
+}
+
+bool have_segmenter()
+{
+    return g_thread_started;
+}
+
+int segment_packet(const AVPacket *pkt, unsigned int stream_index, AVRational time_base)
+{
+    int ret;
+
+    if (!g_segment_open || stream_index >= g_seg_streams.size() || g_seg_streams[stream_index] < 0)
+        return 0;
+
+    if ((int) stream_index == g_cut_stream && pkt->pts != AV_NOPTS_VALUE)
+    {
+        int64_t time = av_rescale_q(pkt->pts, time_base, AV_TIME_BASE_Q);
+
+        if (g_segment_start == AV_NOPTS_VALUE)
+        {
+            g_segment_start = time;
+        }
+        else if ((pkt->flags & AV_PKT_FLAG_KEY) &&
+                 time - g_segment_start >= (int64_t) (g_options.segment_duration * AV_TIME_BASE))
+        {
+            if ((ret = end_segment(time)) < 0 || (ret = start_segment()) < 0)
+                return ret;
+        }
+
+        int64_t end = av_rescale_q(pkt->pts + pkt->duration, time_base, AV_TIME_BASE_Q);
+        g_segment_end = g_segment_end == AV_NOPTS_VALUE ? end : FFMAX(g_segment_end, end);
+    }
+
+    AVStream *st = g_seg_ctx->streams[g_seg_streams[stream_index]];
+    AVBSFContext *bsf = g_seg_bsfs[stream_index];
+    AVPacket copy = {0};
+
+    av_init_packet(&copy);
+
+    if ((ret = av_packet_ref(&copy, pkt)) < 0)
+        return ret;
+
+    copy.stream_index = st->index;
+    av_packet_rescale_ts(&copy, time_base, st->time_base);
+
+    if (!bsf)
+    {
+        ret = av_write_frame(g_seg_ctx, &copy);
+        av_packet_unref(&copy);
+    }
+    else if ((ret = av_bsf_send_packet(bsf, &copy)) >= 0)
+    {
+        while ((ret = av_bsf_receive_packet(bsf, &copy)) >= 0)
+        {
+            ret = av_write_frame(g_seg_ctx, &copy);
+            av_packet_unref(&copy);
+
+            if (ret < 0)
+                break;
+        }
+
+        if (ret == AVERROR(EAGAIN))
+            ret = 0;
+    }
+    else
+    {
+        av_packet_unref(&copy);
+    }
+
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not segment a packet of stream #%u: %s\n", stream_index, av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+
+    return ret;
+}
+
+void close_segmenter()
+{
+    if (g_seg_ctx)
+    {
+        if (g_thread_started && g_segment_open)
+            end_segment(g_segment_end != AV_NOPTS_VALUE ? g_segment_end : 0);
+
+        // The trailer has nothing the segments need, like the mfra after the last fragment
+        if (g_thread_started && avio_open_dyn_buf(&g_seg_ctx->pb) >= 0)
+        {
+            uint8_t *trailer = NULL;
+
+            av_write_trailer(g_seg_ctx);
+            avio_close_dyn_buf(g_seg_ctx->pb, &trailer);
+            av_free(trailer);
+        }
+        else if (g_seg_ctx->pb)
+        {
+            uint8_t *unused = NULL;
+
+            avio_close_dyn_buf(g_seg_ctx->pb, &unused);
+            av_free(unused);
+        }
+
+        g_seg_ctx->pb = NULL;
+        avformat_free_context(g_seg_ctx);
+        g_seg_ctx = NULL;
+    }
+
+    if (g_segment_queue)
+    {
+        av_thread_message_queue_set_err_recv(g_segment_queue, AVERROR_EOF);
+
+        if (g_thread_started)
+            pthread_join(g_segment_thread, NULL);
+
+        av_thread_message_queue_free(&g_segment_queue);
+    }
+
+    for (size_t i = 0; i < g_seg_bsfs.size(); i++)
+        av_bsf_free(&g_seg_bsfs[i]);
+
+    g_seg_bsfs.clear();
+    g_seg_streams.clear();
+    g_entries.clear();
+    g_thread_started = false;
+    g_segment_open = false;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+/** True if the encoders must be opened with AV_CODEC_FLAG_GLOBAL_HEADER, for CMAF segments. */
+bool segmenter_needs_global_header();
+
+/**
+ * Start cutting the encoded audio and video into segments in -segment_dir,
+ * once the encoders are open. MPEG-TS segments (seg_NNNNN.ts) get an HLS
+ * playlist, stream.m3u8. CMAF segments (init.mp4 and seg_NNNNN.m4s) get the
+ * HLS playlist and a DASH manifest, stream.mpd. Segments are finished and
+ * written, and the playlists rewritten, on a thread of their own.
+ */
+int init_segmenter();
+
+bool have_segmenter();
+
+/**
+ * Add a copy of an encoded packet of input stream stream_index, timestamps
+ * in time_base, to the current segment. A segment ends at the first video
+ * keyframe at least -segment seconds after it started, so each one starts
+ * with a keyframe.
+ */
+int segment_packet(const AVPacket *pkt, unsigned int stream_index, AVRational time_base);
+
+/** Finish the last segment, end the playlists and stop the thread. */
+void close_segmenter();
@@ -0,0 +1,333 @@
+/**
+ * @file
+ * Runs the chunk coordinator on the video of an input file with worker
+ * processes of this executable, and plays a worker that claimed the first
+ * chunk and then went quiet. The coordinator has to issue the chunk again
+ * without touching the quiet worker's claim, and keep the attempt that was
+ * done first when the quiet worker finishes late with a broken stream. The
+ * stitched stream is read back and must have a packet for every frame of
+ * the input.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+    #include <libavutil/time.h>
+}
+
+#include "../chunk_jobs.h"
+#include "../utils.h"
+
+#ifdef LINUX
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define TEST_CHUNKS 4
+#define TEST_WORKERS 2
+
+// How long the quiet worker waits for the coordinator, in seconds
+#define STEP_TIMEOUT 30
+
+// The quiet worker finishes this long after the re-run, past a coordinator poll
+#define LATE_FINISH_SECONDS 2
+
+typedef struct WorkerRun {
+    const char *executable;
+    std::string args;
+    pthread_t thread;
+    int exit_code;
+} WorkerRun;
+
+typedef struct QuietWorker {
+    const char *executable;
+    std::string job_dir;
+    pthread_t thread;
+    ContinueMutex coordinator_running;
+    bool claim_kept;                // The claim stayed put while the chunk was run again
+    bool finished_late;             // Done while the coordinator was still polling
+    WorkerRun workers[TEST_WORKERS];
+} QuietWorker;
+
+static std::string get_chunk_path(const std::string &job_dir, int index, int attempt, const char *ext)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "/chunk_%04d.%d.%s", index, attempt, ext);
+
+    return job_dir + name;
+}
+
+static bool file_exists(const std::string &path)
+{
+    struct stat info;
+
+    return stat(path.c_str(), &info) == 0;
+}
+
+/** Wait for a file to appear, false on timeout or once the coordinator is done. */
+static bool wait_for_file(QuietWorker *quiet, const std::string &path)
+{
+    int64_t start = av_gettime_relative();
+
+    while (!file_exists(path))
+    {
+        if (!quiet->coordinator_running.get() || av_gettime_relative() - start > STEP_TIMEOUT * 1000000LL)
+            return false;
+
+        av_usleep(10000);
+    }
+
+    return true;
+}
+
+static void *worker_thread_proc(void *arg)
+{
+    WorkerRun *run = (WorkerRun *) arg;
+
+    run->exit_code = RunProcess(run->executable, run->args.c_str());
+
+    return NULL;
+}
+
+static void *quiet_worker_thread_proc(void *arg)
+{
+    QuietWorker *quiet = (QuietWorker *) arg;
+    std::string job = get_chunk_path(quiet->job_dir, 0, 1, "job");
+    std::string claim = get_chunk_path(quiet->job_dir, 0, 1, "claim");
+
+    // Claim the first chunk before any worker runs, then look an hour gone
+    if (!wait_for_file(quiet, quiet->job_dir + "/manifest") || rename(job.c_str(), claim.c_str()))
+        return NULL;
+
+    struct utimbuf old_times;
+    old_times.actime = old_times.modtime = time(NULL) - 3600;
+    utime(claim.c_str(), &old_times);
+
+    // Workers start either way, so a coordinator that never issues it again still ends
+    quiet->claim_kept = wait_for_file(quiet, get_chunk_path(quiet->job_dir, 0, 2, "job")) && file_exists(claim);
+
+    for (int i = 0; i < TEST_WORKERS; i++)
+    {
+        WorkerRun *run = &quiet->workers[i];
+
+        run->executable = quiet->executable;
+        run->args = "-chunk_worker \"" + quiet->job_dir + "\"";
+        run->exit_code = kRunProcessError;
+
+        if (pthread_create(&run->thread, NULL, worker_thread_proc, run))
+            run->executable = NULL;
+    }
+
+    // The claim is not the coordinator's to move while the re-run is going
+    while (!file_exists(get_chunk_path(quiet->job_dir, 0, 2, "done")) && quiet->coordinator_running.get())
+    {
+        quiet->claim_kept = quiet->claim_kept && file_exists(claim);
+        av_usleep(10000);
+    }
+
+    quiet->claim_kept = quiet->claim_kept && file_exists(claim);
+
+    av_usleep(LATE_FINISH_SECONDS * 1000000);
+
+    // Finish late, like a worker would, with a stream that would not decode
+    FILE *f = fopen(get_chunk_path(quiet->job_dir, 0, 1, "h264").c_str(), "wb");
+
+    if (f)
+    {
+        for (int i = 0; i < 4096; i++)
+            fputc(0xff, f);
+
+        fclose(f);
+    }
+
+    utime(claim.c_str(), NULL);
+
+    quiet->finished_late = quiet->coordinator_running.get() &&
+                           !rename(claim.c_str(), get_chunk_path(quiet->job_dir, 0, 1, "done").c_str());
+
+    return NULL;
+}
+
+/** Video packets in file, read as format_name when given, -1 if it cannot be read. */
+static int count_video_packets(const char *file, const char *format_name)
+{
+    AVFormatContext *ifmt_ctx = NULL;
+    AVInputFormat *format = format_name ? av_find_input_format(format_name) : NULL;
+    AVPacket packet;
+    int packets = 0;
+
+    if (avformat_open_input(&ifmt_ctx, file, format, NULL) < 0)
+        return -1;
+
+    int stream_index = -1;
+
+    if (avformat_find_stream_info(ifmt_ctx, NULL) >= 0)
+        stream_index = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+
+    av_init_packet(&packet);
+
+    while (stream_index >= 0 && av_read_frame(ifmt_ctx, &packet) >= 0)
+    {
+        if (packet.stream_index == stream_index)
+            packets++;
+
+        av_packet_unref(&packet);
+    }
+
+    avformat_close_input(&ifmt_ctx);
+
+    return stream_index >= 0 ? packets : -1;
+}
+
+/** An encoder set up for the stream the way the transcoder sets up its video encoders. */
+static AVCodecContext *open_encoder(AVFormatContext *ifmt_ctx, AVStream *st)
+{
+    AVCodec *encoder = avcodec_find_encoder_by_name("libx264");
+
+    if (!encoder)
+        return NULL;
+
+    AVCodecContext *enc_ctx = avcodec_alloc_context3(encoder);
+
+    if (!enc_ctx)
+        return NULL;
+
+    AVRational framerate = av_guess_frame_rate(ifmt_ctx, st, NULL);
+
+    enc_ctx->width = st->codecpar->width;
+    enc_ctx->height = st->codecpar->height;
+    enc_ctx->sample_aspect_ratio.num = 1;
+    enc_ctx->sample_aspect_ratio.den = 1;
+    enc_ctx->pix_fmt = avcodec_find_best_pix_fmt_of_list(encoder->pix_fmts, (enum AVPixelFormat) st->codecpar->format, 0, NULL);
+    enc_ctx->time_base = av_inv_q(framerate);
+    enc_ctx->framerate = framerate;
+    enc_ctx->gop_size = 10;
+    enc_ctx->max_b_frames = 1;
+
+    if (avcodec_open2(enc_ctx, encoder, NULL) < 0)
+        avcodec_free_context(&enc_ctx);
+
+    return enc_ctx;
+}
+
+bool DoChunkJobsTest(const char *executable, const char *input_file)
+{
+    char work_dir[] = "/tmp/chunk_jobs_test_XXXXXX";
+    std::string output_file;
+    std::vector<VideoChunk> chunks;
+    AVFormatContext *ifmt_ctx = NULL;
+    AVFormatContext *ofmt_ctx = NULL;
+    AVCodecContext *enc_ctx = NULL;
+    AVStream *st = NULL;
+    QuietWorker quiet;
+    int ret = -1;
+
+    av_register_all();
+
+    if (!mkdtemp(work_dir))
+    {
+        printf("chunk jobs test: could not create a work directory\n");
+        return false;
+    }
+
+    output_file = std::string(work_dir) + "/output.h264";
+
+    if (avformat_open_input(&ifmt_ctx, input_file, NULL, NULL) >= 0 &&
+        avformat_find_stream_info(ifmt_ctx, NULL) >= 0)
+    {
+        ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        st = ret >= 0 ? ifmt_ctx->streams[ret] : NULL;
+    }
+
+    if (st)
+        enc_ctx = open_encoder(ifmt_ctx, st);
+
+    if (enc_ctx)
+        ret = plan_video_chunks(input_file, st->index, TEST_CHUNKS, -1, -1, chunks);
+
+    if (!enc_ctx || ret < 0 ||
+        avformat_alloc_output_context2(&ofmt_ctx, NULL, "h264", output_file.c_str()) < 0 ||
+        avio_open(&ofmt_ctx->pb, output_file.c_str(), AVIO_FLAG_WRITE) < 0)
+    {
+        printf("chunk jobs test: could not set up %s\n", input_file);
+        avformat_free_context(ofmt_ctx);
+        avcodec_free_context(&enc_ctx);
+        avformat_close_input(&ifmt_ctx);
+        rmdir(work_dir);
+        return false;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/chunks_%d", (int) getpid());
+
+    quiet.executable = executable;
+    quiet.job_dir = std::string(work_dir) + name;
+    quiet.claim_kept = false;
+    quiet.finished_late = false;
+
+    for (int i = 0; i < TEST_WORKERS; i++)
+        quiet.workers[i].executable = NULL;
+
+    bool quiet_running = !pthread_create(&quiet.thread, NULL, quiet_worker_thread_proc, &quiet);
+
+    // No local workers, the quiet worker starts them once the chunk it holds is issued again
+    ret = run_chunk_coordinator(executable, work_dir, 0, input_file, st, enc_ctx, ofmt_ctx, chunks);
+
+    quiet.coordinator_running.set(false);
+
+    if (quiet_running)
+        pthread_join(quiet.thread, NULL);
+
+    for (int i = 0; i < TEST_WORKERS; i++)
+    {
+        if (quiet.workers[i].executable)
+            pthread_join(quiet.workers[i].thread, NULL);
+    }
+
+    avio_closep(&ofmt_ctx->pb);
+    avformat_free_context(ofmt_ctx);
+
+    int input_packets = count_video_packets(input_file, NULL);
+    int output_packets = ret >= 0 ? count_video_packets(output_file.c_str(), "h264") : -1;
+
+    printf("chunk jobs test: coordinator %d, %d chunks, claim %s, late finish %s, %d of %d packets\n",
+           ret, (int) chunks.size(), quiet.claim_kept ? "kept" : "moved",
+           quiet.finished_late ? "before the end" : "after the end", output_packets, input_packets);
+
+    bool ok = ret >= 0 && quiet.claim_kept && input_packets > 0 && output_packets == input_packets;
+
+    // The coordinator removed its job directory, a worker it gave up on may have left files
+    remove(output_file.c_str());
+    remove(get_chunk_path(quiet.job_dir, 0, 1, "claim").c_str());
+    remove(get_chunk_path(quiet.job_dir, 0, 1, "done").c_str());
+    remove(get_chunk_path(quiet.job_dir, 0, 1, "h264").c_str());
+    rmdir(quiet.job_dir.c_str());
+    rmdir(work_dir);
+
+    avcodec_free_context(&enc_ctx);
+    avformat_close_input(&ifmt_ctx);
+
+    printf("chunk jobs test: %s\n", ok ? "passed" : "failed");
+
+    return ok;
+}
+
+#else
+
+bool DoChunkJobsTest(const char *executable, const char *input_file)
+{
+    printf("The chunk jobs test is only supported on Linux\n");
+    return false;
+}
+
+#endif
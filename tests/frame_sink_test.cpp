@@ -0,0 +1,269 @@
+/**
+ * @file
+ * A minimal consumer of the -frame_sink ring, and a self test that publishes
+ * synthetic frames to a forked consumer. The consumer maps the ring, reads
+ * every frame in order and checks its sequence number and that its pts goes
+ * up, as a real consumer would before handing the frame on.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+    #include <libavutil/time.h>
+}
+
+#include "../frame_sink.h"
+
+#ifdef LINUX
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TEST_SLOTS 4
+#define TEST_FRAMES 200
+#define TEST_WIDTH 320
+#define TEST_HEIGHT 240
+#define TEST_PTS_STEP 1001
+
+// How long the consumer waits for the ring to appear, and for a frame, in seconds
+#define OPEN_TIMEOUT 10
+#define FRAME_TIMEOUT 30
+
+static void futex_wait(uint32_t *word, uint32_t value)
+{
+    struct timespec timeout = { 1, 0 };
+
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/** Map the ring once the producer has set it up, NULL on timeout. */
+static uint8_t *map_ring(const char *name, size_t *size)
+{
+    int64_t start = av_gettime_relative();
+
+    while (av_gettime_relative() - start < OPEN_TIMEOUT * 1000000LL)
+    {
+        int fd = shm_open(name, O_RDWR, 0);
+        struct stat st;
+
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(FrameRingHeader))
+        {
+            void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (map != MAP_FAILED)
+            {
+                FrameRingHeader *header = (FrameRingHeader *) map;
+
+                if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == FRAME_RING_MAGIC)
+                {
+                    *size = st.st_size;
+                    return (uint8_t *) map;
+                }
+
+                munmap(map, st.st_size);
+            }
+        }
+        else if (fd >= 0)
+            close(fd);
+
+        av_usleep(10000);
+    }
+
+    return NULL;
+}
+
+/**
+ * Read frames until the ring is closed. With expected_frames >= 0 also
+ * check the count and the synthetic frames DoFrameSinkTest publishes.
+ */
+static bool consume(const char *name, int64_t expected_frames)
+{
+    size_t size = 0;
+    uint8_t *map = map_ring(name, &size);
+
+    if (!map)
+    {
+        printf("frame sink consumer: no ring at %s\n", name);
+        return false;
+    }
+
+    FrameRingHeader *header = (FrameRingHeader *) map;
+    FrameDescriptor *descriptors = (FrameDescriptor *) (header + 1);
+    int64_t frames = 0;
+    int64_t last_pts = AV_NOPTS_VALUE;
+    int bad = 0;
+
+    if (header->version != FRAME_RING_VERSION ||
+        header->data_offset + (uint64_t) header->slot_count * header->slot_size > size)
+    {
+        printf("frame sink consumer: unexpected ring layout\n");
+        munmap(map, size);
+        return false;
+    }
+
+    while (1)
+    {
+        uint32_t read_seq = header->read_seq;
+        uint32_t write_seq = __atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE);
+        int64_t start = av_gettime_relative();
+
+        while (write_seq == read_seq && !__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+        {
+            if (av_gettime_relative() - start > FRAME_TIMEOUT * 1000000LL)
+                break;
+
+            futex_wait(&header->write_seq, write_seq);
+            write_seq = __atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE);
+        }
+
+        // Closed is only set after the last frame is published
+        if (write_seq == read_seq)
+        {
+            if (!header->closed)
+            {
+                printf("frame sink consumer: no frame for %d s\n", FRAME_TIMEOUT);
+                bad++;
+            }
+            break;
+        }
+
+        const FrameDescriptor *desc = &descriptors[read_seq % header->slot_count];
+        const uint8_t *slot = map + header->data_offset + (uint64_t) (read_seq % header->slot_count) * header->slot_size;
+
+        if (desc->sequence != read_seq || desc->size > header->slot_size)
+            bad++;
+
+        if (desc->pts != AV_NOPTS_VALUE)
+        {
+            if (last_pts != AV_NOPTS_VALUE && desc->pts <= last_pts)
+                bad++;
+
+            last_pts = desc->pts;
+        }
+
+        if (expected_frames >= 0 &&
+            (desc->pts != (int64_t) read_seq * TEST_PTS_STEP ||
+             desc->width != TEST_WIDTH || desc->height != TEST_HEIGHT ||
+             slot[desc->plane_offset[0]] != (uint8_t) read_seq))
+            bad++;
+
+        frames++;
+
+        __atomic_store_n(&header->read_seq, read_seq + 1, __ATOMIC_RELEASE);
+        futex_wake(&header->read_seq);
+    }
+
+    if (expected_frames >= 0 && frames != expected_frames)
+        bad++;
+
+    printf("frame sink consumer: %" PRId64 " frames, %d bad\n", frames, bad);
+
+    munmap(map, size);
+
+    return bad == 0;
+}
+
+bool DoFrameSinkConsumer(const char *name)
+{
+    return consume(name, -1);
+}
+
+bool DoFrameSinkTest()
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "/frame_sink_test_%d", (int) getpid());
+
+    AVCodecContext *enc_ctx = avcodec_alloc_context3(NULL);
+    AVFrame *frame = av_frame_alloc();
+    bool ok = enc_ctx && frame;
+
+    if (ok)
+    {
+        enc_ctx->width = frame->width = TEST_WIDTH;
+        enc_ctx->height = frame->height = TEST_HEIGHT;
+        enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        enc_ctx->time_base = { 1, 30000 };
+        frame->format = AV_PIX_FMT_YUV420P;
+
+        ok = av_frame_get_buffer(frame, 32) >= 0 && init_frame_sink(name, TEST_SLOTS, 0, enc_ctx) >= 0;
+    }
+
+    if (!ok)
+    {
+        printf("frame sink test: setup failed\n");
+        av_frame_free(&frame);
+        avcodec_free_context(&enc_ctx);
+        return false;
+    }
+
+    fflush(stdout);
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        bool consumed = consume(name, TEST_FRAMES);
+        fflush(stdout);
+        _exit(consumed ? 0 : 1);
+    }
+
+    // Far more frames than slots, so the producer waits on the consumer
+    for (int i = 0; i < TEST_FRAMES && pid > 0; i++)
+    {
+        memset(frame->data[0], (uint8_t) i, frame->linesize[0] * frame->height);
+        frame->pts = (int64_t) i * TEST_PTS_STEP;
+
+        if (send_frame_sink_frame(0, frame) < 0)
+        {
+            ok = false;
+            break;
+        }
+    }
+
+    close_frame_sink();
+
+    int status = 0;
+
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ok = false;
+
+    av_frame_free(&frame);
+    avcodec_free_context(&enc_ctx);
+
+    printf("frame sink test: %s\n", ok ? "passed" : "failed");
+
+    return ok;
+}
+
+#else
+
+bool DoFrameSinkConsumer(const char *name)
+{
+    printf("The shared memory frame sink is only supported on Linux\n");
+    return false;
+}
+
+bool DoFrameSinkTest()
+{
+    printf("The shared memory frame sink is only supported on Linux\n");
+    return false;
+}
+
+#endif
@@ -0,0 +1,344 @@
+/**
+ * @file
+ * Reads a synthetic input through the -read_ahead ring, from a local HTTP
+ * stand-in server and from a file, with random read sizes and seeks, and
+ * checks every byte. The server logs the range of each request, so the test
+ * also checks that the fetchers ask for bounded runs and never for the rest
+ * of the input.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+}
+
+#include "../ffmpeg_transcoder.h"
+#include "../read_ahead.h"
+
+extern Options g_options;
+
+#ifdef LINUX
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define TEST_SIZE (37 * 1024 * 1024 + 123)
+#define TEST_READS 3000
+#define TEST_MAX_READ 100000
+#define TEST_READ_AHEAD_MB 8
+#define TEST_FETCHES 4
+
+typedef struct HttpRequest {
+    int64_t start;
+    int64_t end;                // Inclusive, -1 for open ended
+} HttpRequest;
+
+// The HTTP stand-in, one request per connection
+static int g_listen_fd = -1;
+static pthread_mutex_t g_requests_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<HttpRequest> g_requests;
+
+static uint8_t test_byte(int64_t pos)
+{
+    return (uint8_t) ((pos * 31) ^ (pos >> 20));
+}
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static void *http_connection_proc(void *arg)
+{
+    int fd = (int) (intptr_t) arg;
+    std::string request;
+    char buf[4096];
+
+    while (request.find("\r\n\r\n") == std::string::npos)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+        {
+            close(fd);
+            return NULL;
+        }
+
+        request.append(buf, n);
+    }
+
+    HttpRequest range = { 0, -1 };
+    size_t p = request.find("Range: bytes=");
+
+    if (p != std::string::npos)
+    {
+        const char *spec = request.c_str() + p + strlen("Range: bytes=");
+        char *end = NULL;
+
+        range.start = strtoll(spec, &end, 10);
+        if (*end == '-' && end[1] >= '0' && end[1] <= '9')
+            range.end = strtoll(end + 1, NULL, 10);
+    }
+
+    pthread_mutex_lock(&g_requests_mutex);
+    g_requests.push_back(range);
+    pthread_mutex_unlock(&g_requests_mutex);
+
+    int64_t last = range.end < 0 ? TEST_SIZE - 1 : FFMIN(range.end, (int64_t) TEST_SIZE - 1);
+    char header[512];
+
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 206 Partial Content\r\n"
+             "Accept-Ranges: bytes\r\n"
+             "Content-Type: application/octet-stream\r\n"
+             "Content-Range: bytes %" PRId64 "-%" PRId64 "/%d\r\n"
+             "Content-Length: %" PRId64 "\r\n"
+             "Connection: close\r\n\r\n",
+             range.start, last, TEST_SIZE, last - range.start + 1);
+
+    bool ok = send_all(fd, header, strlen(header));
+
+    // The client hangs up on an open ended response when it is done with it
+    for (int64_t pos = range.start; ok && pos <= last; pos += sizeof(buf))
+    {
+        int len = (int) FFMIN((int64_t) sizeof(buf), last - pos + 1);
+
+        for (int i = 0; i < len; i++)
+            buf[i] = test_byte(pos + i);
+
+        ok = send_all(fd, buf, len);
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static void *http_server_proc(void *)
+{
+    while (1)
+    {
+        int fd = accept(g_listen_fd, NULL, NULL);
+        if (fd < 0)
+            break;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, http_connection_proc, (void *) (intptr_t) fd))
+            close(fd);
+        else
+            pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/** Start the HTTP stand-in on a free port of the loopback address, 0 on failure. */
+static int start_http_server(pthread_t *thread)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    g_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (g_listen_fd < 0 ||
+        bind(g_listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(g_listen_fd, 16) < 0 ||
+        getsockname(g_listen_fd, (struct sockaddr *) &addr, &len) < 0 ||
+        pthread_create(thread, NULL, http_server_proc, NULL))
+    {
+        if (g_listen_fd >= 0)
+            close(g_listen_fd);
+        g_listen_fd = -1;
+        return 0;
+    }
+
+    return ntohs(addr.sin_port);
+}
+
+static void stop_http_server(pthread_t thread)
+{
+    // Wakes the accept
+    shutdown(g_listen_fd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(g_listen_fd);
+    g_listen_fd = -1;
+}
+
+/** Random reads, seeks here and there and to near the end, every byte checked. */
+static bool read_through(const char *url)
+{
+    AVIOContext *pb = NULL;
+    int ret = open_read_ahead_input(&pb, url);
+
+    if (ret < 0)
+    {
+        printf("read ahead test: could not open %s\n", url);
+        return false;
+    }
+
+    std::vector<uint8_t> buf(TEST_MAX_READ);
+    int64_t pos = 0;
+    int bad = 0;
+
+    srand(1);
+
+    for (int i = 0; i < TEST_READS; i++)
+    {
+        if (rand() % 300 == 0)
+        {
+            pos = rand() % TEST_SIZE;
+            avio_seek(pb, pos, SEEK_SET);
+        }
+
+        if (rand() % 400 == 0)
+        {
+            pos = TEST_SIZE - 50;
+            avio_seek(pb, pos, SEEK_SET);
+        }
+
+        int n = avio_read(pb, buf.data(), rand() % TEST_MAX_READ + 1);
+
+        if (n <= 0)
+        {
+            // Only at the end
+            if (pos != TEST_SIZE)
+                bad++;
+
+            pos = 0;
+            avio_seek(pb, 0, SEEK_SET);
+            continue;
+        }
+
+        for (int j = 0; j < n; j++)
+        {
+            if (buf[j] != test_byte(pos + j))
+            {
+                bad++;
+                break;
+            }
+        }
+
+        pos += n;
+    }
+
+    close_read_ahead_input(&pb);
+
+    printf("read ahead test: %s, %d bad reads\n", url, bad);
+
+    return bad == 0;
+}
+
+static bool test_http()
+{
+    pthread_t server;
+    int port = start_http_server(&server);
+
+    if (!port)
+    {
+        printf("read ahead test: could not start the HTTP server\n");
+        return false;
+    }
+
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/input.bin", port);
+
+    bool ok = read_through(url);
+
+    stop_http_server(server);
+
+    // The first request only finds out the size, the fetchers ask for their runs
+    int open_ended = 0;
+    int64_t longest = 0;
+
+    pthread_mutex_lock(&g_requests_mutex);
+
+    int requests = (int) g_requests.size();
+
+    for (int i = 1; i < requests; i++)
+    {
+        if (g_requests[i].end < 0)
+            open_ended++;
+        else
+            longest = FFMAX(longest, g_requests[i].end - g_requests[i].start + 1);
+    }
+
+    pthread_mutex_unlock(&g_requests_mutex);
+
+    printf("read ahead test: %d requests, %d open ended, longest %.1f MB\n",
+           requests, open_ended, longest / 1048576.0);
+
+    return ok && requests > 1 && open_ended == 0;
+}
+
+static bool test_file()
+{
+    char file_name[] = "/tmp/read_ahead_test_XXXXXX";
+    int fd = mkstemp(file_name);
+
+    if (fd < 0)
+    {
+        printf("read ahead test: could not create a file\n");
+        return false;
+    }
+
+    std::vector<uint8_t> data(TEST_SIZE);
+    for (int64_t i = 0; i < TEST_SIZE; i++)
+        data[i] = test_byte(i);
+
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t) data.size();
+    close(fd);
+
+    ok = ok && read_through(file_name);
+
+    unlink(file_name);
+
+    return ok;
+}
+
+bool DoReadAheadTest()
+{
+    avformat_network_init();
+
+    g_options.read_ahead = TEST_READ_AHEAD_MB;
+    g_options.read_ahead_fetches = TEST_FETCHES;
+
+    bool ok = test_http();
+    ok = test_file() && ok;
+
+    printf("read ahead test: %s\n", ok ? "passed" : "failed");
+
+    return ok;
+}
+
+#else
+
+bool DoReadAheadTest()
+{
+    printf("The read ahead test needs the Linux socket API\n");
+    return false;
+}
+
+#endif
@@ -0,0 +1,184 @@
+/**
+ * @file
+ * Times the fast_scale kernels, AVX2 and C, against sws_scale on synthetic
+ * 1080p and 4K frames, and checks the AVX2 output against the C kernels.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/time.h>
+    #include <libswscale/swscale.h>
+}
+
+#include "../fast_scale.h"
+
+#define BENCHMARK_ITERATIONS 50
+
+typedef struct BenchmarkCase {
+    const char *name;
+    int src_width;
+    int src_height;
+    AVPixelFormat src_fmt;
+    int dst_width;
+    int dst_height;
+} BenchmarkCase;
+
+static const BenchmarkCase benchmark_cases[] = {
+    { "1080p 2:1",       1920, 1080, AV_PIX_FMT_YUV420P,  960,  540 },
+    { "4K 2:1",          3840, 2160, AV_PIX_FMT_YUV420P, 1920, 1080 },
+    { "1080p 3:2",       1920, 1080, AV_PIX_FMT_YUV420P, 1280,  720 },
+    { "4K 3:2",          3840, 2160, AV_PIX_FMT_YUV420P, 2560, 1440 },
+    { "1080p 422->420",  1920, 1080, AV_PIX_FMT_YUV422P, 1920, 1080 },
+    { "4K 422->420",     3840, 2160, AV_PIX_FMT_YUV422P, 3840, 2160 },
+};
+
+static AVFrame *alloc_benchmark_frame(int width, int height, AVPixelFormat fmt)
+{
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        return NULL;
+
+    frame->width = width;
+    frame->height = height;
+    frame->format = fmt;
+
+    if (av_frame_get_buffer(frame, 32) < 0)
+        av_frame_free(&frame);
+
+    return frame;
+}
+
+/** Gradients with some noise, so neither kernel sees flat planes. */
+static void fill_benchmark_frame(AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat) frame->format);
+    unsigned seed = 12345;
+
+    for (int p = 0; p < 3; p++)
+    {
+        int w = p ? AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w) : frame->width;
+        int h = p ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+
+        for (int y = 0; y < h; y++)
+        {
+            uint8_t *row = frame->data[p] + y * frame->linesize[p];
+
+            for (int x = 0; x < w; x++)
+            {
+                seed = seed * 1103515245 + 12345;
+                row[x] = (uint8_t) ((x + 2 * y + p * 64 + ((seed >> 16) & 31)) & 0xFF);
+            }
+        }
+    }
+}
+
+static int count_mismatches(const AVFrame *a, const AVFrame *b)
+{
+    int mismatches = 0;
+
+    for (int p = 0; p < 3; p++)
+    {
+        int w = p ? (a->width + 1) >> 1 : a->width;
+        int h = p ? (a->height + 1) >> 1 : a->height;
+
+        for (int y = 0; y < h; y++)
+        {
+            if (memcmp(a->data[p] + y * a->linesize[p], b->data[p] + y * b->linesize[p], w))
+                mismatches++;
+        }
+    }
+
+    return mismatches;
+}
+
+/** Milliseconds per frame of fast_scale over the whole picture. */
+static double time_fast_scale(EFastScaleKind kind, const AVFrame *src, AVFrame *dst, bool simd)
+{
+    int64_t start = av_gettime_relative();
+
+    for (int i = 0; i < BENCHMARK_ITERATIONS; i++)
+        fast_scale(kind, src, dst, 0, dst->height, simd);
+
+    return (av_gettime_relative() - start) / 1000.0 / BENCHMARK_ITERATIONS;
+}
+
+static double time_sws_scale(struct SwsContext *ctx, const AVFrame *src, AVFrame *dst)
+{
+    int64_t start = av_gettime_relative();
+
+    for (int i = 0; i < BENCHMARK_ITERATIONS; i++)
+        sws_scale(ctx, src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+
+    return (av_gettime_relative() - start) / 1000.0 / BENCHMARK_ITERATIONS;
+}
+
+bool DoScalerBenchmark()
+{
+    bool ok = true;
+
+    printf("AVX2 kernels: %s\n", have_fast_scale_simd() ? "yes" : "no");
+    printf("%-16s %10s %10s %10s %10s %10s\n", "case", "avx2 ms", "c ms", "bicubic", "bilinear", "mismatch");
+
+    for (size_t i = 0; i < sizeof(benchmark_cases) / sizeof(benchmark_cases[0]); i++)
+    {
+        const BenchmarkCase &c = benchmark_cases[i];
+
+        EFastScaleKind kind = find_fast_scale(c.src_width, c.src_height, c.src_fmt,
+                                              c.dst_width, c.dst_height, AV_PIX_FMT_YUV420P);
+        if (kind == kNoFastScale)
+        {
+            printf("%-16s no fast path\n", c.name);
+            ok = false;
+            continue;
+        }
+
+        AVFrame *src = alloc_benchmark_frame(c.src_width, c.src_height, c.src_fmt);
+        AVFrame *dst_simd = alloc_benchmark_frame(c.dst_width, c.dst_height, AV_PIX_FMT_YUV420P);
+        AVFrame *dst_c = alloc_benchmark_frame(c.dst_width, c.dst_height, AV_PIX_FMT_YUV420P);
+        AVFrame *dst_sws = alloc_benchmark_frame(c.dst_width, c.dst_height, AV_PIX_FMT_YUV420P);
+
+        struct SwsContext *bicubic = sws_getContext(c.src_width, c.src_height, c.src_fmt,
+                                                    c.dst_width, c.dst_height, AV_PIX_FMT_YUV420P,
+                                                    SWS_BICUBIC, NULL, NULL, NULL);
+        struct SwsContext *bilinear = sws_getContext(c.src_width, c.src_height, c.src_fmt,
+                                                     c.dst_width, c.dst_height, AV_PIX_FMT_YUV420P,
+                                                     SWS_FAST_BILINEAR, NULL, NULL, NULL);
+
+        if (src && dst_simd && dst_c && dst_sws && bicubic && bilinear)
+        {
+            fill_benchmark_frame(src);
+
+            double simd_ms = time_fast_scale(kind, src, dst_simd, true);
+            double c_ms = time_fast_scale(kind, src, dst_c, false);
+            double bicubic_ms = time_sws_scale(bicubic, src, dst_sws);
+            double bilinear_ms = time_sws_scale(bilinear, src, dst_sws);
+
+            // The AVX2 kernels round exactly like the C ones
+            int mismatches = count_mismatches(dst_simd, dst_c);
+            if (mismatches)
+                ok = false;
+
+            printf("%-16s %10.3f %10.3f %10.3f %10.3f %10d\n",
+                   c.name, simd_ms, c_ms, bicubic_ms, bilinear_ms, mismatches);
+        }
+        else
+        {
+            printf("%-16s allocation failed\n", c.name);
+            ok = false;
+        }
+
+        sws_freeContext(bicubic);
+        sws_freeContext(bilinear);
+        av_frame_free(&src);
+        av_frame_free(&dst_simd);
+        av_frame_free(&dst_c);
+        av_frame_free(&dst_sws);
+    }
+
+    return ok;
+}
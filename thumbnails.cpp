@@ -0,0 +1,379 @@
+#include "thumbnails.h"
+#include "ffmpeg_transcoder.h"
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/threadmessage.h>
+    #include <libswscale/swscale.h>
+}
+
+#include <pthread.h>
+#include <stdio.h>
+#include <vector>
+
+#define THUMBNAIL_QUEUE_SIZE 8
+
+// Minimum spacing between two scene change thumbnails, in seconds
+#define SCENE_MIN_SPACING 1.0
+
+#define SPRITE_NAME "sprite_%03d.jpg"
+#define THUMBNAIL_VTT_FILE "thumbnails.vtt"
+#define THUMBNAIL_JSON_FILE "thumbnails.json"
+
+extern Options g_options;
+
+typedef struct ThumbnailFrame {
+    AVFrame *frame;
+    double  time;
+} ThumbnailFrame;
+
+typedef struct ThumbnailEntry {
+    double time;
+    int    sheet;
+    int    x;
+    int    y;
+} ThumbnailEntry;
+
+static char g_error[AV_ERROR_MAX_STRING_SIZE] = {0};
+
+static AVThreadMessageQueue *g_thumbnail_queue = NULL;
+static pthread_t g_thumbnail_thread;
+static unsigned int g_stream_index = 0;
+static AVRational g_time_base;
+static int g_thumb_width = 0;
+static int g_thumb_height = 0;
+
+// Decode thread state
+static double g_next_thumbnail_time = 0;
+static double g_last_thumbnail_time = -1;
+static double g_last_frame_time = 0;
+
+// Thumbnail thread state
+static struct SwsContext *g_sws_ctx = NULL;
+static AVCodecContext *g_sheet_enc_ctx = NULL;
+static AVFrame *g_sheet = NULL;
+static int g_sheet_num = 0;
+static int g_sheet_tiles = 0;
+static std::vector<ThumbnailEntry> g_entries;
+
+static int open_sheet_encoder()
+{
+    AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+
+    if (!encoder)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Thumbnailer could not find the MJPEG encoder\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    g_sheet_enc_ctx = avcodec_alloc_context3(encoder);
+    if (!g_sheet_enc_ctx)
+        return AVERROR(ENOMEM);
+
+    g_sheet_enc_ctx->width = g_thumb_width * g_options.sprite_columns;
+    g_sheet_enc_ctx->height = g_thumb_height * g_options.sprite_rows;
+    g_sheet_enc_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    g_sheet_enc_ctx->time_base = { 1, 25 };
+    g_sheet_enc_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+    g_sheet_enc_ctx->global_quality = FF_QP2LAMBDA * 3;
+
+    int ret = avcodec_open2(g_sheet_enc_ctx, encoder, NULL);
+    if (ret < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Thumbnailer could not open the MJPEG encoder: %s\n", av_make_error_string(g_error, AV_ERROR_MAX_STRING_SIZE, ret));
+        return ret;
+    }
+
+    g_sheet = av_frame_alloc();
+    if (!g_sheet)
+        return AVERROR(ENOMEM);
+
+    g_sheet->format = g_sheet_enc_ctx->pix_fmt;
+    g_sheet->width = g_sheet_enc_ctx->width;
+    g_sheet->height = g_sheet_enc_ctx->height;
+
+    return av_frame_get_buffer(g_sheet, 32);
+}
+
+static void clear_sheet()
+{
+    for (int y = 0; y < g_sheet->height; y++)
+        memset(g_sheet->data[0] + y * g_sheet->linesize[0], 16, g_sheet->width);
+
+    for (int plane = 1; plane < 3; plane++)
+        for (int y = 0; y < g_sheet->height / 2; y++)
+            memset(g_sheet->data[plane] + y * g_sheet->linesize[plane], 128, g_sheet->width / 2);
+}
+
+static int write_sheet()
+{
+    char filename[64];
+    AVPacket pkt = {0};
+
+    av_init_packet(&pkt);
+
+    int ret = avcodec_send_frame(g_sheet_enc_ctx, g_sheet);
+    if (ret < 0)
+        return ret;
+
+    ret = avcodec_receive_packet(g_sheet_enc_ctx, &pkt);
+    if (ret < 0)
+        return ret;
+
+    snprintf(filename, sizeof(filename), SPRITE_NAME, g_sheet_num);
+
+    FILE *f = fopen(filename, "wb");
+    if (f)
+    {
+        fwrite(pkt.data, 1, pkt.size, f);
+        fclose(f);
+    }
+    else
+    {
+        av_log(NULL, AV_LOG_ERROR, "Thumbnailer could not write %s\n", filename);
+        ret = AVERROR(EIO);
+    }
+
+    av_packet_unref(&pkt);
+
+    g_sheet_num++;
+    g_sheet_tiles = 0;
+
+    return ret;
+}
+
+static int add_thumbnail(ThumbnailFrame *thumb)
+{
+    AVFrame *frame = thumb->frame;
+
+    g_sws_ctx = sws_getCachedContext(g_sws_ctx,
+                                     frame->width, frame->height, (AVPixelFormat) frame->format,
+                                     g_thumb_width, g_thumb_height, AV_PIX_FMT_YUVJ420P,
+                                     SWS_BILINEAR, NULL, NULL, NULL);
+
+    if (!g_sws_ctx)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Thumbnailer cannot initialize the conversion context\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (g_sheet_tiles == 0)
+    {
+        // The encoder may still hold a reference to the last sheet
+        int ret = av_frame_make_writable(g_sheet);
+        if (ret < 0)
+            return ret;
+
+        clear_sheet();
+    }
+
+    ThumbnailEntry entry;
+    entry.time = thumb->time;
+    entry.sheet = g_sheet_num;
+    entry.x = (g_sheet_tiles % g_options.sprite_columns) * g_thumb_width;
+    entry.y = (g_sheet_tiles / g_options.sprite_columns) * g_thumb_height;
+
+    // Scale straight into the tile of the sprite sheet
+    uint8_t *dst[4] = {
+        g_sheet->data[0] + entry.y * g_sheet->linesize[0] + entry.x,
+        g_sheet->data[1] + (entry.y / 2) * g_sheet->linesize[1] + entry.x / 2,
+        g_sheet->data[2] + (entry.y / 2) * g_sheet->linesize[2] + entry.x / 2,
+        NULL
+    };
+
+    sws_scale(g_sws_ctx, frame->data, frame->linesize, 0, frame->height, dst, g_sheet->linesize);
+
+    g_entries.push_back(entry);
+
+    if (++g_sheet_tiles == g_options.sprite_columns * g_options.sprite_rows)
+        return write_sheet();
+
+    return 0;
+}
+
+static void format_vtt_time(char *buf, size_t size, double t)
+{
+    int64_t ms = (int64_t) (t * 1000.0 + 0.5);
+
+    snprintf(buf, size, "%02d:%02d:%02d.%03d",
+             (int) (ms / 3600000), (int) (ms / 60000 % 60), (int) (ms / 1000 % 60), (int) (ms % 1000));
+}
+
+static void write_index()
+{
+    FILE *vtt = fopen(THUMBNAIL_VTT_FILE, "w");
+    FILE *json = fopen(THUMBNAIL_JSON_FILE, "w");
+
+    if (!vtt || !json)
+        av_log(NULL, AV_LOG_ERROR, "Thumbnailer could not write the thumbnail index\n");
+
+    if (vtt)
+        fprintf(vtt, "WEBVTT\n");
+
+    if (json)
+        fprintf(json, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"columns\": %d,\n  \"rows\": %d,\n  \"thumbnails\": [",
+                g_thumb_width, g_thumb_height, g_options.sprite_columns, g_options.sprite_rows);
+
+    for (size_t i = 0; i < g_entries.size(); i++)
+    {
+        const ThumbnailEntry &entry = g_entries[i];
+        char sprite[64];
+        char start[32];
+        char end[32];
+
+        double end_time = (i + 1 < g_entries.size()) ? g_entries[i + 1].time : g_last_frame_time;
+        if (end_time <= entry.time)
+            end_time = entry.time + 1.0;
+
+        snprintf(sprite, sizeof(sprite), SPRITE_NAME, entry.sheet);
+        format_vtt_time(start, sizeof(start), entry.time);
+        format_vtt_time(end, sizeof(end), end_time);
+
+        if (vtt)
+            fprintf(vtt, "\n%s --> %s\n%s#xywh=%d,%d,%d,%d\n",
+                    start, end, sprite, entry.x, entry.y, g_thumb_width, g_thumb_height);
+
+        if (json)
+            fprintf(json, "%s\n    { \"time\": %.3f, \"sprite\": \"%s\", \"x\": %d, \"y\": %d }",
+                    i ? "," : "", entry.time, sprite, entry.x, entry.y);
+    }
+
+    if (json)
+    {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+
+    if (vtt)
+        fclose(vtt);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// THUMBNAIL THREAD PROC - reads from thumbnail_queue
+///////////////////////////////////////////////////////////////////////////////
+static void *thumbnail_thread_proc(void *arg)
+{
+    ThumbnailFrame thumb;
+    int ret = 0;
+
+    while (av_thread_message_queue_recv(g_thumbnail_queue, &thumb, 0) >= 0)
+    {
+        if (ret >= 0)
+            ret = add_thumbnail(&thumb);
+
+        av_frame_free(&thumb.frame);
+
+        if (ret < 0)
+            av_log(NULL, AV_LOG_ERROR, "Thumbnailer failed, no more thumbnails will be written\n");
+    }
+
+    if (ret >= 0 && g_sheet_tiles)
+        write_sheet();
+
+    write_index();
+
+    return NULL;
+}
+
+int init_thumbnailer(AVStream *stream)
+{
+    g_stream_index = stream->index;
+    g_time_base = stream->time_base;
+
+    // Thumbnails and sprite tiles need even dimensions for 4:2:0
+    g_thumb_width = g_options.thumbnail_width & ~1;
+    g_thumb_height = g_options.thumbnail_height;
+
+    if (g_thumb_height <= 0 && stream->codecpar->width)
+        g_thumb_height = (int) av_rescale(g_thumb_width, stream->codecpar->height, stream->codecpar->width);
+
+    g_thumb_height &= ~1;
+
+    if (g_thumb_width <= 0 || g_thumb_height <= 0 ||
+        g_options.sprite_columns <= 0 || g_options.sprite_rows <= 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Invalid thumbnail size %dx%d or sprite layout %dx%d\n",
+               g_thumb_width, g_thumb_height, g_options.sprite_columns, g_options.sprite_rows);
+        return AVERROR(EINVAL);
+    }
+
+    int ret = open_sheet_encoder();
+    if (ret < 0)
+        return ret;
+
+    ret = av_thread_message_queue_alloc(&g_thumbnail_queue, THUMBNAIL_QUEUE_SIZE, sizeof(ThumbnailFrame));
+    if (ret < 0)
+        return ret;
+
+    if ((ret = pthread_create(&g_thumbnail_thread, NULL, thumbnail_thread_proc, NULL)))
+    {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        av_thread_message_queue_free(&g_thumbnail_queue);
+        return AVERROR(ret);
+    }
+
+    return 0;
+}
+
+int send_thumbnail_frame(unsigned int stream_index, AVFrame *frame, double scene_score)
+{
+    if (!g_thumbnail_queue || stream_index != g_stream_index || frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return 0;
+
+    double time = frame->best_effort_timestamp * av_q2d(g_time_base);
+    bool due = false;
+
+    g_last_frame_time = time;
+
+    if (g_options.thumbnail_interval > 0 && time >= g_next_thumbnail_time)
+        due = true;
+
+    if (g_options.thumbnail_scene_threshold > 0 &&
+        scene_score > g_options.thumbnail_scene_threshold &&
+        (g_last_thumbnail_time < 0 || time - g_last_thumbnail_time >= SCENE_MIN_SPACING))
+        due = true;
+
+    if (!due)
+        return 0;
+
+    ThumbnailFrame thumb;
+    thumb.time = time;
+    thumb.frame = av_frame_clone(frame);
+
+    if (!thumb.frame)
+        return AVERROR(ENOMEM);
+
+    int ret = av_thread_message_queue_send(g_thumbnail_queue, &thumb, 0);
+    if (ret < 0)
+    {
+        av_frame_free(&thumb.frame);
+        return ret;
+    }
+
+    g_last_thumbnail_time = time;
+
+    if (g_options.thumbnail_interval > 0)
+        g_next_thumbnail_time = time + g_options.thumbnail_interval;
+
+    return 0;
+}
+
+void close_thumbnailer()
+{
+    if (g_thumbnail_queue)
+    {
+        av_thread_message_queue_set_err_recv(g_thumbnail_queue, AVERROR_EOF);
+
+        pthread_join(g_thumbnail_thread, NULL);
+
+        av_thread_message_queue_free(&g_thumbnail_queue);
+    }
+
+    sws_freeContext(g_sws_ctx);
+    g_sws_ctx = NULL;
+
+    av_frame_free(&g_sheet);
+    avcodec_free_context(&g_sheet_enc_ctx);
+    g_entries.clear();
+}
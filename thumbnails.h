@@ -0,0 +1,26 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+    #include <libavutil/frame.h>
+}
+
+/**
+ * Start the thumbnail thread for the given video stream.
+ * Thumbnails are scaled into sprite sheets (sprite_NNN.jpg) and indexed by
+ * thumbnails.vtt and thumbnails.json in the working directory.
+ */
+int init_thumbnailer(AVStream *stream);
+
+/**
+ * Called from the decode thread for every decoded video frame with its scene
+ * change score from analyze_video_frame().
+ * Decides if the frame is due for a thumbnail, by interval or scene change,
+ * and if so hands a reference to the thumbnail thread. Frames of streams
+ * other than the thumbnailer's are ignored.
+ */
+int send_thumbnail_frame(unsigned int stream_index, AVFrame *frame, double scene_score);
+
+/** Write the last sprite sheet and the index files, then stop the thread. */
+void close_thumbnailer();
@@ -17,7 +17,10 @@ extern "C"
 
 #ifdef LINUX
 
+#include <errno.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 unsigned int timeGetTime()
 {
@@ -115,6 +118,67 @@ void LogProgress(const char *msg, int progress)
 #endif
 }
 
+int RunProcess(const char *executable, const char *args)
+{
+    char commandLine[kMaxSysStringLength];
+
+    snprintf(commandLine, sizeof(commandLine), "\"%s\" %s", executable, args);
+
+#ifdef WINDOWS
+    STARTUPINFOA startupInfo = { sizeof(startupInfo) };
+    PROCESS_INFORMATION processInfo;
+    DWORD exitCode = 0;
+
+    if (!CreateProcessA(NULL, commandLine, NULL, NULL, FALSE, 0, NULL, NULL, &startupInfo, &processInfo))
+    {
+        LogError(kRunProcessError, "Could not start %s: error %lu", executable, GetLastError());
+        return kRunProcessError;
+    }
+
+    WaitForSingleObject(processInfo.hProcess, INFINITE);
+    GetExitCodeProcess(processInfo.hProcess, &exitCode);
+
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+
+    return (int) exitCode;
+#else
+    pid_t pid = fork();
+
+    if (pid < 0)
+    {
+        LogError(kRunProcessError, "Could not start %s: fork failed", executable);
+        return kRunProcessError;
+    }
+
+    // The shell splits the arguments, quoted ones stay whole
+    if (pid == 0)
+    {
+        execl("/bin/sh", "sh", "-c", commandLine, (char *) NULL);
+        _exit(127);
+    }
+
+    int status = 0;
+
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            LogError(kRunProcessError, "Lost track of %s", executable);
+            return kRunProcessError;
+        }
+    }
+
+    if (!WIFEXITED(status))
+    {
+        LogError(kRunProcessError, "%s was killed by signal %d", executable, WTERMSIG(status));
+        return kRunProcessError;
+    }
+
+    return WEXITSTATUS(status);
+#endif
+}
+
 ContinueMutex::ContinueMutex()
 {
     pthread_mutex_init(&m_mutex, NULL);
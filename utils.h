@@ -26,6 +26,8 @@ void LogWarning(const char *fmt, ...);
 void LogStatus(const char *fmt, ...);
 void LogProgress(const char *msg, int progress);
 
+// Run executable with args, split like a shell would, and wait for it to exit.
+// Returns its exit code, kRunProcessError if it could not be run or was killed.
 int RunProcess(const char *executable, const char *args);
 
 class ContinueMutex
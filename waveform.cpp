@@ -0,0 +1,350 @@
+#include "waveform.h"
+
+#include <map>
+#include <stdio.h>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define HAVE_SSE2_INTRINSICS 1
+#endif
+
+#define WAVEFORM_NAME "waveform_%u.bin"
+#define WAVEFORM_VERSION 1
+
+// The finest level is accumulated while transcoding, every coarser level is
+// a multiple of it and folded from it when the file is written
+static const uint32_t g_levels[] = { 256, 1024, 4096 };
+#define WAVEFORM_LEVELS (sizeof(g_levels) / sizeof(g_levels[0]))
+
+typedef struct Waveform {
+    AVSampleFormat       sample_fmt;
+    int                  channels;
+    int                  sample_rate;
+    int                  fill;      // Samples in the current bin
+    std::vector<int16_t> current;   // Min/max pair per channel for the current bin
+    std::vector<int16_t> peaks;     // Finest level, min/max pairs
+} Waveform;
+
+// Owned by the encode thread
+static std::map<unsigned int, Waveform> g_waveforms;
+
+static inline int16_t float_to_s16(float v)
+{
+    v *= 32768.0f;
+    return (int16_t) (v >= 32767.0f ? 32767 : v <= -32768.0f ? -32768 : (int) v);
+}
+
+/** Min/max of n planar float samples. */
+static void minmax_flt(const float *p, int n, int16_t *min, int16_t *max)
+{
+    float lo = 0, hi = 0;
+    int i = 0;
+
+    if (n <= 0)
+        return;
+
+#if HAVE_SSE2_INTRINSICS
+    if (n >= 4)
+    {
+        __m128 vlo = _mm_loadu_ps(p);
+        __m128 vhi = vlo;
+
+        for (i = 4; i + 4 <= n; i += 4)
+        {
+            __m128 v = _mm_loadu_ps(p + i);
+            vlo = _mm_min_ps(vlo, v);
+            vhi = _mm_max_ps(vhi, v);
+        }
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, vlo);
+        lo = FFMIN(FFMIN(lanes[0], lanes[1]), FFMIN(lanes[2], lanes[3]));
+        _mm_storeu_ps(lanes, vhi);
+        hi = FFMAX(FFMAX(lanes[0], lanes[1]), FFMAX(lanes[2], lanes[3]));
+    }
+    else
+#endif
+    {
+        lo = hi = p[0];
+        i = 1;
+    }
+
+    for (; i < n; i++)
+    {
+        lo = FFMIN(lo, p[i]);
+        hi = FFMAX(hi, p[i]);
+    }
+
+    *min = FFMIN(*min, float_to_s16(lo));
+    *max = FFMAX(*max, float_to_s16(hi));
+}
+
+/** Min/max of n planar 16 bit samples. */
+static void minmax_s16(const int16_t *p, int n, int16_t *min, int16_t *max)
+{
+    int16_t lo = *min, hi = *max;
+    int i = 0;
+
+#if HAVE_SSE2_INTRINSICS
+    if (n >= 8)
+    {
+        __m128i vlo = _mm_set1_epi16(lo);
+        __m128i vhi = _mm_set1_epi16(hi);
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+            vlo = _mm_min_epi16(vlo, v);
+            vhi = _mm_max_epi16(vhi, v);
+        }
+
+        int16_t lanes[8];
+        _mm_storeu_si128((__m128i *) lanes, vlo);
+        for (int j = 0; j < 8; j++)
+            lo = FFMIN(lo, lanes[j]);
+        _mm_storeu_si128((__m128i *) lanes, vhi);
+        for (int j = 0; j < 8; j++)
+            hi = FFMAX(hi, lanes[j]);
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        lo = FFMIN(lo, p[i]);
+        hi = FFMAX(hi, p[i]);
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
+/** Min/max of count samples of channel ch, starting at sample offset. */
+static void channel_minmax(const Waveform &w, uint8_t **samples, int ch, int offset, int count,
+                           int16_t *min, int16_t *max)
+{
+    switch (w.sample_fmt)
+    {
+        case AV_SAMPLE_FMT_FLTP:
+            minmax_flt((const float *) samples[ch] + offset, count, min, max);
+            break;
+
+        case AV_SAMPLE_FMT_S16P:
+            minmax_s16((const int16_t *) samples[ch] + offset, count, min, max);
+            break;
+
+        case AV_SAMPLE_FMT_FLT:
+            for (int i = 0; i < count; i++)
+            {
+                int16_t v = float_to_s16(((const float *) samples[0])[(offset + i) * w.channels + ch]);
+                *min = FFMIN(*min, v);
+                *max = FFMAX(*max, v);
+            }
+            break;
+
+        case AV_SAMPLE_FMT_S16:
+            for (int i = 0; i < count; i++)
+            {
+                int16_t v = ((const int16_t *) samples[0])[(offset + i) * w.channels + ch];
+                *min = FFMIN(*min, v);
+                *max = FFMAX(*max, v);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void reset_bin(Waveform &w)
+{
+    for (int ch = 0; ch < w.channels; ch++)
+    {
+        w.current[2 * ch] = INT16_MAX;
+        w.current[2 * ch + 1] = INT16_MIN;
+    }
+
+    w.fill = 0;
+}
+
+static void end_bin(Waveform &w)
+{
+    w.peaks.insert(w.peaks.end(), w.current.begin(), w.current.end());
+    reset_bin(w);
+}
+
+int init_waveform(unsigned int stream_index, AVCodecContext *enc_ctx)
+{
+    switch (enc_ctx->sample_fmt)
+    {
+        case AV_SAMPLE_FMT_FLT:
+        case AV_SAMPLE_FMT_FLTP:
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S16P:
+            break;
+
+        default:
+            av_log(NULL, AV_LOG_WARNING, "Waveform does not support sample format %s\n", av_get_sample_fmt_name(enc_ctx->sample_fmt));
+            return AVERROR(ENOSYS);
+    }
+
+    Waveform &w = g_waveforms[stream_index];
+
+    w.sample_fmt = enc_ctx->sample_fmt;
+    w.channels = enc_ctx->channels;
+    w.sample_rate = enc_ctx->sample_rate;
+    w.current.resize(2 * w.channels);
+    w.peaks.clear();
+
+    reset_bin(w);
+
+    return 0;
+}
+
+void add_waveform_samples(unsigned int stream_index, uint8_t **samples, int nb_samples)
+{
+    std::map<unsigned int, Waveform>::iterator it = g_waveforms.find(stream_index);
+    if (it == g_waveforms.end())
+        return;
+
+    Waveform &w = it->second;
+    int offset = 0;
+
+    while (offset < nb_samples)
+    {
+        int count = FFMIN(nb_samples - offset, (int) g_levels[0] - w.fill);
+
+        for (int ch = 0; ch < w.channels; ch++)
+            channel_minmax(w, samples, ch, offset, count, &w.current[2 * ch], &w.current[2 * ch + 1]);
+
+        offset += count;
+        w.fill += count;
+
+        if (w.fill == (int) g_levels[0])
+            end_bin(w);
+    }
+}
+
+static bool write_zeros(FILE *f, long count)
+{
+    for (; count > 0; count--)
+        if (fputc(0, f) == EOF)
+            return false;
+
+    return true;
+}
+
+static int write_waveform(unsigned int stream_index, Waveform &w)
+{
+    char filename[64];
+    snprintf(filename, sizeof(filename), WAVEFORM_NAME, stream_index);
+
+    // Close a partial last bin
+    if (w.fill)
+        end_bin(w);
+
+    size_t pair_count = 2 * w.channels;
+    size_t bins = pair_count ? w.peaks.size() / pair_count : 0;
+
+    WaveformHeader header = { { 'W', 'F', 'P', 'K' }, WAVEFORM_VERSION,
+                              (uint32_t) w.sample_rate, (uint32_t) w.channels,
+                              (uint32_t) WAVEFORM_LEVELS, 0 };
+    WaveformLevel levels[WAVEFORM_LEVELS];
+
+    uint64_t offset = sizeof(header) + sizeof(levels);
+
+    for (size_t l = 0; l < WAVEFORM_LEVELS; l++)
+    {
+        uint32_t factor = g_levels[l] / g_levels[0];
+
+        offset = FFALIGN(offset, 8);
+
+        levels[l].samples_per_bin = g_levels[l];
+        levels[l].bin_count = (uint32_t) ((bins + factor - 1) / factor);
+        levels[l].offset = offset;
+
+        offset += (uint64_t) levels[l].bin_count * pair_count * sizeof(int16_t);
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not open waveform file '%s'\n", filename);
+        return AVERROR(EIO);
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(levels, sizeof(levels), 1, f) == 1;
+
+    std::vector<int16_t> folded;
+
+    for (size_t l = 0; ok && l < WAVEFORM_LEVELS; l++)
+    {
+        uint32_t factor = g_levels[l] / g_levels[0];
+        const int16_t *data = w.peaks.data();
+
+        if (factor > 1)
+        {
+            folded.assign((size_t) levels[l].bin_count * pair_count, 0);
+
+            for (size_t b = 0; b < levels[l].bin_count; b++)
+            {
+                int16_t *dst = &folded[b * pair_count];
+                size_t end = FFMIN(bins, (b + 1) * factor);
+
+                for (size_t c = 0; c < pair_count; c += 2)
+                {
+                    dst[c] = INT16_MAX;
+                    dst[c + 1] = INT16_MIN;
+                }
+
+                for (size_t s = b * factor; s < end; s++)
+                {
+                    const int16_t *src = &w.peaks[s * pair_count];
+
+                    for (size_t c = 0; c < pair_count; c += 2)
+                    {
+                        dst[c] = FFMIN(dst[c], src[c]);
+                        dst[c + 1] = FFMAX(dst[c + 1], src[c + 1]);
+                    }
+                }
+            }
+
+            data = folded.data();
+        }
+
+        ok = write_zeros(f, (long) levels[l].offset - ftell(f)) &&
+             fwrite(data, sizeof(int16_t) * pair_count, levels[l].bin_count, f) == levels[l].bin_count;
+    }
+
+    if (fclose(f) || !ok)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not write waveform file '%s'\n", filename);
+        return AVERROR(EIO);
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Wrote %u waveform bins for stream #%u to %s\n", (unsigned) bins, stream_index, filename);
+
+    return 0;
+}
+
+int write_waveforms()
+{
+    int ret = 0;
+
+    for (std::map<unsigned int, Waveform>::iterator it = g_waveforms.begin(); it != g_waveforms.end(); ++it)
+    {
+        int err = write_waveform(it->first, it->second);
+        if (err < 0)
+            ret = err;
+    }
+
+    close_waveforms();
+
+    return ret;
+}
+
+void close_waveforms()
+{
+    g_waveforms.clear();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+/**
+ * Start collecting min/max peaks for an audio stream in the encoder's sample
+ * format. The peaks are written to waveform_<stream index>.bin.
+ */
+int init_waveform(unsigned int stream_index, AVCodecContext *enc_ctx);
+
+/** Accumulate converted audio samples on their way into the audio FIFO. */
+void add_waveform_samples(unsigned int stream_index, uint8_t **samples, int nb_samples);
+
+/**
+ * Write the peak files of all streams and free the peak data.
+ *
+ * File layout, little endian:
+ *   WaveformHeader
+ *   WaveformLevel[level_count]
+ *   per level, at its offset: bin_count * channels pairs of int16 min/max,
+ *   bins in order, channels interleaved within a bin
+ */
+int write_waveforms();
+
+/** Free the peak data without writing it. */
+void close_waveforms();
+
+#pragma pack(push, 1)
+
+typedef struct WaveformHeader {
+    char     magic[4];          // "WFPK"
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t level_count;
+    uint32_t reserved;
+} WaveformHeader;
+
+typedef struct WaveformLevel {
+    uint32_t samples_per_bin;
+    uint32_t bin_count;
+    uint64_t offset;            // From the start of the file, 8 byte aligned
+} WaveformLevel;
+
+#pragma pack(pop)
@@ -7,10 +7,12 @@
 
 static void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame);
 
+// Conversion context is cached across calls, it is only rebuilt when the
+// decoded frame size or format changes.
+static struct SwsContext *img_convert_ctx = NULL;
+
 bool WriteFrame(AVCodecContext *dec_ctx, AVFrame *frame, int frame_num)
 {
-    struct SwsContext *img_convert_ctx = NULL;
-
     // Allocate an AVFrame structure
     AVFrame *pFrameRGB = av_frame_alloc();
     if(pFrameRGB==NULL)
@@ -22,6 +24,11 @@ bool WriteFrame(AVCodecContext *dec_ctx, AVFrame *frame, int frame_num)
                                       dec_ctx->height);
 
     uint8_t *buffer = (uint8_t*) malloc(numBytes);
+    if(buffer==NULL)
+    {
+        av_frame_free(&pFrameRGB);
+        return false;
+    }
 
     // Assign appropriate parts of buffer to image planes in pFrameRGB
     avpicture_fill((AVPicture *)pFrameRGB,
@@ -30,33 +37,40 @@ bool WriteFrame(AVCodecContext *dec_ctx, AVFrame *frame, int frame_num)
                     dec_ctx->width,
                     dec_ctx->height);
 
-	// Convert the image into YUV format that SDL uses
+	// Convert the image into RGB for the PPM
+	img_convert_ctx = sws_getCachedContext(img_convert_ctx,
+	                                       dec_ctx->width, dec_ctx->height,
+	                                       dec_ctx->pix_fmt,
+	                                       dec_ctx->width, dec_ctx->height,
+	                                       AV_PIX_FMT_RGB24, SWS_BICUBIC,
+	                                       NULL, NULL, NULL);
+
 	if(img_convert_ctx == NULL) {
-		img_convert_ctx = sws_getContext(dec_ctx->width, dec_ctx->height, 
-                                         dec_ctx->pix_fmt, 
-                                         dec_ctx->width, dec_ctx->height,
-                                         AV_PIX_FMT_RGB24, SWS_BICUBIC,
-                                         NULL, NULL, NULL);
-
-		if(img_convert_ctx == NULL) {
-			fprintf(stderr, "Cannot initialize the conversion context!\n");
-			exit(1);
-		}
+		fprintf(stderr, "Cannot initialize the conversion context!\n");
+		free(buffer);
+		av_frame_free(&pFrameRGB);
+		return false;
 	}
 
-	int ret = sws_scale(img_convert_ctx, frame->data, frame->linesize, 0, 
-						dec_ctx->height, pFrameRGB->data, pFrameRGB->linesize);
+	sws_scale(img_convert_ctx, frame->data, frame->linesize, 0,
+			  dec_ctx->height, pFrameRGB->data, pFrameRGB->linesize);
 
     // Save the frame to disk
     SaveFrame(pFrameRGB, dec_ctx->width, dec_ctx->height, frame_num);
 
     // Free the RGB image
     free(buffer);
-    av_free(pFrameRGB);
+    av_frame_free(&pFrameRGB);
 
     return true;
 }
 
+void FreeWriteFrame()
+{
+    sws_freeContext(img_convert_ctx);
+    img_convert_ctx = NULL;
+}
+
 static void SaveFrame(AVFrame *pFrame, int width, int height, int iFrame)
 {
     FILE *pFile;
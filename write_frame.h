@@ -7,4 +7,5 @@ extern "C"
     #include <libswscale/swscale.h>
 }
 
-bool WriteFrame(AVCodecContext *dec_ctx, AVFrame *frame, int frame_num);
\ No newline at end of file
+bool WriteFrame(AVCodecContext *dec_ctx, AVFrame *frame, int frame_num);
+void FreeWriteFrame();
\ No newline at end of file